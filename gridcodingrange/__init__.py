@@ -1,10 +1,15 @@
 import _gridcodingrange
 
+import atexit
+import concurrent.futures
+import threading
+
 import numpy as np
 
 def computeCodingRange(domainToPlaneByModule, latticeBasisByModule,
                        boxToScale, ignoreBox, phaseResolution,
-                       pingInterval=10.0):
+                       pingInterval=10.0, numThreads=0, timeout=-1.0,
+                       stats=None, precision=0.01, maxShellFactor=1.01):
     '''
     Given a set of grid cell module parameters, scale a k-dimensional box until
     it reaches a point with the same grid cell representation as the origin.
@@ -55,6 +60,33 @@ def computeCodingRange(domainToPlaneByModule, latticeBasisByModule,
     How often, in seconds, the function should print its current status. If <=
     0, no printing will occur.
 
+    @param numThreads (int)
+    How many searches to run concurrently on the process-wide thread pool. If
+    0, use one per thread in the pool. See setNumThreads.
+
+    @param timeout (float)
+    Specifies how long to try. This function will give up after 'timeout'
+    seconds. If <= 0, the function will not time out. On timeout, the function
+    throws a RuntimeError with message "timeout".
+
+    @param stats (dict or None)
+    Optional. If provided, it's filled with counters describing the search:
+    numNodes, maxDepth, numImpossibleProofsByModule, numLatticePoints,
+    numPolygonDistanceChecks, numShadowFramesBuilt and numExpansionTasks. They
+    are all 0 unless the extension was built with search statistics enabled.
+    See searchStatsEnabled().
+
+    @param precision (float)
+    The tested scaling factors grow by a factor of 1 + precision. The result is
+    the largest of them below the nearest collision.
+
+    @param maxShellFactor (float)
+    How far to scale the box in one shell while no collision has been found.
+    Shells start one precision step wide and double up to this factor. Once a
+    shell contains a collision, the steps below it are bisected, so a larger
+    value reaches distant collisions in fewer steps without changing the
+    result.
+
     @return
     - The largest tested scaling factor of the scaledbox that contains no
       collisions.
@@ -71,12 +103,189 @@ def computeCodingRange(domainToPlaneByModule, latticeBasisByModule,
 
     return _gridcodingrange.computeCodingRange(
         domainToPlaneByModule, latticeBasisByModule, boxToScale,
-        ignoreBox, phaseResolution, pingInterval)
+        ignoreBox, phaseResolution, pingInterval, numThreads, timeout, stats,
+        precision, maxShellFactor)
+
+
+def computeCodingRangeWithCheckpoints(domainToPlaneByModule,
+                                      latticeBasisByModule, boxToScale,
+                                      ignoreBox, phaseResolution,
+                                      checkpointPath, checkpointInterval=600.0,
+                                      pingInterval=10.0, numThreads=0,
+                                      timeout=-1.0):
+    '''
+    Like computeCodingRange, but it saves its progress to a checkpoint file
+    periodically and once more when it stops, including when it times out or
+    is interrupted. If the run is lost, resumeCodingRange picks it up from the
+    last checkpoint.
+
+    @param checkpointPath (str)
+    The checkpoint file. It's overwritten. Each save writes a temporary file
+    next to it and renames it, so the checkpoint is never partially written.
+
+    @param checkpointInterval (float)
+    How often, in seconds, to save the checkpoint. If <= 0, it's only saved
+    when the search starts and stops.
+
+    See computeCodingRange for the other parameters and the result.
+    '''
+    domainToPlaneByModule = np.asarray(
+        domainToPlaneByModule, dtype='float64')
+    latticeBasisByModule = np.asarray(
+        latticeBasisByModule, dtype='float64')
+    boxToScale = np.asarray(
+        boxToScale, dtype='float64')
+    ignoreBox = np.asarray(
+        ignoreBox, dtype='float64')
+
+    return _gridcodingrange.computeCodingRangeWithCheckpoints(
+        domainToPlaneByModule, latticeBasisByModule, boxToScale,
+        ignoreBox, phaseResolution, checkpointPath, checkpointInterval,
+        pingInterval, numThreads, timeout)
+
+
+def resumeCodingRange(checkpointPath, checkpointInterval=600.0,
+                      pingInterval=10.0, numThreads=0, timeout=-1.0):
+    '''
+    Continue a computeCodingRangeWithCheckpoints run from its checkpoint file.
+    The query is read from the file, and the search skips every expansion box
+    that had been searched when the checkpoint was saved. It keeps saving
+    checkpoints to the same file. Resuming a run that already finished returns
+    its result.
+
+    @param checkpointPath (str)
+    The file written by computeCodingRangeWithCheckpoints.
+
+    See computeCodingRangeWithCheckpoints for the other parameters and the
+    result.
+    '''
+    return _gridcodingrange.resumeCodingRange(
+        checkpointPath, checkpointInterval, pingInterval, numThreads, timeout)
+
+
+class CodingRangeCoordinator(object):
+    '''
+    Runs one computeCodingRange query on worker processes, possibly on other
+    machines, so it can use more cores than one process has.
+
+    The coordinator owns the expansion and hands out work units, each a range
+    of bins in one box of one orthant of one expansion shell, to the workers
+    over TCP. When a worker finds grid code zero, every worker stops its units
+    at or above that scale factor. If a worker disconnects, its units are
+    handed to someone else. The result is the same as computeCodingRange's.
+
+    Start runCodingRangeWorker(host, coordinator.port()) in each worker
+    process, then call run(). Start local workers with the multiprocessing
+    "spawn" method, not "fork", because this process's thread pool doesn't
+    survive a fork.
+
+    The port is unauthenticated and unencrypted. Anyone who can connect to it
+    receives the query and can report false results, so only listen on a
+    network where every peer is trusted.
+    '''
+
+    def __init__(self, domainToPlaneByModule, latticeBasisByModule,
+                 boxToScale, ignoreBox, phaseResolution, host='127.0.0.1',
+                 port=0):
+        '''
+        See computeCodingRange for the query parameters.
+
+        @param host (str)
+        The address to listen on. Use '0.0.0.0' to accept workers from other
+        machines, but only on a trusted network.
+
+        @param port (int)
+        The port to listen on. If 0, the system chooses one. See port().
+        '''
+        domainToPlaneByModule = np.asarray(
+            domainToPlaneByModule, dtype='float64')
+        latticeBasisByModule = np.asarray(
+            latticeBasisByModule, dtype='float64')
+        boxToScale = np.asarray(
+            boxToScale, dtype='float64')
+        ignoreBox = np.asarray(
+            ignoreBox, dtype='float64')
+
+        self._coordinator = _gridcodingrange.CodingRangeCoordinator(
+            domainToPlaneByModule, latticeBasisByModule, boxToScale,
+            ignoreBox, phaseResolution, host, port)
+
+    def port(self):
+        return self._coordinator.port()
+
+    def run(self, pingInterval=10.0, timeout=-1.0):
+        '''
+        Coordinate the workers until the search finishes, then release them.
+        The search waits for workers indefinitely, so use a timeout to give
+        up.
+
+        See computeCodingRange for the parameters and the result.
+        '''
+        return self._coordinator.run(pingInterval, timeout)
+
+
+def runCodingRangeWorker(host, port, numThreads=0, timeout=-1.0):
+    '''
+    Work on a CodingRangeCoordinator's search until it finishes.
+
+    @param host (str)
+    @param port (int)
+    The coordinator's address.
+
+    @param numThreads (int)
+    How many units to search concurrently, each on a thread of its own rather
+    than on the process-wide thread pool. If 0, use as many as the pool has
+    threads. Other computations in the same process compete with these threads
+    for cores.
+
+    @param timeout (float)
+    If > 0, stop after this many seconds and raise a RuntimeError with message
+    "timeout". The worker's unfinished units go to other workers.
+    '''
+    _gridcodingrange.runCodingRangeWorker(host, port, numThreads, timeout)
+
+
+def computeCodingRangeBatch(queries, pingInterval=10.0, numThreadsPerQuery=0,
+                            timeout=-1.0):
+    '''
+    Like computeCodingRange, but for many queries at once. Every query's
+    searches are queued on the process-wide thread pool together, so short
+    queries don't leave threads idle while they wait for each other, and the
+    setup and teardown happen once.
+
+    @param queries (list)
+    A list of (domainToPlaneByModule, latticeBasisByModule, boxToScale,
+    ignoreBox, phaseResolution) tuples. See computeCodingRange.
+
+    @param pingInterval (float)
+    How often, in seconds, the function should print its current status. If <=
+    0, no printing will occur.
+
+    @param numThreadsPerQuery (int)
+    How many searches to run concurrently for each query. If 0, use one per
+    thread in the pool.
+
+    @param timeout (float)
+    If > 0, the time limit for the whole batch, in seconds.
+
+    @return
+    A list with one computeCodingRange result per query, in order.
+    '''
+    queries = [(np.asarray(domainToPlaneByModule, dtype='float64'),
+                np.asarray(latticeBasisByModule, dtype='float64'),
+                np.asarray(boxToScale, dtype='float64'),
+                np.asarray(ignoreBox, dtype='float64'),
+                float(phaseResolution))
+               for (domainToPlaneByModule, latticeBasisByModule, boxToScale,
+                    ignoreBox, phaseResolution) in queries]
+
+    return _gridcodingrange.computeCodingRangeBatch(
+        queries, pingInterval, numThreadsPerQuery, timeout)
 
 
 def computeGridUniquenessHypercube(domainToPlaneByModule, latticeBasisByModule,
                                    phaseResolution, ignoredCenterDiameter,
-                                   pingInterval=10.0):
+                                   pingInterval=10.0, timeout=-1.0):
     '''
     Calls computeCodingRange with a unit cube scaledBox and cube ignore box.
 
@@ -99,6 +308,9 @@ def computeGridUniquenessHypercube(domainToPlaneByModule, latticeBasisByModule,
     How often, in seconds, the function should print its current status. If <=
     0, no printing will occur.
 
+    @param timeout
+    See computeCodingRange.
+
     @return
     - The diameter of the hypercube that contains no collisions.
     - A point just outside this hypercube that collides with the origin.
@@ -110,11 +322,12 @@ def computeGridUniquenessHypercube(domainToPlaneByModule, latticeBasisByModule,
 
     return _gridcodingrange.computeGridUniquenessHypercube(
         domainToPlaneByModule, latticeBasisByModule, phaseResolution,
-        ignoredCenterDiameter, pingInterval)
+        ignoredCenterDiameter, pingInterval, timeout)
 
 
 def computeBinSidelength(domainToPlaneByModule, phaseResolution,
-                         resultPrecision, upperBound=1000.0, timeout=-1.0):
+                         resultPrecision, upperBound=1000.0, timeout=-1.0,
+                         stats=None):
     '''
     Compute the sidelength of the smallest hypercube that encloses the
     intersection of all of the modules' firing fields centered at the origin.
@@ -145,6 +358,9 @@ def computeBinSidelength(domainToPlaneByModule, phaseResolution,
     throws an exception with message "timeout". In Python this exception is of
     type RuntimeError.
 
+    @param stats (dict or None)
+    Optional. See computeCodingRange.
+
     @return
     The sidelength of this hypercube. Returns -1.0 if a surface can't be found
     (i.e. if upperBound is reached.)
@@ -153,11 +369,13 @@ def computeBinSidelength(domainToPlaneByModule, phaseResolution,
         domainToPlaneByModule, dtype='float64')
 
     return _gridcodingrange.computeBinSidelength(
-        domainToPlaneByModule, phaseResolution, resultPrecision, upperBound, timeout)
+        domainToPlaneByModule, phaseResolution, resultPrecision, upperBound,
+        timeout, stats)
 
 
 def computeBinRectangle(domainToPlaneByModule, phaseResolution,
-                        resultPrecision, upperBound=1000.0, timeout=-1.0):
+                        resultPrecision, upperBound=1000.0, timeout=-1.0,
+                        stats=None):
     '''
     Like computeBinSidelength, but it computes a hyperrectangle rather than a
     hypercube.
@@ -188,6 +406,9 @@ def computeBinRectangle(domainToPlaneByModule, phaseResolution,
     throws an exception with message "timeout". In Python this exception is of
     type RuntimeError.
 
+    @param stats (dict or None)
+    Optional. See computeCodingRange.
+
     @return
     The dimensions of this hyperrectangle. Returns an empty vector if a surface
     can't be found (i.e. if upperBound is reached.)
@@ -196,7 +417,305 @@ def computeBinRectangle(domainToPlaneByModule, phaseResolution,
         domainToPlaneByModule, dtype='float64')
 
     return _gridcodingrange.computeBinRectangle(
-        domainToPlaneByModule, phaseResolution, resultPrecision, upperBound, timeout)
+        domainToPlaneByModule, phaseResolution, resultPrecision, upperBound,
+        timeout, stats)
+
+
+class ComputationFuture(concurrent.futures.Future):
+    '''
+    The result of an async computation. The computation runs on a thread of its
+    own, and its searches run on the process-wide thread pool.
+
+    running() is True once the computation starts. Unlike other Futures, it can
+    be cancelled while the computation is running. cancel() tells the
+    computation to stop, and it always succeeds unless the result is already
+    available. A future that's cancelled before the computation starts skips
+    the computation.
+    '''
+
+    def __init__(self):
+        super(ComputationFuture, self).__init__()
+        self._token = _gridcodingrange.CancellationToken()
+        self._started = False
+        self._finished = threading.Event()
+
+    def cancel(self):
+        # The future stays pending while the computation runs, so the base
+        # class lets it be cancelled.
+        self._token.cancel()
+        return super(ComputationFuture, self).cancel()
+
+    def running(self):
+        return self._started and not self.done()
+
+    def _onStart(self):
+        if self.cancelled():
+            self._notifyCancelled()
+            _pendingFutures.discard(self)
+            self._finished.set()
+            return False
+
+        self._started = True
+        return True
+
+    def _onDone(self, result):
+        self._finish(self.set_result, result)
+
+    def _onError(self, message):
+        self._finish(self.set_exception, RuntimeError(message))
+
+    def _finish(self, setOutcome, outcome):
+        _pendingFutures.discard(self)
+        try:
+            if not self.cancelled():
+                setOutcome(outcome)
+        except Exception:
+            # The future was cancelled just as the computation finished.
+            if not self.cancelled():
+                raise
+        finally:
+            if self.cancelled():
+                self._notifyCancelled()
+            self._finished.set()
+
+    def _notifyCancelled(self):
+        # concurrent.futures.wait() and as_completed() only hear about a
+        # cancellation through this call.
+        self.set_running_or_notify_cancel()
+
+
+# Computations that haven't called back yet. On exit, they're cancelled and
+# waited for, because they need the interpreter to finish.
+_pendingFutures = set()
+
+
+@atexit.register
+def _cancelPendingFutures():
+    for future in list(_pendingFutures):
+        future.cancel()
+    for future in list(_pendingFutures):
+        future._finished.wait()
+
+
+def _startAsync(function, *args):
+    future = ComputationFuture()
+    _pendingFutures.add(future)
+    try:
+        function(*(args + (future._token, future._onStart, future._onDone,
+                           future._onError)))
+    except Exception:
+        _pendingFutures.discard(future)
+        raise
+    return future
+
+
+def computeCodingRangeAsync(domainToPlaneByModule, latticeBasisByModule,
+                            boxToScale, ignoreBox, phaseResolution,
+                            numThreads=0, timeout=-1.0):
+    '''
+    Like computeCodingRange, but it returns a ComputationFuture right away and
+    runs the computation in the background. No status is printed. If the
+    future is cancelled, the computation stops.
+
+    @return (ComputationFuture)
+    A future for the computeCodingRange result. If the computation fails, the
+    future's exception is a RuntimeError.
+    '''
+    domainToPlaneByModule = np.asarray(
+        domainToPlaneByModule, dtype='float64')
+    latticeBasisByModule = np.asarray(
+        latticeBasisByModule, dtype='float64')
+    boxToScale = np.asarray(
+        boxToScale, dtype='float64')
+    ignoreBox = np.asarray(
+        ignoreBox, dtype='float64')
+
+    return _startAsync(
+        _gridcodingrange.computeCodingRangeAsync,
+        domainToPlaneByModule, latticeBasisByModule, boxToScale, ignoreBox,
+        phaseResolution, numThreads, timeout)
+
+
+def computeCodingRangeBatchAsync(queries, numThreadsPerQuery=0, timeout=-1.0):
+    '''
+    The async version of computeCodingRangeBatch. See computeCodingRangeAsync.
+
+    @return (ComputationFuture)
+    A future for the list of results.
+    '''
+    queries = [(np.asarray(domainToPlaneByModule, dtype='float64'),
+                np.asarray(latticeBasisByModule, dtype='float64'),
+                np.asarray(boxToScale, dtype='float64'),
+                np.asarray(ignoreBox, dtype='float64'),
+                float(phaseResolution))
+               for (domainToPlaneByModule, latticeBasisByModule, boxToScale,
+                    ignoreBox, phaseResolution) in queries]
+
+    return _startAsync(
+        _gridcodingrange.computeCodingRangeBatchAsync,
+        queries, numThreadsPerQuery, timeout)
+
+
+def computeGridUniquenessHypercubeAsync(domainToPlaneByModule,
+                                        latticeBasisByModule, phaseResolution,
+                                        ignoredCenterDiameter, timeout=-1.0):
+    '''
+    The async version of computeGridUniquenessHypercube. See
+    computeCodingRangeAsync.
+    '''
+    domainToPlaneByModule = np.asarray(
+        domainToPlaneByModule, dtype='float64')
+    latticeBasisByModule = np.asarray(
+        latticeBasisByModule, dtype='float64')
+
+    return _startAsync(
+        _gridcodingrange.computeGridUniquenessHypercubeAsync,
+        domainToPlaneByModule, latticeBasisByModule, phaseResolution,
+        ignoredCenterDiameter, timeout)
+
+
+def computeBinSidelengthAsync(domainToPlaneByModule, phaseResolution,
+                              resultPrecision, upperBound=1000.0,
+                              timeout=-1.0):
+    '''
+    The async version of computeBinSidelength. See computeCodingRangeAsync.
+    '''
+    domainToPlaneByModule = np.asarray(
+        domainToPlaneByModule, dtype='float64')
+
+    return _startAsync(
+        _gridcodingrange.computeBinSidelengthAsync,
+        domainToPlaneByModule, phaseResolution, resultPrecision, upperBound,
+        timeout)
+
+
+def computeBinRectangleAsync(domainToPlaneByModule, phaseResolution,
+                             resultPrecision, upperBound=1000.0, timeout=-1.0):
+    '''
+    The async version of computeBinRectangle. See computeCodingRangeAsync.
+
+    This is useful for filtering many candidate bases at once. When one of them
+    fails the filter, cancel the others.
+    '''
+    domainToPlaneByModule = np.asarray(
+        domainToPlaneByModule, dtype='float64')
+
+    return _startAsync(
+        _gridcodingrange.computeBinRectangleAsync,
+        domainToPlaneByModule, phaseResolution, resultPrecision, upperBound,
+        timeout)
+
+
+def setNumThreads(numThreads):
+    '''
+    Set the number of threads in the process-wide thread pool that every
+    parallel computation in this library shares. The pool is created on first
+    use and reused after that.
+
+    @param numThreads (int)
+    If 0, use the GRIDCODINGRANGE_NUM_THREADS environment variable, or one
+    thread per hardware thread if it isn't set.
+    '''
+    _gridcodingrange.setNumThreads(numThreads)
+
+
+def getNumThreads():
+    '''
+    Get the number of threads in the process-wide thread pool.
+    '''
+    return _gridcodingrange.getNumThreads()
+
+
+def setCaptureInterrupts(captureInterrupts):
+    '''
+    Choose whether computations stop on SIGINT, e.g. Ctrl+C or a Jupyter
+    notebook's "interrupt" button. If they do, they throw a RuntimeError with
+    message "interrupt". This is on by default. Turn it off when embedding
+    this library in a program that handles signals itself, and cancel
+    computations with ComputationFuture.cancel() instead.
+
+    @param captureInterrupts (bool)
+    '''
+    _gridcodingrange.setCaptureInterrupts(captureInterrupts)
+
+
+def getCaptureInterrupts():
+    '''
+    Get whether computations stop on SIGINT.
+    '''
+    return _gridcodingrange.getCaptureInterrupts()
+
+
+_searchOrders = {
+    "depthFirst": _gridcodingrange.SearchOrder.DepthFirst,
+    "bestFirst": _gridcodingrange.SearchOrder.BestFirst,
+    "branchAndBound": _gridcodingrange.SearchOrder.BranchAndBound,
+}
+
+
+def setSearchOrder(searchOrder):
+    '''
+    Choose the order in which computeCodingRange searches the boxes of each
+    expansion step. "depthFirst", the default, always searches the lower half
+    of a box first. "bestFirst" always splits the unresolved box nearest to the
+    origin, preferring boxes whose centers are near grid code zero.
+    "branchAndBound" doesn't go step by step. It searches the whole region
+    outside the ignorebox nearest box first, pruning boxes that can't contain
+    a nearer collision than the nearest one found so far, so its cost doesn't
+    grow with the number of steps. Checkpointed searches and workers use
+    "depthFirst" in its place. Every order gives the same coding range, but
+    they may report different points.
+
+    @param searchOrder (str)
+    "depthFirst", "bestFirst" or "branchAndBound"
+    '''
+    _gridcodingrange.setSearchOrder(_searchOrders[searchOrder])
+
+
+def getSearchOrder():
+    '''
+    Get the search order, "depthFirst", "bestFirst" or "branchAndBound".
+    '''
+    searchOrder = _gridcodingrange.getSearchOrder()
+    return next(name for name, value in _searchOrders.items()
+                if value == searchOrder)
+
+
+def setTorusOccupancyResolution(resolution):
+    '''
+    Experimental. Choose the resolution of the bitmaps that later searches
+    precompute over each module's lattice cell. They let a search rule out a
+    small shadow that is far from every lattice point with one lookup. 0, the
+    default, disables them. Every resolution gives the same results, but no
+    benchmark has shown a speedup yet.
+
+    @param resolution (int)
+    The number of bitmap cells along each lattice basis vector
+    '''
+    _gridcodingrange.setTorusOccupancyResolution(resolution)
+
+
+def getTorusOccupancyResolution():
+    '''
+    Get the resolution of the torus occupancy bitmaps, or 0 if they're
+    disabled.
+    '''
+    return _gridcodingrange.getTorusOccupancyResolution()
+
+
+def resetTorusOccupancyResolution():
+    '''
+    Restore the default torus occupancy resolution.
+    '''
+    _gridcodingrange.resetTorusOccupancyResolution()
+
+
+def searchStatsEnabled():
+    '''
+    Whether the extension was built to collect search statistics. See the
+    stats parameter of computeCodingRange.
+    '''
+    return _gridcodingrange.searchStatsEnabled()
 
 
 def resetCheckPolygonThreshold():
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")"
+
+outbin="run-benchmarks"
+
+cmd="g++ -o $outbin ./src/benchmark/*.cpp ./src/*.cpp -I./src -I./src/external -lpthread -std=c++14 -O3"
+
+eval $cmd
+
+echo "To run benchmarks, execute: ./$outbin > results.json"
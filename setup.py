@@ -17,8 +17,16 @@ class get_pybind_include(object):
 
 
 sources = [
+    'src/cancellation_token.cpp',
+    'src/coding_range_checkpoint.cpp',
     'src/distance_from_polygon.cpp',
     'src/grid_coding_range.cpp',
+    'src/matrix_list.cpp',
+    'src/message_channel.cpp',
+    'src/module_set.cpp',
+    'src/search_stats.cpp',
+    'src/thread_pool.cpp',
+    'src/zonogon.cpp',
     'src/pyextension/gridcodingrange_module.cpp',
 ]
 
@@ -32,6 +40,12 @@ if debug_mode:
 else:
     compile_args += ["-g0"]
 
+# Count search statistics, e.g. for the stats parameter of computeCodingRange.
+# This slows down the search a little.
+search_stats = False
+if search_stats:
+    compile_args += ["-D GRIDCODINGRANGE_SEARCH_STATS"]
+
 
 if sys.platform == "darwin":
     compile_args += ["-std=c++14", "-mmacosx-version-min=10.10"]
@@ -0,0 +1,714 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+/** @file
+ * Timings for the search on seeded workloads that mirror the scripts in
+ * experiments/. Every run with the same seed generates the same grid cell
+ * modules, so timings from two builds are directly comparable. The results,
+ * including checksums of the computed values, are printed as JSON.
+ *
+ * Usage: run-benchmarks [--seed N] [--repetitions N] [--threads N]
+ *                       [--filter SUBSTRING] [--full] [--best-first]
+ *                       [--branch-and-bound] [--torus-occupancy N]
+ */
+
+#include <nta_logging.hpp>
+
+#include "distance_from_polygon.hpp"
+#include "grid_coding_range.hpp"
+#include "lattice_point_enumerator.hpp"
+#include "module_set.hpp"
+#include "zonogon.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace gridcodingrange;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace {
+
+  typedef vector<vector<vector<double>>> Matrices;
+
+  struct Options
+  {
+    unsigned seed = 42;
+    size_t repetitions = 3;
+    size_t numThreads = 0;
+    string filter;
+    bool full = false;
+    bool bestFirst = false;
+    bool branchAndBound = false;
+    size_t torusOccupancyResolution = 0;
+  };
+
+  /**
+   * The grid cell modules for one (phase resolution, m, k) combination of an
+   * experiment script, after generate_bases.py's filtering.
+   */
+  struct Basis
+  {
+    string workload;
+    double phaseResolution;
+    size_t m;
+    double k;
+    Matrices domainToPlaneByModule;
+    Matrices latticeBasisByModule;
+    vector<double> binRectangle;
+    bool filtered;
+    vector<double> scaledbox;
+    vector<double> ignorebox;
+
+    // Seeds the boxes for the findGridCodeZero benchmark.
+    unsigned boxSeed;
+  };
+
+  struct Timing
+  {
+    vector<double> seconds;
+    double checksum;
+  };
+
+  /**
+   * Time f once per repetition. f returns a checksum of what it computed, so
+   * the optimizer can't skip the work and so a build that changes results is
+   * easy to spot.
+   */
+  Timing timeRepeatedly(size_t repetitions, const std::function<double()>& f)
+  {
+    Timing timing;
+    for (size_t i = 0; i < repetitions; i++)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      timing.checksum = f();
+      const auto end = std::chrono::steady_clock::now();
+      timing.seconds.push_back(
+        std::chrono::duration<double>(end - start).count());
+    }
+    return timing;
+  }
+
+  /**
+   * generate_bases.py's create_params with style "normal" and no imposed
+   * scales, followed by testBasis's sort by descending scale.
+   */
+  Matrices createDomainToPlane(size_t m, size_t k, std::mt19937& rng)
+  {
+    std::normal_distribution<double> normal(0.0, 1.0);
+
+    Matrices A(m, vector<vector<double>>(2, vector<double>(k)));
+    for (auto& matrix : A)
+    {
+      for (auto& row : matrix)
+      {
+        for (double& v : row)
+        {
+          v = normal(rng)*0.5;
+        }
+      }
+    }
+
+    // Normalize A so that the mean column vector length is 1.
+    vector<double> columnLengths(m);
+    for (size_t iModule = 0; iModule < m; iModule++)
+    {
+      double sum = 0;
+      for (size_t col = 0; col < k; col++)
+      {
+        sum += hypot(A[iModule][0][col], A[iModule][1][col]);
+      }
+      columnLengths[iModule] = sum / k;
+    }
+    const double correction =
+      std::accumulate(columnLengths.begin(), columnLengths.end(), 0.0) / m;
+    for (size_t iModule = 0; iModule < m; iModule++)
+    {
+      columnLengths[iModule] /= correction;
+      for (auto& row : A[iModule])
+      {
+        for (double& v : row)
+        {
+          v /= correction;
+        }
+      }
+    }
+
+    // The scale is 1/columnLength, so the largest scale has the shortest
+    // columns.
+    vector<size_t> order(m);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) {
+                       return columnLengths[a] < columnLengths[b];
+                     });
+
+    Matrices sorted;
+    for (size_t iModule : order)
+    {
+      sorted.push_back(A[iModule]);
+    }
+    return sorted;
+  }
+
+  /**
+   * measure_unique_sidelength.py's create_L. Every module uses the same
+   * hexagonal lattice.
+   */
+  Matrices createLatticeBases(size_t m)
+  {
+    const double theta = M_PI/3;
+    return Matrices(m, {{1.0, cos(theta)},
+                        {0.0, sin(theta)}});
+  }
+
+  /**
+   * Sample bases until one passes generate_bases.py's --filtered check, then
+   * choose the boxes the way measure_unique_sidelength.py does.
+   */
+  Basis createBasis(const string& workload, double phaseResolution, size_t m,
+                    double k, bool scaleMinimalBox, std::mt19937& rng)
+  {
+    fprintf(stderr, "Generating basis %s/phr=%g/m=%zu/k=%g\n",
+            workload.c_str(), phaseResolution, m, k);
+
+    const size_t numDims = (size_t)ceil(k);
+
+    Basis basis;
+    basis.workload = workload;
+    basis.phaseResolution = phaseResolution;
+    basis.m = m;
+    basis.k = k;
+    basis.latticeBasisByModule = createLatticeBases(m);
+
+    // Few modules in many dimensions rarely pass the filter. After this many
+    // attempts, settle for the sample with the smallest bin.
+    const size_t maxAttempts = 100;
+    double bestMaxSidelength = std::numeric_limits<double>::max();
+    for (size_t attempt = 0; attempt < maxAttempts; attempt++)
+    {
+      const Matrices domainToPlaneByModule =
+        createDomainToPlane(m, numDims, rng);
+      const vector<double> binRectangle = computeBinRectangle(
+        domainToPlaneByModule, phaseResolution, 0.01, 2048.0);
+      if (binRectangle.empty())
+      {
+        continue;
+      }
+
+      const double maxSidelength =
+        *std::max_element(binRectangle.begin(), binRectangle.end());
+      if (maxSidelength < bestMaxSidelength)
+      {
+        bestMaxSidelength = maxSidelength;
+        basis.domainToPlaneByModule = domainToPlaneByModule;
+        basis.binRectangle = binRectangle;
+      }
+
+      if (maxSidelength < 1.0)
+      {
+        break;
+      }
+    }
+
+    NTA_CHECK(!basis.binRectangle.empty())
+      << "Every basis hit the upper bound for " << workload << " m=" << m
+      << " k=" << k;
+
+    basis.filtered = (bestMaxSidelength < 1.0);
+    basis.boxSeed = rng();
+
+    for (double sidelength : basis.binRectangle)
+    {
+      basis.ignorebox.push_back(0.51*sidelength);
+    }
+
+    basis.scaledbox = scaleMinimalBox
+      ? basis.ignorebox
+      : vector<double>(numDims, 1.0);
+
+    const double partialFinalDim = k - floor(k);
+    if (partialFinalDim > 0)
+    {
+      basis.scaledbox.back() = partialFinalDim;
+    }
+
+    return basis;
+  }
+
+  vector<Basis> createBases(const Options& options)
+  {
+    std::mt19937 rng(options.seed);
+    vector<Basis> bases;
+
+    // runFilteredExperiments_1D_benchmark.sh
+    for (double phr : {0.4, 0.2, 0.1, 0.05, 0.025})
+    {
+      for (size_t m : {1, 2, 3})
+      {
+        bases.push_back(createBasis("1D_benchmark", phr, m, 1, true, rng));
+      }
+    }
+
+    // runFilteredExperiments_m_k.sh, by default without the slowest
+    // combinations.
+    const vector<size_t> ms = options.full
+      ? vector<size_t>{1, 2, 3, 4, 5, 6, 7, 8, 9}
+      : vector<size_t>{2, 3, 4, 5, 6, 7};
+    const vector<double> ks = options.full
+      ? vector<double>{3, 4, 5, 6}
+      : vector<double>{3, 4};
+    for (size_t m : ms)
+    {
+      for (double k : ks)
+      {
+        if (2*m >= k)
+        {
+          bases.push_back(createBasis("m_k", 0.2, m, k, true, rng));
+        }
+      }
+    }
+
+    // runFilteredExperiments_smooth_k.sh
+    const vector<double> smoothKs = options.full
+      ? vector<double>{2.0, 2.0128, 2.2048, 2.4096, 2.8192, 3.0, 3.0128,
+                       3.2048, 3.4096, 3.8192, 4.0}
+      : vector<double>{2.0, 2.4096, 3.0};
+    for (double k : smoothKs)
+    {
+      bases.push_back(createBasis("smooth_k", 0.2, 5, k, false, rng));
+    }
+
+    return bases;
+  }
+
+  /**
+   * Boxes with the dimensions of the bin rectangle, scattered out to about
+   * twice the distance where computeCodingRange found its collision.
+   */
+  vector<pair<vector<double>, vector<double>>>
+  createSearchBoxes(const Basis& basis, double codingRange, std::mt19937& rng)
+  {
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    const double radius = 2.0*codingRange*
+      *std::max_element(basis.scaledbox.begin(), basis.scaledbox.end());
+
+    vector<pair<vector<double>, vector<double>>> boxes;
+    for (size_t i = 0; i < 64; i++)
+    {
+      vector<double> x0;
+      for (size_t iDim = 0; iDim < basis.binRectangle.size(); iDim++)
+      {
+        x0.push_back(radius*uniform(rng));
+      }
+      boxes.push_back({x0, basis.binRectangle});
+    }
+    return boxes;
+  }
+
+  class JsonWriter
+  {
+  public:
+    void beginResult(const string& name)
+    {
+      out_ << (numResults_++ > 0 ? ",\n" : "\n") << "    {\"name\": \""
+           << name << "\"";
+    }
+
+    void field(const string& key, double value)
+    {
+      out_ << ", \"" << key << "\": " << value;
+    }
+
+    void field(const string& key, const string& value)
+    {
+      out_ << ", \"" << key << "\": \"" << value << "\"";
+    }
+
+    void flag(const string& key, bool value)
+    {
+      out_ << ", \"" << key << "\": " << (value ? "true" : "false");
+    }
+
+    void endResult(const Timing& timing, size_t numOperations)
+    {
+      vector<double> sorted = timing.seconds;
+      std::sort(sorted.begin(), sorted.end());
+      const double mean =
+        std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+
+      field("operations", numOperations);
+      out_ << ", \"seconds\": {\"min\": " << sorted.front()
+           << ", \"median\": " << sorted[sorted.size()/2]
+           << ", \"mean\": " << mean << "}";
+      field("checksum", timing.checksum);
+      out_ << "}";
+    }
+
+    string str(const Options& options) const
+    {
+      std::ostringstream out;
+      out << "{\n"
+          << "  \"seed\": " << options.seed << ",\n"
+          << "  \"repetitions\": " << options.repetitions << ",\n"
+          << "  \"numThreads\": " << getNumThreads() << ",\n"
+          << "  \"full\": " << (options.full ? "true" : "false") << ",\n"
+          << "  \"searchOrder\": "
+          << (getSearchOrder() == SearchOrder::BestFirst
+              ? "\"bestFirst\""
+              : getSearchOrder() == SearchOrder::BranchAndBound
+              ? "\"branchAndBound\""
+              : "\"depthFirst\"") << ",\n"
+          << "  \"torusOccupancyResolution\": "
+          << getTorusOccupancyResolution() << ",\n"
+          << "  \"results\": [" << out_.str() << "\n  ]\n"
+          << "}\n";
+      return out.str();
+    }
+
+  private:
+    std::ostringstream out_;
+    size_t numResults_ = 0;
+  };
+
+  bool selected(const Options& options, const string& name)
+  {
+    return name.find(options.filter) != string::npos;
+  }
+
+  string basisName(const string& function, const Basis& basis)
+  {
+    std::ostringstream name;
+    name << function << "/" << basis.workload
+         << "/phr=" << basis.phaseResolution << "/m=" << basis.m
+         << "/k=" << basis.k;
+    return name.str();
+  }
+
+  void beginBasisResult(JsonWriter& json, const string& name,
+                        const Basis& basis)
+  {
+    json.beginResult(name);
+    json.field("workload", basis.workload);
+    json.field("phaseResolution", basis.phaseResolution);
+    json.field("m", basis.m);
+    json.field("k", basis.k);
+    json.flag("filtered", basis.filtered);
+  }
+
+  void benchmarkBasis(const Options& options, const Basis& basis,
+                      JsonWriter& json)
+  {
+    if (!selected(options, basisName("computeBinRectangle", basis)) &&
+        !selected(options, basisName("computeCodingRange", basis)) &&
+        !selected(options, basisName("findGridCodeZero", basis)))
+    {
+      return;
+    }
+
+    // The coding range decides where findGridCodeZero's boxes go, so compute
+    // it even if its benchmark is filtered out.
+    const double codingRange = computeCodingRange(
+      basis.domainToPlaneByModule, basis.latticeBasisByModule,
+      basis.scaledbox, basis.ignorebox, basis.phaseResolution, 0.0).first;
+    std::mt19937 rng(basis.boxSeed);
+    const vector<pair<vector<double>, vector<double>>> boxes =
+      createSearchBoxes(basis, codingRange, rng);
+
+    string name = basisName("computeBinRectangle", basis);
+    if (selected(options, name))
+    {
+      fprintf(stderr, "%s\n", name.c_str());
+      const Timing timing = timeRepeatedly(options.repetitions, [&] {
+          const vector<double> rect = computeBinRectangle(
+            basis.domainToPlaneByModule, basis.phaseResolution, 0.01, 2048.0);
+          return std::accumulate(rect.begin(), rect.end(), 0.0);
+        });
+      beginBasisResult(json, name, basis);
+      json.endResult(timing, 1);
+    }
+
+    name = basisName("computeCodingRange", basis);
+    if (selected(options, name))
+    {
+      fprintf(stderr, "%s\n", name.c_str());
+      const Timing timing = timeRepeatedly(options.repetitions, [&] {
+          return computeCodingRange(
+            basis.domainToPlaneByModule, basis.latticeBasisByModule,
+            basis.scaledbox, basis.ignorebox, basis.phaseResolution,
+            0.0).first;
+        });
+      beginBasisResult(json, name, basis);
+      json.endResult(timing, 1);
+    }
+
+    name = basisName("findGridCodeZero", basis);
+    if (selected(options, name))
+    {
+      fprintf(stderr, "%s\n", name.c_str());
+      const Timing timing = timeRepeatedly(options.repetitions, [&] {
+          double numFound = 0;
+          for (const auto& box : boxes)
+          {
+            numFound += findGridCodeZero(
+              basis.domainToPlaneByModule, basis.latticeBasisByModule,
+              box.first, box.second, basis.phaseResolution);
+          }
+          return numFound;
+        });
+      beginBasisResult(json, name, basis);
+      json.endResult(timing, boxes.size());
+    }
+  }
+
+  void benchmarkDistToConvexPolygon(const Options& options, JsonWriter& json)
+  {
+    const string name = "distToConvexPolygonSquared";
+    if (!selected(options, name))
+    {
+      return;
+    }
+    fprintf(stderr, "%s\n", name.c_str());
+
+    std::mt19937 rng(options.seed);
+
+    // Shadows of 4D boxes, the polygons that the search actually measures.
+    const size_t numPolygons = 64;
+    const size_t numPointsPerPolygon = 4096;
+    const size_t numDims = 4;
+    std::normal_distribution<double> normal(0.0, 0.5);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    vector<PolygonInfo> polygons;
+    vector<vector<pair<double,double>>> points;
+    Zonogon zonogon;
+    for (size_t i = 0; i < numPolygons; i++)
+    {
+      vector<double> domainToPlane(2*numDims);
+      vector<double> dims(numDims);
+      for (double& v : domainToPlane) v = normal(rng);
+      for (double& v : dims) v = 0.5 + uniform(rng);
+
+      zonogon.build(domainToPlane.data(), numDims, dims.data());
+      polygons.emplace_back(zonogon.vertices());
+
+      // Points in and around the bounding box.
+      const BoundingBox2D& b = zonogon.boundingBox();
+      const double padX = 0.5*(b.xmax - b.xmin);
+      const double padY = 0.5*(b.ymax - b.ymin);
+      std::uniform_real_distribution<double> x(b.xmin - padX, b.xmax + padX);
+      std::uniform_real_distribution<double> y(b.ymin - padY, b.ymax + padY);
+      points.emplace_back();
+      for (size_t j = 0; j < numPointsPerPolygon; j++)
+      {
+        points.back().push_back({x(rng), y(rng)});
+      }
+    }
+
+    const Timing timing = timeRepeatedly(options.repetitions, [&] {
+        double sum = 0;
+        for (size_t i = 0; i < numPolygons; i++)
+        {
+          for (const pair<double,double>& point : points[i])
+          {
+            sum += distToConvexPolygonSquared(point, polygons[i]);
+          }
+        }
+        return sum;
+      });
+    json.beginResult(name);
+    json.endResult(timing, numPolygons*numPointsPerPolygon);
+  }
+
+  void benchmarkLatticePointEnumerator(const Options& options,
+                                       JsonWriter& json)
+  {
+    const string name = "LatticePointEnumerator";
+    if (!selected(options, name))
+    {
+      return;
+    }
+    fprintf(stderr, "%s\n", name.c_str());
+
+    std::mt19937 rng(options.seed);
+
+    // Rectangles like the shadows' bounding boxes, on the hexagonal lattice
+    // that the experiments use, with phase resolution 0.2.
+    const size_t numRectangles = 16384;
+    const double r = 0.1;
+    const SquareMatrix2D<double> latticeBasis = {1.0, cos(M_PI/3),
+                                                 0.0, sin(M_PI/3)};
+    const SquareMatrix2D<double> inverseLatticeBasis =
+      invert2DMatrix(latticeBasis);
+    std::uniform_real_distribution<double> position(-100.0, 100.0);
+    std::uniform_real_distribution<double> size(0.05, 3.0);
+
+    vector<BoundingBox2D> rectangles;
+    for (size_t i = 0; i < numRectangles; i++)
+    {
+      const double x = position(rng);
+      const double y = position(rng);
+      rectangles.push_back({x, x + size(rng), y, y + size(rng)});
+    }
+
+    const Timing timing = timeRepeatedly(options.repetitions, [&] {
+        double sum = 0;
+        for (const BoundingBox2D& rect : rectangles)
+        {
+          LatticePointEnumerator latticePoints(
+            latticeBasis, inverseLatticeBasis, rect.xmin, rect.xmax,
+            rect.ymin, rect.ymax, r, r*r);
+          pair<double,double> latticePoint;
+          while (latticePoints.getNext(&latticePoint))
+          {
+            sum += latticePoint.first + latticePoint.second;
+          }
+        }
+        return sum;
+      });
+    json.beginResult(name);
+    json.endResult(timing, numRectangles);
+  }
+
+  void printUsage(const char *program)
+  {
+    fprintf(stderr,
+            "Usage: %s [--seed N] [--repetitions N] [--threads N] "
+            "[--filter SUBSTRING] [--full] [--best-first] [--branch-and-bound] "
+            "[--torus-occupancy N]\n", program);
+  }
+
+  /**
+   * @return
+   * false if an argument isn't recognized or is invalid.
+   */
+  bool parseOptions(int argc, char *argv[], Options *options)
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      const bool hasValue = (i + 1 < argc);
+      if (strcmp(argv[i], "--seed") == 0 && hasValue)
+      {
+        options->seed = (unsigned)strtoul(argv[++i], nullptr, 10);
+      }
+      else if (strcmp(argv[i], "--repetitions") == 0 && hasValue)
+      {
+        options->repetitions = strtoul(argv[++i], nullptr, 10);
+      }
+      else if (strcmp(argv[i], "--threads") == 0 && hasValue)
+      {
+        options->numThreads = strtoul(argv[++i], nullptr, 10);
+      }
+      else if (strcmp(argv[i], "--filter") == 0 && hasValue)
+      {
+        options->filter = argv[++i];
+      }
+      else if (strcmp(argv[i], "--full") == 0)
+      {
+        options->full = true;
+      }
+      else if (strcmp(argv[i], "--best-first") == 0)
+      {
+        options->bestFirst = true;
+      }
+      else if (strcmp(argv[i], "--branch-and-bound") == 0)
+      {
+        options->branchAndBound = true;
+      }
+      else if (strcmp(argv[i], "--torus-occupancy") == 0 && hasValue)
+      {
+        options->torusOccupancyResolution = strtoul(argv[++i], nullptr, 10);
+      }
+      else
+      {
+        fprintf(stderr, "Unrecognized argument: %s\n", argv[i]);
+        return false;
+      }
+    }
+
+    if (options->repetitions == 0)
+    {
+      fprintf(stderr, "--repetitions must be positive\n");
+      return false;
+    }
+
+    return true;
+  }
+
+} // end namespace
+
+int main(int argc, char *argv[])
+{
+  Options options;
+  if (!parseOptions(argc, argv, &options))
+  {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  if (options.numThreads > 0)
+  {
+    setNumThreads(options.numThreads);
+  }
+
+  if (options.bestFirst)
+  {
+    setSearchOrder(SearchOrder::BestFirst);
+  }
+  else if (options.branchAndBound)
+  {
+    setSearchOrder(SearchOrder::BranchAndBound);
+  }
+
+  setTorusOccupancyResolution(options.torusOccupancyResolution);
+
+  // Let Ctrl+C end the process rather than just the current computation.
+  setCaptureInterrupts(false);
+
+  JsonWriter json;
+
+  benchmarkDistToConvexPolygon(options, json);
+  benchmarkLatticePointEnumerator(options, json);
+
+  for (const Basis& basis : createBases(options))
+  {
+    benchmarkBasis(options, basis, json);
+  }
+
+  printf("%s", json.str(options).c_str());
+
+  return 0;
+}
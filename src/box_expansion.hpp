@@ -23,6 +23,7 @@
 #ifndef NTA_BOX_EXPANSION
 #define NTA_BOX_EXPANSION
 
+#include <cstddef>
 #include <limits>
 #include <vector>
 
@@ -104,17 +105,37 @@ public:
       ignorebox_(ignorebox_begin, ignorebox_end),
       ndim_(std::distance(scaledbox_begin, scaledbox_end))
   {
-    baseline_factor_ = std::numeric_limits<double>::max();
+    initial_baseline_factor_ = std::numeric_limits<double>::max();
     for (size_t i = 0; i < scaledbox_.size(); i++)
     {
       if (scaledbox_[i] > 0)
       {
-        baseline_factor_ = std::min(baseline_factor_,
-                                    ignorebox_[i] / scaledbox_[i]);
+        initial_baseline_factor_ = std::min(initial_baseline_factor_,
+                                            ignorebox_[i] / scaledbox_[i]);
       }
     }
 
-    expansion_factor_ = baseline_factor_ * 1.01;
+    setShell(initial_baseline_factor_, initial_baseline_factor_ * 1.01);
+  }
+
+  /**
+   * The scale factor of the first shell's inner box, where the scaledbox first
+   * reaches past the ignorebox.
+   */
+  double initialBaselineFactor() const
+  {
+    return initial_baseline_factor_;
+  }
+
+  /**
+   * Enumerate the shell between the scaledbox scaled by baseline_factor and
+   * the scaledbox scaled by expansion_factor.
+   */
+  void setShell(double baseline_factor, double expansion_factor)
+  {
+    baseline_factor_ = baseline_factor;
+    expansion_factor_ = expansion_factor;
+    secondary_expanding_ = false;
 
     std::vector<double> initial(scaledbox_);
     std::vector<double> goal(scaledbox_);
@@ -130,8 +151,35 @@ public:
     buffer_.assign(ndim_, -1);
   }
 
+  /**
+   * Get the next box, moving on to the next shell, 1.01 times larger, when
+   * the current one is finished.
+   */
   void getNext(
     double offset[], double shape[], double *baseline_factor)
+  {
+    while (!getNextInShell(offset, shape, baseline_factor))
+    {
+      // Expand and retry
+      baseline_factor_ = expansion_factor_;
+      expansion_factor_ *= 1.01;
+
+      for (size_t i = 0; i < ndim_; i++)
+      {
+        buffer_[i] = scaledbox_[i]*expansion_factor_;
+      }
+      main_expansion_.setGoal(buffer_.begin(), buffer_.end());
+    }
+  }
+
+  /**
+   * Get the next box of the current shell.
+   *
+   * @return
+   * false if every box of the shell has been returned.
+   */
+  bool getNextInShell(
+    double offset[], double shape[], double *baseline_factor)
   {
     if (!secondary_expanding_)
     {
@@ -148,7 +196,7 @@ public:
           offset[main_nonzero_offset_dim_] =
             main_nonzero_offset_val_;
           *baseline_factor = baseline_factor_;
-          return;
+          return true;
         }
         else
         {
@@ -167,21 +215,12 @@ public:
 
           secondary_expansion_.initialize(buffer_.begin(), buffer_.end(),
                                           shape, shape + ndim_);
-          return this->getNext(offset, shape, baseline_factor);
+          return this->getNextInShell(offset, shape, baseline_factor);
         }
       }
       else
       {
-        // Expand and retry
-        baseline_factor_ = expansion_factor_;
-        expansion_factor_ *= 1.01;
-
-        for (size_t i = 0; i < ndim_; i++)
-        {
-          buffer_[i] = scaledbox_[i]*expansion_factor_;
-        }
-        main_expansion_.setGoal(buffer_.begin(), buffer_.end());
-        return this->getNext(offset, shape, baseline_factor);
+        return false;
       }
     }
     else
@@ -198,12 +237,12 @@ public:
         // Convert to reference frame of the main expansion.
         offset[main_nonzero_offset_dim_] += main_nonzero_offset_val_;
         *baseline_factor = baseline_factor_;
-        return;
+        return true;
       }
       else
       {
         secondary_expanding_ = false;
-        return this->getNext(offset, shape, baseline_factor);
+        return this->getNextInShell(offset, shape, baseline_factor);
       }
     }
   }
@@ -213,6 +252,7 @@ private:
   size_t main_nonzero_offset_dim_;
   double main_nonzero_offset_val_;
 
+  double initial_baseline_factor_;
   double baseline_factor_;
   double expansion_factor_;
 
@@ -248,7 +288,60 @@ public:
     shape_.assign(ndim_, -1);
   }
 
+  double initialBaselineFactor() const
+  {
+    return single_quadrant_expansion_.initialBaselineFactor();
+  }
+
+  /**
+   * Enumerate one shell, in every quadrant. See
+   * SelectiveIgnoranceBoxExpansion::setShell.
+   */
+  void setShell(double baseline_factor, double expansion_factor)
+  {
+    single_quadrant_expansion_.setShell(baseline_factor, expansion_factor);
+    bitvector_ = 0x0;
+    started_ = false;
+  }
+
   void getNext(double x0[], double shape[], double *baseline_factor)
+  {
+    advance_();
+
+    if (bitvector_ == 0x0)
+    {
+      single_quadrant_expansion_.getNext(x0_unreflected_.data(),
+                                         shape_.data(), &baseline_factor_);
+    }
+
+    reflect_(x0, shape, baseline_factor);
+  }
+
+  /**
+   * Get the next box of the current shell.
+   *
+   * @return
+   * false if every box of the shell has been returned.
+   */
+  bool getNextInShell(double x0[], double shape[], double *baseline_factor)
+  {
+    advance_();
+
+    if (bitvector_ == 0x0 &&
+        !single_quadrant_expansion_.getNextInShell(x0_unreflected_.data(),
+                                                   shape_.data(),
+                                                   &baseline_factor_))
+    {
+      started_ = false;
+      return false;
+    }
+
+    reflect_(x0, shape, baseline_factor);
+    return true;
+  }
+
+private:
+  void advance_()
   {
     if (!started_)
     {
@@ -272,13 +365,10 @@ public:
         }
       }
     }
+  }
 
-    if (bitvector_ == 0x0)
-    {
-      single_quadrant_expansion_.getNext(x0_unreflected_.data(),
-                                         shape_.data(), &baseline_factor_);
-    }
-
+  void reflect_(double x0[], double shape[], double *baseline_factor) const
+  {
     // Perform appropriate reflection
     for (size_t i = 0; i < ndim_; i++)
     {
@@ -296,7 +386,6 @@ public:
     *baseline_factor = baseline_factor_;
   }
 
-private:
   unsigned bitvector_;
   unsigned dimflags_;
 
@@ -0,0 +1,52 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#include "cancellation_token.hpp"
+
+namespace gridcodingrange
+{
+  CancellationToken::CancellationToken()
+    : cancelled_(false), hasDeadline_(false)
+  {
+  }
+
+  void CancellationToken::setDeadline(Clock::time_point deadline)
+  {
+    hasDeadline_ = true;
+    deadline_ = deadline;
+  }
+
+  void CancellationToken::setTimeout(double seconds)
+  {
+    if (seconds > 0)
+    {
+      setDeadline(Clock::now() +
+                  std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(seconds)));
+    }
+    else
+    {
+      hasDeadline_ = false;
+    }
+  }
+}
@@ -0,0 +1,91 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#ifndef NTA_CANCELLATION_TOKEN_HPP
+#define NTA_CANCELLATION_TOKEN_HPP
+
+#include <atomic>
+#include <chrono>
+
+namespace gridcodingrange
+{
+  /**
+   * Lets a caller stop computations, either explicitly from another thread or
+   * at a deadline. Pass the same token to any number of computations. They
+   * check it as they recurse, so they stop soon after it's cancelled or its
+   * deadline passes, and then they throw an exception with message
+   * "cancelled" or "timeout", respectively.
+   *
+   * Checking a token is cheap, and it doesn't need any threads.
+   */
+  class CancellationToken
+  {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    CancellationToken();
+
+    CancellationToken(const CancellationToken&) = delete;
+    CancellationToken& operator=(const CancellationToken&) = delete;
+
+    /**
+     * Thread-safe. Can be called at any time.
+     */
+    void cancel()
+    {
+      cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    bool isCancelled() const
+    {
+      return cancelled_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Set the deadline before passing the token to a computation.
+     */
+    void setDeadline(Clock::time_point deadline);
+
+    /**
+     * Set the deadline to this many seconds from now. If <= 0, clear it.
+     */
+    void setTimeout(double seconds);
+
+    bool hasDeadline() const
+    {
+      return hasDeadline_;
+    }
+
+    Clock::time_point deadline() const
+    {
+      return deadline_;
+    }
+
+  private:
+    std::atomic<bool> cancelled_;
+    bool hasDeadline_;
+    Clock::time_point deadline_;
+  };
+} // end namespace gridcodingrange
+
+#endif // NTA_CANCELLATION_TOKEN_HPP
@@ -0,0 +1,212 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#include "coding_range_checkpoint.hpp"
+#include <nta_logging.hpp>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+using std::string;
+using std::vector;
+using gridcodingrange::MatrixList;
+
+namespace {
+  const char *const Header = "gridcodingrange-checkpoint";
+  const int Version = 1;
+
+  void writeValues(std::ostream &os, const char *key,
+                   const vector<double> &values)
+  {
+    os << key;
+    for (double v : values)
+    {
+      os << " " << v;
+    }
+    os << "\n";
+  }
+
+  void readKey(std::istream &is, const string &path, const char *key)
+  {
+    string actual;
+    is >> actual;
+    NTA_CHECK(is && actual == key)
+      << "Invalid checkpoint " << path << ": expected " << key
+      << ", found '" << actual << "'";
+  }
+
+  template<typename T>
+  T readValue(std::istream &is, const string &path, const char *key)
+  {
+    readKey(is, path, key);
+    T value;
+    is >> value;
+    NTA_CHECK(is) << "Invalid checkpoint " << path << ": bad " << key;
+    return value;
+  }
+
+  vector<double> readValues(std::istream &is, const string &path,
+                            const char *key, size_t count)
+  {
+    readKey(is, path, key);
+    vector<double> values(count);
+    for (double &v : values)
+    {
+      is >> v;
+    }
+    NTA_CHECK(is) << "Invalid checkpoint " << path << ": bad " << key;
+    return values;
+  }
+}
+
+CodingRangeCheckpoint::CodingRangeCheckpoint(
+  const MatrixList &domainToPlaneByModule,
+  const MatrixList &latticeBasisByModule,
+  const vector<double> &scaledbox,
+  const vector<double> &ignorebox,
+  double readoutResolution)
+  : numModules(domainToPlaneByModule.size()),
+    numDims(domainToPlaneByModule.numCols()),
+    scaledbox(scaledbox),
+    ignorebox(ignorebox),
+    readoutResolution(readoutResolution),
+    numTasksFinished(0),
+    certifiedBaselineFactor(0),
+    foundPointBaselineRadius(std::numeric_limits<double>::max()),
+    pointWithGridCodeZero(numDims, 0.0)
+{
+  for (size_t iModule = 0; iModule < numModules; iModule++)
+  {
+    for (size_t row = 0; row < 2; row++)
+    {
+      for (size_t col = 0; col < numDims; col++)
+      {
+        this->domainToPlaneByModule.push_back(
+          domainToPlaneByModule(iModule, row, col));
+      }
+      for (size_t col = 0; col < 2; col++)
+      {
+        this->latticeBasisByModule.push_back(
+          latticeBasisByModule(iModule, row, col));
+      }
+    }
+  }
+}
+
+CodingRangeCheckpoint::CodingRangeCheckpoint()
+  : numModules(0),
+    numDims(0),
+    readoutResolution(0),
+    numTasksFinished(0),
+    certifiedBaselineFactor(0),
+    foundPointBaselineRadius(std::numeric_limits<double>::max())
+{
+}
+
+MatrixList CodingRangeCheckpoint::domainToPlaneView() const
+{
+  return MatrixList(domainToPlaneByModule.data(), numModules, 2, numDims,
+                    2*numDims*sizeof(double), numDims*sizeof(double),
+                    sizeof(double));
+}
+
+MatrixList CodingRangeCheckpoint::latticeBasisView() const
+{
+  return MatrixList(latticeBasisByModule.data(), numModules, 2, 2,
+                    4*sizeof(double), 2*sizeof(double), sizeof(double));
+}
+
+void CodingRangeCheckpoint::save(const string &path) const
+{
+  std::ostringstream oss;
+  oss.precision(std::numeric_limits<double>::max_digits10);
+
+  oss << Header << " " << Version << "\n";
+  oss << "numModules " << numModules << "\n";
+  oss << "numDims " << numDims << "\n";
+  writeValues(oss, "domainToPlaneByModule", domainToPlaneByModule);
+  writeValues(oss, "latticeBasisByModule", latticeBasisByModule);
+  writeValues(oss, "scaledbox", scaledbox);
+  writeValues(oss, "ignorebox", ignorebox);
+  oss << "readoutResolution " << readoutResolution << "\n";
+  oss << "numTasksFinished " << numTasksFinished << "\n";
+  oss << "certifiedBaselineFactor " << certifiedBaselineFactor << "\n";
+  oss << "foundPointBaselineRadius " << foundPointBaselineRadius << "\n";
+  writeValues(oss, "pointWithGridCodeZero", pointWithGridCodeZero);
+
+  const string text = oss.str();
+  const string tmpPath = path + ".tmp";
+
+  FILE *f = fopen(tmpPath.c_str(), "w");
+  NTA_CHECK(f != nullptr) << "Can't write checkpoint " << tmpPath;
+
+  const bool written =
+    (fwrite(text.data(), 1, text.size(), f) == text.size() &&
+     fflush(f) == 0 &&
+     fsync(fileno(f)) == 0);
+  const bool closed = (fclose(f) == 0);
+  NTA_CHECK(written && closed) << "Can't write checkpoint " << tmpPath;
+
+  NTA_CHECK(rename(tmpPath.c_str(), path.c_str()) == 0)
+    << "Can't move checkpoint " << tmpPath << " to " << path;
+}
+
+CodingRangeCheckpoint CodingRangeCheckpoint::load(const string &path)
+{
+  std::ifstream is(path);
+  NTA_CHECK(is) << "Can't read checkpoint " << path;
+
+  const int version = readValue<int>(is, path, Header);
+  NTA_CHECK(version == Version)
+    << "Checkpoint " << path << " has version " << version
+    << ", expected " << Version;
+
+  CodingRangeCheckpoint checkpoint;
+  checkpoint.numModules = readValue<size_t>(is, path, "numModules");
+  checkpoint.numDims = readValue<size_t>(is, path, "numDims");
+  checkpoint.domainToPlaneByModule = readValues(
+    is, path, "domainToPlaneByModule",
+    checkpoint.numModules*2*checkpoint.numDims);
+  checkpoint.latticeBasisByModule = readValues(
+    is, path, "latticeBasisByModule", checkpoint.numModules*4);
+  checkpoint.scaledbox = readValues(is, path, "scaledbox",
+                                    checkpoint.numDims);
+  checkpoint.ignorebox = readValues(is, path, "ignorebox",
+                                    checkpoint.numDims);
+  checkpoint.readoutResolution =
+    readValue<double>(is, path, "readoutResolution");
+  checkpoint.numTasksFinished =
+    readValue<unsigned long long>(is, path, "numTasksFinished");
+  checkpoint.certifiedBaselineFactor =
+    readValue<double>(is, path, "certifiedBaselineFactor");
+  checkpoint.foundPointBaselineRadius =
+    readValue<double>(is, path, "foundPointBaselineRadius");
+  checkpoint.pointWithGridCodeZero = readValues(
+    is, path, "pointWithGridCodeZero", checkpoint.numDims);
+
+  return checkpoint;
+}
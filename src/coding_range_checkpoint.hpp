@@ -0,0 +1,95 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+/** @file
+ * Saving and loading the progress of a computeCodingRange search
+ */
+
+#ifndef NTA_CODING_RANGE_CHECKPOINT_HPP
+#define NTA_CODING_RANGE_CHECKPOINT_HPP
+
+#include "matrix_list.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * Everything needed to resume a computeCodingRange search: the query, and how
+ * far the expansion got.
+ *
+ * The expansion hands out its boxes as tasks in a fixed order, so its position
+ * is just a task number. A search resumes by replaying the enumerator up to
+ * the first task that wasn't finished. Tasks that finished out of order after
+ * that one are searched again, at most one per thread.
+ */
+struct CodingRangeCheckpoint
+{
+  // The query. The matrices are stored row-major, one after another.
+  size_t numModules;
+  size_t numDims;
+  std::vector<double> domainToPlaneByModule;
+  std::vector<double> latticeBasisByModule;
+  std::vector<double> scaledbox;
+  std::vector<double> ignorebox;
+  double readoutResolution;
+
+  // Every task before this one in the expansion order has been searched.
+  unsigned long long numTasksFinished;
+
+  // Every box with a smaller scale factor has been searched.
+  double certifiedBaselineFactor;
+
+  // The best result so far, or numeric_limits<double>::max() if there isn't
+  // one yet.
+  double foundPointBaselineRadius;
+  std::vector<double> pointWithGridCodeZero;
+
+  /**
+   * Copy a query into a checkpoint with no progress.
+   */
+  CodingRangeCheckpoint(
+    const gridcodingrange::MatrixList &domainToPlaneByModule,
+    const gridcodingrange::MatrixList &latticeBasisByModule,
+    const std::vector<double> &scaledbox,
+    const std::vector<double> &ignorebox,
+    double readoutResolution);
+
+  CodingRangeCheckpoint();
+
+  /**
+   * Views of the stored matrices. The checkpoint must outlive them.
+   */
+  gridcodingrange::MatrixList domainToPlaneView() const;
+  gridcodingrange::MatrixList latticeBasisView() const;
+
+  /**
+   * Write the checkpoint to a temporary file, then rename it over the path,
+   * so a crash during the write leaves the previous checkpoint intact.
+   */
+  void save(const std::string &path) const;
+
+  static CodingRangeCheckpoint load(const std::string &path);
+};
+
+#endif // NTA_CODING_RANGE_CHECKPOINT_HPP
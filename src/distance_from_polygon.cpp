@@ -21,10 +21,12 @@
  */
 
 #include "distance_from_polygon.hpp"
+#include "search_stats.hpp"
 #include <nta_logging.hpp>
 
 #include <algorithm>
 #include <cmath>
+#include <limits>
 #include <numeric>
 
 using std::vector;
@@ -38,7 +40,9 @@ LineSegmentInfo2D::LineSegmentInfo2D(
   const pair<double,double> v = {end.first - start.first,
                                  end.second - start.second};
   this->length = sqrt(pow(v.first, 2) + pow(v.second, 2));
-  this->unitvector = {v.first / length, v.second / length};
+  this->unitvector = (length > 0)
+    ? pair<double,double>(v.first / length, v.second / length)
+    : pair<double,double>(0, 0);
 }
 
 double distToSegmentSquared(
@@ -146,26 +150,35 @@ static double getThetaIndex(double dx, double dy)
   }
 }
 
-static vector<LineSegmentInfo2D> computeEdges(
-  const vector<pair<double,double>> &vertices)
+static void computeEdges(
+  const vector<pair<double,double>> &vertices,
+  vector<LineSegmentInfo2D> *edges)
 {
-  vector<LineSegmentInfo2D> edges;
-  edges.reserve(vertices.size());
+  edges->clear();
+  edges->reserve(vertices.size());
 
   for (size_t i = 0; i < vertices.size(); ++i)
   {
     const pair<double,double> &v1 = vertices[i];
     const pair<double,double> &v2 =
       vertices[(i == vertices.size() - 1) ? 0 : i + 1];
-    edges.push_back(LineSegmentInfo2D(v1, v2));
+    edges->push_back(LineSegmentInfo2D(v1, v2));
   }
-
-  return edges;
 }
 
 PolygonInfo::PolygonInfo(
   const vector<pair<double, double>> &vertices)
 {
+  assign(vertices);
+}
+
+void PolygonInfo::assign(
+  const vector<pair<double, double>> &vertices)
+{
+  this->vertices.clear();
+  this->thetas.clear();
+  this->halfplanes.clear();
+
   // Compute the polygon's area times two.
   double acc = 0;
   for (size_t i = 0; i < vertices.size(); ++i)
@@ -194,28 +207,48 @@ PolygonInfo::PolygonInfo(
                       ysum / vertices.size()};
 
     // Compute thetas.
-    vector<double> thetas;
-    thetas.reserve(vertices.size());
+    this->vertices.assign(vertices.begin(), vertices.end());
     for (const pair<double,double> &v : vertices)
     {
-      thetas.push_back(getThetaIndex(v.first - centroid.first,
-                                     v.second - centroid.second));
+      this->thetas.push_back(getThetaIndex(v.first - centroid.first,
+                                           v.second - centroid.second));
+    }
+
+    // Sort by theta. Vertices that are already in counterclockwise order
+    // (e.g. from a Zonogon) only need to be rotated in place to start at the
+    // smallest theta.
+    size_t numDescents = 0;
+    size_t iSmallest = 0;
+    for (size_t i = 0; i < thetas.size(); ++i)
+    {
+      const size_t next = (i == thetas.size() - 1) ? 0 : i + 1;
+      if (thetas[next] < thetas[i])
+      {
+        numDescents++;
+        iSmallest = next;
+      }
     }
 
-    // Sort by theta.
-    this->vertices.reserve(vertices.size());
-    this->thetas.reserve(vertices.size());
+    if (numDescents <= 1)
     {
+      std::rotate(this->vertices.begin(), this->vertices.begin() + iSmallest,
+                  this->vertices.end());
+      std::rotate(this->thetas.begin(), this->thetas.begin() + iSmallest,
+                  this->thetas.end());
+    }
+    else
+    {
+      const vector<double> unsortedThetas = this->thetas;
       vector<size_t> indices(vertices.size());
       std::iota(indices.begin(), indices.end(), 0);
       std::sort(indices.begin(), indices.end(),
                 [&](size_t a, size_t b) {
-                  return thetas[a] < thetas[b];
+                  return unsortedThetas[a] < unsortedThetas[b];
                 });
-      for (size_t idx : indices)
+      for (size_t i = 0; i < indices.size(); ++i)
       {
-        this->vertices.push_back(vertices[idx]);
-        this->thetas.push_back(thetas[idx]);
+        this->vertices[i] = vertices[indices[i]];
+        this->thetas[i] = unsortedThetas[indices[i]];
       }
     }
 
@@ -233,12 +266,12 @@ PolygonInfo::PolygonInfo(
       this->halfplanes.push_back({normalvector, top});
     }
 
-    this->edges = computeEdges(this->vertices);
+    computeEdges(this->vertices, &this->edges);
   }
   else
   {
     bool use_x = false;
-    for (size_t i = 0; i < vertices.size(); ++i)
+    for (size_t i = 0; i + 1 < vertices.size(); ++i)
     {
       if (vertices[i].first != vertices[i+1].first)
       {
@@ -247,7 +280,6 @@ PolygonInfo::PolygonInfo(
       }
     }
 
-    this->vertices.reserve(2);
     if (use_x)
     {
       auto compare =
@@ -276,9 +308,7 @@ PolygonInfo::PolygonInfo(
     }
 
     this->centroid = {INFINITY,INFINITY};
-    this->thetas = {};
-    this->halfplanes = {};
-    this->edges = computeEdges(this->vertices);
+    computeEdges(this->vertices, &this->edges);
   }
 }
 
@@ -286,6 +316,8 @@ double distToConvexPolygonSquared(
   pair<double, double> point,
   const PolygonInfo &polygon)
 {
+  SEARCH_STATS(numPolygonDistanceChecks++);
+
   if (polygon.is_valid_polygon)
   {
     // Figure out which edge to check.
@@ -47,6 +47,13 @@ struct PolygonInfo {
   PolygonInfo(
     const std::vector<std::pair<double, double>> &vertices);
 
+  /**
+   * Recompute everything for a new polygon, reusing this PolygonInfo's
+   * storage.
+   */
+  void assign(
+    const std::vector<std::pair<double, double>> &vertices);
+
   bool is_valid_polygon;
   std::pair<double,double> centroid;
   std::vector<std::pair<double,double>> vertices;
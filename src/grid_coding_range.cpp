@@ -27,624 +27,872 @@
 #include "grid_coding_range.hpp"
 #include "box_expansion.hpp"
 #include "distance_from_polygon.hpp"
+#include "cancellation_token.hpp"
+#include "coding_range_checkpoint.hpp"
+#include "lattice_point_enumerator.hpp"
+#include "message_channel.hpp"
+#include "module_set.hpp"
+#include "search_stats.hpp"
+#include "thread_pool.hpp"
+#include "zonogon.hpp"
 #include <nta_logging.hpp>
 
 #include <math.h>
+#include <poll.h>
 #include <signal.h>
 #include <time.h>
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <numeric>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
-#include <boost/geometry.hpp>
-#include <boost/geometry/geometries/polygon.hpp>
-#include <boost/geometry/geometries/adapted/boost_tuple.hpp>
-#include <boost/geometry/geometries/register/point.hpp>
-
 using std::vector;
 using std::pair;
-namespace bg = boost::geometry;
+using gridcodingrange::MatrixList;
+using gridcodingrange::SearchOrder;
+using gridcodingrange::SearchStats;
+using gridcodingrange::SearchStatsScope;
+using gridcodingrange::SearchStatsTaskScope;
 
-BOOST_GEOMETRY_REGISTER_BOOST_TUPLE_CS(cs::cartesian)
 
+static std::atomic<bool> g_captureInterrupts(true);
+static std::atomic<SearchOrder> g_searchOrder(SearchOrder::DepthFirst);
+static std::atomic<unsigned> g_interruptCount(0);
+static size_t g_captureInterruptsCounter = 0;
+static std::mutex g_captureInterruptsMutex;
+static void (*g_prevHandler)(int) = nullptr;
 
-template<typename T>
-class ThreadSafeQueue {
+
+// Custom interrupt processing is particularly necessary in Jupyter notebooks.
+// Only touch a lock-free atomic here. Computations notice the change when they
+// poll.
+void processInterrupt(int)
+{
+  g_interruptCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+class CaptureInterruptsRAII
+{
 public:
-  void put(T v)
+  CaptureInterruptsRAII()
   {
-    std::unique_lock<std::mutex> lock(mutex_);
-    queue_.push(v);
-    cv_.notify_one();
+    std::unique_lock<std::mutex> lock(g_captureInterruptsMutex);
+
+    if (g_captureInterruptsCounter++ == 0)
+    {
+      g_prevHandler = signal(SIGINT, processInterrupt);
+    }
   }
 
-  T take()
+  ~CaptureInterruptsRAII()
   {
-    std::unique_lock<std::mutex> lock(mutex_);
-    while (queue_.empty())
+    std::unique_lock<std::mutex> lock(g_captureInterruptsMutex);
+
+    if (--g_captureInterruptsCounter == 0)
     {
-      cv_.wait(lock);
+      signal(SIGINT, g_prevHandler);
+      g_prevHandler = nullptr;
     }
-
-    T ret = queue_.front();
-    queue_.pop();
-    return ret;
   }
-
-private:
-  std::mutex mutex_;
-  std::condition_variable cv_;
-  std::queue<T> queue_;
 };
 
+typedef gridcodingrange::CancellationToken::Clock Clock;
+
+/**
+ * A cheaper, lower-resolution steady_clock::now(), good enough for deadlines.
+ */
+Clock::time_point coarseNow()
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+  // steady_clock uses CLOCK_MONOTONIC, which has the same epoch.
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return Clock::time_point(
+    std::chrono::duration_cast<Clock::duration>(
+      std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+#else
+  return Clock::now();
+#endif
+}
 
-class ScheduledTask {
+/**
+ * Everything that can stop one call early: the caller's CancellationToken, a
+ * timeout, and SIGINT. The searches poll this at every node, and the first
+ * reason to stop sticks. Afterward, throwIfStopped turns it into an exception.
+ */
+class CallCancellation
+{
 public:
-  template <typename T, typename F>
-  ScheduledTask(T timeout, F f)
-  {
-    timerThread_ = std::thread(
-      [this, timeout, f]() { this->waiterThread_(timeout, f); });
-  }
+  enum Reason {
+    None,
+    Cancelled,
+    Timeout,
+    Interrupt
+  };
 
-  ~ScheduledTask()
+  /**
+   * @param token
+   * Optional.
+   *
+   * @param timeout
+   * If <= 0, only the token's deadline applies.
+   *
+   * @param captureInterrupts
+   * Whether SIGINT should stop the call, if interrupt capture is enabled. See
+   * setCaptureInterrupts.
+   */
+  CallCancellation(const gridcodingrange::CancellationToken* token,
+                   double timeout, bool captureInterrupts)
+    : token_(token), hasDeadline_(false), reason_(None),
+      interruptBaseline_(g_interruptCount.load())
   {
+    if (token_ != nullptr && token_->hasDeadline())
     {
-      std::unique_lock<std::mutex> lock(timerMutex_);
-      timerCancelled_ = true;
-      timerCondition_.notify_one();
+      hasDeadline_ = true;
+      deadline_ = token_->deadline();
     }
-    timerThread_.join();
-  }
 
-private:
-
-  template <typename T, typename F>
-  void waiterThread_(T tTimeout, F f)
-  {
-    std::unique_lock<std::mutex> lock(this->timerMutex_);
+    if (timeout > 0)
+    {
+      const Clock::time_point deadline = Clock::now() +
+        std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(timeout));
+      deadline_ = hasDeadline_ ? std::min(deadline_, deadline) : deadline;
+      hasDeadline_ = true;
+    }
 
-    while (!this->timerCancelled_)
+    if (captureInterrupts && g_captureInterrupts)
     {
-      if (this->timerCondition_.wait_until(lock, tTimeout) ==
-          std::cv_status::timeout)
-      {
-        f();
-        this->timerCancelled_ = true;
-      }
+      captureInterrupts_.reset(new CaptureInterruptsRAII);
     }
+
+    mustPoll_ = token_ != nullptr || hasDeadline_ || captureInterrupts_;
   }
 
-  std::mutex timerMutex_;
-  std::condition_variable timerCondition_;
-  bool timerCancelled_ = false;
-  std::thread timerThread_;
-};
+  /**
+   * @return
+   * true if the call should stop.
+   */
+  bool poll()
+  {
+    if (reason_.load(std::memory_order_relaxed) != None)
+    {
+      return true;
+    }
 
+    if (!mustPoll_)
+    {
+      return false;
+    }
 
-enum Message {
-  Interrupt,
-  Timeout,
-  Exiting
-};
+    if (token_ != nullptr && token_->isCancelled())
+    {
+      stop_(Cancelled);
+    }
+    else if (hasDeadline_ && coarseNow() >= deadline_)
+    {
+      stop_(Timeout);
+    }
+    else if (captureInterrupts_ &&
+             g_interruptCount.load(std::memory_order_relaxed) !=
+             interruptBaseline_)
+    {
+      stop_(Interrupt);
+    }
 
+    return reason_.load(std::memory_order_relaxed) != None;
+  }
 
-static size_t g_captureInterruptsCounter = 0;
-static std::mutex g_messageQueuesMutex;
-static vector<ThreadSafeQueue<Message>*> g_messageQueues;
-static void (*g_prevHandler)(int) = nullptr;
+  void throwIfStopped() const
+  {
+    switch (reason_.load())
+    {
+      case Timeout:
+        // Python code may check for the precise string "timeout".
+        NTA_THROW << "timeout";
+      case Interrupt:
+        NTA_THROW << "interrupt";
+      case Cancelled:
+        NTA_THROW << "cancelled";
+      case None:
+      default:
+        break;
+    }
+  }
 
+private:
+  void stop_(Reason reason)
+  {
+    Reason expected = None;
+    reason_.compare_exchange_strong(expected, reason);
+  }
 
-// Custom interrupt processing is particularly necessary in Jupyter notebooks.
-void processInterrupt(int sig)
+  const gridcodingrange::CancellationToken* token_;
+  bool hasDeadline_;
+  Clock::time_point deadline_;
+  std::atomic<Reason> reason_;
+  const unsigned interruptBaseline_;
+  std::unique_ptr<CaptureInterruptsRAII> captureInterrupts_;
+  bool mustPoll_;
+};
+
+/**
+ * Compute d % 1.0, returning a value within the range [-0.5, 0.5]
+ */
+double mod1_05(double d)
 {
+  double ret = d - floor(d);
+  if (ret > 0.5)
   {
-    std::unique_lock<std::mutex> lock(g_messageQueuesMutex);
-    for (ThreadSafeQueue<Message>* messageQueue : g_messageQueues)
-    {
-      messageQueue->put(Message::Interrupt);
-    }
+    ret -= 1.0;
   }
+
+  return ret;
 }
 
-class CaptureInterruptsRAII
+/**
+ * The projections of a box's x0 and of its center onto every module's plane,
+ * with one frame per recursion depth.
+ *
+ * A child box differs from its parent in only one dimension, so a child's
+ * frame is derived from its parent's frame with a single column add per module
+ * rather than a full projection of x0.
+ */
+class ProjectionStack
 {
 public:
-  CaptureInterruptsRAII(ThreadSafeQueue<Message>* messages)
-    : messages_(messages)
+  explicit ProjectionStack(size_t numModules)
+    : frameSize_(4*numModules)
   {
-    std::unique_lock<std::mutex> lock(g_messageQueuesMutex);
+  }
 
-    if (g_captureInterruptsCounter++ == 0)
+  /**
+   * Fill frame frameNumber by projecting a box directly. This is the root of a
+   * recursion.
+   */
+  template<size_t K>
+  void initialize(const ModuleSet& modules, const double x0[],
+                  const double dims[], double centerBuffer[],
+                  size_t frameNumber = 0)
+  {
+    if (frames_.size() < (frameNumber + 1)*frameSize_)
     {
-      g_prevHandler = signal(SIGINT, processInterrupt);
+      frames_.resize((frameNumber + 1)*frameSize_);
+    }
+
+    for (size_t iDim = 0; iDim < numDimsOf<K>(modules); iDim++)
+    {
+      centerBuffer[iDim] = x0[iDim] + (dims[iDim]/2);
     }
 
-    g_messageQueues.push_back(messages);
+    for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
+    {
+      const pair<double,double> shift = modules.project<K>(iModule, x0);
+      shifts_(frameNumber)[iModule*2] = shift.first;
+      shifts_(frameNumber)[iModule*2 + 1] = shift.second;
+
+      const pair<double,double> center =
+        modules.project<K>(iModule, centerBuffer);
+      centers_(frameNumber)[iModule*2] = center.first;
+      centers_(frameNumber)[iModule*2 + 1] = center.second;
+    }
   }
 
-  ~CaptureInterruptsRAII()
+  /**
+   * Fill frame frameNumber + 1 for a child of the box in frame frameNumber.
+   * The child's width in dimension iDim is childWidth, half of the parent's,
+   * and it is the upper half if isUpperHalf is set.
+   */
+  template<size_t K>
+  void pushChild(const ModuleSet& modules, size_t frameNumber, size_t iDim,
+                 double childWidth, bool isUpperHalf)
   {
-    std::unique_lock<std::mutex> lock(g_messageQueuesMutex);
-
-    if (--g_captureInterruptsCounter == 0)
+    if (frames_.size() < (frameNumber + 2)*frameSize_)
     {
-      signal(SIGINT, g_prevHandler);
-      g_prevHandler = nullptr;
+      frames_.resize((frameNumber + 2)*frameSize_);
     }
 
-    for (auto it = g_messageQueues.begin(); it != g_messageQueues.end(); it++)
+    const double *parentShifts = shifts(frameNumber);
+    const double *parentCenters = centers(frameNumber);
+    double *childShifts = shifts_(frameNumber + 1);
+    double *childCenters = centers_(frameNumber + 1);
+
+    const size_t numDims = numDimsOf<K>(modules);
+    const double shiftDelta = isUpperHalf ? childWidth : 0.0;
+    const double centerDelta = isUpperHalf ? childWidth/2 : -childWidth/2;
+
+    for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
     {
-      if (*it == messages_)
-      {
-        g_messageQueues.erase(it);
-        break;
-      }
+      const double *domainToPlane = modules.domainToPlane(iModule);
+      const double column0 = domainToPlane[iDim];
+      const double column1 = domainToPlane[numDims + iDim];
+
+      childShifts[iModule*2] = parentShifts[iModule*2] + column0*shiftDelta;
+      childShifts[iModule*2 + 1] =
+        parentShifts[iModule*2 + 1] + column1*shiftDelta;
+      childCenters[iModule*2] = parentCenters[iModule*2] + column0*centerDelta;
+      childCenters[iModule*2 + 1] =
+        parentCenters[iModule*2 + 1] + column1*centerDelta;
     }
   }
 
+  /**
+   * The projected x0 of every module, interleaved as x, y.
+   */
+  const double *shifts(size_t frameNumber) const
+  {
+    return frames_.data() + frameNumber*frameSize_;
+  }
+
+  /**
+   * The projected box center of every module, interleaved as x, y.
+   */
+  const double *centers(size_t frameNumber) const
+  {
+    return frames_.data() + frameNumber*frameSize_ + frameSize_/2;
+  }
+
 private:
-  ThreadSafeQueue<Message>* messages_;
-};
+  double *shifts_(size_t frameNumber)
+  {
+    return frames_.data() + frameNumber*frameSize_;
+  }
 
-template<typename T>
-struct SquareMatrix2D {
-  T v00;
-  T v01;
-  T v10;
-  T v11;
-};
+  double *centers_(size_t frameNumber)
+  {
+    return frames_.data() + frameNumber*frameSize_ + frameSize_/2;
+  }
 
-pair<double,double> transform2D(const SquareMatrix2D<double>& M,
-                                pair<double,double> p)
-{
-  return {M.v00*p.first + M.v01*p.second,
-          M.v10*p.first + M.v11*p.second};
-}
+  const size_t frameSize_;
+  vector<double> frames_;
+};
 
-SquareMatrix2D<double> invert2DMatrix(const vector<vector<double>>& M)
+/**
+ * Every module's shadow of a box, its bounding box, and its bounding box in
+ * the lattice's basis. Every box at a given recursion depth has the same dims,
+ * so a frame is valid for any box of the search at that depth.
+ */
+struct ShadowFrame
 {
-  const double detInv = 1 / (M[0][0]*M[1][1] - M[0][1]*M[1][0]);
-  return {detInv*M[1][1], -detInv*M[0][1],
-          -detInv*M[1][0], detInv*M[0][0]};
-}
+  vector<PolygonInfo> shadows;
+  vector<BoundingBox2D> boundingBoxes;
+  vector<LatticeBox> latticeBoxes;
+};
 
-pair<double,double> transformND(const vector<vector<double>>& M,
-                                const double p[])
+/**
+ * One thread's ShadowFrames, one per recursion depth. Resetting only forgets
+ * which frames are built, so a ShadowFrames that's reused for many searches
+ * stops allocating once it has seen its deepest recursion.
+ */
+class ShadowFrames
 {
-  pair<double,double> result = {0, 0};
-
-  for (size_t col = 0; col < M[0].size(); col++)
+public:
+  /**
+   * Forget every frame, e.g. because the next search has different dims.
+   */
+  void reset()
   {
-    result.first += M[0][col]*p[col];
+    std::fill(frameBuilt_.begin(), frameBuilt_.end(), false);
   }
 
-  for (size_t col = 0; col < M[1].size(); col++)
+  /**
+   * The frame for this depth, or nullptr if it isn't built.
+   */
+  const ShadowFrame *find(size_t frameNumber) const
   {
-    result.second += M[1][col]*p[col];
+    return (frameNumber < frameBuilt_.size() && frameBuilt_[frameNumber])
+      ? &frames_[frameNumber]
+      : nullptr;
   }
 
-  return result;
-}
+  /**
+   * Make room for a frame and mark it as built. The caller fills it in.
+   */
+  ShadowFrame& add(size_t frameNumber)
+  {
+    if (frameNumber >= frameBuilt_.size())
+    {
+      frameBuilt_.resize(frameNumber + 1, false);
+      frames_.resize(frameNumber + 1);
+    }
 
+    frameBuilt_[frameNumber] = true;
+    return frames_[frameNumber];
+  }
 
-struct LatticeBox {
-  double xmin;
-  double xmax;
-  pair<double,double> middle;
+private:
+  vector<char> frameBuilt_;
+  vector<ShadowFrame> frames_;
 };
 
 /**
- * Enumerate the points of a lattice near or within a specified rectangle. This
- * is equivalent to checking whether any circles centered on the points of a
- * lattice overlap the rectangle.
+ * The ShadowFrames of one box shape, shared by every task that searches a box
+ * of that shape.
  *
- * This enumeration works by first guessing at an initial lattice point (i, j),
- * then performing a series of nested sweeps. It sweeps downward, decrementing j
- * until decrementing j causes the distance of the lattice point from the
- * rectangle to increase. Then it sweeps upward using the same rules. It sweeps
- * leftward, decrementing i and repeating these downward and upward sweeps at
- * each i until it passes the lowest i possible for this rectangle. It repeats
- * the process sweeping right. As it sweeps left and right it attempts to choose
- * a good starting j value by considering results from the previous downward and
- * upward sweeps.
+ * Whichever thread needs a frame first builds it and publishes it with a
+ * compare-and-swap. Published frames never change, so reading them takes no
+ * lock.
  */
-class LatticePointEnumerator
+class SharedShadowFrameChain
 {
 public:
-  LatticePointEnumerator(const SquareMatrix2D<double>& latticeBasis,
-                         const SquareMatrix2D<double>& inverseLatticeBasis,
-                         const LatticeBox& cachedLatticeBox,
-                         const pair<double,double>& shift,
-                         double left, double right, double bottom, double top,
-                         double rSquared)
-    :latticeBasis_(latticeBasis), left_(left), right_(right), bottom_(bottom),
-     top_(top), rSquared_(rSquared)
-  {
-    const pair<double,double> ijShift = transform2D(inverseLatticeBasis, shift);
-    iMin_ = ceil(cachedLatticeBox.xmin + ijShift.first);
-    iMax_ = floor(cachedLatticeBox.xmax + ijShift.first);
-    i_ = iStart_ = floor(cachedLatticeBox.middle.first + ijShift.first);
-    j_ = j0_ = jStart_ = floor(cachedLatticeBox.middle.second + ijShift.second);
-  }
-
-  LatticePointEnumerator(const SquareMatrix2D<double>& latticeBasis,
-                         const SquareMatrix2D<double>& inverseLatticeBasis,
-                         double left, double right, double bottom, double top,
-                         double r, double rSquared)
-    :latticeBasis_(latticeBasis), left_(left), right_(right), bottom_(bottom),
-     top_(top), rSquared_(rSquared)
-  {
-    // Find the bounding box of the rectangle in the lattice's basis.
-    double xmin = std::numeric_limits<double>::max();
-    double xmax = std::numeric_limits<double>::lowest();
-
-    const double paddedLeft = left_ - r;
-    const double paddedRight = right_ + r;
-    const double paddedBottom = bottom_ - r;
-    const double paddedTop = top_ + r;
-
-    pair<double, double> ij;
-    ij = transform2D(inverseLatticeBasis, {paddedLeft, paddedBottom});
-    xmin = std::min(xmin, ij.first);
-    xmax = std::max(xmax, ij.first);
-    ij = transform2D(inverseLatticeBasis, {paddedRight, paddedBottom});
-    xmin = std::min(xmin, ij.first);
-    xmax = std::max(xmax, ij.first);
-    ij = transform2D(inverseLatticeBasis, {paddedLeft, paddedTop});
-    xmin = std::min(xmin, ij.first);
-    xmax = std::max(xmax, ij.first);
-    ij = transform2D(inverseLatticeBasis, {paddedRight, paddedTop});
-    xmin = std::min(xmin, ij.first);
-    xmax = std::max(xmax, ij.first);
-
-    iMin_ = ceil(xmin);
-    iMax_ = floor(xmax);
-
-    ij = transform2D(inverseLatticeBasis, {left, bottom});
-    iStart_ = floor(ij.first);
-    jStart_ = floor(ij.second);
-
-    i_ = iStart_;
-    j_ = j0_ = jStart_;
-  }
-
-  bool getNext(pair<double,double> *out)
-  {
-    bool foundContainedPoint = false;
-
-    while (!foundContainedPoint && (sweepingLeft_ || i_ <= iMax_))
-    {
-      const pair<double, double> p = transform2D(latticeBasis_, {i_, j_});
-
-      const double nearestX = std::max(left_,
-                                       std::min(p.first,
-                                                right_));
-      const double nearestY = std::max(bottom_,
-                                       std::min(p.second,
-                                                top_));
-
-      const double dSquared = (pow(p.first - nearestX, 2) +
-                               pow(p.second - nearestY, 2));
-
-      if (j_ == j0_)
-      {
-        dSquared_j0_ = dSquared;
-      }
+  // Frames deeper than this are rare, and each task builds them privately.
+  static const size_t MaxFrames = 128;
 
-      if (dSquared < innerSweepMin_)
-      {
-        innerSweepMin_ = dSquared;
-        jForInnerSweepMin_ = j_;
-      }
+  SharedShadowFrameChain()
+  {
+    for (std::atomic<const ShadowFrame*>& frame : frames_)
+    {
+      frame.store(nullptr, std::memory_order_relaxed);
+    }
+  }
 
-      foundContainedPoint = (dSquared <= rSquared_);
-      if (foundContainedPoint)
-      {
-        *out = p;
-      }
+  ~SharedShadowFrameChain()
+  {
+    for (std::atomic<const ShadowFrame*>& frame : frames_)
+    {
+      delete frame.load(std::memory_order_relaxed);
+    }
+  }
 
-      // If we're moving away from the box, end this part of the inner sweep.
-      const bool endInnerSweep = (!foundContainedPoint &&
-                                  dSquared >= dSquaredPrev_);
+  SharedShadowFrameChain(const SharedShadowFrameChain&) = delete;
+  SharedShadowFrameChain& operator=(const SharedShadowFrameChain&) = delete;
 
-      if (endInnerSweep)
-      {
-        if (sweepingDown_)
-        {
-          sweepingDown_ = false;
+  /**
+   * The frame for this depth, or nullptr if nobody has published it.
+   */
+  const ShadowFrame *find(size_t frameNumber) const
+  {
+    return frames_[frameNumber].load(std::memory_order_acquire);
+  }
 
-          j_ = j0_ + 1;
-          dSquaredPrev_ = dSquared_j0_;
-        }
-        else
-        {
-          if (i_ == iStart_)
-          {
-            jForInnerSweepMin_i0_ = jForInnerSweepMin_;
-          }
+  /**
+   * Publish a frame unless another thread already did. Either way, return the
+   * published frame.
+   */
+  const ShadowFrame *publish(size_t frameNumber,
+                             std::unique_ptr<ShadowFrame> frame)
+  {
+    const ShadowFrame *published = nullptr;
+    if (frames_[frameNumber].compare_exchange_strong(
+          published, frame.get(), std::memory_order_acq_rel,
+          std::memory_order_acquire))
+    {
+      return frame.release();
+    }
 
-          if (sweepingLeft_)
-          {
-            if (--i_ < iMin_)
-            {
-              sweepingLeft_ = false;
-              i_ = iStart_ + 1;
+    return published;
+  }
 
-              j0_ = jForInnerSweepMin_i0_;
-              j_ = j0_;
-            }
-            else
-            {
-              j0_ = jForInnerSweepMin_;
-              j_ = j0_;
-            }
-          }
-          else
-          {
-            ++i_;
-            j0_ = jForInnerSweepMin_;
-            j_ = j0_;
-          }
+private:
+  std::array<std::atomic<const ShadowFrame*>, MaxFrames> frames_;
+};
 
-          sweepingDown_ = true;
-          innerSweepMin_ = std::numeric_limits<double>::max();
-          dSquaredPrev_ = std::numeric_limits<double>::max();
-        }
-      }
-      else
-      {
-        if (sweepingDown_)
-        {
-          --j_;
-        }
-        else
-        {
-          ++j_;
-        }
+/**
+ * The SharedShadowFrameChains of a computeCodingRange search's recently used
+ * box shapes, keyed by their exact dims.
+ *
+ * The expansion hands out the reflections of each box into every orthant back
+ * to back, and they all have identical dims. So a short list of recent shapes
+ * catches nearly every reuse, and memory stays bounded as the expansion moves
+ * on to new shapes. Tasks look up their chain once, so a lock is cheap here.
+ */
+class SharedShadowFrames
+{
+public:
+  std::shared_ptr<SharedShadowFrameChain> acquire(const double dims[],
+                                                  size_t numDims)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
 
-        dSquaredPrev_ = dSquared;
+    for (const Entry& entry : entries_)
+    {
+      if (std::equal(dims, dims + numDims, entry.dims.begin()))
+      {
+        return entry.chain;
       }
     }
 
-    return foundContainedPoint;
-  }
+    if (entries_.size() == MaxShapes)
+    {
+      entries_.pop_front();
+    }
 
-  void restart()
-  {
-    dSquaredPrev_ = std::numeric_limits<double>::max();
-    innerSweepMin_ = std::numeric_limits<double>::max();
-    i_ = iStart_;
-    j_ = j0_ = jStart_;
-    finished_ = false;
-    sweepingLeft_ = true;
-    sweepingDown_ = true;
+    entries_.push_back({vector<double>(dims, dims + numDims),
+                        std::make_shared<SharedShadowFrameChain>()});
+    return entries_.back().chain;
   }
 
 private:
+  static const size_t MaxShapes = 16;
+
+  struct Entry
+  {
+    vector<double> dims;
+    std::shared_ptr<SharedShadowFrameChain> chain;
+  };
 
-  const SquareMatrix2D<double>& latticeBasis_;
-  const double left_;
-  const double right_;
-  const double bottom_;
-  const double top_;
-  const double rSquared_;
-
-  double dSquaredPrev_ = std::numeric_limits<double>::max();
-  double innerSweepMin_ = std::numeric_limits<double>::max();
-  long long jForInnerSweepMin_ = std::numeric_limits<long long>::lowest();
-  long long jForInnerSweepMin_i0_ = std::numeric_limits<long long>::lowest();
-  double dSquared_j0_;
-
-  bool finished_ = false;
-  bool sweepingLeft_ = true;
-  bool sweepingDown_ = true;
-
-  long long iStart_;
-  long long jStart_;
-  long long i_;
-  long long j_;
-  long long j0_;
-  long long iMin_;
-  long long iMax_;
+  std::mutex mutex_;
+  std::deque<Entry> entries_;
 };
 
 /**
- * Enumerate the vertices of a hyperrectangle by incrementing an integer and
- * converting each binary representation into a vertex.
+ * The unresolved boxes of a best-first search. pop() returns the box nearest
+ * to the origin, measured in scaledbox scale factors, and breaks ties with the
+ * box whose projected center is nearest to grid code zero in its worst module,
+ * then with the deeper box. The boxes are stored in a pool that's reused from
+ * search to search.
  */
-class HyperrectangleVertexEnumerator
+class BoxQueue
 {
 public:
-  HyperrectangleVertexEnumerator(const double dims[], size_t numDims)
-    :dims_(dims), numDims_(numDims), upper_(pow(2, numDims)), bitvector_(0x0)
+  // Past this, a best-first search searches the boxes it pops depth-first, so
+  // that a search with a wide frontier doesn't use unbounded memory.
+  static const size_t MaxBoxes = 1 << 14;
+
+  /**
+   * Empty the queue and start storing boxes with numDims dimensions.
+   */
+  void reset(size_t numDims)
+  {
+    numDims_ = numDims;
+    heap_.clear();
+    freeSlots_.clear();
+    pool_.clear();
+  }
+
+  bool empty() const
   {
+    return heap_.empty();
   }
 
-  bool getNext(double *out)
+  size_t size() const
   {
-    if (bitvector_ >= upper_)
+    return heap_.size();
+  }
+
+  /**
+   * The minScaleFactor of the box that pop() would return.
+   */
+  double minScaleFactor() const
+  {
+    return heap_.front().minScaleFactor;
+  }
+
+  void push(const double x0[], const double dims[], size_t frameNumber,
+            double minScaleFactor, double distSquared)
+  {
+    size_t slot;
+    if (freeSlots_.empty())
     {
-      return false;
+      slot = pool_.size() / (2*numDims_);
+      pool_.resize(pool_.size() + 2*numDims_);
     }
-
-    for (size_t bit = 0; bit < numDims_; bit++)
+    else
     {
-      out[bit] = (bitvector_ & (0x1 << bit))
-        ? dims_[bit]
-        : 0;
+      slot = freeSlots_.back();
+      freeSlots_.pop_back();
     }
 
-    bitvector_++;
+    double *box = pool_.data() + slot*2*numDims_;
+    std::copy(x0, x0 + numDims_, box);
+    std::copy(dims, dims + numDims_, box + numDims_);
 
-    return true;
+    heap_.push_back({minScaleFactor, distSquared, frameNumber, slot});
+    std::push_heap(heap_.begin(), heap_.end(), lowerPriority);
   }
 
-  void restart()
+  /**
+   * Remove the next box, copying it to x0 and dims.
+   *
+   * @return
+   * The box's frame number.
+   */
+  size_t pop(double x0[], double dims[])
   {
-    bitvector_ = 0x0;
+    std::pop_heap(heap_.begin(), heap_.end(), lowerPriority);
+    const Entry entry = heap_.back();
+    heap_.pop_back();
+
+    const double *box = pool_.data() + entry.slot*2*numDims_;
+    std::copy(box, box + numDims_, x0);
+    std::copy(box + numDims_, box + 2*numDims_, dims);
+    freeSlots_.push_back(entry.slot);
+
+    return entry.frameNumber;
   }
 
 private:
-  const double *dims_;
-  const size_t numDims_;
-  const double upper_;
-  unsigned int bitvector_;
-};
+  struct Entry
+  {
+    double minScaleFactor;
+    double distSquared;
+    size_t frameNumber;
+    size_t slot;
+  };
 
-/**
- * Compute d % 1.0, returning a value within the range [-0.5, 0.5]
- */
-double mod1_05(double d)
-{
-  double ret = d - floor(d);
-  if (ret > 0.5)
+  static bool lowerPriority(const Entry& a, const Entry& b)
   {
-    ret -= 1.0;
+    if (a.minScaleFactor != b.minScaleFactor)
+    {
+      return a.minScaleFactor > b.minScaleFactor;
+    }
+    if (a.distSquared != b.distSquared)
+    {
+      return a.distSquared > b.distSquared;
+    }
+    return a.frameNumber < b.frameNumber;
   }
 
-  return ret;
-}
+  size_t numDims_ = 0;
+  vector<Entry> heap_;
+  vector<size_t> freeSlots_;
+  vector<double> pool_;
+};
 
 /**
- * Quickly check a few points in this hyperrectangle to see if they have grid
- * code zero.
+ * Everything the divide-and-conquer search caches.
  */
-bool tryFindGridCodeZero(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  const vector<SquareMatrix2D<double>>& latticeBasisByModule,
-  const vector<SquareMatrix2D<double>>& inverseLatticeBasisByModule,
-  size_t numDims,
-  const double x0[],
-  const double dims[],
-  double rSquared,
-  double vertexBuffer[])
+struct SearchCache
 {
-  for (size_t iDim = 0; iDim < numDims; iDim++)
+  explicit SearchCache(size_t numModules)
+    : projectionStack(numModules)
   {
-    vertexBuffer[iDim] = x0[iDim] + (dims[iDim]/2);
   }
 
-  for (size_t iModule = 0; iModule < domainToPlaneByModule.size(); iModule++)
+  /**
+   * Start caching frames for boxes with new dims. If sharedFrames is set, use
+   * its frames and publish new ones there.
+   */
+  void resetFrames(
+    std::shared_ptr<SharedShadowFrameChain> sharedFrames_ = nullptr)
   {
-    const pair<double, double> pointOnPlane =
-      transformND(domainToPlaneByModule[iModule], vertexBuffer);
-
-    const pair<double, double> pointOnUnrolledTorus =
-      transform2D(inverseLatticeBasisByModule[iModule], pointOnPlane);
-
-    const pair<double, double> pointOnTorus = {
-      mod1_05(pointOnUnrolledTorus.first),
-      mod1_05(pointOnUnrolledTorus.second)
-    };
+    privateFrames.reset();
+    sharedFrames = std::move(sharedFrames_);
+  }
 
-    const pair<double, double> pointOnPlaneNearestZero =
-      transform2D(latticeBasisByModule[iModule], pointOnTorus);
+  /**
+   * The frame for this depth, or nullptr if it isn't built.
+   */
+  const ShadowFrame *findFrame(size_t frameNumber) const
+  {
+    return (sharedFrames && frameNumber < SharedShadowFrameChain::MaxFrames)
+      ? sharedFrames->find(frameNumber)
+      : privateFrames.find(frameNumber);
+  }
 
-    if (pow(pointOnPlaneNearestZero.first, 2) +
-        pow(pointOnPlaneNearestZero.second, 2) > rSquared)
+  /**
+   * Add the frame for this depth, filled in by build(ShadowFrame&).
+   */
+  template<typename BuildFrame>
+  const ShadowFrame *addFrame(size_t frameNumber, BuildFrame build)
+  {
+    if (sharedFrames && frameNumber < SharedShadowFrameChain::MaxFrames)
     {
-      return false;
+      std::unique_ptr<ShadowFrame> frame(new ShadowFrame);
+      build(*frame);
+      return sharedFrames->publish(frameNumber, std::move(frame));
     }
+
+    ShadowFrame& frame = privateFrames.add(frameNumber);
+    build(frame);
+    return &frame;
   }
 
-  return true;
-}
+  std::shared_ptr<SharedShadowFrameChain> sharedFrames;
+  ShadowFrames privateFrames;
+  ProjectionStack projectionStack;
+  BoxQueue boxQueue;
 
-vector<pair<double,double>> getShadowConvexHull(
-  const vector<vector<double>>& domainToPlane,
-  size_t numDims,
-  const double dims[],
-  double vertexBuffer[])
+  // Scratch space for building shadows.
+  Zonogon zonogon;
+};
+
+/**
+ * Round a point in the lattice coordinates of a hexagonal lattice to the
+ * nearest lattice point. In these coordinates the six neighbors of the origin
+ * are (±1, 0), (0, ±1), ±(1, -1), so this is the usual cube-coordinate rounding
+ * of hex grids: round x, y = -x - z, and z independently, then recompute
+ * whichever moved the most from the other two.
+ */
+inline pair<double,double> roundToHexagonalLattice(pair<double,double> ab)
 {
-  if (numDims == 2)
-  {
-    // Optimization: in 2D we already know the convex hull.
-    const double point1[2] = {0, 0};
-    const double point2[2] = {0, dims[1]};
-    const double point3[2] = {dims[0], dims[1]};
-    const double point4[2] = {dims[0], 0};
+  const double x = ab.first;
+  const double z = ab.second;
+  const double y = -x - z;
+
+  double rx = floor(x + 0.5);
+  double ry = floor(y + 0.5);
+  double rz = floor(z + 0.5);
 
-    return {transformND(domainToPlane, point1),
-            transformND(domainToPlane, point2),
-            transformND(domainToPlane, point3),
-            transformND(domainToPlane, point4)};
+  const double dx = fabs(rx - x);
+  const double dy = fabs(ry - y);
+  const double dz = fabs(rz - z);
+
+  if (dx > dy && dx > dz)
+  {
+    rx = -ry - rz;
+  }
+  else if (dz > dy)
+  {
+    rz = -rx - ry;
   }
 
-  typedef boost::tuple<float, float> point;
-  typedef bg::model::polygon<point> polygon;
+  return {rx, rz};
+}
 
-  polygon poly;
+/**
+ * The squared distance from a point on a module's plane to the nearest point
+ * with grid code zero, i.e. the nearest lattice point.
+ *
+ * Square and hexagonal lattices get the exact nearest lattice point in closed
+ * form, and measure the offset to it with the lattice's Gram matrix rather than
+ * transforming it back onto the plane. Other lattices round each lattice
+ * coordinate, which finds the nearest lattice point for any point that's near
+ * one, given a reduced basis.
+ */
+inline double distToGridCodeZeroSquared(const ModuleSet& modules,
+                                        size_t iModule,
+                                        const double pointOnPlane[])
+{
+  const pair<double, double> pointOnUnrolledTorus =
+    transform2D(modules.inverseLatticeBasis(iModule),
+                {pointOnPlane[0], pointOnPlane[1]});
 
-  HyperrectangleVertexEnumerator vertices(dims, numDims);
-  while (vertices.getNext(vertexBuffer))
+  switch (modules.latticeKind())
   {
-    const pair<double,double> p = transformND(domainToPlane, vertexBuffer);
-    bg::append(poly, point(p.first, p.second));
+    case LatticeKind::Square:
+    {
+      const SquareMatrix2D<double>& basis = modules.latticeBasis(iModule);
+      const double da = mod1_05(pointOnUnrolledTorus.first);
+      const double db = mod1_05(pointOnUnrolledTorus.second);
+      return (basis.v00*basis.v00 + basis.v10*basis.v10)*(da*da + db*db);
+    }
+    case LatticeKind::Hexagonal:
+    {
+      const SquareMatrix2D<double>& basis = modules.latticeBasis(iModule);
+      const pair<double, double> nearest =
+        roundToHexagonalLattice(pointOnUnrolledTorus);
+      const double da = pointOnUnrolledTorus.first - nearest.first;
+      const double db = pointOnUnrolledTorus.second - nearest.second;
+      return ((basis.v00*basis.v00 + basis.v10*basis.v10)*
+              (da*da + db*db + da*db));
+    }
+    default:
+    {
+      const pair<double, double> pointOnTorus = {
+        mod1_05(pointOnUnrolledTorus.first),
+        mod1_05(pointOnUnrolledTorus.second)
+      };
+
+      const pair<double, double> pointOnPlaneNearestZero =
+        transform2D(modules.latticeBasis(iModule), pointOnTorus);
+
+      return (pow(pointOnPlaneNearestZero.first, 2) +
+              pow(pointOnPlaneNearestZero.second, 2));
+    }
   }
+}
 
-  polygon hull;
-  bg::convex_hull(poly, hull);
+/**
+ * Quickly check a few points in this hyperrectangle to see if they have grid
+ * code zero. If one does, write it to vertexBuffer.
+ *
+ * This function and the recursion that calls it are templated on the number
+ * of dimensions K, so that the common cases get fixed-size, fully unrolled
+ * loops. K = 0 is the generic version.
+ */
+template<size_t K>
+bool tryFindGridCodeZero(
+  const ModuleSet& modules,
+  const double x0[],
+  const double dims[],
+  const double projectedCenters[],
+  double rSquared,
+  double vertexBuffer[])
+{
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
+  {
+    if (distToGridCodeZeroSquared(modules, iModule,
+                                  projectedCenters + iModule*2) > rSquared)
+    {
+      return false;
+    }
+  }
 
-  vector<pair<double, double>> convexHull;
-  convexHull.reserve(hull.outer().size());
-  for (auto it = hull.outer().begin();
-       it != hull.outer().end() - 1; // don't include duplicate start point
-       ++it)
+  for (size_t iDim = 0; iDim < numDimsOf<K>(modules); iDim++)
   {
-    convexHull.push_back({bg::get<0>(*it),
-                          bg::get<1>(*it)});
+    vertexBuffer[iDim] = x0[iDim] + (dims[iDim]/2);
   }
 
-  return convexHull;
+  return true;
 }
 
-struct BoundingBox2D {
-  double xmin;
-  double xmax;
-  double ymin;
-  double ymax;
-};
+/**
+ * Whether a module's TorusOccupancy shows that this rectangle is farther than r
+ * from every lattice point. Only small rectangles can be checked this way.
+ */
+inline bool ruledOutByTorusOccupancy(const TorusOccupancy& occupancy,
+                                     double xmin, double xmax,
+                                     double ymin, double ymax)
+{
+  const double width = xmax - xmin;
+  const double height = ymax - ymin;
+  return occupancy.isFar((xmin + xmax)/2, (ymin + ymax)/2,
+                         (width*width + height*height)/4);
+}
 
 /**
  * Quickly check whether this hyperrectangle excludes grid code zero
  * in any individual module.
  */
 bool tryProveGridCodeZeroImpossible_1D(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  const vector<SquareMatrix2D<double>>& latticeBasisByModule,
-  const vector<SquareMatrix2D<double>>& inverseLatticeBasisByModule,
-  size_t numDims,
-  const double x0[],
+  const ModuleSet& modules,
   const double dims[],
+  const double projectedShifts[],
   double r,
   double rSquared)
 {
-  const double point1 = x0[0];
-  const double point2 = x0[0] + dims[0];
+  const bool checkTorusOccupancy = modules.hasTorusOccupancy();
 
-  for (size_t iModule = 0; iModule < domainToPlaneByModule.size(); iModule++)
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
   {
-    const pair<double,double> p1 = transformND(domainToPlaneByModule[iModule],
-                                               &point1);
-    const pair<double,double> p2 = transformND(domainToPlaneByModule[iModule],
-                                               &point2);
+    const double *domainToPlane = modules.domainToPlane(iModule);
+    const pair<double,double> p1 = {projectedShifts[iModule*2],
+                                    projectedShifts[iModule*2 + 1]};
+    const pair<double,double> p2 = {p1.first + domainToPlane[0]*dims[0],
+                                    p1.second + domainToPlane[1]*dims[0]};
 
     // Figure out which lattice points we need to check.
     const double xmin = std::min(p1.first, p2.first);
     const double xmax = std::max(p1.first, p2.first);
     const double ymin = std::min(p1.second, p2.second);
     const double ymax = std::max(p1.second, p2.second);
-    LatticePointEnumerator latticePoints(latticeBasisByModule[iModule],
-                                         inverseLatticeBasisByModule[iModule],
+
+    if (checkTorusOccupancy &&
+        ruledOutByTorusOccupancy(modules.torusOccupancy(iModule),
+                                 xmin, xmax, ymin, ymax))
+    {
+      SEARCH_STATS(recordImpossibleProof(iModule));
+      return true;
+    }
+
+    LatticePointEnumerator latticePoints(modules.latticeBasis(iModule),
+                                         modules.inverseLatticeBasis(iModule),
                                          xmin, xmax, ymin, ymax, r, rSquared);
 
     pair<double, double> latticePoint;
@@ -659,6 +907,7 @@ bool tryProveGridCodeZeroImpossible_1D(
     {
       // This module never gets near grid code zero for the provided range of
       // locations. So this range can't possibly contain grid code zero.
+      SEARCH_STATS(recordImpossibleProof(iModule));
       return true;
     }
   }
@@ -678,141 +927,109 @@ void gridcodingrange::setCheckPolygonThreshold(double threshold)
   g_checkPolygonThreshold = threshold;
 }
 
-BoundingBox2D computeBoundingBox(const vector<pair<double,double>>& shadow)
+const size_t DefaultTorusOccupancyResolution = 0;
+size_t g_torusOccupancyResolution = DefaultTorusOccupancyResolution;
+
+void gridcodingrange::resetTorusOccupancyResolution()
 {
-  BoundingBox2D boundingBox = {
-    std::numeric_limits<double>::max(),
-    std::numeric_limits<double>::lowest(),
-    std::numeric_limits<double>::max(),
-    std::numeric_limits<double>::lowest(),
-  };
+  g_torusOccupancyResolution = DefaultTorusOccupancyResolution;
+}
 
-  for (const pair<double,double>& p : shadow)
-  {
-    boundingBox.xmin = std::min(boundingBox.xmin, p.first);
-    boundingBox.xmax = std::max(boundingBox.xmax, p.first);
-    boundingBox.ymin = std::min(boundingBox.ymin, p.second);
-    boundingBox.ymax = std::max(boundingBox.ymax, p.second);
-  }
+void gridcodingrange::setTorusOccupancyResolution(size_t resolution)
+{
+  g_torusOccupancyResolution = resolution;
+}
 
-  return boundingBox;
+size_t gridcodingrange::getTorusOccupancyResolution()
+{
+  return g_torusOccupancyResolution;
 }
 
-LatticeBox computeLatticeBox(
-  const BoundingBox2D& boundingBox,
-  const SquareMatrix2D<double>& inverseLatticeBasis,
-  double r)
+/**
+ * Compute every module's shadow of a box with these dims.
+ */
+void buildShadowFrame(const ModuleSet& modules, const double dims[], double r,
+                      Zonogon& shadow, ShadowFrame& frame)
 {
-  const double paddedLeft = boundingBox.xmin - r;
-  const double paddedRight = boundingBox.xmax + r;
-  const double paddedBottom = boundingBox.ymin - r;
-  const double paddedTop = boundingBox.ymax + r;
+  SEARCH_STATS(numShadowFramesBuilt++);
+
+  frame.shadows.resize(modules.numModules());
+  frame.boundingBoxes.resize(modules.numModules());
+  frame.latticeBoxes.resize(modules.numModules());
 
-  double xmin = std::numeric_limits<double>::max();
-  double xmax = std::numeric_limits<double>::lowest();
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
+  {
+    shadow.build(modules.domainToPlane(iModule), modules.numDims(), dims);
 
-  pair<double, double> ij;
-  ij = transform2D(inverseLatticeBasis, {paddedLeft, paddedBottom});
-  xmin = std::min(xmin, ij.first);
-  xmax = std::max(xmax, ij.first);
-  ij = transform2D(inverseLatticeBasis, {paddedRight, paddedBottom});
-  xmin = std::min(xmin, ij.first);
-  xmax = std::max(xmax, ij.first);
-  ij = transform2D(inverseLatticeBasis, {paddedLeft, paddedTop});
-  xmin = std::min(xmin, ij.first);
-  xmax = std::max(xmax, ij.first);
-  ij = transform2D(inverseLatticeBasis, {paddedRight, paddedTop});
-  xmin = std::min(xmin, ij.first);
-  xmax = std::max(xmax, ij.first);
+    const BoundingBox2D& boundingBox = shadow.boundingBox();
+    frame.boundingBoxes[iModule] = boundingBox;
+    frame.latticeBoxes[iModule] = LatticePointEnumerator::computeLatticeBox(
+      modules.inverseLatticeBasis(iModule), boundingBox.xmin - r,
+      boundingBox.xmax + r, boundingBox.ymin - r, boundingBox.ymax + r);
 
-  return {xmin, xmax,
-          transform2D(inverseLatticeBasis, {(paddedRight + paddedLeft) / 2,
-                                            (paddedTop + paddedBottom) / 2})};
+    // Large shadows are only checked via their bounding boxes.
+    if (boundingBox.xmax - boundingBox.xmin <= g_checkPolygonThreshold &&
+        boundingBox.ymax - boundingBox.ymin <= g_checkPolygonThreshold)
+    {
+      frame.shadows[iModule].assign(shadow.vertices());
+    }
+  }
 }
 
 /**
  * Quickly check whether this hyperrectangle excludes grid code zero
  * in any individual module.
  */
+template<size_t K>
 bool tryProveGridCodeZeroImpossible(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  const vector<SquareMatrix2D<double>>& latticeBasisByModule,
-  const vector<SquareMatrix2D<double>>& inverseLatticeBasisByModule,
-  size_t numDims,
-  const double x0[],
+  const ModuleSet& modules,
   const double dims[],
+  const double projectedShifts[],
   double r,
   double rSquared,
-  double vertexBuffer[],
-  vector<vector<PolygonInfo>>& cachedShadows,
-  vector<vector<BoundingBox2D>>& cachedShadowBoundingBoxes,
-  vector<vector<LatticeBox>>& cachedLatticeBoxes,
+  SearchCache& cache,
   size_t frameNumber)
 {
-  if (numDims == 1)
+  if (numDimsOf<K>(modules) == 1)
   {
-    return tryProveGridCodeZeroImpossible_1D(
-      domainToPlaneByModule, latticeBasisByModule, inverseLatticeBasisByModule,
-      numDims, x0, dims, r, rSquared);
+    return tryProveGridCodeZeroImpossible_1D(modules, dims, projectedShifts, r,
+                                             rSquared);
   }
 
-  NTA_ASSERT(frameNumber <= cachedShadowBoundingBoxes.size());
-
-  if (frameNumber == cachedShadowBoundingBoxes.size())
+  // A search that starts below the top of the recursion may skip frames, so
+  // build each frame the first time it's used.
+  const ShadowFrame *frame = cache.findFrame(frameNumber);
+  if (frame == nullptr)
   {
-    vector<PolygonInfo> shadowByModule;
-    shadowByModule.reserve(domainToPlaneByModule.size());
-
-    vector<BoundingBox2D> boundingBoxByModule;
-    boundingBoxByModule.reserve(domainToPlaneByModule.size());
-
-    vector<LatticeBox> latticeBoxByModule;
-    latticeBoxByModule.reserve(domainToPlaneByModule.size());
-
-    for (size_t iModule = 0; iModule < domainToPlaneByModule.size(); iModule++)
-    {
-      const vector<pair<double, double>> shadow =
-        getShadowConvexHull(domainToPlaneByModule[iModule], numDims, dims,
-                            vertexBuffer);
-
-      const BoundingBox2D boundingBox = computeBoundingBox(shadow);;
-      boundingBoxByModule.push_back(boundingBox);
-
-      latticeBoxByModule.push_back(
-        computeLatticeBox(boundingBox, inverseLatticeBasisByModule[iModule],
-                          r));
-
-      if (boundingBox.xmax - boundingBox.xmin > g_checkPolygonThreshold ||
-          boundingBox.ymax - boundingBox.ymin > g_checkPolygonThreshold)
-      {
-        shadowByModule.push_back({});
-      }
-      else
-      {
-        shadowByModule.push_back(PolygonInfo(shadow));
-      }
-    }
-
-    cachedShadows.push_back(shadowByModule);
-    cachedShadowBoundingBoxes.push_back(boundingBoxByModule);
-    cachedLatticeBoxes.push_back(latticeBoxByModule);
+    frame = cache.addFrame(frameNumber, [&](ShadowFrame& newFrame) {
+        buildShadowFrame(modules, dims, r, cache.zonogon, newFrame);
+      });
   }
 
-  for (size_t iModule = 0; iModule < domainToPlaneByModule.size(); iModule++)
+  const bool checkTorusOccupancy = modules.hasTorusOccupancy();
+
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
   {
     // Figure out which lattice points we need to check.
-    const pair<double,double> shift =
-      transformND(domainToPlaneByModule[iModule], x0);
-    const BoundingBox2D& boundingBox =
-      cachedShadowBoundingBoxes[frameNumber][iModule];
+    const pair<double,double> shift = {projectedShifts[iModule*2],
+                                       projectedShifts[iModule*2 + 1]};
+    const BoundingBox2D& boundingBox = frame->boundingBoxes[iModule];
     const double xmin = boundingBox.xmin + shift.first;
     const double xmax = boundingBox.xmax + shift.first;
     const double ymin = boundingBox.ymin + shift.second;
     const double ymax = boundingBox.ymax + shift.second;
 
+    if (checkTorusOccupancy &&
+        ruledOutByTorusOccupancy(modules.torusOccupancy(iModule),
+                                 xmin, xmax, ymin, ymax))
+    {
+      SEARCH_STATS(recordImpossibleProof(iModule));
+      return true;
+    }
+
     LatticePointEnumerator latticePoints(
-      latticeBasisByModule[iModule], inverseLatticeBasisByModule[iModule],
-      cachedLatticeBoxes[frameNumber][iModule], shift, xmin, xmax, ymin, ymax,
+      modules.latticeBasis(iModule), modules.inverseLatticeBasis(iModule),
+      frame->latticeBoxes[iModule], shift, xmin, xmax, ymin, ymax, r,
       rSquared);
 
     pair<double, double> latticePoint;
@@ -848,8 +1065,7 @@ bool tryProveGridCodeZeroImpossible(
         latticePoint.second -= shift.second;
         foundLatticeCollision =
           distToConvexPolygonSquared(
-            latticePoint, cachedShadows[frameNumber][iModule]
-            ) <= rSquared;
+            latticePoint, frame->shadows[iModule]) <= rSquared;
       }
     }
 
@@ -857,6 +1073,7 @@ bool tryProveGridCodeZeroImpossible(
     {
       // This module never gets near grid code zero for the provided range of
       // locations. So this range can't possibly contain grid code zero.
+      SEARCH_STATS(recordImpossibleProof(iModule));
       return true;
     }
   }
@@ -887,687 +1104,3268 @@ private:
 };
 
 /**
- * Helper function that doesn't allocate any memory, so it's much better for
- * recursion.
+ * Helper function that doesn't allocate any memory once its caches are warm,
+ * so it's much better for recursion.
+ *
+ * The box's projections must already be in frame frameNumber of
+ * cache.projectionStack, e.g. via ProjectionStack::initialize.
  */
+template<size_t K>
 bool findGridCodeZeroHelper(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  const vector<SquareMatrix2D<double>>& latticeBasisByModule,
-  const vector<SquareMatrix2D<double>>& inverseLatticeBasisByModule,
-  size_t numDims,
+  const ModuleSet& modules,
   double x0[],
   double dims[],
   double r,
   double rSquaredPositive,
   double rSquaredNegative,
   double vertexBuffer[],
-  vector<vector<PolygonInfo>>& cachedShadows,
-  vector<vector<BoundingBox2D>>& cachedShadowBoundingBoxes,
-  vector<vector<LatticeBox>>& cachedLatticeBoxes,
+  SearchCache& cache,
   size_t frameNumber,
-  std::atomic<bool>& shouldContinue)
+  std::atomic<bool>& shouldContinue,
+  CallCancellation& cancellation)
 {
-  if (!shouldContinue)
+  if (!shouldContinue || cancellation.poll())
   {
     return false;
   }
 
-  if (tryProveGridCodeZeroImpossible(domainToPlaneByModule,
-                                     latticeBasisByModule,
-                                     inverseLatticeBasisByModule, numDims, x0,
-                                     dims, r, rSquaredNegative, vertexBuffer,
-                                     cachedShadows, cachedShadowBoundingBoxes,
-                                     cachedLatticeBoxes, frameNumber))
+  SEARCH_STATS(recordNode(frameNumber));
+
+  ProjectionStack& projectionStack = cache.projectionStack;
+
+  if (tryProveGridCodeZeroImpossible<K>(modules, dims,
+                                        projectionStack.shifts(frameNumber),
+                                        r, rSquaredNegative, cache,
+                                        frameNumber))
   {
     return false;
   }
 
-  if (tryFindGridCodeZero(domainToPlaneByModule, latticeBasisByModule,
-                          inverseLatticeBasisByModule, numDims, x0, dims,
-                          rSquaredPositive, vertexBuffer))
+  if (tryFindGridCodeZero<K>(modules, x0, dims,
+                             projectionStack.centers(frameNumber),
+                             rSquaredPositive, vertexBuffer))
   {
     return true;
   }
 
+  const size_t numDims = numDimsOf<K>(modules);
   size_t iWidestDim = std::distance(dims,
                                     std::max_element(dims, dims + numDims));
   {
     SwapValueRAII swap1(&dims[iWidestDim], dims[iWidestDim] / 2);
-    if (findGridCodeZeroHelper(
-          domainToPlaneByModule, latticeBasisByModule,
-          inverseLatticeBasisByModule, numDims, x0, dims, r, rSquaredPositive,
-          rSquaredNegative, vertexBuffer, cachedShadows,
-          cachedShadowBoundingBoxes, cachedLatticeBoxes, frameNumber + 1,
-          shouldContinue))
+    projectionStack.pushChild<K>(modules, frameNumber, iWidestDim,
+                                 dims[iWidestDim], false);
+    if (findGridCodeZeroHelper<K>(
+          modules, x0, dims, r, rSquaredPositive, rSquaredNegative,
+          vertexBuffer, cache, frameNumber + 1, shouldContinue,
+          cancellation))
     {
       return true;
     }
 
     {
       SwapValueRAII swap2(&x0[iWidestDim], x0[iWidestDim] + dims[iWidestDim]);
-      return findGridCodeZeroHelper(
-        domainToPlaneByModule, latticeBasisByModule,
-        inverseLatticeBasisByModule, numDims, x0, dims, r, rSquaredPositive,
-        rSquaredNegative, vertexBuffer, cachedShadows,
-        cachedShadowBoundingBoxes, cachedLatticeBoxes, frameNumber + 1,
-        shouldContinue);
+      projectionStack.pushChild<K>(modules, frameNumber, iWidestDim,
+                                   dims[iWidestDim], true);
+      return findGridCodeZeroHelper<K>(
+        modules, x0, dims, r, rSquaredPositive, rSquaredNegative,
+        vertexBuffer, cache, frameNumber + 1, shouldContinue,
+        cancellation);
     }
   }
 }
 
-struct ExpansionState {
-  // Constants (thread-safe)
-  const vector<vector<vector<double>>>& domainToPlaneByModule;
-  const vector<SquareMatrix2D<double>>& latticeBasisByModule;
-  const vector<SquareMatrix2D<double>>& inverseLatticeBasisByModule;
-  const double readoutResolution;
-  const double meanScaleEstimate;
-  const size_t numDims;
-
-  // Task management
-  MultiDirectionExpansion expansionEnumerator;
-  bool continueExpansion;
+/**
+ * The shared state of a findGridCodeZero search that has been split into tasks
+ * on a thread pool.
+ */
+struct ParallelSearch
+{
+  ParallelSearch(const ModuleSet& modules_, double r_, double rSquaredPositive_,
+                 double rSquaredNegative_, size_t parallelDepth_,
+                 double pointWithGridCodeZero_[],
+                 std::atomic<bool>& shouldContinue_,
+                 CallCancellation& cancellation_, TaskGroup& tasks_)
+    : modules(modules_), r(r_), rSquaredPositive(rSquaredPositive_),
+      rSquaredNegative(rSquaredNegative_), parallelDepth(parallelDepth_),
+      shouldContinue(shouldContinue_), cancellation(cancellation_),
+      tasks(tasks_), parentStats(SearchStats::current()),
+      foundGridCodeZero(false), pointWithGridCodeZero(pointWithGridCodeZero_)
+  {
+  }
 
-  // Results
-  vector<double> pointWithGridCodeZero;
-  double foundPointBaselineRadius;
+  /**
+   * Borrow a cache that no other task is using. Caches outlive tasks, so the
+   * shadows of deep frames are only built a few times per search.
+   */
+  std::unique_ptr<SearchCache> acquireCache()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idleCaches.empty())
+    {
+      return std::unique_ptr<SearchCache>(
+        new SearchCache(modules.numModules()));
+    }
 
-  // Thread management
-  std::mutex& mutex;
-  std::condition_variable& finishedCondition;
-  bool finished;
-  size_t numActiveThreads;
-  vector<double> threadBaselineFactor;
-  vector<vector<double>> threadQueryX0;
-  vector<vector<double>> threadQueryDims;
-  vector<std::atomic<bool>> threadShouldContinue;
-  std::atomic<bool>& quitting;
-  vector<bool> threadRunning;
-};
+    std::unique_ptr<SearchCache> cache = std::move(idleCaches.back());
+    idleCaches.pop_back();
+    return cache;
+  }
 
-template<typename T>
-std::string vecs(const vector<T>& v)
-{
-  std::ostringstream oss;
-  oss << "[";
+  void releaseCache(std::unique_ptr<SearchCache> cache)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    idleCaches.push_back(std::move(cache));
+  }
 
-  for (size_t i = 0; i < v.size(); i++)
+  /**
+   * Keep the first point found and cancel every other task.
+   */
+  void recordResult(const double point[])
   {
-    oss << v[i];
-    if (i < v.size() - 1)
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!foundGridCodeZero)
     {
-      oss << ", ";
+      foundGridCodeZero = true;
+      std::copy(point, point + modules.numDims(), pointWithGridCodeZero);
     }
+    shouldContinue = false;
   }
 
-  oss << "]";
-
-  return oss.str();
-}
+  // Constants (thread-safe)
+  const ModuleSet& modules;
+  const double r;
+  const double rSquaredPositive;
+  const double rSquaredNegative;
+  const size_t parallelDepth;
+
+  std::atomic<bool>& shouldContinue;
+  CallCancellation& cancellation;
+  TaskGroup& tasks;
+  SearchStats *const parentStats;
+
+  // Guarded by the mutex
+  std::mutex mutex;
+  vector<std::unique_ptr<SearchCache>> idleCaches;
+  bool foundGridCodeZero;
+  double *pointWithGridCodeZero;
+};
 
-void recordResult(size_t iThread, ExpansionState& state,
-                  const vector<double>& pointWithGridCodeZero)
+/**
+ * One node of a parallel findGridCodeZero search. Above the search's
+ * parallelDepth, a node that can't be resolved queues its two halves as new
+ * tasks. At parallelDepth, it runs the ordinary recursion on its subtree.
+ */
+template<size_t K>
+void findGridCodeZeroTask(ParallelSearch& search, DimsArray<K> x0,
+                          DimsArray<K> dims, size_t frameNumber)
 {
-  state.continueExpansion = false;
-  if (state.threadBaselineFactor[iThread] < state.foundPointBaselineRadius)
+  if (!search.shouldContinue || search.cancellation.poll())
   {
-    state.foundPointBaselineRadius = state.threadBaselineFactor[iThread];
-    state.pointWithGridCodeZero = pointWithGridCodeZero;
+    return;
+  }
 
-    // Notify all others that they should stop unless they're checking a lower
-    // base width.
-    for (size_t iOtherThread = 0;
-         iOtherThread < state.threadBaselineFactor.size();
-         iOtherThread++)
+  SearchStatsTaskScope statsScope(search.parentStats);
+
+  const ModuleSet& modules = search.modules;
+  DimsArray<K> point(modules.numDims());
+  std::unique_ptr<SearchCache> cache = search.acquireCache();
+  cache->projectionStack.initialize<K>(modules, x0.data(), dims.data(),
+                                       point.data(), frameNumber);
+
+  bool found = false;
+  bool split = false;
+  if (frameNumber >= search.parallelDepth)
+  {
+    found = findGridCodeZeroHelper<K>(
+      modules, x0.data(), dims.data(), search.r, search.rSquaredPositive,
+      search.rSquaredNegative, point.data(), *cache, frameNumber,
+      search.shouldContinue, search.cancellation);
+  }
+  else
+  {
+    SEARCH_STATS(recordNode(frameNumber));
+
+    if (!tryProveGridCodeZeroImpossible<K>(
+          modules, dims.data(), cache->projectionStack.shifts(frameNumber),
+          search.r, search.rSquaredNegative, *cache, frameNumber))
     {
-      if (iOtherThread != iThread &&
-          state.threadShouldContinue[iOtherThread] &&
-          (state.threadBaselineFactor[iOtherThread] >=
-           state.foundPointBaselineRadius))
-      {
-        state.threadShouldContinue[iOtherThread] = false;
-      }
+      found = tryFindGridCodeZero<K>(
+        modules, x0.data(), dims.data(),
+        cache->projectionStack.centers(frameNumber), search.rSquaredPositive,
+        point.data());
+      split = !found;
     }
   }
+
+  search.releaseCache(std::move(cache));
+
+  if (found)
+  {
+    search.recordResult(point.data());
+  }
+  else if (split)
+  {
+    const size_t numDims = numDimsOf<K>(modules);
+    const size_t iWidestDim = std::distance(
+      dims.data(), std::max_element(dims.data(), dims.data() + numDims));
+    dims[iWidestDim] /= 2;
+
+    ParallelSearch *s = &search;
+    search.tasks.run([s, x0, dims, frameNumber] {
+        findGridCodeZeroTask<K>(*s, x0, dims, frameNumber + 1);
+      });
+
+    x0[iWidestDim] += dims[iWidestDim];
+    search.tasks.run([s, x0, dims, frameNumber] {
+        findGridCodeZeroTask<K>(*s, x0, dims, frameNumber + 1);
+      });
+  }
 }
 
-void findGridCodeZeroThread(size_t iThread, ExpansionState& state)
+/**
+ * The order in which a computeCodingRange query searches its boxes.
+ */
+MultiDirectionExpansion createExpansion(const vector<double>& scaledbox,
+                                        const vector<double>& ignorebox,
+                                        size_t numDims)
 {
-  bool foundGridCodeZero = false;
-  vector<double> x0(state.numDims);
-  vector<double> dims(state.numDims);
-  vector<double> pointWithGridCodeZero(state.numDims);
+  // Optimization: for the final dimension, don't go negative. Half of the box
+  // will be equal-and-opposite phases of the other half, so we ignore the
+  // lower half of the final dimension.
+  return MultiDirectionExpansion(scaledbox.begin(), scaledbox.end(),
+                                 ignorebox.begin(), ignorebox.end(),
+                                 (0x1u << (numDims - 1)) - 1);
+}
 
-  vector<long long> numBinsByDim(state.numDims);
+/**
+ * The box scale factors that a computeCodingRange query tests. They start at
+ * the expansion's initial baseline factor and grow by 1 + precision per step.
+ */
+class ScaleFactorGrid
+{
+public:
+  ScaleFactorGrid(double initialFactor, double precision)
+    : growth_(1 + precision),
+      factors_(1, initialFactor)
+  {
+    NTA_CHECK(precision > 0)
+      << "The expansion precision must be positive. "
+      << "Actual: " << precision;
+  }
 
-  // Add a small epsilon to handle situations where floating point math causes
-  // a vertex to be non-zero-overlapping here and zero-overlapping in
-  // tryProveGridCodeZeroImpossible. With this addition, anything
-  // zero-overlapping in tryProveGridCodeZeroImpossible is guaranteed to be
-  // zero-overlapping here, so the program won't get caught in infinite
-  // recursion.
-  const double rSquaredPositive = pow(state.readoutResolution/2 + 0.000000001, 2);
-  const double rSquaredNegative = pow(state.readoutResolution/2, 2);
+  double factor(size_t step)
+  {
+    // Multiply step by step, so the default schedule gets exactly the factors
+    // that SelectiveIgnoranceBoxExpansion::getNext gets.
+    while (factors_.size() <= step)
+    {
+      factors_.push_back(factors_.back() * growth_);
+    }
+    return factors_[step];
+  }
 
-  while (!state.quitting)
+  /**
+   * The last step whose factor is at or below this scale factor, or 0 if
+   * every step's is above it.
+   */
+  size_t stepAt(double scaleFactor)
   {
-    // Modify the shared state. Record the results, decide the next task,
-    // volunteer to do it.
+    while (factors_.back() <= scaleFactor)
     {
-      std::lock_guard<std::mutex> lock(state.mutex);
+      factors_.push_back(factors_.back() * growth_);
+    }
 
-      if (foundGridCodeZero)
-      {
-        recordResult(iThread, state, pointWithGridCodeZero);
-      }
+    const size_t above = std::distance(
+      factors_.begin(),
+      std::upper_bound(factors_.begin(), factors_.end(), scaleFactor));
+    return (above > 0) ? above - 1 : 0;
+  }
 
-      if (!state.continueExpansion)
-      {
-        break;
-      }
+  double growth() const
+  {
+    return growth_;
+  }
 
-      // Select task params.
-      state.expansionEnumerator.getNext(state.threadQueryX0[iThread].data(),
-                                        state.threadQueryDims[iThread].data(),
-                                        &state.threadBaselineFactor[iThread]);
+private:
+  const double growth_;
+  vector<double> factors_;
+};
 
-      // Make an unshared copy that findGridCodeZeroHelper can modify.
-      x0 = state.threadQueryX0[iThread];
-      dims = state.threadQueryDims[iThread];
+/**
+ * The scale factor of the scaledbox, reflected into the point's orthant, that
+ * reaches this point.
+ */
+inline double scaleFactorOf(const double point[], const double scaledbox[],
+                            size_t numDims)
+{
+  double scaleFactor = 0;
+  for (size_t iDim = 0; iDim < numDims; iDim++)
+  {
+    if (scaledbox[iDim] > 0)
+    {
+      scaleFactor = std::max(scaleFactor, fabs(point[iDim]) / scaledbox[iDim]);
     }
+  }
 
-    // Perform the task.
+  return scaleFactor;
+}
+
+/**
+ * The smallest factor by which the scaledbox, reflected into any orthant, must
+ * be scaled to reach a point in this box.
+ */
+template<size_t K>
+double minScaleFactor(const double x0[], const double dims[],
+                      const double scaledbox[], size_t numDims)
+{
+  const size_t n = (K > 0) ? K : numDims;
 
-    vector<vector<PolygonInfo>> cachedShadows;
-    vector<vector<BoundingBox2D>> cachedShadowBoundingBoxes;
-    vector<vector<LatticeBox>> cachedLatticeBoxes;
+  double factor = 0;
+  for (size_t iDim = 0; iDim < n; iDim++)
+  {
+    if (scaledbox[iDim] == 0)
+    {
+      continue;
+    }
 
-    // Optimization: if the box is large, break it into small chunks rather than
-    // relying completely on the divide-and-conquer to break into
-    // reasonable-sized chunks.
+    const double lower = x0[iDim];
+    const double upper = x0[iDim] + dims[iDim];
+    const double nearest = (lower <= 0 && upper >= 0)
+      ? 0
+      : std::min(fabs(lower), fabs(upper));
+    factor = std::max(factor, nearest / scaledbox[iDim]);
+  }
 
-    // Use a longer bin size for 1D. A 1D slice of a 2D plane can be relatively
-    // long before it has high probability of colliding with a lattice point in
-    // every module.
-    const double scalesPerBin = (state.numDims == 1)
-      ? 2.5
-      : 0.55;
+  return factor;
+}
 
-    for (size_t iDim = 0; iDim < state.numDims; iDim++)
+/**
+ * Decides which shells of a computeCodingRange expansion to search, following
+ * an ExpansionSchedule. The shells' scale factors are on a grid that starts at
+ * the expansion's initial baseline factor and grows by 1 + precision per step.
+ * Each shell spans one or more steps.
+ *
+ * The caller hands out the boxes from getNext and reports each one to
+ * finishBox. A shell whose box contains grid code zero is "dirty": its other
+ * boxes are pointless, and if it's more than one step wide, the steps between
+ * its inner box and the collision are searched again, half at a time, once its
+ * running boxes are finished.
+ *
+ * It isn't thread-safe.
+ */
+class ShellScheduler
+{
+public:
+  ShellScheduler(const vector<double>& scaledbox,
+                 const vector<double>& ignorebox,
+                 size_t numDims,
+                 const gridcodingrange::ExpansionSchedule& schedule)
+    : expansion_(createExpansion(scaledbox, ignorebox, numDims)),
+      scaledbox_(scaledbox),
+      grid_(expansion_.initialBaselineFactor(), schedule.precision),
+      maxShellSteps_(1),
+      currentShell_(0),
+      hasCurrentShell_(false),
+      front_(0),
+      shellSteps_(1),
+      nearestCollision_(NoStep)
+  {
+    // Floor, but tolerate rounding when maxShellFactor is a power of the
+    // growth.
+    const double steps = log(schedule.maxShellFactor) / log(grid_.growth());
+    if (steps >= 2)
     {
-      if (dims[iDim] != 0)
-      {
-        numBinsByDim[iDim] = ceil(dims[iDim] / (scalesPerBin *
-                                                state.meanScaleEstimate));
-        dims[iDim] /= numBinsByDim[iDim];
-      }
+      maxShellSteps_ = (size_t)(steps + 1e-9);
     }
+  }
 
-    const vector<double>& x0_orig = state.threadQueryX0[iThread];
-    vector<long long> currentBinByDim(state.numDims, 0);
-    while (state.threadShouldContinue[iThread])
+  /**
+   * Get the next box to search.
+   *
+   * @param shell
+   * Output. The box's shell, for finishBox and shouldStop.
+   *
+   * @return
+   * false if there's nothing to search until a running shell finishes, or
+   * ever. See mayHaveMoreBoxes.
+   */
+  bool getNext(double x0[], double dims[], double *baselineFactor,
+               size_t *shell)
+  {
+    while (true)
     {
-      for (size_t iDim = 0; iDim < state.numDims; iDim++)
+      if (hasCurrentShell_)
       {
-        x0[iDim] = x0_orig[iDim] + currentBinByDim[iDim]*dims[iDim];
-      }
-
-      foundGridCodeZero = findGridCodeZeroHelper(
-        state.domainToPlaneByModule, state.latticeBasisByModule,
-        state.inverseLatticeBasisByModule, state.numDims, x0.data(),
-        dims.data(), state.readoutResolution/2, rSquaredPositive,
-        rSquaredNegative, pointWithGridCodeZero.data(), cachedShadows,
-        cachedShadowBoundingBoxes, cachedLatticeBoxes, 0,
-        state.threadShouldContinue[iThread]);
+        Shell& current = shells_[currentShell_];
+        if (!shouldStop(currentShell_) &&
+            expansion_.getNextInShell(x0, dims, baselineFactor))
+        {
+          current.numRunning++;
+          *shell = currentShell_;
+          return true;
+        }
 
-      if (foundGridCodeZero) break;
+        current.enumerating = false;
+        hasCurrentShell_ = false;
+        finishShellIfDone(currentShell_);
+      }
 
-      // Increment as little endian arithmetic with a varying base.
-      bool overflow = true;
-      for (size_t iDigit = 0; iDigit < state.numDims; iDigit++)
+      if (!startPendingShell() && !startExpansionShell())
       {
-        if (numBinsByDim[iDigit] == 0) continue;
-        overflow = ++currentBinByDim[iDigit] == numBinsByDim[iDigit];
-        if (!overflow) break;
-        currentBinByDim[iDigit] = 0;
+        return false;
       }
-
-      if (overflow) break;
     }
   }
 
-  // This thread is exiting.
+  /**
+   * Record that a box from getNext is finished.
+   *
+   * @param pointWithGridCodeZero
+   * The point with grid code zero in the box, or nullptr if there isn't one.
+   *
+   * @return
+   * true if this is the nearest collision so far.
+   */
+  bool finishBox(size_t shell, const double pointWithGridCodeZero[])
   {
-    std::lock_guard<std::mutex> lock(state.mutex);
-    if (--state.numActiveThreads == 0)
+    Shell& finished = shells_[shell];
+    finished.numRunning--;
+
+    bool nearest = false;
+    if (pointWithGridCodeZero != nullptr)
     {
-      state.finished = true;
-      state.finishedCondition.notify_all();
+      const size_t step = stepOf(pointWithGridCodeZero, finished);
+      finished.dirty = true;
+      finished.nearestCollision = std::min(finished.nearestCollision, step);
+      if (step < nearestCollision_)
+      {
+        nearestCollision_ = step;
+        nearest = true;
+      }
     }
-    state.threadRunning[iThread] = false;
+
+    finishShellIfDone(shell);
+    return nearest;
   }
+
+  /**
+   * Whether the rest of this shell's boxes can't improve the result.
+   */
+  bool shouldStop(size_t shell) const
+  {
+    return (shells_[shell].dirty ||
+            shells_[shell].begin >= nearestCollision_);
+  }
+
+  bool foundCollision() const
+  {
+    return nearestCollision_ != NoStep;
+  }
+
+  /**
+   * The largest grid factor that's certified to be below the nearest
+   * collision once the search is finished.
+   */
+  double collisionFactor()
+  {
+    return grid_.factor(nearestCollision_);
+  }
+
+  /**
+   * Whether every step below the nearest collision has been searched.
+   */
+  bool finished() const
+  {
+    if (!foundCollision() ||
+        (hasCurrentShell_ && !shouldStop(currentShell_)))
+    {
+      return false;
+    }
+
+    for (const Shell& shell : shells_)
+    {
+      if (!shell.done && shell.begin < nearestCollision_)
+      {
+        return false;
+      }
+    }
+
+    return !hasPendingShell();
+  }
+
+  /**
+   * Whether getNext might return a box after running boxes finish. If not, a
+   * thread that gets no box can quit.
+   */
+  bool mayHaveMoreBoxes() const
+  {
+    if (!foundCollision() || hasPendingShell())
+    {
+      return true;
+    }
+
+    // A dirty shell that's more than one step wide will be searched again.
+    for (const Shell& shell : shells_)
+    {
+      if (!shell.done && shell.begin < nearestCollision_ &&
+          shell.end - shell.begin > 1)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Resume a search that found grid code zero at this grid factor.
+   */
+  void restoreCollision(double collisionFactor)
+  {
+    size_t step = 0;
+    while (grid_.factor(step) < collisionFactor)
+    {
+      step++;
+    }
+    nearestCollision_ = step;
+  }
+
+private:
+  static const size_t NoStep = std::numeric_limits<size_t>::max();
+
+  struct Shell
+  {
+    size_t begin;
+    size_t end;
+    size_t numRunning;
+    size_t nearestCollision;
+    bool enumerating;
+    bool dirty;
+    bool done;
+  };
+
+  /**
+   * The grid step whose shell contains this point.
+   */
+  size_t stepOf(const double point[], const Shell& shell)
+  {
+    const double scaleFactor = scaleFactorOf(point, scaledbox_.data(),
+                                             scaledbox_.size());
+
+    size_t step = shell.begin;
+    while (step + 1 < shell.end && grid_.factor(step + 1) <= scaleFactor)
+    {
+      step++;
+    }
+    return step;
+  }
+
+  void startShell(size_t begin, size_t end)
+  {
+    expansion_.setShell(grid_.factor(begin), grid_.factor(end));
+    shells_.push_back({begin, end, 0, NoStep, true, false, false});
+    currentShell_ = shells_.size() - 1;
+    hasCurrentShell_ = true;
+  }
+
+  bool hasPendingShell() const
+  {
+    for (const pair<size_t, size_t>& pending : pending_)
+    {
+      if (pending.first < nearestCollision_)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Start the lowest pending shell that can still improve the result.
+   */
+  bool startPendingShell()
+  {
+    auto lowest = pending_.end();
+    for (auto it = pending_.begin(); it != pending_.end(); ++it)
+    {
+      if (it->first < nearestCollision_ &&
+          (lowest == pending_.end() || it->first < lowest->first))
+      {
+        lowest = it;
+      }
+    }
+
+    if (lowest == pending_.end())
+    {
+      pending_.clear();
+      return false;
+    }
+
+    const pair<size_t, size_t> range = *lowest;
+    pending_.erase(lowest);
+    startShell(range.first, range.second);
+    return true;
+  }
+
+  /**
+   * Grow the expansion. Until grid code zero is found, each shell is twice as
+   * wide as the last, up to maxShellSteps_.
+   */
+  bool startExpansionShell()
+  {
+    if (foundCollision())
+    {
+      return false;
+    }
+
+    startShell(front_, front_ + shellSteps_);
+    front_ += shellSteps_;
+    shellSteps_ = std::min(2*shellSteps_, maxShellSteps_);
+    return true;
+  }
+
+  void finishShellIfDone(size_t iShell)
+  {
+    Shell& shell = shells_[iShell];
+    if (shell.done || shell.enumerating || shell.numRunning > 0)
+    {
+      return;
+    }
+
+    shell.done = true;
+
+    if (shell.dirty && shell.nearestCollision > shell.begin &&
+        shell.begin < nearestCollision_)
+    {
+      // Bisect the steps below the collision.
+      const size_t mid =
+        shell.begin + (shell.nearestCollision - shell.begin + 1)/2;
+      pending_.push_back({shell.begin, mid});
+      if (mid < shell.nearestCollision)
+      {
+        pending_.push_back({mid, shell.nearestCollision});
+      }
+    }
+  }
+
+  MultiDirectionExpansion expansion_;
+  const vector<double> scaledbox_;
+  ScaleFactorGrid grid_;
+  size_t maxShellSteps_;
+
+  // Every shell so far, and the one whose boxes getNext is handing out
+  vector<Shell> shells_;
+  size_t currentShell_;
+  bool hasCurrentShell_;
+
+  // Where the next expansion shell starts, and how wide it is
+  size_t front_;
+  size_t shellSteps_;
+
+  // Shells to search again, as [begin, end) grid steps
+  vector<pair<size_t, size_t>> pending_;
+
+  size_t nearestCollision_;
+};
+
+/**
+ * The queue of a SearchOrder::BranchAndBound search. It holds every box of
+ * the region outside the ignorebox that hasn't been searched, ordered by the
+ * smallest scale factor that reaches it. The region is unbounded, so it's
+ * seeded lazily, an expansion shell at a time, with each shell twice as many
+ * grid steps wide as the last. A shell is only seeded once every queued box is
+ * beyond the shells before it.
+ *
+ * A box can only improve the result if it reaches below threshold(), the grid
+ * factor of the nearest collision so far. Every other box is pruned, so the
+ * search is certified once no box below the threshold is queued or running.
+ *
+ * The caller searches each box from getNext with
+ * minimizeCollisionFactorHelper and gives the parts of it beyond the horizon
+ * back to finishBox.
+ *
+ * It isn't thread-safe, except for threshold().
+ */
+class BranchAndBoundScheduler
+{
+public:
+  BranchAndBoundScheduler(const vector<double>& scaledbox,
+                          const vector<double>& ignorebox,
+                          size_t numDims,
+                          const gridcodingrange::ExpansionSchedule& schedule)
+    : expansion_(createExpansion(scaledbox, ignorebox, numDims)),
+      scaledbox_(scaledbox),
+      grid_(expansion_.initialBaselineFactor(), schedule.precision),
+      front_(0),
+      shellSteps_(1),
+      numRunning_(0),
+      nearestCollision_(NoStep),
+      threshold_(std::numeric_limits<double>::max()),
+      x0_(numDims),
+      dims_(numDims)
+  {
+    queue_.reset(numDims);
+  }
+
+  // For ExpansionState's initializer. The default would have to move the
+  // atomic.
+  BranchAndBoundScheduler(BranchAndBoundScheduler&& other)
+    : expansion_(std::move(other.expansion_)),
+      scaledbox_(other.scaledbox_),
+      grid_(std::move(other.grid_)),
+      front_(other.front_),
+      shellSteps_(other.shellSteps_),
+      queue_(std::move(other.queue_)),
+      numRunning_(other.numRunning_),
+      nearestCollision_(other.nearestCollision_),
+      threshold_(other.threshold_.load()),
+      x0_(std::move(other.x0_)),
+      dims_(std::move(other.dims_))
+  {
+  }
+
+  /**
+   * Get the next box to search.
+   *
+   * @param minFactor
+   * Output. The smallest scale factor that reaches the box.
+   *
+   * @param horizon
+   * Output. The search should give the parts of the box that don't reach this
+   * scale factor back to finishBox, so that nearer boxes are searched first.
+   *
+   * @return
+   * false if there's nothing to search until a running box finishes, or ever.
+   * See mayHaveMoreBoxes.
+   */
+  bool getNext(double x0[], double dims[], double *minFactor,
+               double *horizon)
+  {
+    while (true)
+    {
+      const double threshold = threshold_.load(std::memory_order_relaxed);
+      const double frontFactor = grid_.factor(front_);
+
+      if (!queue_.empty() &&
+          queue_.minScaleFactor() < std::min(frontFactor, threshold))
+      {
+        *minFactor = queue_.minScaleFactor();
+        queue_.pop(x0, dims);
+        numRunning_++;
+
+        // Once the queue is full, search whole boxes so that it stops growing.
+        *horizon = (queue_.size() < MaxQueuedBoxes)
+          ? *minFactor * (1 + HorizonBand)
+          : std::numeric_limits<double>::max();
+        return true;
+      }
+
+      if (frontFactor >= threshold)
+      {
+        return false;
+      }
+
+      // Every queued box is beyond the front.
+      expansion_.setShell(frontFactor, grid_.factor(front_ + shellSteps_));
+      double baselineFactor;
+      while (expansion_.getNextInShell(x0_.data(), dims_.data(),
+                                       &baselineFactor))
+      {
+        push(x0_.data(), dims_.data());
+      }
+      front_ += shellSteps_;
+      shellSteps_ *= 2;
+    }
+  }
+
+  /**
+   * @param deferred
+   * The parts of the box that were beyond the horizon, as concatenated x0 and
+   * dims.
+   */
+  void finishBox(const vector<double>& deferred)
+  {
+    numRunning_--;
+    const size_t numDims = scaledbox_.size();
+    for (size_t i = 0; i < deferred.size(); i += 2*numDims)
+    {
+      push(deferred.data() + i, deferred.data() + i + numDims);
+    }
+  }
+
+  /**
+   * Record a point with grid code zero.
+   *
+   * @return
+   * true if this is the nearest collision so far.
+   */
+  bool offer(const double pointWithGridCodeZero[])
+  {
+    const size_t step = grid_.stepAt(scaleFactorOf(pointWithGridCodeZero,
+                                                   scaledbox_.data(),
+                                                   scaledbox_.size()));
+    if (step >= nearestCollision_)
+    {
+      return false;
+    }
+
+    nearestCollision_ = step;
+    threshold_.store(grid_.factor(step), std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * The scale factor that a box must reach below to improve the result.
+   */
+  const std::atomic<double>& threshold() const
+  {
+    return threshold_;
+  }
+
+  bool foundCollision() const
+  {
+    return nearestCollision_ != NoStep;
+  }
+
+  /**
+   * The largest grid factor that's certified to be below the nearest
+   * collision once the search is finished.
+   */
+  double collisionFactor()
+  {
+    return grid_.factor(nearestCollision_);
+  }
+
+  /**
+   * Whether getNext might return a box after running boxes finish. If not, a
+   * thread that gets no box can quit.
+   */
+  bool mayHaveMoreBoxes() const
+  {
+    return numRunning_ > 0;
+  }
+
+private:
+  static const size_t NoStep = std::numeric_limits<size_t>::max();
+
+  // How far past a box's nearest scale factor its search reaches before it
+  // gives the rest of the box back. Much narrower, and the boxes bounce
+  // between the queue and the threads. Much wider, and they're searched far
+  // past the nearest collision before it's found.
+  static constexpr double HorizonBand = 0.05;
+
+  static const size_t MaxQueuedBoxes = 1 << 18;
+
+  void push(const double x0[], const double dims[])
+  {
+    const double factor = minScaleFactor<0>(x0, dims, scaledbox_.data(),
+                                            scaledbox_.size());
+    if (factor < threshold_.load(std::memory_order_relaxed))
+    {
+      queue_.push(x0, dims, 0, factor, 0);
+    }
+  }
+
+  MultiDirectionExpansion expansion_;
+  const vector<double> scaledbox_;
+  ScaleFactorGrid grid_;
+
+  // Where the next shell starts, and how wide it is
+  size_t front_;
+  size_t shellSteps_;
+
+  BoxQueue queue_;
+  size_t numRunning_;
+
+  size_t nearestCollision_;
+  std::atomic<double> threshold_;
+
+  // Scratch space for seeding
+  vector<double> x0_;
+  vector<double> dims_;
+};
+
+struct ExpansionState {
+  // Constants (thread-safe)
+  const ModuleSet& modules;
+  const double readoutResolution;
+  const double meanScaleEstimate;
+  const size_t numDims;
+  const vector<double> scaledbox;
+  const SearchOrder searchOrder;
+
+  // Shadows for box shapes that several tasks share (thread-safe)
+  SharedShadowFrames& sharedShadowFrames;
+
+  // Task management
+  ShellScheduler scheduler;
+  vector<size_t> threadShell;
+  BranchAndBoundScheduler branchAndBound;
+
+  // Tasks are numbered in the order the scheduler hands them out. Every task
+  // numbered below the lowest one in threadTaskNumber is finished.
+  unsigned long long numTasksStarted;
+  vector<unsigned long long> threadTaskNumber;
+
+  // Results
+  vector<double> pointWithGridCodeZero;
+  double foundPointBaselineRadius;
+
+  // Thread management
+  std::mutex& mutex;
+  std::condition_variable& finishedCondition;
+  std::condition_variable& boxAvailableCondition;
+  bool finished;
+  size_t numActiveThreads;
+  vector<double> threadBaselineFactor;
+  vector<vector<double>> threadQueryX0;
+  vector<vector<double>> threadQueryDims;
+  vector<std::atomic<bool>> threadShouldContinue;
+  CallCancellation& cancellation;
+  vector<bool> threadRunning;
+};
+
+template<typename T>
+std::string vecs(const vector<T>& v)
+{
+  std::ostringstream oss;
+  oss << "[";
+
+  for (size_t i = 0; i < v.size(); i++)
+  {
+    oss << v[i];
+    if (i < v.size() - 1)
+    {
+      oss << ", ";
+    }
+  }
+
+  oss << "]";
+
+  return oss.str();
+}
+
+const unsigned long long NoTask =
+  std::numeric_limits<unsigned long long>::max();
+
+/**
+ * Report a thread's finished task to the scheduler, and record its point if
+ * it's the nearest collision so far.
+ */
+void recordResult(size_t iThread, ExpansionState& state,
+                  bool foundGridCodeZero, const double pointWithGridCodeZero[])
+{
+  if (state.scheduler.finishBox(state.threadShell[iThread],
+                                (foundGridCodeZero
+                                 ? pointWithGridCodeZero
+                                 : nullptr)))
+  {
+    state.foundPointBaselineRadius = state.scheduler.collisionFactor();
+    std::copy(pointWithGridCodeZero, pointWithGridCodeZero + state.numDims,
+              state.pointWithGridCodeZero.begin());
+  }
+
+  if (foundGridCodeZero)
+  {
+    // Notify all others that they should stop unless their shell can still
+    // improve the result.
+    for (size_t iOtherThread = 0;
+         iOtherThread < state.threadBaselineFactor.size();
+         iOtherThread++)
+    {
+      if (iOtherThread != iThread &&
+          state.threadTaskNumber[iOtherThread] != NoTask &&
+          state.threadShouldContinue[iOtherThread] &&
+          state.scheduler.shouldStop(state.threadShell[iOtherThread]))
+      {
+        state.threadShouldContinue[iOtherThread] = false;
+      }
+    }
+  }
+
+  // Finishing a shell can make more boxes available.
+  state.boxAvailableCondition.notify_all();
+}
+
+/**
+ * Optimization: if an expansion task's box is large, break it into small bins
+ * rather than relying completely on the divide-and-conquer to break it into
+ * reasonable-sized chunks.
+ *
+ * @param dims
+ * The task's box. It's overwritten with the dims of one bin.
+ *
+ * @param numBinsByDim
+ * Output. The number of bins along each dimension, or 0 where the box has no
+ * width.
+ *
+ * @return
+ * The total number of bins.
+ */
+unsigned long long splitIntoBins(double dims[], long long numBinsByDim[],
+                                 size_t numDims, double meanScaleEstimate)
+{
+  // Use a longer bin size for 1D. A 1D slice of a 2D plane can be relatively
+  // long before it has high probability of colliding with a lattice point in
+  // every module.
+  const double scalesPerBin = (numDims == 1)
+    ? 2.5
+    : 0.55;
+
+  unsigned long long numBins = 1;
+  for (size_t iDim = 0; iDim < numDims; iDim++)
+  {
+    if (dims[iDim] != 0)
+    {
+      numBinsByDim[iDim] = ceil(dims[iDim] / (scalesPerBin *
+                                              meanScaleEstimate));
+      dims[iDim] /= numBinsByDim[iDim];
+      numBins *= numBinsByDim[iDim];
+    }
+    else
+    {
+      numBinsByDim[iDim] = 0;
+    }
+  }
+
+  return numBins;
+}
+
+/**
+ * How far a box's center is from grid code zero in the module where it is
+ * farthest. Boxes with a lower value are more likely to contain grid code
+ * zero.
+ */
+inline double maxDistToGridCodeZeroSquared(const ModuleSet& modules,
+                                           const double projectedCenters[])
+{
+  double distSquared = 0;
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
+  {
+    distSquared = std::max(distSquared,
+                           distToGridCodeZeroSquared(modules, iModule,
+                                                     projectedCenters +
+                                                     iModule*2));
+  }
+
+  return distSquared;
+}
+
+/**
+ * The best-first alternative to findGridCodeZeroHelper. Rather than always
+ * searching the lower half of a box first, keep every unresolved box in
+ * cache.boxQueue and split the most promising one, so that the search
+ * concentrates on the part of the task nearest to the origin and doesn't
+ * descend deep into unpromising corners before it has looked elsewhere.
+ *
+ * Every box with the same frame number must have the same dims.
+ */
+template<size_t K>
+class BestFirstSearch
+{
+public:
+  BestFirstSearch(const ModuleSet& modules, const double scaledbox[],
+                  double r, double rSquaredPositive, double rSquaredNegative,
+                  double vertexBuffer[], SearchCache& cache,
+                  std::atomic<bool>& shouldContinue,
+                  CallCancellation& cancellation)
+    : modules_(modules), scaledbox_(scaledbox), r_(r),
+      rSquaredPositive_(rSquaredPositive),
+      rSquaredNegative_(rSquaredNegative), vertexBuffer_(vertexBuffer),
+      cache_(cache), shouldContinue_(shouldContinue),
+      cancellation_(cancellation), x0_(modules.numDims()),
+      dims_(modules.numDims())
+  {
+    cache_.boxQueue.reset(modules.numDims());
+  }
+
+  /**
+   * Check a box and queue it if it's unresolved. Its projections must already
+   * be in frame frameNumber of cache.projectionStack.
+   *
+   * @return
+   * true if the box contains grid code zero.
+   */
+  bool add(double x0[], double dims[], size_t frameNumber)
+  {
+    BoxQueue& queue = cache_.boxQueue;
+    if (queue.size() >= BoxQueue::MaxBoxes)
+    {
+      return findGridCodeZeroHelper<K>(
+        modules_, x0, dims, r_, rSquaredPositive_, rSquaredNegative_,
+        vertexBuffer_, cache_, frameNumber, shouldContinue_, cancellation_);
+    }
+
+    SEARCH_STATS(recordNode(frameNumber));
+
+    const ProjectionStack& projectionStack = cache_.projectionStack;
+
+    if (tryProveGridCodeZeroImpossible<K>(modules_, dims,
+                                          projectionStack.shifts(frameNumber),
+                                          r_, rSquaredNegative_, cache_,
+                                          frameNumber))
+    {
+      return false;
+    }
+
+    if (tryFindGridCodeZero<K>(modules_, x0, dims,
+                               projectionStack.centers(frameNumber),
+                               rSquaredPositive_, vertexBuffer_))
+    {
+      return true;
+    }
+
+    queue.push(x0, dims, frameNumber,
+               minScaleFactor<K>(x0, dims, scaledbox_, modules_.numDims()),
+               maxDistToGridCodeZeroSquared(
+                 modules_, projectionStack.centers(frameNumber)));
+    return false;
+  }
+
+  /**
+   * Split queued boxes until the queue is empty.
+   *
+   * @return
+   * true if grid code zero was found.
+   */
+  bool run()
+  {
+    const size_t numDims = numDimsOf<K>(modules_);
+    BoxQueue& queue = cache_.boxQueue;
+    ProjectionStack& projectionStack = cache_.projectionStack;
+
+    while (!queue.empty())
+    {
+      if (!shouldContinue_ || cancellation_.poll())
+      {
+        return false;
+      }
+
+      const size_t frameNumber = queue.pop(x0_.data(), dims_.data());
+      projectionStack.initialize<K>(modules_, x0_.data(), dims_.data(),
+                                    vertexBuffer_, frameNumber);
+
+      const size_t iWidestDim = std::distance(
+        dims_.data(), std::max_element(dims_.data(), dims_.data() + numDims));
+      dims_[iWidestDim] /= 2;
+
+      for (bool isUpperHalf : {false, true})
+      {
+        if (isUpperHalf)
+        {
+          x0_[iWidestDim] += dims_[iWidestDim];
+        }
+
+        projectionStack.pushChild<K>(modules_, frameNumber, iWidestDim,
+                                     dims_[iWidestDim], isUpperHalf);
+        if (add(x0_.data(), dims_.data(), frameNumber + 1))
+        {
+          return true;
+        }
+      }
+    }
+
+    return false;
+  }
+
+private:
+  const ModuleSet& modules_;
+  const double *scaledbox_;
+  const double r_;
+  const double rSquaredPositive_;
+  const double rSquaredNegative_;
+  double *vertexBuffer_;
+  SearchCache& cache_;
+  std::atomic<bool>& shouldContinue_;
+  CallCancellation& cancellation_;
+
+  // The box being split.
+  DimsArray<K> x0_;
+  DimsArray<K> dims_;
+};
+
+/**
+ * Search bins binBegin through binEnd - 1 of an expansion task for grid code
+ * zero. The bins are numbered as little endian arithmetic with a varying base,
+ * skipping dimensions with no width.
+ *
+ * @param scaledbox
+ * The computeCodingRange scaledbox, used to rank boxes in a best-first search.
+ *
+ * @param currentBinByDim
+ * Scratch space with one value per dimension.
+ */
+template<size_t K>
+bool findGridCodeZeroInBins(
+  const ModuleSet& modules,
+  double readoutResolution,
+  SearchOrder searchOrder,
+  const double scaledbox[],
+  const double taskX0[],
+  const double binDims[],
+  const long long numBinsByDim[],
+  unsigned long long binBegin,
+  unsigned long long binEnd,
+  double pointWithGridCodeZero[],
+  SearchCache& cache,
+  vector<long long>& currentBinByDim,
+  std::atomic<bool>& shouldContinue,
+  CallCancellation& cancellation)
+{
+  const size_t numDims = numDimsOf<K>(modules);
+
+  // Unshared copies that findGridCodeZeroHelper can modify.
+  DimsArray<K> x0(numDims);
+  DimsArray<K> dims(numDims);
+  std::copy(binDims, binDims + numDims, dims.data());
+
+  // Add a small epsilon to handle situations where floating point math causes
+  // a vertex to be non-zero-overlapping here and zero-overlapping in
+  // tryProveGridCodeZeroImpossible. With this addition, anything
+  // zero-overlapping in tryProveGridCodeZeroImpossible is guaranteed to be
+  // zero-overlapping here, so the program won't get caught in infinite
+  // recursion.
+  const double rSquaredPositive = pow(readoutResolution/2 + 0.000000001, 2);
+  const double rSquaredNegative = pow(readoutResolution/2, 2);
+
+  unsigned long long remainder = binBegin;
+  for (size_t iDim = 0; iDim < numDims; iDim++)
+  {
+    currentBinByDim[iDim] = 0;
+    if (numBinsByDim[iDim] != 0)
+    {
+      currentBinByDim[iDim] = remainder % numBinsByDim[iDim];
+      remainder /= numBinsByDim[iDim];
+    }
+  }
+
+  const bool bestFirst = (searchOrder == SearchOrder::BestFirst);
+  BestFirstSearch<K> bestFirstSearch(
+    modules, scaledbox, readoutResolution/2, rSquaredPositive,
+    rSquaredNegative, pointWithGridCodeZero, cache, shouldContinue,
+    cancellation);
+
+  for (unsigned long long iBin = binBegin;
+       iBin < binEnd && shouldContinue;
+       iBin++)
+  {
+    for (size_t iDim = 0; iDim < numDims; iDim++)
+    {
+      x0[iDim] = taskX0[iDim] + currentBinByDim[iDim]*dims[iDim];
+    }
+
+    cache.projectionStack.initialize<K>(modules, x0.data(), dims.data(),
+                                        pointWithGridCodeZero);
+    if (bestFirst)
+    {
+      // Queue the bins in batches, leaving room for their subboxes.
+      if (bestFirstSearch.add(x0.data(), dims.data(), 0) ||
+          ((cache.boxQueue.size() >= BoxQueue::MaxBoxes/2 ||
+            iBin + 1 == binEnd) &&
+           bestFirstSearch.run()))
+      {
+        return true;
+      }
+    }
+    else if (findGridCodeZeroHelper<K>(
+               modules, x0.data(), dims.data(), readoutResolution/2,
+               rSquaredPositive, rSquaredNegative, pointWithGridCodeZero,
+               cache, 0, shouldContinue, cancellation))
+    {
+      return true;
+    }
+
+    // Increment as little endian arithmetic with a varying base.
+    for (size_t iDigit = 0; iDigit < numDims; iDigit++)
+    {
+      if (numBinsByDim[iDigit] == 0) continue;
+      if (++currentBinByDim[iDigit] < numBinsByDim[iDigit]) break;
+      currentBinByDim[iDigit] = 0;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Mark a thread of an ExpansionState as exited, and the search as finished if
+ * it was the last one.
+ */
+void finishThread(size_t iThread, ExpansionState& state)
+{
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if (--state.numActiveThreads == 0)
+  {
+    state.finished = true;
+    state.finishedCondition.notify_all();
+  }
+  state.threadRunning[iThread] = false;
+}
+
+template<size_t K>
+void findGridCodeZeroThread(size_t iThread, ExpansionState& state)
+{
+  bool foundGridCodeZero = false;
+  DimsArray<K> dims(state.numDims);
+  DimsArray<K> pointWithGridCodeZero(state.numDims);
+
+  vector<long long> numBinsByDim(state.numDims);
+  vector<long long> currentBinByDim(state.numDims);
+
+  // Reused by every task of this thread. Each task switches it to the shared
+  // frames for its box shape, but the private storage is kept.
+  SearchCache cache(state.modules.numModules());
+
+  // This may start later than its siblings if the thread pool is busy.
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.threadRunning[iThread] = true;
+  }
+
+  while (!state.cancellation.poll())
+  {
+    // Modify the shared state. Record the results, decide the next task,
+    // volunteer to do it.
+    {
+      std::unique_lock<std::mutex> lock(state.mutex);
+
+      // If this thread was ordered to stop, its task is unfinished, but it
+      // can't improve the result, so it's fine to mark it finished.
+      if (state.threadTaskNumber[iThread] != NoTask)
+      {
+        recordResult(iThread, state, foundGridCodeZero,
+                     pointWithGridCodeZero.data());
+        state.threadTaskNumber[iThread] = NoTask;
+      }
+
+      // Select task params. A shell that's being bisected has to wait for its
+      // running tasks.
+      bool gotTask;
+      while (!(gotTask = state.scheduler.getNext(
+                 state.threadQueryX0[iThread].data(),
+                 state.threadQueryDims[iThread].data(),
+                 &state.threadBaselineFactor[iThread],
+                 &state.threadShell[iThread])) &&
+             state.scheduler.mayHaveMoreBoxes() &&
+             !state.cancellation.poll())
+      {
+        state.boxAvailableCondition.wait_for(
+          lock, std::chrono::milliseconds(100));
+      }
+
+      if (!gotTask)
+      {
+        break;
+      }
+
+      state.threadTaskNumber[iThread] = state.numTasksStarted++;
+      state.threadShouldContinue[iThread] = true;
+
+      std::copy(state.threadQueryDims[iThread].begin(),
+                state.threadQueryDims[iThread].end(), dims.data());
+    }
+
+    // Perform the task.
+    const unsigned long long numBins = splitIntoBins(
+      dims.data(), numBinsByDim.data(), state.numDims,
+      state.meanScaleEstimate);
+
+    cache.resetFrames(
+      state.sharedShadowFrames.acquire(dims.data(), state.numDims));
+
+    foundGridCodeZero = findGridCodeZeroInBins<K>(
+      state.modules, state.readoutResolution, state.searchOrder,
+      state.scaledbox.data(), state.threadQueryX0[iThread].data(),
+      dims.data(), numBinsByDim.data(), 0, numBins,
+      pointWithGridCodeZero.data(), cache, currentBinByDim,
+      state.threadShouldContinue[iThread], state.cancellation);
+
+    SEARCH_STATS(numExpansionTasks++);
+  }
+
+  finishThread(iThread, state);
+}
+
+/**
+ * The branch-and-bound alternative to findGridCodeZeroHelper. Rather than
+ * stopping at the first point with grid code zero, report every one that
+ * improves on the nearest collision so far to offer(point), and skip the parts
+ * of the box that can't, i.e. that don't reach below threshold. The parts
+ * that don't reach below horizon are appended to deferred, x0 then dims,
+ * without being searched.
+ *
+ * Each box is split until it's proven not to contain grid code zero or it
+ * lies beyond the threshold. Like findGridCodeZeroHelper, this relies on
+ * rSquaredPositive being slightly larger than rSquaredNegative: the center of
+ * every small enough box that isn't proven empty is found, and once a box
+ * within one grid step has offered a point, it's beyond the threshold.
+ */
+template<size_t K, typename OfferPoint>
+void minimizeCollisionFactorHelper(
+  const ModuleSet& modules,
+  const double scaledbox[],
+  double x0[],
+  double dims[],
+  double r,
+  double rSquaredPositive,
+  double rSquaredNegative,
+  double vertexBuffer[],
+  SearchCache& cache,
+  size_t frameNumber,
+  const std::atomic<double>& threshold,
+  double horizon,
+  vector<double>& deferred,
+  OfferPoint& offer,
+  std::atomic<bool>& shouldContinue,
+  CallCancellation& cancellation)
+{
+  if (!shouldContinue || cancellation.poll())
+  {
+    return;
+  }
+
+  const size_t numDims = numDimsOf<K>(modules);
+  const double factor = minScaleFactor<K>(x0, dims, scaledbox, numDims);
+  if (factor >= threshold.load(std::memory_order_relaxed))
+  {
+    return;
+  }
+
+  if (factor > horizon)
+  {
+    deferred.insert(deferred.end(), x0, x0 + numDims);
+    deferred.insert(deferred.end(), dims, dims + numDims);
+    return;
+  }
+
+  SEARCH_STATS(recordNode(frameNumber));
+
+  ProjectionStack& projectionStack = cache.projectionStack;
+
+  if (tryProveGridCodeZeroImpossible<K>(modules, dims,
+                                        projectionStack.shifts(frameNumber),
+                                        r, rSquaredNegative, cache,
+                                        frameNumber))
+  {
+    return;
+  }
+
+  if (tryFindGridCodeZero<K>(modules, x0, dims,
+                             projectionStack.centers(frameNumber),
+                             rSquaredPositive, vertexBuffer))
+  {
+    offer(vertexBuffer);
+  }
+
+  size_t iWidestDim = std::distance(dims,
+                                    std::max_element(dims, dims + numDims));
+  SwapValueRAII swap1(&dims[iWidestDim], dims[iWidestDim] / 2);
+
+  // Search the half nearer to the origin first. It's more likely to lower the
+  // threshold for the other half.
+  const bool upperFirst = x0[iWidestDim] + dims[iWidestDim] < 0;
+  for (bool isUpperHalf : {upperFirst, !upperFirst})
+  {
+    SwapValueRAII swap2(&x0[iWidestDim],
+                        x0[iWidestDim] + (isUpperHalf
+                                          ? dims[iWidestDim]
+                                          : 0));
+    projectionStack.pushChild<K>(modules, frameNumber, iWidestDim,
+                                 dims[iWidestDim], isUpperHalf);
+    minimizeCollisionFactorHelper<K>(
+      modules, scaledbox, x0, dims, r, rSquaredPositive, rSquaredNegative,
+      vertexBuffer, cache, frameNumber + 1, threshold, horizon, deferred,
+      offer, shouldContinue, cancellation);
+  }
+}
+
+template<size_t K>
+void branchAndBoundThread(size_t iThread, ExpansionState& state)
+{
+  const ModuleSet& modules = state.modules;
+  DimsArray<K> x0(state.numDims);
+  DimsArray<K> dims(state.numDims);
+  DimsArray<K> vertexBuffer(state.numDims);
+
+  // See findGridCodeZeroInBins.
+  const double r = state.readoutResolution/2;
+  const double rSquaredPositive = pow(r + 0.000000001, 2);
+  const double rSquaredNegative = pow(r, 2);
+
+  auto offer = [&state](const double point[]) {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.branchAndBound.offer(point))
+    {
+      state.foundPointBaselineRadius = state.branchAndBound.collisionFactor();
+      std::copy(point, point + state.numDims,
+                state.pointWithGridCodeZero.begin());
+    }
+  };
+
+  SearchCache cache(modules.numModules());
+
+  // This may start later than its siblings if the thread pool is busy.
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.threadRunning[iThread] = true;
+  }
+
+  vector<double> deferred;
+  double horizon = 0;
+  bool searching = false;
+  while (!state.cancellation.poll())
+  {
+    {
+      std::unique_lock<std::mutex> lock(state.mutex);
+
+      if (searching)
+      {
+        state.branchAndBound.finishBox(deferred);
+        searching = false;
+
+        // Finishing the last running box can end the search.
+        state.boxAvailableCondition.notify_all();
+      }
+
+      bool gotBox;
+      while (!(gotBox = state.branchAndBound.getNext(
+                 state.threadQueryX0[iThread].data(),
+                 state.threadQueryDims[iThread].data(),
+                 &state.threadBaselineFactor[iThread], &horizon)) &&
+             state.branchAndBound.mayHaveMoreBoxes() &&
+             !state.cancellation.poll())
+      {
+        state.boxAvailableCondition.wait_for(
+          lock, std::chrono::milliseconds(100));
+      }
+
+      if (!gotBox)
+      {
+        break;
+      }
+
+      searching = true;
+      std::copy(state.threadQueryX0[iThread].begin(),
+                state.threadQueryX0[iThread].end(), x0.data());
+      std::copy(state.threadQueryDims[iThread].begin(),
+                state.threadQueryDims[iThread].end(), dims.data());
+    }
+
+    cache.resetFrames(
+      state.sharedShadowFrames.acquire(dims.data(), state.numDims));
+    cache.projectionStack.initialize<K>(modules, x0.data(), dims.data(),
+                                        vertexBuffer.data());
+
+    deferred.clear();
+    minimizeCollisionFactorHelper<K>(
+      modules, state.scaledbox.data(), x0.data(), dims.data(), r,
+      rSquaredPositive, rSquaredNegative, vertexBuffer.data(), cache, 0,
+      state.branchAndBound.threshold(), horizon, deferred, offer,
+      state.threadShouldContinue[iThread], state.cancellation);
+
+    SEARCH_STATS(numExpansionTasks++);
+  }
+
+  finishThread(iThread, state);
+}
+
+pair<double,double> rotateClockwise(double theta, double x, double y)
+{
+  return {cos(theta)*x + sin(theta)*y,
+          -sin(theta)*x + cos(theta)*y};
+}
+
+/**
+ * Change the matrices so that movement tends to be along the x axis on the
+ * plane. The end result is the same, but this improves performance because we
+ * draw bounding boxes around the projected hyperrectangles. This is especially
+ * beneficial in 1D, totally eliminating diagonal motion so that the bounding
+ * box perfectly encloses the projected line.
+ *
+ * Also reduce each lattice basis. A skewed basis describes the same lattice,
+ * but it makes the lattice box around each shadow long and thin, and it makes
+ * rounding in lattice coordinates a poor guess at the nearest lattice point.
+ */
+void optimizeMatrices(ModuleSet *modules)
+{
+  const size_t numDims = modules->numDims();
+
+  for (size_t iModule = 0; iModule < modules->numModules(); iModule++)
+  {
+    double *row0 = modules->domainToPlane(iModule);
+    double *row1 = row0 + numDims;
+    SquareMatrix2D<double> &latticeBasis = modules->latticeBasis(iModule);
+    latticeBasis = reduce2DLatticeBasis(latticeBasis);
+
+    size_t iLongest = (size_t) -1;
+    double dLongest = std::numeric_limits<double>::lowest();
+    for (size_t iColumn = 0; iColumn < numDims; iColumn++)
+    {
+      double length = sqrt(pow(row0[iColumn], 2) +
+                           pow(row1[iColumn], 2));
+      if (length > dLongest)
+      {
+        dLongest = length;
+        iLongest = iColumn;
+      }
+    }
+
+    const double theta = atan2(row1[iLongest], row0[iLongest]);
+    for (size_t iColumn = 0; iColumn < numDims; iColumn++)
+    {
+      const pair<double, double> newColumn = rotateClockwise(theta,
+                                                             row0[iColumn],
+                                                             row1[iColumn]);
+      row0[iColumn] = newColumn.first;
+      row1[iColumn] = newColumn.second;
+    }
+
+    pair<double, double> newColumn;
+    newColumn = rotateClockwise(theta, latticeBasis.v00, latticeBasis.v10);
+    latticeBasis.v00 = newColumn.first;
+    latticeBasis.v10 = newColumn.second;
+    newColumn = rotateClockwise(theta, latticeBasis.v01, latticeBasis.v11);
+    latticeBasis.v01 = newColumn.first;
+    latticeBasis.v11 = newColumn.second;
+  }
+
+  modules->updateInverseLatticeBases();
+}
+
+void gridcodingrange::setNumThreads(size_t numThreads)
+{
+  ThreadPool::setSharedNumThreads(numThreads);
+}
+
+size_t gridcodingrange::getNumThreads()
+{
+  return ThreadPool::sharedNumThreads();
+}
+
+void gridcodingrange::setCaptureInterrupts(bool captureInterrupts)
+{
+  g_captureInterrupts = captureInterrupts;
+}
+
+bool gridcodingrange::getCaptureInterrupts()
+{
+  return g_captureInterrupts;
+}
+
+void gridcodingrange::setSearchOrder(SearchOrder searchOrder)
+{
+  g_searchOrder = searchOrder;
+}
+
+SearchOrder gridcodingrange::getSearchOrder()
+{
+  return g_searchOrder;
+}
+
+bool gridcodingrange::findGridCodeZero(
+  const MatrixList& domainToPlaneByModule,
+  const MatrixList& latticeBasisByModule,
+  const vector<double>& x0,
+  const vector<double>& dims,
+  double readoutResolution,
+  vector<double>* pointWithGridCodeZero,
+  size_t parallelDepth,
+  double timeout,
+  const CancellationToken* cancellationToken)
+{
+  std::atomic<bool> shouldContinue(true);
+  CallCancellation cancellation(cancellationToken, timeout, false);
+
+  vector<double> defaultPointBuffer;
+
+  if (pointWithGridCodeZero != nullptr)
+  {
+    NTA_ASSERT(pointWithGridCodeZero->size() == dims.size());
+  }
+  else
+  {
+    defaultPointBuffer.resize(dims.size());
+    pointWithGridCodeZero = &defaultPointBuffer;
+  }
+
+  NTA_ASSERT(domainToPlaneByModule.numRows() == 2);
+
+  ModuleSet modules(domainToPlaneByModule, latticeBasisByModule);
+  optimizeMatrices(&modules);
+  modules.buildTorusOccupancy(readoutResolution/2, g_torusOccupancyResolution);
+
+  // Add a small epsilon to handle situations where floating point math causes a
+  // vertex to be non-zero-overlapping here and zero-overlapping in
+  // tryProveGridCodeZeroImpossible. With this addition, anything
+  // zero-overlapping in tryProveGridCodeZeroImpossible is guaranteed to be
+  // zero-overlapping here, so the program won't get caught in infinite
+  // recursion.
+  const double rSquaredPositive = pow(readoutResolution/2 + 0.000000001, 2);
+  const double rSquaredNegative = pow(readoutResolution/2, 2);
+
+  const bool found = dispatchOnNumDims(dims.size(), [&](auto k) {
+    constexpr size_t K = decltype(k)::value;
+
+    // Avoid doing any allocations in each recursion.
+    DimsArray<K> x0Copy(dims.size());
+    DimsArray<K> dimsCopy(dims.size());
+    std::copy(x0.begin(), x0.end(), x0Copy.data());
+    std::copy(dims.begin(), dims.end(), dimsCopy.data());
+
+    if (parallelDepth > 0)
+    {
+      const ThreadPoolLease pool;
+      TaskGroup tasks(*pool);
+      ParallelSearch search(modules, readoutResolution/2, rSquaredPositive,
+                            rSquaredNegative, parallelDepth,
+                            pointWithGridCodeZero->data(), shouldContinue,
+                            cancellation, tasks);
+      tasks.run([&] {
+          findGridCodeZeroTask<K>(search, x0Copy, dimsCopy, 0);
+        });
+      tasks.wait();
+
+      return search.foundGridCodeZero;
+    }
+
+    SearchCache cache(modules.numModules());
+    cache.projectionStack.initialize<K>(modules, x0Copy.data(),
+                                        dimsCopy.data(),
+                                        pointWithGridCodeZero->data());
+
+    return findGridCodeZeroHelper<K>(
+      modules, x0Copy.data(), dimsCopy.data(), readoutResolution/2,
+      rSquaredPositive, rSquaredNegative, pointWithGridCodeZero->data(),
+      cache, 0, shouldContinue, cancellation);
+  });
+
+  // A point that was found before the search stopped is still valid.
+  if (!found)
+  {
+    cancellation.throwIfStopped();
+  }
+
+  return found;
+}
+
+ModuleSet optimizedModuleSet(
+  const MatrixList& domainToPlaneByModule,
+  const MatrixList& latticeBasisByModule,
+  double readoutResolution)
+{
+  NTA_CHECK(domainToPlaneByModule.size() == latticeBasisByModule.size())
+    << "The two arrays of matrices must be the same length (one per module) "
+    << "Actual: " << domainToPlaneByModule.size()
+    << " " << latticeBasisByModule.size();
+
+  NTA_CHECK(domainToPlaneByModule.numRows() == 2)
+    << "Each matrix should have two rows -- the modules are two-dimensional. "
+    << "Actual: " << domainToPlaneByModule.numRows();
+
+  NTA_CHECK(latticeBasisByModule.numRows() == 2 &&
+            latticeBasisByModule.numCols() == 2)
+    << "There should be two lattice basis vectors. "
+    << "Actual: " << latticeBasisByModule.numCols();
+
+  const size_t numDims = domainToPlaneByModule.numCols();
+  NTA_CHECK(numDims < sizeof(int)*8)
+    << "Unsupported number of dimensions: " << numDims;
+
+  ModuleSet modules(domainToPlaneByModule, latticeBasisByModule);
+  optimizeMatrices(&modules);
+  modules.buildTorusOccupancy(readoutResolution/2, g_torusOccupancyResolution);
+  return modules;
+}
+
+double computeMeanScaleEstimate(const ModuleSet& modules)
+{
+  const size_t numDims = modules.numDims();
+  double meanScaleEstimate = 0.0;
+
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
+  {
+    const double *domainToPlane = modules.domainToPlane(iModule);
+    double longestDisplacementSquared = std::numeric_limits<double>::min();
+
+    for (size_t iDim = 0; iDim < numDims; iDim++)
+    {
+      longestDisplacementSquared = std::max(longestDisplacementSquared,
+                                            pow(domainToPlane[iDim], 2) +
+                                            pow(domainToPlane[numDims + iDim],
+                                                2));
+    }
+
+    const double scaleEstimate = 1 / sqrt(longestDisplacementSquared);
+    meanScaleEstimate += scaleEstimate;
+  }
+
+  return meanScaleEstimate / modules.numModules();
+}
+
+/**
+ * One computeCodingRange query, searched by a set of findGridCodeZeroThread
+ * tasks on a thread pool.
+ */
+class CodingRangeSearch
+{
+public:
+  CodingRangeSearch(
+    const MatrixList& domainToPlaneByModule,
+    const MatrixList& latticeBasisByModule,
+    const vector<double>& scaledbox,
+    const vector<double>& ignorebox,
+    double readoutResolution,
+    const gridcodingrange::ExpansionSchedule& schedule,
+    SearchOrder searchOrder,
+    size_t numThreads,
+    CallCancellation& cancellation)
+    : domainToPlaneByModule_(domainToPlaneByModule),
+      latticeBasisByModule_(latticeBasisByModule),
+      modules_(optimizedModuleSet(domainToPlaneByModule,
+                                  latticeBasisByModule, readoutResolution)),
+      state_{
+        modules_,
+        readoutResolution,
+
+        computeMeanScaleEstimate(modules_),
+        modules_.numDims(),
+        scaledbox,
+        searchOrder,
+
+        sharedShadowFrames_,
+
+        ShellScheduler(scaledbox, ignorebox, modules_.numDims(), schedule),
+        vector<size_t>(numThreads, 0),
+        BranchAndBoundScheduler(scaledbox, ignorebox, modules_.numDims(),
+                                schedule),
+
+        0,
+        vector<unsigned long long>(numThreads, NoTask),
+
+        vector<double>(modules_.numDims()),
+        std::numeric_limits<double>::max(),
+
+        mutex_,
+        finishedCondition_,
+        boxAvailableCondition_,
+        false,
+        0,
+        vector<double>(numThreads, std::numeric_limits<double>::max()),
+        vector<vector<double>>(numThreads, vector<double>(modules_.numDims())),
+        vector<vector<double>>(numThreads, vector<double>(modules_.numDims())),
+        vector<std::atomic<bool>>(numThreads),
+        cancellation,
+        vector<bool>(numThreads, false),
+      },
+      printedInitialStatement_(false)
+  {
+    for (size_t i = 0; i < numThreads; i++)
+    {
+      state_.threadShouldContinue[i] = true;
+    }
+  }
+
+  void start(TaskGroup& tasks)
+  {
+    const bool branchAndBound =
+      state_.searchOrder == SearchOrder::BranchAndBound;
+    void (*threadFunction)(size_t, ExpansionState&) =
+      dispatchOnNumDims(state_.numDims, [branchAndBound](auto k) {
+        return (branchAndBound
+                ? &branchAndBoundThread<decltype(k)::value>
+                : &findGridCodeZeroThread<decltype(k)::value>);
+      });
+
+    SearchStats *parentStats = SearchStats::current();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < state_.threadBaselineFactor.size(); i++)
+    {
+      ExpansionState *state = &state_;
+      tasks.run([threadFunction, i, state, parentStats] {
+          SearchStatsTaskScope statsScope(parentStats);
+          threadFunction(i, *state);
+        });
+      state_.numActiveThreads++;
+    }
+  }
+
+  /**
+   * @return
+   * true if every task finished before the deadline.
+   */
+  template<typename TimePoint>
+  bool waitUntil(const TimePoint& deadline)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!state_.finished)
+    {
+      if (finishedCondition_.wait_until(lock, deadline) ==
+          std::cv_status::timeout)
+      {
+        return state_.finished;
+      }
+    }
+
+    return true;
+  }
+
+  bool finished()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_.finished;
+  }
+
+  void logStatus(double secondsElapsed)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (!printedInitialStatement_)
+    {
+      {
+        std::ostringstream oss;
+        oss << "[";
+
+        for (size_t iModule = 0;
+             iModule < domainToPlaneByModule_.size();
+             iModule++)
+        {
+          oss << "[";
+          oss << vecs(domainToPlaneByModule_.row(iModule, 0)) << ",";
+          oss << vecs(domainToPlaneByModule_.row(iModule, 1));
+          oss << "],";
+        }
+        oss << "]" << std::endl;
+        NTA_INFO << "domainToPlaneByModule:" << std::endl << oss.str();
+      }
+
+      {
+        std::ostringstream oss;
+        oss << "[";
+        for (size_t iModule = 0;
+             iModule < latticeBasisByModule_.size();
+             iModule++)
+        {
+          oss << "[";
+          oss << vecs(latticeBasisByModule_.row(iModule, 0)) << ",";
+          oss << vecs(latticeBasisByModule_.row(iModule, 1));
+          oss << "],";
+        }
+        oss << "]" << std::endl;
+
+        NTA_INFO << "latticeBasisByModule:" << std::endl << oss.str();
+      }
+
+      NTA_INFO << "readout resolution: " << state_.readoutResolution;
+
+      printedInitialStatement_ = true;
+    }
+
+    NTA_INFO << "";
+    NTA_INFO << domainToPlaneByModule_.size() << " modules, "
+             << state_.numDims << " dimensions, "
+             << (long long)secondsElapsed << " seconds elapsed";
+
+    if (state_.foundPointBaselineRadius <
+        std::numeric_limits<double>::max())
+    {
+      NTA_INFO << "**Box scale factor upper bound: "
+               << state_.foundPointBaselineRadius << "**";
+      NTA_INFO << "**Grid code zero found at: "
+               << vecs(state_.pointWithGridCodeZero) << "**";
+    }
+
+    for (size_t iThread = 0; iThread < state_.threadBaselineFactor.size();
+         iThread++)
+    {
+      if (state_.threadRunning[iThread])
+      {
+        if (state_.threadShouldContinue[iThread])
+        {
+          NTA_INFO << "  Thread " << iThread
+                   << " assuming box scale factor lower bound "
+                   << state_.threadBaselineFactor[iThread]
+                   << ", querying x0 "
+                   << vecs(state_.threadQueryX0[iThread]) << " and dims "
+                   << vecs(state_.threadQueryDims[iThread]);
+        }
+        else
+        {
+          NTA_INFO << "  Thread " << iThread
+                   << " has been ordered to stop.";
+        }
+      }
+      else
+      {
+        NTA_INFO << "  Thread " << iThread << " is not running.";
+      }
+    }
+  }
+
+  pair<double, vector<double>> result()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {state_.foundPointBaselineRadius, state_.pointWithGridCodeZero};
+  }
+
+  /**
+   * Skip the tasks that a checkpoint says are finished and start from its
+   * result. Call this before start.
+   */
+  void resume(const CodingRangeCheckpoint& checkpoint)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    NTA_CHECK(checkpoint.pointWithGridCodeZero.size() == state_.numDims);
+
+    if (checkpoint.foundPointBaselineRadius <
+        std::numeric_limits<double>::max())
+    {
+      state_.scheduler.restoreCollision(checkpoint.foundPointBaselineRadius);
+    }
+
+    // Tasks in shells at or above the collision are skipped, whether or not
+    // they were finished.
+    vector<double> x0(state_.numDims);
+    vector<double> dims(state_.numDims);
+    double baselineFactor;
+    size_t shell;
+    for (unsigned long long i = 0;
+         i < checkpoint.numTasksFinished &&
+           state_.scheduler.getNext(x0.data(), dims.data(), &baselineFactor,
+                                    &shell);
+         i++)
+    {
+      state_.scheduler.finishBox(shell, nullptr);
+    }
+
+    state_.numTasksStarted = checkpoint.numTasksFinished;
+    state_.foundPointBaselineRadius = checkpoint.foundPointBaselineRadius;
+    state_.pointWithGridCodeZero = checkpoint.pointWithGridCodeZero;
+  }
+
+  /**
+   * Record how far the search has gotten. Unfinished tasks, including ones
+   * that were interrupted, are left for the resumed search.
+   */
+  void updateCheckpoint(CodingRangeCheckpoint& checkpoint)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    unsigned long long firstUnfinished = state_.numTasksStarted;
+    bool anyUnfinished = false;
+    for (size_t iThread = 0; iThread < state_.threadTaskNumber.size();
+         iThread++)
+    {
+      if (state_.threadTaskNumber[iThread] < firstUnfinished)
+      {
+        firstUnfinished = state_.threadTaskNumber[iThread];
+        checkpoint.certifiedBaselineFactor =
+          state_.threadBaselineFactor[iThread];
+        anyUnfinished = true;
+      }
+    }
+
+    if (!anyUnfinished && state_.scheduler.finished())
+    {
+      // The search is complete.
+      checkpoint.certifiedBaselineFactor = state_.foundPointBaselineRadius;
+    }
+
+    checkpoint.numTasksFinished = firstUnfinished;
+    checkpoint.foundPointBaselineRadius = state_.foundPointBaselineRadius;
+    checkpoint.pointWithGridCodeZero = state_.pointWithGridCodeZero;
+  }
+
+private:
+  const MatrixList domainToPlaneByModule_;
+  const MatrixList latticeBasisByModule_;
+  ModuleSet modules_;
+  SharedShadowFrames sharedShadowFrames_;
+
+  // Use condition_variables to enable periodic logging while waiting for the
+  // threads to finish.
+  std::mutex mutex_;
+  std::condition_variable finishedCondition_;
+  std::condition_variable boxAvailableCondition_;
+
+  ExpansionState state_;
+  bool printedInitialStatement_;
+};
+
+/**
+ * Run a set of searches on the process-wide thread pool and wait for all of
+ * them, printing their status every pingInterval seconds and calling
+ * saveCheckpoint every checkpointInterval seconds.
+ */
+void runCodingRangeSearches(
+  const vector<std::unique_ptr<CodingRangeSearch>>& searches,
+  double pingInterval,
+  double checkpointInterval = -1.0,
+  const std::function<void()>& saveCheckpoint = nullptr)
+{
+  const ThreadPoolLease pool;
+  TaskGroup tasks(*pool);
+
+  for (const std::unique_ptr<CodingRangeSearch>& search : searches)
+  {
+    search->start(tasks);
+  }
+
+  const bool printing = pingInterval > 0;
+  const bool checkpointing = checkpointInterval > 0 && saveCheckpoint;
+
+  if (!printing && !checkpointing)
+  {
+    // Nothing to do meanwhile, so help with the searches rather than block.
+    tasks.wait();
+    return;
+  }
+
+  const auto tStart = Clock::now();
+  auto tNextPrint = tStart + std::chrono::duration<double>(pingInterval);
+  auto tNextCheckpoint =
+    tStart + std::chrono::duration<double>(checkpointInterval);
+
+  for (const std::unique_ptr<CodingRangeSearch>& search : searches)
+  {
+    while (!search->waitUntil(
+             !checkpointing ? tNextPrint
+             : !printing ? tNextCheckpoint
+             : std::min(tNextPrint, tNextCheckpoint)))
+    {
+      const auto tNow = Clock::now();
+
+      if (printing && tNow >= tNextPrint)
+      {
+        const double secondsElapsed =
+          std::chrono::duration<double>(tNow - tStart).count();
+
+        for (size_t iSearch = 0; iSearch < searches.size(); iSearch++)
+        {
+          if (!searches[iSearch]->finished())
+          {
+            if (searches.size() > 1)
+            {
+              NTA_INFO << "";
+              NTA_INFO << "Query " << iSearch << " of " << searches.size();
+            }
+
+            searches[iSearch]->logStatus(secondsElapsed);
+          }
+        }
+
+        tNextPrint = (Clock::now() +
+                      std::chrono::duration<double>(pingInterval));
+      }
+
+      if (checkpointing && tNow >= tNextCheckpoint)
+      {
+        saveCheckpoint();
+        tNextCheckpoint = (Clock::now() +
+                           std::chrono::duration<double>(checkpointInterval));
+      }
+    }
+  }
+
+  tasks.wait();
 }
 
-pair<double,double> rotateClockwise(double theta, double x, double y)
+vector<pair<double,vector<double>>>
+computeCodingRanges(
+  const vector<gridcodingrange::CodingRangeQuery>& queries,
+  double pingInterval,
+  size_t numThreads,
+  double timeout,
+  const gridcodingrange::CancellationToken* cancellationToken,
+  SearchStats* stats,
+  bool captureInterrupts)
 {
-  return {cos(theta)*x + sin(theta)*y,
-          -sin(theta)*x + cos(theta)*y};
+  if (numThreads == 0)
+  {
+    numThreads = ThreadPool::sharedNumThreads();
+  }
+
+  CallCancellation cancellation(cancellationToken, timeout, captureInterrupts);
+
+  if (stats != nullptr)
+  {
+    *stats = SearchStats();
+  }
+  SearchStatsScope statsScope(stats);
+
+  // Validate the queries before starting any tasks.
+  vector<std::unique_ptr<CodingRangeSearch>> searches;
+  for (const gridcodingrange::CodingRangeQuery& query : queries)
+  {
+    searches.emplace_back(
+      new CodingRangeSearch(query.domainToPlaneByModule,
+                            query.latticeBasisByModule, query.scaledbox,
+                            query.ignorebox, query.readoutResolution,
+                            query.schedule, gridcodingrange::getSearchOrder(),
+                            numThreads, cancellation));
+  }
+
+  runCodingRangeSearches(searches, pingInterval);
+
+  cancellation.throwIfStopped();
+
+  vector<pair<double,vector<double>>> results;
+  for (const std::unique_ptr<CodingRangeSearch>& search : searches)
+  {
+    results.push_back(search->result());
+  }
+  return results;
+}
+
+pair<double,vector<double>>
+gridcodingrange::computeCodingRange(
+  const MatrixList& domainToPlaneByModule,
+  const MatrixList& latticeBasisByModule,
+  const vector<double> &scaledbox,
+  const vector<double> &ignorebox,
+  double readoutResolution,
+  double pingInterval,
+  size_t numThreads,
+  double timeout,
+  const CancellationToken* cancellationToken,
+  SearchStats* stats,
+  const ExpansionSchedule& schedule,
+  bool captureInterrupts)
+{
+  return computeCodingRanges(
+    {{domainToPlaneByModule, latticeBasisByModule, scaledbox, ignorebox,
+      readoutResolution, schedule}},
+    pingInterval, numThreads, timeout, cancellationToken, stats,
+    captureInterrupts)[0];
+}
+
+vector<pair<double,vector<double>>>
+gridcodingrange::computeCodingRangeBatch(
+  const vector<CodingRangeQuery>& queries,
+  double pingInterval,
+  size_t numThreadsPerQuery,
+  double timeout,
+  const CancellationToken* cancellationToken,
+  bool captureInterrupts)
+{
+  return computeCodingRanges(queries, pingInterval, numThreadsPerQuery,
+                             timeout, cancellationToken, nullptr,
+                             captureInterrupts);
 }
 
 /**
- * Change the matrices so that movement tends to be along the x axis on the
- * plane. The end result is the same, but this improves performance because we
- * draw bounding boxes around the projected hyperrectangles. This is especially
- * beneficial in 1D, totally eliminating diagonal motion so that the bounding
- * box perfectly encloses the projected line.
+ * Run the search described by a checkpoint, saving its progress to
+ * checkpointPath every checkpointInterval seconds and once more when it stops,
+ * even if it was stopped early.
  */
-void optimizeMatrices(vector<vector<vector<double>>> *domainToPlaneByModule,
-                      vector<vector<vector<double>>> *latticeBasisByModule)
+pair<double,vector<double>>
+runCheckpointedSearch(
+  CodingRangeCheckpoint& checkpoint,
+  bool resume,
+  const std::string& checkpointPath,
+  double checkpointInterval,
+  double pingInterval,
+  size_t numThreads,
+  double timeout,
+  const gridcodingrange::CancellationToken* cancellationToken)
 {
-  for (size_t iModule = 0; iModule < domainToPlaneByModule->size(); iModule++)
+  if (numThreads == 0)
   {
-    vector<vector<double>> &domainToPlane = (*domainToPlaneByModule)[iModule];
-    vector<vector<double>> &latticeBasis = (*latticeBasisByModule)[iModule];
+    numThreads = ThreadPool::sharedNumThreads();
+  }
 
-    size_t iLongest = (size_t) -1;
-    double dLongest = std::numeric_limits<double>::lowest();
-    for (size_t iColumn = 0; iColumn < domainToPlane[0].size(); iColumn++)
+  CallCancellation cancellation(cancellationToken, timeout, true);
+
+  // A checkpoint counts finished expansion tasks, so a branch-and-bound search
+  // can't be resumed from one.
+  SearchOrder searchOrder = gridcodingrange::getSearchOrder();
+  if (searchOrder == SearchOrder::BranchAndBound)
+  {
+    searchOrder = SearchOrder::DepthFirst;
+  }
+
+  vector<std::unique_ptr<CodingRangeSearch>> searches;
+  searches.emplace_back(
+    new CodingRangeSearch(checkpoint.domainToPlaneView(),
+                          checkpoint.latticeBasisView(), checkpoint.scaledbox,
+                          checkpoint.ignorebox, checkpoint.readoutResolution,
+                          gridcodingrange::ExpansionSchedule(), searchOrder,
+                          numThreads, cancellation));
+  CodingRangeSearch& search = *searches[0];
+
+  if (resume)
+  {
+    search.resume(checkpoint);
+
+    if (pingInterval > 0)
     {
-      double length = sqrt(pow(domainToPlane[0][iColumn], 2) +
-                           pow(domainToPlane[1][iColumn], 2));
-      if (length > dLongest)
+      NTA_INFO << "Resuming from " << checkpointPath << " after "
+               << checkpoint.numTasksFinished << " tasks. Box scale factors "
+               << "below " << checkpoint.certifiedBaselineFactor
+               << " have been searched.";
+    }
+  }
+
+  // Save right away, so that the run can be resumed even if it's lost before
+  // the first interval.
+  search.updateCheckpoint(checkpoint);
+  checkpoint.save(checkpointPath);
+
+  runCodingRangeSearches(
+    searches, pingInterval, checkpointInterval,
+    [&] {
+      search.updateCheckpoint(checkpoint);
+      try
       {
-        dLongest = length;
-        iLongest = iColumn;
+        checkpoint.save(checkpointPath);
+      }
+      catch (const std::exception& e)
+      {
+        // Keep searching. The next save might work, and the final one throws.
+        NTA_WARN << e.what();
+      }
+    });
+
+  search.updateCheckpoint(checkpoint);
+  checkpoint.save(checkpointPath);
+
+  cancellation.throwIfStopped();
+
+  return search.result();
+}
+
+pair<double,vector<double>>
+gridcodingrange::computeCodingRangeWithCheckpoints(
+  const MatrixList& domainToPlaneByModule,
+  const MatrixList& latticeBasisByModule,
+  const vector<double> &scaledbox,
+  const vector<double> &ignorebox,
+  double readoutResolution,
+  const std::string& checkpointPath,
+  double checkpointInterval,
+  double pingInterval,
+  size_t numThreads,
+  double timeout,
+  const CancellationToken* cancellationToken)
+{
+  CodingRangeCheckpoint checkpoint(domainToPlaneByModule,
+                                   latticeBasisByModule, scaledbox, ignorebox,
+                                   readoutResolution);
+
+  return runCheckpointedSearch(checkpoint, false, checkpointPath,
+                               checkpointInterval, pingInterval, numThreads,
+                               timeout, cancellationToken);
+}
+
+pair<double,vector<double>>
+gridcodingrange::resumeCodingRange(
+  const std::string& checkpointPath,
+  double checkpointInterval,
+  double pingInterval,
+  size_t numThreads,
+  double timeout,
+  const CancellationToken* cancellationToken)
+{
+  CodingRangeCheckpoint checkpoint =
+    CodingRangeCheckpoint::load(checkpointPath);
+
+  return runCheckpointedSearch(checkpoint, true, checkpointPath,
+                               checkpointInterval, pingInterval, numThreads,
+                               timeout, cancellationToken);
+}
+
+
+// Sharded computeCodingRange. A coordinator owns the expansion and hands out
+// work units over TCP to worker processes, each of which searches them with
+// several slots, one per thread. A unit is a range of bins of one expansion
+// task, i.e. one box in one orthant of one shell.
+//
+// The coordinator's port is unauthenticated. Anyone who can connect to it gets
+// the query and can report results, so only listen where every peer is
+// trusted. Workers check the query's sizes before using them.
+//
+// The messages are:
+//
+//   coordinator -> worker   Query    The protocol version and the query, once
+//                                    per connection.
+//   coordinator -> worker   Unit     A unit for one of the worker's slots.
+//   coordinator -> worker   Best     A new best result. Stop any unit at or
+//                                    above this scale factor.
+//   coordinator -> worker   Done     The search is over.
+//   worker -> coordinator   Next     A slot's previous unit is finished, and
+//                                    the slot wants another.
+
+enum ShardMessageType : uint64_t {
+  ShardQuery = 1,
+  ShardUnitMessage,
+  ShardBest,
+  ShardDone,
+  ShardNext
+};
+
+// Bump this whenever the messages change, so that mismatched builds refuse to
+// work together rather than misread each other.
+const uint64_t ShardProtocolVersion = 1;
+
+// Limits on a query from the coordinator, so that a corrupt or hostile message
+// can't make a worker allocate unbounded memory.
+const uint64_t MaxShardQueryModules = 1 << 16;
+const uint64_t MaxShardQueryDims = 64;
+
+// The coordinator never blocks on a worker for longer than this, so a worker
+// that stalls can't stop it from noticing a timeout or a cancellation.
+const int ShardSendTimeoutMs = 1000;
+
+// Large expansion tasks are split so that several workers can share them.
+// Many bins are disproved almost immediately, so a unit needs a lot of them to
+// outweigh its round trip to the coordinator.
+const unsigned long long BinsPerShardUnit = 1024;
+
+struct ShardUnit
+{
+  unsigned long long id;
+  double baselineFactor;
+  vector<double> x0;
+  vector<double> binDims;
+  vector<long long> numBinsByDim;
+  unsigned long long binBegin;
+  unsigned long long binEnd;
+};
+
+void writeShardUnit(Message& message, unsigned long long iSlot,
+                    const ShardUnit& unit)
+{
+  message.writeU64(ShardUnitMessage);
+  message.writeU64(iSlot);
+  message.writeU64(unit.id);
+  message.writeF64(unit.baselineFactor);
+  message.writeF64s(unit.x0.data(), unit.x0.size());
+  message.writeF64s(unit.binDims.data(), unit.binDims.size());
+  for (long long numBins : unit.numBinsByDim)
+  {
+    message.writeU64(numBins);
+  }
+  message.writeU64(unit.binBegin);
+  message.writeU64(unit.binEnd);
+}
+
+ShardUnit readShardUnit(Message& message, size_t numDims)
+{
+  ShardUnit unit;
+  unit.id = message.readU64();
+  unit.baselineFactor = message.readF64();
+  unit.x0.resize(numDims);
+  message.readF64s(unit.x0.data(), numDims);
+  unit.binDims.resize(numDims);
+  message.readF64s(unit.binDims.data(), numDims);
+  unit.numBinsByDim.resize(numDims);
+  for (long long& numBins : unit.numBinsByDim)
+  {
+    numBins = message.readU64();
+  }
+  unit.binBegin = message.readU64();
+  unit.binEnd = message.readU64();
+  return unit;
+}
+
+void writeShardQuery(Message& message, const CodingRangeCheckpoint& query)
+{
+  message.writeU64(ShardQuery);
+  message.writeU64(ShardProtocolVersion);
+  message.writeU64(query.numModules);
+  message.writeU64(query.numDims);
+  message.writeF64s(query.domainToPlaneByModule.data(),
+                    query.domainToPlaneByModule.size());
+  message.writeF64s(query.latticeBasisByModule.data(),
+                    query.latticeBasisByModule.size());
+  message.writeF64s(query.scaledbox.data(), query.scaledbox.size());
+  message.writeF64(query.readoutResolution);
+}
+
+CodingRangeCheckpoint readShardQuery(Message& message)
+{
+  const uint64_t version = message.readU64();
+  NTA_CHECK(version == ShardProtocolVersion)
+    << "The coordinator uses protocol version " << version
+    << ", but this worker uses version " << ShardProtocolVersion;
+
+  CodingRangeCheckpoint query;
+  const uint64_t numModules = message.readU64();
+  const uint64_t numDims = message.readU64();
+  NTA_CHECK(numModules > 0 && numModules <= MaxShardQueryModules)
+    << "Invalid number of modules in the query: " << numModules;
+  NTA_CHECK(numDims > 0 && numDims <= MaxShardQueryDims)
+    << "Invalid number of dimensions in the query: " << numDims;
+
+  // The limits keep this from overflowing.
+  const uint64_t numValues = numModules*2*numDims + numModules*4 + numDims + 1;
+  NTA_CHECK(numValues*sizeof(double) == message.bytesLeft())
+    << "The query's size doesn't match its " << numModules << " modules and "
+    << numDims << " dimensions";
+
+  query.numModules = numModules;
+  query.numDims = numDims;
+  query.domainToPlaneByModule.resize(query.numModules*2*query.numDims);
+  message.readF64s(query.domainToPlaneByModule.data(),
+                   query.domainToPlaneByModule.size());
+  query.latticeBasisByModule.resize(query.numModules*4);
+  message.readF64s(query.latticeBasisByModule.data(),
+                   query.latticeBasisByModule.size());
+  query.scaledbox.resize(query.numDims);
+  message.readF64s(query.scaledbox.data(), query.scaledbox.size());
+  query.readoutResolution = message.readF64();
+  return query;
+}
+
+struct gridcodingrange::CodingRangeCoordinator::Impl
+{
+  Impl(const MatrixList& domainToPlaneByModule,
+       const MatrixList& latticeBasisByModule,
+       const vector<double>& scaledbox,
+       const vector<double>& ignorebox,
+       double readoutResolution,
+       const std::string& host,
+       int port)
+    : query(domainToPlaneByModule, latticeBasisByModule, scaledbox, ignorebox,
+            readoutResolution),
+      modules(optimizedModuleSet(domainToPlaneByModule,
+                                 latticeBasisByModule, readoutResolution)),
+      meanScaleEstimate(computeMeanScaleEstimate(modules)),
+      expansionEnumerator(createExpansion(scaledbox, ignorebox,
+                                          modules.numDims())),
+      continueExpansion(true),
+      hasCurrentTask(false),
+      nextUnitId(0),
+      foundPointBaselineRadius(std::numeric_limits<double>::max()),
+      pointWithGridCodeZero(modules.numDims()),
+      listener(host, port)
+  {
+  }
+
+  pair<double, vector<double>> run(double pingInterval, double timeout,
+                                   const CancellationToken* cancellationToken)
+  {
+    CallCancellation cancellation(cancellationToken, timeout, true);
+
+    const auto tStart = Clock::now();
+    auto tNextPrint = tStart + std::chrono::duration<double>(pingInterval);
+
+    while (!finished() && !cancellation.poll())
+    {
+      vector<pollfd> fds;
+      vector<size_t> fdWorkers;
+      fds.push_back({listener.fd(), POLLIN, 0});
+      for (size_t iWorker = 0; iWorker < workers.size(); iWorker++)
+      {
+        if (workers[iWorker])
+        {
+          fds.push_back({workers[iWorker]->fd(), POLLIN, 0});
+          fdWorkers.push_back(iWorker);
+        }
+      }
+
+      // Wake up regularly to check for cancellation.
+      if (poll(fds.data(), fds.size(), 100) > 0)
+      {
+        if (fds[0].revents != 0)
+        {
+          std::unique_ptr<MessageChannel> channel = listener.accept();
+          if (channel)
+          {
+            channel->setNonBlocking(ShardSendTimeoutMs);
+
+            Message message;
+            writeShardQuery(message, query);
+            if (channel->send(message))
+            {
+              workers.push_back(std::move(channel));
+            }
+          }
+        }
+
+        for (size_t i = 1; i < fds.size(); i++)
+        {
+          if (fds[i].revents != 0)
+          {
+            receive(fdWorkers[i - 1]);
+          }
+        }
+      }
+
+      if (pingInterval > 0 && Clock::now() >= tNextPrint)
+      {
+        logStatus(
+          std::chrono::duration<double>(Clock::now() - tStart).count());
+        tNextPrint = (Clock::now() +
+                      std::chrono::duration<double>(pingInterval));
       }
     }
 
-    const double theta = atan2(domainToPlane[1][iLongest],
-                               domainToPlane[0][iLongest]);
-    for (size_t iColumn = 0; iColumn < domainToPlane[0].size(); iColumn++)
+    // Release the workers, including after a timeout.
+    Message done;
+    done.writeU64(ShardDone);
+    for (std::unique_ptr<MessageChannel>& worker : workers)
     {
-      const pair<double, double> newColumn = rotateClockwise(theta,
-                                                             domainToPlane[0][iColumn],
-                                                             domainToPlane[1][iColumn]);
-      domainToPlane[0][iColumn] = newColumn.first;
-      domainToPlane[1][iColumn] = newColumn.second;
+      if (worker)
+      {
+        worker->send(done);
+      }
     }
-    for (size_t iColumn = 0; iColumn < latticeBasis[0].size(); iColumn++)
+    workers.clear();
+
+    cancellation.throwIfStopped();
+
+    return {foundPointBaselineRadius, pointWithGridCodeZero};
+  }
+
+  /**
+   * Handle every whole message that a worker has sent, and keep any partial
+   * one for later.
+   */
+  void receive(size_t iWorker)
+  {
+    while (workers[iWorker])
     {
-      const pair<double, double> newColumn = rotateClockwise(theta,
-                                                             latticeBasis[0][iColumn],
-                                                             latticeBasis[1][iColumn]);
-      latticeBasis[0][iColumn] = newColumn.first;
-      latticeBasis[1][iColumn] = newColumn.second;
+      Message message;
+      bool complete;
+      if (!workers[iWorker]->receiveAvailable(message, &complete))
+      {
+        dropWorker(iWorker);
+        return;
+      }
+
+      if (!complete)
+      {
+        return;
+      }
+
+      handleMessage(iWorker, message);
     }
   }
-}
 
-bool gridcodingrange::findGridCodeZero(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  const vector<vector<vector<double>>>& latticeBasisByModule,
-  const vector<double>& x0,
-  const vector<double>& dims,
-  double readoutResolution,
-  vector<double>* pointWithGridCodeZero)
-{
-  // Avoid doing any allocations in each recursion.
-  vector<double> x0Copy(x0);
-  vector<double> dimsCopy(dims);
-  std::atomic<bool> shouldContinue(true);
+  void handleMessage(size_t iWorker, Message& message)
+  {
+    try
+    {
+      NTA_CHECK(message.readU64() == ShardNext)
+        << "Unexpected message from worker " << iWorker;
 
-  vector<double> defaultPointBuffer;
+      const unsigned long long iSlot = message.readU64();
+      const unsigned long long finishedUnit = message.readU64();
+      const bool foundGridCodeZero = message.readU64() != 0;
+      vector<double> point(modules.numDims());
+      message.readF64s(point.data(), point.size());
+
+      auto unit = outstanding.find(finishedUnit);
+      if (unit != outstanding.end() && unit->second.first == iWorker)
+      {
+        const double baselineFactor = unit->second.second.baselineFactor;
+        outstanding.erase(unit);
+
+        if (foundGridCodeZero)
+        {
+          recordResult(baselineFactor, point);
+        }
+      }
+
+      // Recording the result can drop this worker if it's unreachable.
+      if (workers[iWorker])
+      {
+        parked.push_back({iWorker, iSlot});
+        assignUnits();
+      }
+    }
+    catch (const std::exception& e)
+    {
+      NTA_WARN << e.what();
+      dropWorker(iWorker);
+    }
+  }
+
+  /**
+   * Same logic as the threaded recordResult.
+   */
+  void recordResult(double baselineFactor, const vector<double>& point)
+  {
+    continueExpansion = false;
+    hasCurrentTask = false;
+
+    if (baselineFactor < foundPointBaselineRadius)
+    {
+      foundPointBaselineRadius = baselineFactor;
+      pointWithGridCodeZero = point;
+
+      Message best;
+      best.writeU64(ShardBest);
+      best.writeF64(foundPointBaselineRadius);
+      for (size_t iWorker = 0; iWorker < workers.size(); iWorker++)
+      {
+        if (workers[iWorker] && !workers[iWorker]->send(best))
+        {
+          dropWorker(iWorker);
+        }
+      }
+    }
+  }
+
+  /**
+   * Give units to waiting slots, oldest first.
+   */
+  void assignUnits()
+  {
+    while (!parked.empty())
+    {
+      const pair<size_t, unsigned long long> slot = parked.front();
+      if (!workers[slot.first])
+      {
+        parked.pop_front();
+        continue;
+      }
+
+      ShardUnit unit;
+      if (!nextUnit(&unit))
+      {
+        return;
+      }
+      parked.pop_front();
+
+      outstanding[unit.id] = {slot.first, unit};
+
+      Message message;
+      writeShardUnit(message, slot.second, unit);
+      if (!workers[slot.first]->send(message))
+      {
+        dropWorker(slot.first);
+      }
+    }
+  }
+
+  bool nextUnit(ShardUnit *unit)
+  {
+    while (!retry.empty())
+    {
+      *unit = std::move(retry.front());
+      retry.pop_front();
+      if (unit->baselineFactor < foundPointBaselineRadius)
+      {
+        return true;
+      }
+    }
+
+    if (!continueExpansion)
+    {
+      return false;
+    }
+
+    if (!hasCurrentTask || currentTask.binEnd == currentTaskNumBins)
+    {
+      const size_t numDims = modules.numDims();
+      currentTask.x0.resize(numDims);
+      currentTask.binDims.resize(numDims);
+      currentTask.numBinsByDim.resize(numDims);
+      expansionEnumerator.getNext(currentTask.x0.data(),
+                                  currentTask.binDims.data(),
+                                  &currentTask.baselineFactor);
+      currentTaskNumBins = splitIntoBins(
+        currentTask.binDims.data(), currentTask.numBinsByDim.data(),
+        numDims, meanScaleEstimate);
+      currentTask.binEnd = 0;
+      hasCurrentTask = true;
+    }
+
+    currentTask.id = nextUnitId++;
+    currentTask.binBegin = currentTask.binEnd;
+    currentTask.binEnd = std::min(currentTask.binBegin + BinsPerShardUnit,
+                                  currentTaskNumBins);
+    *unit = currentTask;
+    return true;
+  }
+
+  /**
+   * Forget a worker that disconnected or broke the protocol, and give its
+   * units to someone else.
+   */
+  void dropWorker(size_t iWorker)
+  {
+    if (!workers[iWorker])
+    {
+      return;
+    }
+    workers[iWorker].reset();
+
+    size_t numRequeued = 0;
+    for (auto unit = outstanding.rbegin(); unit != outstanding.rend(); ++unit)
+    {
+      if (unit->second.first == iWorker)
+      {
+        retry.push_front(std::move(unit->second.second));
+        numRequeued++;
+      }
+    }
+    for (auto unit = outstanding.begin(); unit != outstanding.end();)
+    {
+      unit = (unit->second.first == iWorker) ? outstanding.erase(unit) : ++unit;
+    }
+
+    parked.erase(
+      std::remove_if(parked.begin(), parked.end(),
+                     [iWorker](const pair<size_t, unsigned long long>& slot) {
+                       return slot.first == iWorker;
+                     }),
+      parked.end());
+
+    NTA_WARN << "Lost worker " << iWorker << ". Requeued " << numRequeued
+             << " units.";
+
+    assignUnits();
+  }
+
+  bool finished() const
+  {
+    if (continueExpansion)
+    {
+      return false;
+    }
+
+    for (const ShardUnit& unit : retry)
+    {
+      if (unit.baselineFactor < foundPointBaselineRadius)
+      {
+        return false;
+      }
+    }
+
+    for (const auto& unit : outstanding)
+    {
+      if (unit.second.second.baselineFactor < foundPointBaselineRadius)
+      {
+        return false;
+      }
+    }
 
-  if (pointWithGridCodeZero != nullptr)
-  {
-    NTA_ASSERT(pointWithGridCodeZero->size() == dims.size());
+    return true;
   }
-  else
+
+  void logStatus(double secondsElapsed) const
   {
-    defaultPointBuffer.resize(dims.size());
-    pointWithGridCodeZero = &defaultPointBuffer;
-  }
+    size_t numWorkers = 0;
+    for (const std::unique_ptr<MessageChannel>& worker : workers)
+    {
+      if (worker) numWorkers++;
+    }
 
-  NTA_ASSERT(domainToPlaneByModule[0].size() == 2);
+    NTA_INFO << "";
+    NTA_INFO << query.numModules << " modules, " << query.numDims
+             << " dimensions, " << (long long)secondsElapsed
+             << " seconds elapsed";
+    NTA_INFO << "  Coordinating " << numWorkers << " workers on port "
+             << listener.port() << ", " << outstanding.size()
+             << " units in progress, " << retry.size() << " requeued";
 
-  vector<vector<vector<double>>> domainToPlaneByModule2(domainToPlaneByModule);
-  vector<vector<vector<double>>> latticeBasisByModule2(latticeBasisByModule);
-  optimizeMatrices(&domainToPlaneByModule2, &latticeBasisByModule2);
+    if (hasCurrentTask)
+    {
+      NTA_INFO << "  Expanding with box scale factor lower bound "
+               << currentTask.baselineFactor;
+    }
 
-  vector<SquareMatrix2D<double>> latticeBasisByModule3;
-  vector<SquareMatrix2D<double>> inverseLatticeBasisByModule;
-  for (const vector<vector<double>>& latticeBasis : latticeBasisByModule2)
-  {
-    latticeBasisByModule3.push_back({
-        latticeBasis[0][0], latticeBasis[0][1],
-        latticeBasis[1][0], latticeBasis[1][1]});
-    inverseLatticeBasisByModule.push_back(invert2DMatrix(latticeBasis));
+    if (foundPointBaselineRadius < std::numeric_limits<double>::max())
+    {
+      NTA_INFO << "**Box scale factor upper bound: "
+               << foundPointBaselineRadius << "**";
+      NTA_INFO << "**Grid code zero found at: "
+               << vecs(pointWithGridCodeZero) << "**";
+    }
   }
 
-  vector<vector<PolygonInfo>> cachedShadows;
-  vector<vector<BoundingBox2D>> cachedShadowBoundingBoxes;
-  vector<vector<LatticeBox>> cachedLatticeBoxes;
+  // The query, as sent to the workers
+  const CodingRangeCheckpoint query;
+  const ModuleSet modules;
+  const double meanScaleEstimate;
 
-  // Add a small epsilon to handle situations where floating point math causes a
-  // vertex to be non-zero-overlapping here and zero-overlapping in
-  // tryProveGridCodeZeroImpossible. With this addition, anything
-  // zero-overlapping in tryProveGridCodeZeroImpossible is guaranteed to be
-  // zero-overlapping here, so the program won't get caught in infinite
-  // recursion.
-  const double rSquaredPositive = pow(readoutResolution/2 + 0.000000001, 2);
-  const double rSquaredNegative = pow(readoutResolution/2, 2);
+  // Task management
+  MultiDirectionExpansion expansionEnumerator;
+  bool continueExpansion;
+  ShardUnit currentTask;
+  unsigned long long currentTaskNumBins;
+  bool hasCurrentTask;
+  unsigned long long nextUnitId;
+  std::map<unsigned long long, pair<size_t, ShardUnit>> outstanding;
+  std::deque<ShardUnit> retry;
+  std::deque<pair<size_t, unsigned long long>> parked;
 
-  return findGridCodeZeroHelper(
-    domainToPlaneByModule2, latticeBasisByModule3, inverseLatticeBasisByModule,
-    dimsCopy.size(), x0Copy.data(), dimsCopy.data(), readoutResolution/2,
-    rSquaredPositive, rSquaredNegative, pointWithGridCodeZero->data(),
-    cachedShadows, cachedShadowBoundingBoxes, cachedLatticeBoxes, 0,
-    shouldContinue);
-}
+  // Results
+  double foundPointBaselineRadius;
+  vector<double> pointWithGridCodeZero;
 
-pair<double,vector<double>>
-gridcodingrange::computeCodingRange(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  const vector<vector<vector<double>>>& latticeBasisByModule,
-  const vector<double> &scaledbox,
-  const vector<double> &ignorebox,
+  // Connections. A lost worker's entry is null.
+  MessageListener listener;
+  vector<std::unique_ptr<MessageChannel>> workers;
+};
+
+gridcodingrange::CodingRangeCoordinator::CodingRangeCoordinator(
+  const MatrixList& domainToPlaneByModule,
+  const MatrixList& latticeBasisByModule,
+  const vector<double>& scaledbox,
+  const vector<double>& ignorebox,
   double readoutResolution,
-  double pingInterval)
+  const std::string& host,
+  int port)
+  : impl_(new Impl(domainToPlaneByModule, latticeBasisByModule, scaledbox,
+                   ignorebox, readoutResolution, host, port))
 {
-  typedef std::chrono::steady_clock Clock;
-
-  enum ExitReason {
-    Timeout,
-    Interrupt,
-    Completed
-  };
+}
 
-  std::atomic<ExitReason> exitReason(ExitReason::Completed);
+gridcodingrange::CodingRangeCoordinator::~CodingRangeCoordinator()
+{
+}
 
-  ThreadSafeQueue<Message> messages;
-  CaptureInterruptsRAII captureInterrupts(&messages);
+int gridcodingrange::CodingRangeCoordinator::port() const
+{
+  return impl_->listener.port();
+}
 
-  std::atomic<bool> quitting(false);
-  std::thread messageThread(
-    [&]() {
-      while (true)
-      {
-        switch (messages.take())
-        {
-          case Message::Interrupt:
-            quitting = true;
-            exitReason = ExitReason::Interrupt;
-            break;
-          case Message::Timeout:
-            quitting = true;
-            exitReason = ExitReason::Timeout;
-            break;
-          case Message::Exiting:
-            return;
-        }
-      }
-    });
+pair<double,vector<double>>
+gridcodingrange::CodingRangeCoordinator::run(
+  double pingInterval,
+  double timeout,
+  const CancellationToken* cancellationToken)
+{
+  return impl_->run(pingInterval, timeout, cancellationToken);
+}
 
-  NTA_CHECK(domainToPlaneByModule.size() == latticeBasisByModule.size())
-    << "The two arrays of matrices must be the same length (one per module) "
-    << "Actual: " << domainToPlaneByModule.size()
-    << " " << latticeBasisByModule.size();
+/**
+ * A worker process's view of the sharded search. The main thread receives
+ * messages and fills the slots' mailboxes, and each slot searches its units on
+ * a thread of its own. The slots spend much of their time blocked on their
+ * mailboxes, so they'd hold thread pool workers hostage.
+ */
+struct ShardWorkerState
+{
+  ShardWorkerState(const ModuleSet& modules, double readoutResolution,
+                   const vector<double>& scaledbox,
+                   MessageChannel& channel, CallCancellation& cancellation,
+                   size_t numSlots)
+    : modules(modules),
+      readoutResolution(readoutResolution),
+      numDims(modules.numDims()),
+      scaledbox(scaledbox),
+      searchOrder(gridcodingrange::getSearchOrder()),
+      channel(channel),
+      cancellation(cancellation),
+      slotHasUnit(numSlots, false),
+      slotUnit(numSlots),
+      slotBaselineFactor(numSlots, std::numeric_limits<double>::max()),
+      slotShouldContinue(numSlots),
+      foundPointBaselineRadius(std::numeric_limits<double>::max()),
+      done(false)
+  {
+  }
 
-  NTA_CHECK(domainToPlaneByModule[0].size() == 2)
-    << "Each matrix should have two rows -- the modules are two-dimensional. "
-    << "Actual: " << domainToPlaneByModule[0].size();
+  // Constants (thread-safe)
+  const ModuleSet& modules;
+  const double readoutResolution;
+  const size_t numDims;
+  const vector<double> scaledbox;
+  const SearchOrder searchOrder;
 
-  NTA_CHECK(latticeBasisByModule[0][0].size() == 2)
-    << "There should be two lattice basis vectors. "
-    << "Actual: " << latticeBasisByModule[0][0].size();
+  // Shadows for box shapes that several units share (thread-safe)
+  SharedShadowFrames sharedShadowFrames;
 
-  const size_t numDims = domainToPlaneByModule[0][0].size();
-  NTA_CHECK(numDims < sizeof(int)*8)
-    << "Unsupported number of dimensions: " << numDims;
+  // Sending is guarded by sendMutex. Only the main thread receives.
+  MessageChannel& channel;
+  std::mutex sendMutex;
 
-  vector<vector<vector<double>>> domainToPlaneByModule2(domainToPlaneByModule);
-  vector<vector<vector<double>>> latticeBasisByModule2(latticeBasisByModule);
-  optimizeMatrices(&domainToPlaneByModule2, &latticeBasisByModule2);
+  CallCancellation& cancellation;
 
-  vector<SquareMatrix2D<double>> latticeBasisByModule3;
-  vector<SquareMatrix2D<double>> inverseLatticeBasisByModule;
-  for (const vector<vector<double>>& latticeBasis : latticeBasisByModule2)
-  {
-    latticeBasisByModule3.push_back({
-        latticeBasis[0][0], latticeBasis[0][1],
-        latticeBasis[1][0], latticeBasis[1][1]});
-    inverseLatticeBasisByModule.push_back(invert2DMatrix(latticeBasis));
-  }
+  // Mailboxes, guarded by mutex
+  std::mutex mutex;
+  std::condition_variable unitArrived;
+  vector<bool> slotHasUnit;
+  vector<ShardUnit> slotUnit;
+  vector<double> slotBaselineFactor;
+  vector<std::atomic<bool>> slotShouldContinue;
+  double foundPointBaselineRadius;
+  bool done;
+};
 
-  double meanScaleEstimate = 0.0;
+template<size_t K>
+void shardWorkerSlot(size_t iSlot, ShardWorkerState& state)
+{
+  bool foundGridCodeZero = false;
+  unsigned long long finishedUnit = NoTask;
+  DimsArray<K> pointWithGridCodeZero(state.numDims);
+  vector<long long> currentBinByDim(state.numDims);
+  SearchCache cache(state.modules.numModules());
+  ShardUnit unit;
 
-  for (const vector<vector<double>>& domainToPlane : domainToPlaneByModule2)
+  while (true)
   {
-    double longestDisplacementSquared = std::numeric_limits<double>::min();
+    {
+      Message message;
+      message.writeU64(ShardNext);
+      message.writeU64(iSlot);
+      message.writeU64(finishedUnit);
+      message.writeU64(foundGridCodeZero);
+      message.writeF64s(pointWithGridCodeZero.data(), state.numDims);
+
+      std::lock_guard<std::mutex> lock(state.sendMutex);
+      if (!state.channel.send(message))
+      {
+        break;
+      }
+    }
 
-    for (size_t iDim = 0; iDim < numDims; iDim++)
     {
-      longestDisplacementSquared = std::max(longestDisplacementSquared,
-                                            pow(domainToPlane[0][iDim], 2) +
-                                            pow(domainToPlane[1][iDim], 2));
+      std::unique_lock<std::mutex> lock(state.mutex);
+      while (!state.slotHasUnit[iSlot] && !state.done)
+      {
+        state.unitArrived.wait(lock);
+      }
+
+      if (state.done)
+      {
+        break;
+      }
+
+      unit = std::move(state.slotUnit[iSlot]);
+      state.slotHasUnit[iSlot] = false;
+      state.slotBaselineFactor[iSlot] = unit.baselineFactor;
+      state.slotShouldContinue[iSlot] =
+        unit.baselineFactor < state.foundPointBaselineRadius;
     }
 
-    const double scaleEstimate = 1 / sqrt(longestDisplacementSquared);
-    meanScaleEstimate += scaleEstimate;
-  }
-  meanScaleEstimate /= domainToPlaneByModule2.size();
+    cache.resetFrames(
+      state.sharedShadowFrames.acquire(unit.binDims.data(), state.numDims));
 
-  // Use condition_variables to enable periodic logging while waiting for the
-  // threads to finish.
-  std::mutex stateMutex;
-  std::condition_variable finishedCondition;
+    foundGridCodeZero = findGridCodeZeroInBins<K>(
+      state.modules, state.readoutResolution, state.searchOrder,
+      state.scaledbox.data(), unit.x0.data(),
+      unit.binDims.data(), unit.numBinsByDim.data(), unit.binBegin,
+      unit.binEnd, pointWithGridCodeZero.data(), cache, currentBinByDim,
+      state.slotShouldContinue[iSlot], state.cancellation);
 
-  size_t numThreads = std::thread::hardware_concurrency();
+    if (state.cancellation.poll())
+    {
+      // The unit is unfinished. The coordinator will requeue it when this
+      // worker disconnects.
+      break;
+    }
 
-  // Optimization: for the final dimension, don't go negative. Half of the box
-  // will be equal-and-opposite phases of the other half, so we ignore the lower
-  // half of the final dimension.
-  unsigned reflectDims = (0x1 << (numDims - 1)) - 1;
-
-  ExpansionState state = {
-    domainToPlaneByModule2,
-    latticeBasisByModule3,
-    inverseLatticeBasisByModule,
-    readoutResolution,
-
-    meanScaleEstimate,
-    numDims,
-
-    {scaledbox.begin(), scaledbox.end(),
-     ignorebox.begin(), ignorebox.end(),
-     reflectDims},
-    true,
-
-    vector<double>(numDims),
-    std::numeric_limits<double>::max(),
-
-    stateMutex,
-    finishedCondition,
-    false,
-    0,
-    vector<double>(numThreads, std::numeric_limits<double>::max()),
-    vector<vector<double>>(numThreads, vector<double>(numDims)),
-    vector<vector<double>>(numThreads, vector<double>(numDims)),
-    vector<std::atomic<bool>>(numThreads),
-    quitting,
-    vector<bool>(numThreads, true),
-  };
+    finishedUnit = unit.id;
+  }
+}
 
-  for (size_t i = 0; i < numThreads; i++)
+void gridcodingrange::runCodingRangeWorker(
+  const std::string& host,
+  int port,
+  size_t numThreads,
+  double timeout,
+  const CancellationToken* cancellationToken)
+{
+  if (numThreads == 0)
   {
-    state.threadShouldContinue[i] = true;
+    numThreads = ThreadPool::sharedNumThreads();
   }
 
+  CallCancellation cancellation(cancellationToken, timeout, true);
+
+  std::unique_ptr<MessageChannel> channel = MessageChannel::connect(host,
+                                                                    port);
+
+  Message message;
+  while (!channel->waitReadable(100))
   {
-    std::unique_lock<std::mutex> lock(stateMutex);
-    for (size_t i = 0; i < numThreads; i++)
+    if (cancellation.poll())
     {
-      std::thread(findGridCodeZeroThread, i,  std::ref(state)).detach();
-      state.numActiveThreads++;
+      cancellation.throwIfStopped();
     }
+  }
+  NTA_CHECK(channel->receive(message) && message.readU64() == ShardQuery)
+    << "The coordinator at " << host << ":" << port
+    << " didn't send a query";
 
-    const auto tStart = Clock::now();
-    auto tNextPrint = tStart + std::chrono::duration<double>(pingInterval);
+  const CodingRangeCheckpoint query = readShardQuery(message);
+  const ModuleSet modules = optimizedModuleSet(query.domainToPlaneView(),
+                                               query.latticeBasisView(),
+                                               query.readoutResolution);
 
-    bool printedInitialStatement = false;
+  ShardWorkerState state(modules, query.readoutResolution, query.scaledbox,
+                         *channel, cancellation, numThreads);
 
-    while (!state.finished)
+  void (*slotFunction)(size_t, ShardWorkerState&) =
+    dispatchOnNumDims(state.numDims, [](auto k) {
+      return &shardWorkerSlot<decltype(k)::value>;
+    });
+
+  // Wake the slots and tell them to stop.
+  auto stopSlots = [&state, numThreads] {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.done = true;
+    for (size_t iSlot = 0; iSlot < numThreads; iSlot++)
     {
-      if (pingInterval <= 0)
-      {
-        state.finishedCondition.wait(lock);
-      }
-      else
+      state.slotShouldContinue[iSlot] = false;
+    }
+    state.unitArrived.notify_all();
+  };
+
+  bool receivedDone = false;
+  std::exception_ptr protocolError;
+  vector<std::exception_ptr> slotErrors(numThreads);
+  {
+    vector<std::thread> slots;
+    try
+    {
+      for (size_t iSlot = 0; iSlot < numThreads; iSlot++)
       {
-        if (state.finishedCondition.wait_until(
-              lock, tNextPrint) == std::cv_status::timeout)
-        {
-          if (!printedInitialStatement)
-          {
+        ShardWorkerState *s = &state;
+        std::exception_ptr *error = &slotErrors[iSlot];
+        slots.emplace_back([slotFunction, iSlot, s, error] {
+            try
             {
-              std::ostringstream oss;
-              oss << "[";
-
-              for (size_t iModule = 0;
-                   iModule < domainToPlaneByModule.size();
-                   iModule++)
-              {
-                oss << "[";
-                oss << vecs(domainToPlaneByModule[iModule][0]) << ",";
-                oss << vecs(domainToPlaneByModule[iModule][1]);
-                oss << "],";
-              }
-              oss << "]" << std::endl;
-              NTA_INFO << "domainToPlaneByModule:" << std::endl << oss.str();
+              slotFunction(iSlot, *s);
             }
-
+            catch (...)
             {
-              std::ostringstream oss;
-              oss << "[";
-              for (size_t iModule = 0;
-                   iModule < latticeBasisByModule.size();
-                   iModule++)
-              {
-                oss << "[";
-                oss << vecs(latticeBasisByModule[iModule][0]) << ",";
-                oss << vecs(latticeBasisByModule[iModule][1]);
-                oss << "],";
-              }
-              oss << "]" << std::endl;
-
-              NTA_INFO << "latticeBasisByModule:" << std::endl << oss.str();
+              *error = std::current_exception();
             }
+          });
+      }
+    }
+    catch (...)
+    {
+      stopSlots();
+      for (std::thread& slot : slots)
+      {
+        slot.join();
+      }
+      throw;
+    }
 
-            NTA_INFO << "readout resolution: " << readoutResolution;
-
-            printedInitialStatement = true;
-          }
+    while (!receivedDone && !cancellation.poll())
+    {
+      // Wake up regularly to check for cancellation.
+      if (!channel->waitReadable(100))
+      {
+        continue;
+      }
 
-          NTA_INFO << "";
-          NTA_INFO << domainToPlaneByModule.size() << " modules, " << numDims
-                   << " dimensions, "
-                   << std::chrono::duration_cast<std::chrono::seconds>(
-                     Clock::now() - tStart).count() << " seconds elapsed";
+      if (!channel->receive(message))
+      {
+        break;
+      }
 
-          if (state.foundPointBaselineRadius <
-              std::numeric_limits<double>::max())
+      // Don't throw until the slots have stopped.
+      try
+      {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        switch (message.readU64())
+        {
+          case ShardUnitMessage:
           {
-            NTA_INFO << "**Box scale factor upper bound: "
-                     << state.foundPointBaselineRadius << "**";
-            NTA_INFO << "**Grid code zero found at: "
-                     << vecs(state.pointWithGridCodeZero) << "**";
+            const unsigned long long iSlot = message.readU64();
+            NTA_CHECK(iSlot < numThreads);
+            state.slotUnit[iSlot] = readShardUnit(message, state.numDims);
+            state.slotHasUnit[iSlot] = true;
+            state.unitArrived.notify_all();
+            break;
           }
-
-          tNextPrint = (Clock::now() +
-                        std::chrono::duration<double>(pingInterval));
-
-          for (size_t iThread = 0; iThread < state.threadBaselineFactor.size();
-               iThread++)
+          case ShardBest:
           {
-            if (state.threadRunning[iThread])
+            state.foundPointBaselineRadius = message.readF64();
+            for (size_t iSlot = 0; iSlot < numThreads; iSlot++)
             {
-              if (state.threadShouldContinue[iThread])
-              {
-                NTA_INFO << "  Thread " << iThread
-                         << " assuming box scale factor lower bound "
-                         << state.threadBaselineFactor[iThread]
-                         << ", querying x0 "
-                         << vecs(state.threadQueryX0[iThread]) << " and dims "
-                         << vecs(state.threadQueryDims[iThread]);
-              }
-              else
+              if (state.slotBaselineFactor[iSlot] >=
+                  state.foundPointBaselineRadius)
               {
-                NTA_INFO << "  Thread " << iThread
-                         << " has been ordered to stop.";
+                state.slotShouldContinue[iSlot] = false;
               }
             }
-            else
-            {
-              NTA_INFO << "  Thread " << iThread << " is finished.";
-            }
+            break;
           }
+          case ShardDone:
+            receivedDone = true;
+            break;
+          default:
+            NTA_THROW << "Unexpected message from the coordinator";
         }
       }
+      catch (...)
+      {
+        protocolError = std::current_exception();
+        break;
+      }
+    }
+
+    // Disconnect before waiting for the slots. If this worker stopped early,
+    // the coordinator requeues its units now rather than waiting on them.
+    channel->shutdown();
+
+    stopSlots();
+    for (std::thread& slot : slots)
+    {
+      slot.join();
     }
   }
 
-  messages.put(Message::Exiting);
-  messageThread.join();
+  for (const std::exception_ptr& error : slotErrors)
+  {
+    if (error)
+    {
+      std::rethrow_exception(error);
+    }
+  }
 
-  switch (exitReason.load())
+  if (protocolError)
   {
-    case ExitReason::Timeout:
-      // Python code may check for the precise string "timeout".
-      NTA_THROW << "timeout";
-    case ExitReason::Interrupt:
-      NTA_THROW << "interrupt";
-    case ExitReason::Completed:
-    default:
-      return {state.foundPointBaselineRadius, state.pointWithGridCodeZero};
+    std::rethrow_exception(protocolError);
   }
-}
 
+  cancellation.throwIfStopped();
+
+  NTA_CHECK(receivedDone)
+    << "Lost the connection to the coordinator at " << host << ":" << port;
+}
 
 pair<double,vector<double>>
 gridcodingrange::computeGridUniquenessHypercube(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  const vector<vector<vector<double>>>& latticeBasisByModule,
+  const MatrixList& domainToPlaneByModule,
+  const MatrixList& latticeBasisByModule,
   double readoutResolution,
   double ignoredCenterDiameter,
-  double pingInterval)
+  double pingInterval,
+  double timeout,
+  const CancellationToken* cancellationToken,
+  bool captureInterrupts)
 {
-  const size_t numDims = domainToPlaneByModule[0][0].size();
+  const size_t numDims = domainToPlaneByModule.numCols();
 
   const vector<double> scaledbox(numDims, 1.0);
   const vector<double> ignorebox(numDims, ignoredCenterDiameter);
 
   return computeCodingRange(domainToPlaneByModule, latticeBasisByModule,
                             scaledbox, ignorebox, readoutResolution,
-                            pingInterval);
+                            pingInterval, 0, timeout, cancellationToken,
+                            nullptr, ExpansionSchedule(), captureInterrupts);
 }
 
 bool tryFindGridCodeZero_noModulo(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  size_t numDims,
+  const ModuleSet& modules,
   const double x0[],
   const double dims[],
   double rSquared,
   double vertexBuffer[])
 {
-  for (size_t iDim = 0; iDim < numDims; iDim++)
+  for (size_t iDim = 0; iDim < modules.numDims(); iDim++)
   {
     vertexBuffer[iDim] = x0[iDim] + (dims[iDim]/2);
   }
 
-  for (size_t iModule = 0; iModule < domainToPlaneByModule.size(); iModule++)
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
   {
     const pair<double, double> pointOnPlane =
-      transformND(domainToPlaneByModule[iModule], vertexBuffer);
+      modules.project(iModule, vertexBuffer);
 
     if (pow(pointOnPlane.first, 2) + pow(pointOnPlane.second, 2) > rSquared)
     {
@@ -1579,8 +4377,7 @@ bool tryFindGridCodeZero_noModulo(
 }
 
 bool tryProveGridCodeZeroImpossible_noModulo_1D(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  size_t numDims,
+  const ModuleSet& modules,
   const double x0[],
   const double dims[],
   double rSquared)
@@ -1588,17 +4385,16 @@ bool tryProveGridCodeZeroImpossible_noModulo_1D(
   const double point1 = x0[0];
   const double point2 = x0[0] + dims[0];
 
-  for (size_t iModule = 0; iModule < domainToPlaneByModule.size(); iModule++)
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
   {
-    const pair<double,double> p1 = transformND(domainToPlaneByModule[iModule],
-                                               &point1);
-    const pair<double,double> p2 = transformND(domainToPlaneByModule[iModule],
-                                               &point2);
+    const pair<double,double> p1 = modules.project(iModule, &point1);
+    const pair<double,double> p2 = modules.project(iModule, &point2);
 
     if (distToSegmentSquared({0.0, 0.0}, p1, p2) > rSquared)
     {
       // This module never gets near grid code zero for the provided range of
       // locations. So this range can't possibly contain grid code zero.
+      SEARCH_STATS(recordImpossibleProof(iModule));
       return true;
     }
   }
@@ -1607,43 +4403,43 @@ bool tryProveGridCodeZeroImpossible_noModulo_1D(
 }
 
 bool tryProveGridCodeZeroImpossible_noModulo(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  size_t numDims,
+  const ModuleSet& modules,
   const double x0[],
   const double dims[],
-  double r,
+  double /*r*/,
   double rSquared,
-  double vertexBuffer[],
   vector<vector<PolygonInfo>>& cachedShadows,
   size_t frameNumber)
 {
-  if (numDims == 1)
+  if (modules.numDims() == 1)
   {
-    return tryProveGridCodeZeroImpossible_noModulo_1D(
-      domainToPlaneByModule, numDims, x0, dims, rSquared);
+    return tryProveGridCodeZeroImpossible_noModulo_1D(modules, x0, dims,
+                                                      rSquared);
   }
 
   NTA_ASSERT(frameNumber <= cachedShadows.size());
 
   if (frameNumber == cachedShadows.size())
   {
+    SEARCH_STATS(numShadowFramesBuilt++);
+
     vector<PolygonInfo> shadowByModule;
-    shadowByModule.reserve(domainToPlaneByModule.size());
+    shadowByModule.reserve(modules.numModules());
 
-    for (size_t iModule = 0; iModule < domainToPlaneByModule.size(); iModule++)
+    Zonogon shadow;
+
+    for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
     {
-      const vector<pair<double, double>> shadow = getShadowConvexHull(
-        domainToPlaneByModule[iModule], numDims, dims, vertexBuffer);
-      shadowByModule.push_back(PolygonInfo(shadow));
+      shadow.build(modules.domainToPlane(iModule), modules.numDims(), dims);
+      shadowByModule.push_back(PolygonInfo(shadow.vertices()));
     }
 
     cachedShadows.push_back(shadowByModule);
   }
 
-  for (size_t iModule = 0; iModule < domainToPlaneByModule.size(); iModule++)
+  for (size_t iModule = 0; iModule < modules.numModules(); iModule++)
   {
-    const pair<double,double> shift =
-      transformND(domainToPlaneByModule[iModule], x0);
+    const pair<double,double> shift = modules.project(iModule, x0);
 
     if (distToConvexPolygonSquared({-shift.first, -shift.second},
                                    cachedShadows[frameNumber][iModule])
@@ -1651,6 +4447,7 @@ bool tryProveGridCodeZeroImpossible_noModulo(
     {
       // This module never gets near grid code zero for the provided range of
       // locations. So this range can't possibly contain grid code zero.
+      SEARCH_STATS(recordImpossibleProof(iModule));
       return true;
     }
   }
@@ -1659,8 +4456,7 @@ bool tryProveGridCodeZeroImpossible_noModulo(
 }
 
 bool findGridCodeZeroHelper_noModulo(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
-  size_t numDims,
+  const ModuleSet& modules,
   double x0[],
   double dims[],
   double r,
@@ -1669,34 +4465,37 @@ bool findGridCodeZeroHelper_noModulo(
   double vertexBuffer[],
   vector<vector<PolygonInfo>>& cachedShadows,
   size_t frameNumber,
-  std::atomic<bool>& shouldContinue)
+  CallCancellation& cancellation,
+  const std::atomic<bool>& faceSearchShouldContinue)
 {
-  if (!shouldContinue)
+  if (!faceSearchShouldContinue || cancellation.poll())
   {
     return false;
   }
 
+  SEARCH_STATS(recordNode(frameNumber));
+
   if (tryProveGridCodeZeroImpossible_noModulo(
-        domainToPlaneByModule, numDims, x0, dims, r, rSquaredNegative,
-        vertexBuffer, cachedShadows, frameNumber))
+        modules, x0, dims, r, rSquaredNegative, cachedShadows, frameNumber))
   {
     return false;
   }
 
-  if (tryFindGridCodeZero_noModulo(domainToPlaneByModule, numDims, x0, dims,
-                                   rSquaredPositive, vertexBuffer))
+  if (tryFindGridCodeZero_noModulo(modules, x0, dims, rSquaredPositive,
+                                   vertexBuffer))
   {
     return true;
   }
 
+  const size_t numDims = modules.numDims();
   size_t iWidestDim = std::distance(dims,
                                     std::max_element(dims, dims + numDims));
   {
     SwapValueRAII swap1(&dims[iWidestDim], dims[iWidestDim] / 2);
     if (findGridCodeZeroHelper_noModulo(
-          domainToPlaneByModule, numDims, x0, dims, r, rSquaredPositive,
-          rSquaredNegative, vertexBuffer, cachedShadows, frameNumber + 1,
-          shouldContinue))
+          modules, x0, dims, r, rSquaredPositive, rSquaredNegative,
+          vertexBuffer, cachedShadows, frameNumber + 1, cancellation,
+          faceSearchShouldContinue))
     {
       return true;
     }
@@ -1704,19 +4503,20 @@ bool findGridCodeZeroHelper_noModulo(
     {
       SwapValueRAII swap2(&x0[iWidestDim], x0[iWidestDim] + dims[iWidestDim]);
       return findGridCodeZeroHelper_noModulo(
-        domainToPlaneByModule, numDims, x0, dims, r, rSquaredPositive,
-        rSquaredNegative, vertexBuffer, cachedShadows, frameNumber + 1,
-        shouldContinue);
+        modules, x0, dims, r, rSquaredPositive, rSquaredNegative,
+        vertexBuffer, cachedShadows, frameNumber + 1, cancellation,
+        faceSearchShouldContinue);
     }
   }
 }
 
 bool findGridCodeZero_noModulo(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
+  const ModuleSet& modules,
   const vector<double>& x0,
   const vector<double>& dims,
   double readoutResolution,
-  std::atomic<bool>& shouldContinue,
+  CallCancellation& cancellation,
+  const std::atomic<bool>& faceSearchShouldContinue,
   vector<double>* pointWithGridCodeZero = nullptr)
 {
   // Avoid doing any allocations in each recursion.
@@ -1735,8 +4535,6 @@ bool findGridCodeZero_noModulo(
     pointWithGridCodeZero = &defaultPointBuffer;
   }
 
-  NTA_ASSERT(domainToPlaneByModule[0].size() == 2);
-
   vector<vector<PolygonInfo>> cachedShadows;
 
   // Add a small epsilon to handle situations where floating point math causes a
@@ -1749,19 +4547,62 @@ bool findGridCodeZero_noModulo(
   const double rSquaredNegative = pow(readoutResolution/2, 2);
 
   return findGridCodeZeroHelper_noModulo(
-    domainToPlaneByModule, dimsCopy.size(), x0Copy.data(), dimsCopy.data(),
-    readoutResolution/2, rSquaredPositive, rSquaredNegative,
-    pointWithGridCodeZero->data(), cachedShadows, 0, shouldContinue);
+    modules, x0Copy.data(), dimsCopy.data(), readoutResolution/2,
+    rSquaredPositive, rSquaredNegative, pointWithGridCodeZero->data(),
+    cachedShadows, 0, cancellation, faceSearchShouldContinue);
+}
+
+/**
+ * A flat face of a box, i.e. a box with one zero-width dimension.
+ */
+struct Face
+{
+  vector<double> x0;
+  vector<double> dims;
+};
+
+/**
+ * Search a set of faces concurrently on the shared thread pool. As soon as one
+ * face contains grid code zero, the searches of the other faces stop.
+ */
+bool findGridCodeZeroOnFaces(
+  const vector<Face>& faces,
+  const ModuleSet& modules,
+  double readoutResolution,
+  CallCancellation& cancellation)
+{
+  std::atomic<bool> faceSearchShouldContinue(true);
+  SearchStats *parentStats = SearchStats::current();
+
+  const ThreadPoolLease pool;
+  TaskGroup tasks(*pool);
+  for (const Face& face : faces)
+  {
+    tasks.run([&] {
+        SearchStatsTaskScope statsScope(parentStats);
+        if (findGridCodeZero_noModulo(modules, face.x0, face.dims,
+                                      readoutResolution, cancellation,
+                                      faceSearchShouldContinue))
+        {
+          faceSearchShouldContinue = false;
+        }
+      });
+  }
+  tasks.wait();
+
+  // The flag is only cleared when a face contains grid code zero.
+  return !faceSearchShouldContinue;
 }
 
 bool findGridCodeZeroAtRadius(
   double radius,
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
+  const ModuleSet& modules,
   double readoutResolution,
-  std::atomic<bool>& shouldContinue)
+  CallCancellation& cancellation)
 {
-  const size_t numDims = domainToPlaneByModule[0][0].size();
+  const size_t numDims = modules.numDims();
 
+  vector<Face> faces;
   for (size_t iDim = 0; iDim < numDims; ++iDim)
   {
     // Test the hyperplanes formed by setting this dimension to r and -r.
@@ -1779,91 +4620,53 @@ bool findGridCodeZeroAtRadius(
     // Test -r
     if (iDim != numDims - 1)
     {
-      if (findGridCodeZero_noModulo(domainToPlaneByModule,
-                                    x0, dims, readoutResolution,
-                                    shouldContinue))
-      {
-        return true;
-      }
+      faces.push_back({x0, dims});
     }
 
     // Test +r
     x0[iDim] = radius;
-    if (findGridCodeZero_noModulo(domainToPlaneByModule,
-                                  x0, dims, readoutResolution,
-                                  shouldContinue))
-    {
-      return true;
-    }
+    faces.push_back({x0, dims});
   }
 
-  return false;
+  return findGridCodeZeroOnFaces(faces, modules, readoutResolution,
+                                 cancellation);
 }
 
 double
 gridcodingrange::computeBinSidelength(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
+  const MatrixList& domainToPlaneByModule,
   double readoutResolution,
   double resultPrecision,
   double upperBound,
-  double timeout)
+  double timeout,
+  const CancellationToken* cancellationToken,
+  SearchStats* stats,
+  bool captureInterrupts)
 {
   //
   // Initialization
   //
-  enum ExitReason {
-    Timeout,
-    Interrupt,
-    Completed
-  };
-
-  std::atomic<ExitReason> exitReason(ExitReason::Completed);
-
-  ThreadSafeQueue<Message> messages;
-  CaptureInterruptsRAII captureInterrupts(&messages);
-
-  std::atomic<bool> shouldContinue(true);
-  std::thread messageThread(
-    [&]() {
-      while (true)
-      {
-        switch (messages.take())
-        {
-          case Message::Interrupt:
-            shouldContinue = false;
-            exitReason = ExitReason::Interrupt;
-            break;
-          case Message::Timeout:
-            shouldContinue = false;
-            exitReason = ExitReason::Timeout;
-            break;
-          case Message::Exiting:
-            return;
-        }
-      }
-    });
+  CallCancellation cancellation(cancellationToken, timeout, captureInterrupts);
 
-  ScheduledTask* scheduledTask = nullptr;
-  if (timeout > 0)
+  if (stats != nullptr)
   {
-    scheduledTask = new ScheduledTask(
-      std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout),
-      [&messages](){
-        messages.put(Message::Timeout);
-      });
+    *stats = SearchStats();
   }
+  SearchStatsScope statsScope(stats);
 
   //
   // Computation
   //
+  const ModuleSet modules(domainToPlaneByModule);
+
   double tested = 0;
   double radius = 0.5;
 
   while (radius <= upperBound &&
          findGridCodeZeroAtRadius(radius,
-                                  domainToPlaneByModule,
+                                  modules,
                                   readoutResolution,
-                                  shouldContinue))
+                                  cancellation))
   {
     tested = radius;
     radius *= 2;
@@ -1883,14 +4686,14 @@ gridcodingrange::computeBinSidelength(
     double dec = (radius - tested) / 2;
 
     // The possible error is equal to dec*2.
-    while (shouldContinue && dec*2 > resultPrecision2)
+    while (!cancellation.poll() && dec*2 > resultPrecision2)
     {
       const double testRadius = radius - dec;
 
       if (!findGridCodeZeroAtRadius(testRadius,
-                                    domainToPlaneByModule,
+                                    modules,
                                     readoutResolution,
-                                    shouldContinue))
+                                    cancellation))
       {
         radius = testRadius;
       }
@@ -1904,36 +4707,19 @@ gridcodingrange::computeBinSidelength(
   //
   // Teardown
   //
-  if (scheduledTask != nullptr)
-  {
-    delete scheduledTask;
-    scheduledTask = nullptr;
-  }
-
-  messages.put(Message::Exiting);
-  messageThread.join();
+  cancellation.throwIfStopped();
 
-  switch (exitReason.load())
-  {
-    case ExitReason::Timeout:
-      // Python code may check for the precise string "timeout".
-      NTA_THROW << "timeout";
-    case ExitReason::Interrupt:
-      NTA_THROW << "interrupt";
-    case ExitReason::Completed:
-    default:
-      return result;
-  }
+  return result;
 }
 
 vector<double> squeezeRectangleToBin(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
+  const ModuleSet& modules,
   double readoutResolution,
   double resultPrecision,
   double startingRadius,
-  std::atomic<bool>& shouldContinue)
+  CallCancellation& cancellation)
 {
-  const size_t numDims = domainToPlaneByModule[0][0].size();
+  const size_t numDims = modules.numDims();
 
   // The radius needs to be twice as precise to get the sidelength sufficiently
   // precise.
@@ -1946,7 +4732,7 @@ vector<double> squeezeRectangleToBin(
     double dec = startingRadius / 2;
 
     // The possible error is equal to dec*2.
-    while (shouldContinue && dec*2 > resultPrecision2)
+    while (!cancellation.poll() && dec*2 > resultPrecision2)
     {
       const double testRadius = radii[iDim] - dec;
 
@@ -1966,27 +4752,21 @@ vector<double> squeezeRectangleToBin(
 
       // Test two faces of the n-dimensional box by setting the ith dimension
       // to -r and +r with width 0.
-      bool foundZero = false;
+      vector<Face> faces;
       dims[iDim] = 0;
       if (iDim != numDims - 1)
       {
         // Test -r
         x0[iDim] = -testRadius;
-        foundZero = findGridCodeZero_noModulo(domainToPlaneByModule,
-                                              x0, dims, readoutResolution,
-                                              shouldContinue);
+        faces.push_back({x0, dims});
       }
 
-      if (!foundZero)
-      {
-        // Test r
-        x0[iDim] = testRadius;;
-        foundZero = findGridCodeZero_noModulo(domainToPlaneByModule,
-                                              x0, dims, readoutResolution,
-                                              shouldContinue);;
-      }
+      // Test r
+      x0[iDim] = testRadius;
+      faces.push_back({x0, dims});
 
-      if (!foundZero)
+      if (!findGridCodeZeroOnFaces(faces, modules, readoutResolution,
+                                   cancellation))
       {
         radii[iDim] = testRadius;
       }
@@ -1999,67 +4779,38 @@ vector<double> squeezeRectangleToBin(
 
 vector<double>
 gridcodingrange::computeBinRectangle(
-  const vector<vector<vector<double>>>& domainToPlaneByModule,
+  const MatrixList& domainToPlaneByModule,
   double readoutResolution,
   double resultPrecision,
   double upperBound,
-  double timeout)
+  double timeout,
+  const CancellationToken* cancellationToken,
+  SearchStats* stats,
+  bool captureInterrupts)
 {
   //
   // Initialization
   //
-  enum ExitReason {
-    Timeout,
-    Interrupt,
-    Completed
-  };
-
-  std::atomic<ExitReason> exitReason(ExitReason::Completed);
-
-  ThreadSafeQueue<Message> messages;
-  CaptureInterruptsRAII captureInterrupts(&messages);
-
-  std::atomic<bool> shouldContinue(true);
-  std::thread messageThread(
-    [&]() {
-      while (true)
-      {
-        switch (messages.take())
-        {
-          case Message::Interrupt:
-            shouldContinue = false;
-            exitReason = ExitReason::Interrupt;
-            break;
-          case Message::Timeout:
-            shouldContinue = false;
-            exitReason = ExitReason::Timeout;
-            break;
-          case Message::Exiting:
-            return;
-        }
-      }
-    });
+  CallCancellation cancellation(cancellationToken, timeout, captureInterrupts);
 
-  ScheduledTask* scheduledTask = nullptr;
-  if (timeout > 0)
+  if (stats != nullptr)
   {
-    scheduledTask = new ScheduledTask(
-      std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout),
-      [&messages](){
-        messages.put(Message::Timeout);
-      });
+    *stats = SearchStats();
   }
+  SearchStatsScope statsScope(stats);
 
   //
   // Computation
   //
+  const ModuleSet modules(domainToPlaneByModule);
+
   double radius = 0.5;
 
   while (radius <= upperBound &&
          findGridCodeZeroAtRadius(radius,
-                                  domainToPlaneByModule,
+                                  modules,
                                   readoutResolution,
-                                  shouldContinue))
+                                  cancellation))
   {
     radius *= 2;
   }
@@ -2072,8 +4823,8 @@ gridcodingrange::computeBinRectangle(
   else
   {
     const vector<double> radii = squeezeRectangleToBin(
-      domainToPlaneByModule, readoutResolution, resultPrecision,
-      radius, shouldContinue);
+      modules, readoutResolution, resultPrecision,
+      radius, cancellation);
 
     result.resize(radii.size());
     std::transform(radii.begin(), radii.end(), result.begin(),
@@ -2083,24 +4834,7 @@ gridcodingrange::computeBinRectangle(
   //
   // Teardown
   //
-  if (scheduledTask != nullptr)
-  {
-    delete scheduledTask;
-    scheduledTask = nullptr;
-  }
-
-  messages.put(Message::Exiting);
-  messageThread.join();
+  cancellation.throwIfStopped();
 
-  switch (exitReason.load())
-  {
-    case ExitReason::Timeout:
-      // Python code may check for the precise string "timeout".
-      NTA_THROW << "timeout";
-    case ExitReason::Interrupt:
-      NTA_THROW << "interrupt";
-    case ExitReason::Completed:
-    default:
-      return result;
-  }
+  return result;
 }
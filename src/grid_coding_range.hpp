@@ -27,6 +27,13 @@
 #ifndef NTA_GRIDCODINGRANGE
 #define NTA_GRIDCODINGRANGE
 
+#include "cancellation_token.hpp"
+#include "matrix_list.hpp"
+#include "search_stats.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string>
 #include <vector>
 #include <utility>
 
@@ -58,16 +65,61 @@ namespace gridcodingrange
    * Output parameter. A point with grid code zero in this hyperrectangle. Only
    * populated if the function returns true.
    *
+   * @param parallelDepth
+   * If > 0, the top parallelDepth levels of the recursion become tasks on the
+   * shared work-stealing thread pool, and each task at that depth searches its
+   * subtree serially. The first task to find grid code zero cancels the rest.
+   * With 2^parallelDepth leaf tasks, a value a few levels above log2(number
+   * of cores) keeps every core busy. If 0, the whole search runs on the calling
+   * thread.
+   *
+   * @param timeout
+   * If > 0, give up after this many seconds and throw an exception with
+   * message "timeout".
+   *
+   * @param cancellationToken
+   * Optional. If the token is cancelled, the function stops and throws an
+   * exception with message "cancelled". If the token's deadline passes, the
+   * message is "timeout".
+   *
    * @return
    * true if grid code zero is found, false otherwise.
    */
   bool findGridCodeZero(
-      const std::vector<std::vector<std::vector<double>>> &domainToPlaneByModule,
-      const std::vector<std::vector<std::vector<double>>> &latticeBasisByModule,
+      const MatrixList &domainToPlaneByModule,
+      const MatrixList &latticeBasisByModule,
       const std::vector<double> &x0,
       const std::vector<double> &dims,
       double readoutResolution,
-      std::vector<double> *pointWithGridCodeZero = nullptr);
+      std::vector<double> *pointWithGridCodeZero = nullptr,
+      size_t parallelDepth = 0,
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr);
+
+  /**
+   * How computeCodingRange grows the scaledbox.
+   *
+   * The scale factors it tests form a grid that starts where the scaledbox
+   * first reaches past the ignorebox and grows by a factor of 1 + precision
+   * per step. The result is the largest grid factor below the nearest
+   * collision, so a smaller precision gives a tighter result.
+   *
+   * Each shell of the expansion spans one or more steps. While no collision
+   * has been found, each shell is twice as wide as the one before it, up to
+   * maxShellFactor. When a shell contains a collision, the collision's own
+   * scale factor bounds the result, and the steps between the shell's inner
+   * box and that bound are bisected until every step below the nearest
+   * collision has been searched.
+   *
+   * The default, one step per shell with a precision of 0.01, never bisects.
+   * Wider shells take fewer, larger steps when the coding range is many times
+   * the ignorebox.
+   */
+  struct ExpansionSchedule
+  {
+    double precision = 0.01;
+    double maxShellFactor = 1.01;
+  };
 
   /**
    * Given a set of grid cell module parameters, scale a k-dimensional box until
@@ -119,18 +171,233 @@ namespace gridcodingrange
    * How often, in seconds, the function should print its current status. If <=
    * 0, no printing will occur.
    *
+   * @param numThreads
+   * How many searches to run concurrently on the process-wide thread pool. If
+   * 0, use one per thread in the pool. See setNumThreads.
+   *
+   * @param timeout
+   * If > 0, every search stops after this many seconds, and the function
+   * throws an exception with message "timeout".
+   *
+   * @param cancellationToken
+   * Optional. If the token is cancelled, the function stops and throws an
+   * exception with message "cancelled". If the token's deadline passes, the
+   * message is "timeout".
+   *
+   * @param stats
+   * Optional output parameter. It's overwritten with counters describing the
+   * search. They're all 0 unless the library is built with
+   * GRIDCODINGRANGE_SEARCH_STATS. See SearchStats.
+   *
+   * @param schedule
+   * The scale factors to test. See ExpansionSchedule.
+   *
+   * @param captureInterrupts
+   * Whether SIGINT stops the function with an exception with message
+   * "interrupt", if interrupt capture is enabled. See setCaptureInterrupts.
+   * Pass false for calls that run in the background, so that SIGINT still
+   * reaches the program. Stop them with the cancellationToken instead.
+   *
    * @return
    * - The largest tested scaling factor of the scaledbox that contains no
        collisions.
    * - A point just outside this scaled scaledbox that collides with the origin.
    */
   std::pair<double, std::vector<double>> computeCodingRange(
-      const std::vector<std::vector<std::vector<double>>> &domainToPlaneByModule,
-      const std::vector<std::vector<std::vector<double>>> &latticeBasisByModule,
+      const MatrixList &domainToPlaneByModule,
+      const MatrixList &latticeBasisByModule,
       const std::vector<double> &scaledbox,
       const std::vector<double> &ignorebox,
       double readoutResolution,
-      double pingInterval = 10.0);
+      double pingInterval = 10.0,
+      size_t numThreads = 0,
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr,
+      SearchStats *stats = nullptr,
+      const ExpansionSchedule &schedule = ExpansionSchedule(),
+      bool captureInterrupts = true);
+
+  /**
+   * The arguments of one computeCodingRange call. The matrices aren't copied,
+   * so they must outlive the call.
+   */
+  struct CodingRangeQuery
+  {
+    MatrixList domainToPlaneByModule;
+    MatrixList latticeBasisByModule;
+    std::vector<double> scaledbox;
+    std::vector<double> ignorebox;
+    double readoutResolution;
+    ExpansionSchedule schedule = ExpansionSchedule();
+  };
+
+  /**
+   * Like computeCodingRange, but for many queries at once. Every query's
+   * searches are queued on the process-wide thread pool together, so short
+   * queries don't leave threads idle while they wait for each other, and the
+   * setup and teardown happen once.
+   *
+   * @param numThreadsPerQuery
+   * How many searches to run concurrently for each query. If 0, use one per
+   * thread in the pool.
+   *
+   * @param timeout
+   * If > 0, the time limit for the whole batch, in seconds.
+   *
+   * @param cancellationToken
+   * Optional. Cancelling it stops every query.
+   *
+   * @param captureInterrupts
+   * See computeCodingRange.
+   *
+   * @return
+   * One computeCodingRange result per query, in order.
+   */
+  std::vector<std::pair<double, std::vector<double>>> computeCodingRangeBatch(
+      const std::vector<CodingRangeQuery> &queries,
+      double pingInterval = 10.0,
+      size_t numThreadsPerQuery = 0,
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr,
+      bool captureInterrupts = true);
+
+  /**
+   * Like computeCodingRange, but it saves its progress to a checkpoint file
+   * periodically and once more when it stops, including when it times out, is
+   * cancelled or is interrupted. If the run is lost, resumeCodingRange picks
+   * it up from the last checkpoint.
+   *
+   * @param checkpointPath
+   * The checkpoint file. It's overwritten. Each save writes a temporary file
+   * next to it and renames it, so the checkpoint is never partially written.
+   *
+   * @param checkpointInterval
+   * How often, in seconds, to save the checkpoint. If <= 0, it's only saved
+   * when the search starts and stops.
+   *
+   * See computeCodingRange for the other parameters and the result.
+   */
+  std::pair<double, std::vector<double>> computeCodingRangeWithCheckpoints(
+      const MatrixList &domainToPlaneByModule,
+      const MatrixList &latticeBasisByModule,
+      const std::vector<double> &scaledbox,
+      const std::vector<double> &ignorebox,
+      double readoutResolution,
+      const std::string &checkpointPath,
+      double checkpointInterval = 600.0,
+      double pingInterval = 10.0,
+      size_t numThreads = 0,
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr);
+
+  /**
+   * Continue a computeCodingRangeWithCheckpoints run from its checkpoint file.
+   * The query is read from the file, and the search skips every expansion box
+   * that had been searched when the checkpoint was saved. It keeps saving
+   * checkpoints to the same file. Resuming a run that already finished
+   * returns its result.
+   *
+   * The numThreads, timeout and other parameters don't need to match the
+   * original run's. See computeCodingRangeWithCheckpoints.
+   */
+  std::pair<double, std::vector<double>> resumeCodingRange(
+      const std::string &checkpointPath,
+      double checkpointInterval = 600.0,
+      double pingInterval = 10.0,
+      size_t numThreads = 0,
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr);
+
+  /**
+   * Runs one computeCodingRange query on worker processes, possibly on other
+   * machines, so it can use more cores than one process has.
+   *
+   * The coordinator owns the expansion. It hands out work units, each a range
+   * of bins in one box of one orthant of one expansion shell, to the workers'
+   * threads over TCP. When a worker finds grid code zero, the coordinator
+   * tells every worker to stop its units at or above that scale factor. If a
+   * worker disconnects, its units are handed to someone else. The result is
+   * the same as computeCodingRange's.
+   *
+   * Start runCodingRangeWorker in each worker process, pointed at port(), and
+   * call run. Workers can connect before or during run. The workers and the
+   * coordinator must be built from the same version of this library.
+   *
+   * The port is unauthenticated and unencrypted. Anyone who can connect to it
+   * receives the query and can report false results, so only listen on a
+   * network where every peer is trusted.
+   */
+  class CodingRangeCoordinator
+  {
+  public:
+    /**
+     * Start listening. See computeCodingRange for the query parameters.
+     *
+     * @param host
+     * The address to listen on. Use "0.0.0.0" to accept workers from other
+     * machines, but only on a trusted network.
+     *
+     * @param port
+     * The port to listen on. If 0, the system chooses one. See port().
+     */
+    CodingRangeCoordinator(
+        const MatrixList &domainToPlaneByModule,
+        const MatrixList &latticeBasisByModule,
+        const std::vector<double> &scaledbox,
+        const std::vector<double> &ignorebox,
+        double readoutResolution,
+        const std::string &host = "127.0.0.1",
+        int port = 0);
+
+    ~CodingRangeCoordinator();
+
+    CodingRangeCoordinator(const CodingRangeCoordinator&) = delete;
+    CodingRangeCoordinator& operator=(const CodingRangeCoordinator&) = delete;
+
+    int port() const;
+
+    /**
+     * Coordinate the workers until the search finishes, then release them.
+     * The search waits for workers indefinitely, so use a timeout or a
+     * cancellationToken to give up.
+     *
+     * See computeCodingRange for the parameters and the result.
+     */
+    std::pair<double, std::vector<double>> run(
+        double pingInterval = 10.0,
+        double timeout = -1.0,
+        const CancellationToken *cancellationToken = nullptr);
+
+  private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+  };
+
+  /**
+   * Work on a CodingRangeCoordinator's search until it finishes. Call this in
+   * each worker process, on a thread that isn't in the thread pool.
+   *
+   * @param host
+   * @param port
+   * The coordinator's address.
+   *
+   * @param numThreads
+   * How many units to search concurrently, each on a thread of its own rather
+   * than on the process-wide thread pool. If 0, use as many as the pool has
+   * threads. Other computations in the same process compete with these
+   * threads for cores.
+   *
+   * @param timeout
+   * @param cancellationToken
+   * Optional. If the worker stops early, its unfinished units go to other
+   * workers. See computeCodingRange.
+   */
+  void runCodingRangeWorker(
+      const std::string &host,
+      int port,
+      size_t numThreads = 0,
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr);
 
   /**
    * Calls computeCodingRange with a unit cube scaledBox and cube ignore box.
@@ -145,16 +412,24 @@ namespace gridcodingrange
    * How often, in seconds, the function should print its current status. If <=
    * 0, no printing will occur.
    *
+   * @param timeout
+   * @param cancellationToken
+   * @param captureInterrupts
+   * Optional. See computeCodingRange.
+   *
    * @return
    * - The diameter of the hypercube that contains no collisions.
    * - A point just outside this hypercube that collides with the origin.
    */
   std::pair<double, std::vector<double>> computeGridUniquenessHypercube(
-      const std::vector<std::vector<std::vector<double>>> &domainToPlaneByModule,
-      const std::vector<std::vector<std::vector<double>>> &latticeBasisByModule,
+      const MatrixList &domainToPlaneByModule,
+      const MatrixList &latticeBasisByModule,
       double readoutResolution,
       double ignoredCenterDiameter,
-      double pingInterval = 10.0);
+      double pingInterval = 10.0,
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr,
+      bool captureInterrupts = true);
 
   /**
    * Compute the sidelength of the smallest hypercube that encloses the
@@ -186,16 +461,30 @@ namespace gridcodingrange
    * throws an exception with message "timeout". In Python this exception is of
    * type RuntimeError.
    *
+   * @param cancellationToken
+   * Optional. If the token is cancelled, the function stops and throws an
+   * exception with message "cancelled". If the token's deadline passes, the
+   * message is "timeout".
+   *
+   * @param stats
+   * Optional output parameter. See computeCodingRange.
+   *
+   * @param captureInterrupts
+   * See computeCodingRange.
+   *
    * @return
    * The sidelength of this hypercube. Returns -1.0 if a surface can't be found
    * (i.e. if upperBound is reached.)
    */
   double computeBinSidelength(
-      const std::vector<std::vector<std::vector<double>>> &domainToPlaneByModule,
+      const MatrixList &domainToPlaneByModule,
       double readoutResolution,
       double resultPrecision,
       double upperBound = 2048.0,
-      double timeout = -1.0);
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr,
+      SearchStats *stats = nullptr,
+      bool captureInterrupts = true);
 
   /**
    * Like computeBinSidelength, but it computes a hyperrectangle rather than a
@@ -227,17 +516,99 @@ namespace gridcodingrange
    * throws an exception with message "timeout". In Python this exception is of
    * type RuntimeError.
    *
+   * @param cancellationToken
+   * Optional. If the token is cancelled, the function stops and throws an
+   * exception with message "cancelled". If the token's deadline passes, the
+   * message is "timeout".
+   *
+   * @param stats
+   * Optional output parameter. See computeCodingRange.
+   *
+   * @param captureInterrupts
+   * See computeCodingRange.
+   *
    * @return
    * The dimensions of this hyperrectangle. Returns an empty vector if a surface
    * can't be found (i.e. if upperBound is reached.)
    */
   std::vector<double> computeBinRectangle(
-      const std::vector<std::vector<std::vector<double>>> &domainToPlaneByModule,
+      const MatrixList &domainToPlaneByModule,
       double readoutResolution,
       double resultPrecision,
       double upperBound = 2048.0,
-      double timeout = -1.0);
+      double timeout = -1.0,
+      const CancellationToken *cancellationToken = nullptr,
+      SearchStats *stats = nullptr,
+      bool captureInterrupts = true);
+
+
+  /**
+   * Set the number of threads in the process-wide thread pool that every
+   * parallel computation in this library shares. The pool is created on first
+   * use and reused after that.
+   *
+   * @param numThreads
+   * If 0, use the GRIDCODINGRANGE_NUM_THREADS environment variable, or one
+   * thread per hardware thread if it isn't set.
+   */
+  void setNumThreads(size_t numThreads);
+
+  /**
+   * Get the number of threads in the process-wide thread pool.
+   */
+  size_t getNumThreads();
+
+  /**
+   * Choose whether the computeCodingRange and computeBin* functions stop on
+   * SIGINT. If they do, they temporarily install a SIGINT handler and throw an
+   * exception with message "interrupt". This is on by default, mainly for
+   * Jupyter notebooks. Programs that handle signals themselves should turn it
+   * off and use a CancellationToken.
+   */
+  void setCaptureInterrupts(bool captureInterrupts);
+
+  bool getCaptureInterrupts();
+
+  /**
+   * The order in which computeCodingRange searches the boxes of each expansion
+   * step.
+   *
+   * DepthFirst splits each box along its widest dimension and searches the
+   * lower half before the upper half.
+   *
+   * BestFirst keeps the unresolved boxes in a priority queue. It always splits
+   * the box nearest to the origin, measured in scaledbox scale factors, and
+   * among equally near boxes, the one whose center is nearest to grid code
+   * zero in its worst module. If the queue grows too large, it searches the
+   * boxes it removes depth-first.
+   *
+   * BranchAndBound doesn't search step by step. It minimizes the scale factor
+   * of the collision directly, keeping every unsearched box outside the
+   * ignorebox in one priority queue ordered by the smallest scale factor that
+   * reaches it. Each box is searched depth-first for its nearest collision,
+   * and its subboxes that are much farther out go back in the queue. Boxes
+   * that can't beat the nearest collision so far are pruned, and the search
+   * ends when none are left. Checkpointed
+   * searches and runCodingRangeWorker search their steps depth-first instead.
+   *
+   * Every order computes the same coding range, but they may report different
+   * points with grid code zero.
+   */
+  enum class SearchOrder
+  {
+    DepthFirst,
+    BestFirst,
+    BranchAndBound
+  };
+
+  /**
+   * Choose the SearchOrder of later computeCodingRange calls in this process,
+   * including the units that runCodingRangeWorker searches. DepthFirst is the
+   * default.
+   */
+  void setSearchOrder(SearchOrder searchOrder);
 
+  SearchOrder getSearchOrder();
 
   /**
    * Intended for testing.
@@ -249,6 +620,23 @@ namespace gridcodingrange
    */
   void setCheckPolygonThreshold(double threshold);
 
+  /**
+   * Experimental. Choose the resolution of the torus occupancy bitmaps that
+   * later searches in this process precompute for each module (see
+   * TorusOccupancy). A small shadow that's far from every lattice point is
+   * then ruled out with one lookup rather than by enumerating lattice points.
+   * Higher resolutions rule out more shadows and take longer to precompute.
+   * 0, the default, disables the bitmaps, and the searches skip the lookups
+   * entirely. The exact lattice point enumerator already rejects these
+   * shadows cheaply, so on the benchmarks the bitmaps don't pay for
+   * themselves.
+   */
+  void setTorusOccupancyResolution(size_t resolution);
+
+  size_t getTorusOccupancyResolution();
+
+  void resetTorusOccupancyResolution();
+
 } // end namespace gridcodingrange
 
 #endif // NTA_GRIDCODINGRANGE
@@ -0,0 +1,240 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef NTA_LATTICE_POINT_ENUMERATOR_HPP
+#define NTA_LATTICE_POINT_ENUMERATOR_HPP
+
+#include "module_set.hpp"
+#include "search_stats.hpp"
+
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+inline std::pair<double,double> transform2D(const SquareMatrix2D<double>& M,
+                                            std::pair<double,double> p)
+{
+  return {M.v00*p.first + M.v01*p.second,
+          M.v10*p.first + M.v11*p.second};
+}
+
+
+/**
+ * The range of lattice columns i that a padded rectangle spans, in the
+ * lattice's basis.
+ */
+struct LatticeBox {
+  double xmin;
+  double xmax;
+};
+
+/**
+ * Enumerate the points of a lattice near or within a specified rectangle. This
+ * is equivalent to checking whether any circles centered on the points of a
+ * lattice overlap the rectangle.
+ *
+ * Every point within distance r of the rectangle lies inside the rectangle
+ * padded by r. For each lattice column i, the points i*b0 + j*b1 in that
+ * padded rectangle form one contiguous range of j, which we compute in closed
+ * form by intersecting the column's line with the padded rectangle's x and y
+ * slabs. The enumerator walks exactly these candidates, column by column, and
+ * tests each one's distance to the rectangle.
+ */
+class LatticePointEnumerator
+{
+public:
+  LatticePointEnumerator(const SquareMatrix2D<double>& latticeBasis,
+                         const SquareMatrix2D<double>& inverseLatticeBasis,
+                         const LatticeBox& cachedLatticeBox,
+                         const std::pair<double,double>& shift,
+                         double left, double right, double bottom, double top,
+                         double r, double rSquared)
+    :latticeBasis_(latticeBasis), left_(left), right_(right), bottom_(bottom),
+     top_(top), rSquared_(rSquared), columnX_(0), columnY_(0)
+  {
+    const double iShift = (inverseLatticeBasis.v00*shift.first +
+                           inverseLatticeBasis.v01*shift.second);
+    initialize_(ceil(cachedLatticeBox.xmin + iShift),
+                floor(cachedLatticeBox.xmax + iShift), r);
+  }
+
+  LatticePointEnumerator(const SquareMatrix2D<double>& latticeBasis,
+                         const SquareMatrix2D<double>& inverseLatticeBasis,
+                         double left, double right, double bottom, double top,
+                         double r, double rSquared)
+    :latticeBasis_(latticeBasis), left_(left), right_(right), bottom_(bottom),
+     top_(top), rSquared_(rSquared), columnX_(0), columnY_(0)
+  {
+    const LatticeBox latticeBox = computeLatticeBox(
+      inverseLatticeBasis, left - r, right + r, bottom - r, top + r);
+    initialize_(ceil(latticeBox.xmin), floor(latticeBox.xmax), r);
+  }
+
+  /**
+   * Find the range of lattice columns that a rectangle spans. The lattice
+   * coordinate i is linear in x and y, so its extremes are at the corners that
+   * the signs of the inverse basis's first row pick out.
+   */
+  static LatticeBox computeLatticeBox(
+    const SquareMatrix2D<double>& inverseLatticeBasis,
+    double left, double right, double bottom, double top)
+  {
+    const double w0 = inverseLatticeBasis.v00;
+    const double w1 = inverseLatticeBasis.v01;
+    return {w0*(w0 >= 0 ? left : right) + w1*(w1 >= 0 ? bottom : top),
+            w0*(w0 >= 0 ? right : left) + w1*(w1 >= 0 ? top : bottom)};
+  }
+
+  bool getNext(std::pair<double,double> *out)
+  {
+    do
+    {
+      for (; j_ <= jMax_; j_++)
+      {
+        SEARCH_STATS(numLatticePoints++);
+
+        const double x = columnX_ + latticeBasis_.v01*j_;
+        const double y = columnY_ + latticeBasis_.v11*j_;
+        const double dx = x - std::max(left_, std::min(x, right_));
+        const double dy = y - std::max(bottom_, std::min(y, top_));
+
+        if (dx*dx + dy*dy <= rSquared_)
+        {
+          *out = {x, y};
+          j_++;
+          return true;
+        }
+      }
+    } while (nextColumn_());
+
+    return false;
+  }
+
+  void restart()
+  {
+    i_ = iMin_ - 1;
+    j_ = 1;
+    jMax_ = 0;
+  }
+
+private:
+
+  /**
+   * The j values for which a + j*c lies in [lo, hi], as a closed interval.
+   * Returns false if there are none.
+   */
+  static bool slab_(double a, double c, double lo, double hi,
+                    double *jLo, double *jHi)
+  {
+    if (c > 0)
+    {
+      *jLo = (lo - a) / c;
+      *jHi = (hi - a) / c;
+    }
+    else if (c < 0)
+    {
+      *jLo = (hi - a) / c;
+      *jHi = (lo - a) / c;
+    }
+    else
+    {
+      *jLo = std::numeric_limits<double>::lowest();
+      *jHi = std::numeric_limits<double>::max();
+      return lo <= a && a <= hi;
+    }
+
+    return true;
+  }
+
+  void initialize_(long long iMin, long long iMax, double r)
+  {
+    // Pad slightly more than r so that rounding in the slab intersections
+    // never drops a point on the edge of the padded rectangle. Extra
+    // candidates are rejected by the exact distance test.
+    const double padding = r + PaddingSlack*(1.0 + r);
+    paddedLeft_ = left_ - padding;
+    paddedRight_ = right_ + padding;
+    paddedBottom_ = bottom_ - padding;
+    paddedTop_ = top_ + padding;
+
+    iMin_ = iMin;
+    iMax_ = iMax;
+    restart();
+  }
+
+  /**
+   * Advance to the next column whose range of j is nonempty.
+   */
+  bool nextColumn_()
+  {
+    while (++i_ <= iMax_)
+    {
+      columnX_ = latticeBasis_.v00*i_;
+      columnY_ = latticeBasis_.v10*i_;
+
+      double jLoX, jHiX, jLoY, jHiY;
+      if (slab_(columnX_, latticeBasis_.v01, paddedLeft_, paddedRight_,
+                &jLoX, &jHiX) &&
+          slab_(columnY_, latticeBasis_.v11, paddedBottom_, paddedTop_,
+                &jLoY, &jHiY))
+      {
+        const double jLo = ceil(std::max(jLoX, jLoY));
+        const double jHi = floor(std::min(jHiX, jHiY));
+        if (jLo <= jHi)
+        {
+          j_ = jLo;
+          jMax_ = jHi;
+          return true;
+        }
+      }
+    }
+
+    return false;
+  }
+
+  static constexpr double PaddingSlack = 1e-9;
+
+  const SquareMatrix2D<double>& latticeBasis_;
+  const double left_;
+  const double right_;
+  const double bottom_;
+  const double top_;
+  const double rSquared_;
+
+  double paddedLeft_;
+  double paddedRight_;
+  double paddedBottom_;
+  double paddedTop_;
+
+  double columnX_;
+  double columnY_;
+
+  long long iMin_;
+  long long iMax_;
+  long long i_;
+  long long j_;
+  long long jMax_;
+};
+
+#endif // NTA_LATTICE_POINT_ENUMERATOR_HPP
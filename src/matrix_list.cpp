@@ -0,0 +1,77 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#include "matrix_list.hpp"
+#include <nta_logging.hpp>
+
+using std::vector;
+
+namespace gridcodingrange
+{
+  MatrixList::MatrixList(const vector<vector<vector<double>>> &matrices)
+    : vectors_(&matrices), data_(nullptr), numMatrices_(matrices.size()),
+      numRows_(0), numCols_(0), matrixStride_(0), rowStride_(0),
+      colStride_(0)
+  {
+    if (numMatrices_ > 0)
+    {
+      numRows_ = matrices[0].size();
+      numCols_ = (numRows_ > 0) ? matrices[0][0].size() : 0;
+    }
+
+    for (const vector<vector<double>> &matrix : matrices)
+    {
+      NTA_CHECK(matrix.size() == numRows_)
+        << "Every matrix should have the same number of rows. "
+        << "Expected: " << numRows_ << " Actual: " << matrix.size();
+
+      for (const vector<double> &r : matrix)
+      {
+        NTA_CHECK(r.size() == numCols_)
+          << "Every matrix should have the same number of columns. "
+          << "Expected: " << numCols_ << " Actual: " << r.size();
+      }
+    }
+  }
+
+  MatrixList::MatrixList(const void *data, size_t numMatrices, size_t numRows,
+                         size_t numCols, ptrdiff_t matrixStride,
+                         ptrdiff_t rowStride, ptrdiff_t colStride)
+    : vectors_(nullptr), data_(static_cast<const char*>(data)),
+      numMatrices_(numMatrices), numRows_(numRows), numCols_(numCols),
+      matrixStride_(matrixStride), rowStride_(rowStride),
+      colStride_(colStride)
+  {
+  }
+
+  vector<double> MatrixList::row(size_t iMatrix, size_t iRow) const
+  {
+    vector<double> v(numCols_);
+    for (size_t col = 0; col < numCols_; col++)
+    {
+      v[col] = (*this)(iMatrix, iRow, col);
+    }
+
+    return v;
+  }
+}
@@ -0,0 +1,98 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#ifndef NTA_MATRIX_LIST_HPP
+#define NTA_MATRIX_LIST_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace gridcodingrange
+{
+  /**
+   * A read-only list of equally-shaped matrices, e.g. one per module.
+   *
+   * It either refers to nested std::vectors or views a strided buffer such as
+   * a NumPy array, so Python callers don't need to copy their arrays into
+   * nested vectors. It never owns the data, so the data must outlive it.
+   */
+  class MatrixList
+  {
+  public:
+    /**
+     * Refer to a list of matrices stored as nested std::vectors.
+     */
+    MatrixList(
+      const std::vector<std::vector<std::vector<double>>> &matrices);
+
+    /**
+     * View a strided 3D buffer of doubles. The strides are in bytes.
+     */
+    MatrixList(const void *data, size_t numMatrices, size_t numRows,
+               size_t numCols, ptrdiff_t matrixStride, ptrdiff_t rowStride,
+               ptrdiff_t colStride);
+
+    size_t size() const
+    {
+      return numMatrices_;
+    }
+
+    size_t numRows() const
+    {
+      return numRows_;
+    }
+
+    size_t numCols() const
+    {
+      return numCols_;
+    }
+
+    double operator()(size_t iMatrix, size_t row, size_t col) const
+    {
+      if (vectors_ != nullptr)
+      {
+        return (*vectors_)[iMatrix][row][col];
+      }
+
+      return *reinterpret_cast<const double*>(
+        data_ + iMatrix*matrixStride_ + row*rowStride_ + col*colStride_);
+    }
+
+    /**
+     * Copy out a row, e.g. for logging.
+     */
+    std::vector<double> row(size_t iMatrix, size_t iRow) const;
+
+  private:
+    const std::vector<std::vector<std::vector<double>>> *vectors_;
+    const char *data_;
+    size_t numMatrices_;
+    size_t numRows_;
+    size_t numCols_;
+    ptrdiff_t matrixStride_;
+    ptrdiff_t rowStride_;
+    ptrdiff_t colStride_;
+  };
+} // end namespace gridcodingrange
+
+#endif // NTA_MATRIX_LIST_HPP
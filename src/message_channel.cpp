@@ -0,0 +1,360 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#include "message_channel.hpp"
+#include <nta_logging.hpp>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+using std::string;
+
+namespace {
+  // Anything longer is a protocol error, not a real message.
+  const uint64_t MaxMessageSize = 1 << 26;
+
+  // A non-blocking receive reads at most this much at a time, so that a peer
+  // can't make it allocate a whole message that it never sends.
+  const size_t ReceiveChunkSize = 1 << 16;
+
+#ifdef MSG_NOSIGNAL
+  // A peer that disconnects shouldn't kill this process with SIGPIPE.
+  const int SendFlags = MSG_NOSIGNAL;
+#else
+  const int SendFlags = 0;
+#endif
+
+  void configureSocket(int fd)
+  {
+    const int one = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    // Messages are small and each one waits for a reply.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  /**
+   * @param timeoutMs
+   * For non-blocking sockets, how long to wait for the peer to make room.
+   */
+  bool sendAll(int fd, const char *data, size_t size, int timeoutMs)
+  {
+    while (size > 0)
+    {
+      const ssize_t sent = ::send(fd, data, size, SendFlags);
+      if (sent < 0)
+      {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          pollfd p;
+          p.fd = fd;
+          p.events = POLLOUT;
+          p.revents = 0;
+          if (poll(&p, 1, timeoutMs) > 0) continue;
+        }
+        return false;
+      }
+      data += sent;
+      size -= sent;
+    }
+    return true;
+  }
+
+  bool receiveAll(int fd, char *data, size_t size)
+  {
+    while (size > 0)
+    {
+      const ssize_t received = ::recv(fd, data, size, 0);
+      if (received < 0)
+      {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      if (received == 0)
+      {
+        return false;
+      }
+      data += received;
+      size -= received;
+    }
+    return true;
+  }
+
+  struct AddrInfoRAII
+  {
+    AddrInfoRAII(const string& host, int port, bool passive)
+      : result(nullptr)
+    {
+      addrinfo hints;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if (passive)
+      {
+        hints.ai_flags = AI_PASSIVE;
+      }
+
+      const string service = std::to_string(port);
+      const int error = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                                    service.c_str(), &hints, &result);
+      NTA_CHECK(error == 0)
+        << "Can't resolve " << host << ":" << port << ": "
+        << gai_strerror(error);
+    }
+
+    ~AddrInfoRAII()
+    {
+      freeaddrinfo(result);
+    }
+
+    addrinfo *result;
+  };
+}
+
+void Message::write_(const void *data, size_t size)
+{
+  const char *bytes = static_cast<const char*>(data);
+  bytes_.insert(bytes_.end(), bytes, bytes + size);
+}
+
+void Message::read_(void *data, size_t size)
+{
+  NTA_CHECK(size <= bytes_.size() - readPos_)
+    << "Message is too short";
+  memcpy(data, bytes_.data() + readPos_, size);
+  readPos_ += size;
+}
+
+MessageChannel::MessageChannel(int fd)
+  : fd_(fd),
+    sendTimeoutMs_(-1),
+    incomingSize_(0),
+    hasIncomingSize_(false)
+{
+  configureSocket(fd_);
+}
+
+MessageChannel::~MessageChannel()
+{
+  close(fd_);
+}
+
+std::unique_ptr<MessageChannel> MessageChannel::connect(const string& host,
+                                                        int port)
+{
+  AddrInfoRAII addresses(host, port, false);
+
+  for (addrinfo *address = addresses.result; address != nullptr;
+       address = address->ai_next)
+  {
+    const int fd = socket(address->ai_family, address->ai_socktype,
+                          address->ai_protocol);
+    if (fd < 0) continue;
+
+    if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+    {
+      return std::unique_ptr<MessageChannel>(new MessageChannel(fd));
+    }
+
+    close(fd);
+  }
+
+  NTA_THROW << "Can't connect to " << host << ":" << port << ": "
+            << strerror(errno);
+}
+
+void MessageChannel::setNonBlocking(int sendTimeoutMs)
+{
+  const int flags = fcntl(fd_, F_GETFL, 0);
+  NTA_CHECK(flags >= 0 && fcntl(fd_, F_SETFL, flags | O_NONBLOCK) == 0)
+    << "Can't make a socket non-blocking: " << strerror(errno);
+  sendTimeoutMs_ = sendTimeoutMs;
+}
+
+bool MessageChannel::send(const Message& message)
+{
+  Message header;
+  header.writeU64(message.bytes().size());
+  return (sendAll(fd_, header.bytes().data(), header.bytes().size(),
+                  sendTimeoutMs_) &&
+          sendAll(fd_, message.bytes().data(), message.bytes().size(),
+                  sendTimeoutMs_));
+}
+
+bool MessageChannel::receive(Message& message)
+{
+  Message header;
+  header.bytes().resize(sizeof(uint64_t));
+  if (!receiveAll(fd_, header.bytes().data(), header.bytes().size()))
+  {
+    return false;
+  }
+
+  const uint64_t size = header.readU64();
+
+  if (size > MaxMessageSize)
+  {
+    NTA_WARN << "Dropping a connection that sent a " << size
+             << " byte message";
+    return false;
+  }
+
+  message.clear();
+  message.bytes().resize(size);
+  return receiveAll(fd_, message.bytes().data(), size);
+}
+
+bool MessageChannel::receiveAvailable(Message& message, bool *complete)
+{
+  *complete = false;
+
+  while (true)
+  {
+    // Read the length prefix, then the body, never past the end of this
+    // message.
+    const uint64_t target = hasIncomingSize_ ? incomingSize_ : sizeof(uint64_t);
+    const size_t offset = incoming_.size();
+    if (offset < target)
+    {
+      const size_t size = std::min<uint64_t>(target - offset, ReceiveChunkSize);
+      incoming_.resize(offset + size);
+      const ssize_t received = ::recv(fd_, incoming_.data() + offset, size, 0);
+      incoming_.resize(offset + std::max<ssize_t>(received, 0));
+      if (received < 0)
+      {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      if (received == 0)
+      {
+        return false;
+      }
+      continue;
+    }
+
+    if (!hasIncomingSize_)
+    {
+      Message header;
+      header.bytes().swap(incoming_);
+      incomingSize_ = header.readU64();
+      if (incomingSize_ > MaxMessageSize)
+      {
+        NTA_WARN << "Dropping a connection that sent a " << incomingSize_
+                 << " byte message";
+        return false;
+      }
+      hasIncomingSize_ = true;
+      continue;
+    }
+
+    message.clear();
+    message.bytes().swap(incoming_);
+    incoming_.clear();
+    hasIncomingSize_ = false;
+    *complete = true;
+    return true;
+  }
+}
+
+bool MessageChannel::waitReadable(int timeoutMs)
+{
+  pollfd p;
+  p.fd = fd_;
+  p.events = POLLIN;
+  p.revents = 0;
+  return poll(&p, 1, timeoutMs) > 0;
+}
+
+void MessageChannel::shutdown()
+{
+  ::shutdown(fd_, SHUT_RDWR);
+}
+
+MessageListener::MessageListener(const string& host, int port)
+  : fd_(-1),
+    port_(port)
+{
+  AddrInfoRAII addresses(host, port, true);
+
+  for (addrinfo *address = addresses.result; address != nullptr;
+       address = address->ai_next)
+  {
+    const int fd = socket(address->ai_family, address->ai_socktype,
+                          address->ai_protocol);
+    if (fd < 0) continue;
+
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // A connection can be dropped between poll and accept, so don't let
+    // accept block.
+    if (bind(fd, address->ai_addr, address->ai_addrlen) == 0 &&
+        listen(fd, SOMAXCONN) == 0 &&
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == 0)
+    {
+      fd_ = fd;
+      break;
+    }
+
+    close(fd);
+  }
+
+  NTA_CHECK(fd_ >= 0)
+    << "Can't listen on " << host << ":" << port << ": " << strerror(errno);
+
+  sockaddr_storage bound;
+  socklen_t boundSize = sizeof(bound);
+  NTA_CHECK(getsockname(fd_, reinterpret_cast<sockaddr*>(&bound),
+                        &boundSize) == 0);
+  port_ = ntohs(bound.ss_family == AF_INET6
+                ? reinterpret_cast<sockaddr_in6*>(&bound)->sin6_port
+                : reinterpret_cast<sockaddr_in*>(&bound)->sin_port);
+}
+
+MessageListener::~MessageListener()
+{
+  close(fd_);
+}
+
+std::unique_ptr<MessageChannel> MessageListener::accept()
+{
+  const int fd = ::accept(fd_, nullptr, nullptr);
+  if (fd < 0)
+  {
+    return nullptr;
+  }
+
+  return std::unique_ptr<MessageChannel>(new MessageChannel(fd));
+}
@@ -0,0 +1,256 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+/** @file
+ * Length-prefixed messages over TCP sockets, for sharding a search across
+ * processes
+ */
+
+#ifndef NTA_MESSAGE_CHANNEL_HPP
+#define NTA_MESSAGE_CHANNEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A message is a sequence of fixed-size values, each stored little-endian
+ * regardless of the host's byte order. Values are read back in the order they
+ * were written.
+ */
+class Message
+{
+public:
+  Message()
+    : readPos_(0)
+  {
+  }
+
+  void clear()
+  {
+    bytes_.clear();
+    readPos_ = 0;
+  }
+
+  void writeU64(uint64_t v)
+  {
+    unsigned char bytes[sizeof(v)];
+    for (size_t i = 0; i < sizeof(v); i++)
+    {
+      bytes[i] = static_cast<unsigned char>(v >> (8*i));
+    }
+    write_(bytes, sizeof(v));
+  }
+
+  void writeF64(double v)
+  {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(v));
+    writeU64(bits);
+  }
+
+  void writeF64s(const double values[], size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      writeF64(values[i]);
+    }
+  }
+
+  uint64_t readU64()
+  {
+    unsigned char bytes[sizeof(uint64_t)];
+    read_(bytes, sizeof(bytes));
+    uint64_t v = 0;
+    for (size_t i = 0; i < sizeof(bytes); i++)
+    {
+      v |= static_cast<uint64_t>(bytes[i]) << (8*i);
+    }
+    return v;
+  }
+
+  double readF64()
+  {
+    const uint64_t bits = readU64();
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+
+  void readF64s(double values[], size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      values[i] = readF64();
+    }
+  }
+
+  /**
+   * The number of bytes that haven't been read yet.
+   */
+  size_t bytesLeft() const
+  {
+    return bytes_.size() - readPos_;
+  }
+
+  std::vector<char>& bytes()
+  {
+    return bytes_;
+  }
+
+  const std::vector<char>& bytes() const
+  {
+    return bytes_;
+  }
+
+private:
+  void write_(const void *data, size_t size);
+  void read_(void *data, size_t size);
+
+  std::vector<char> bytes_;
+  size_t readPos_;
+};
+
+/**
+ * A connected TCP socket that sends and receives whole Messages. It isn't
+ * thread-safe, but one thread can send while another receives.
+ */
+class MessageChannel
+{
+public:
+  /**
+   * Take ownership of a connected socket.
+   */
+  explicit MessageChannel(int fd);
+  ~MessageChannel();
+
+  MessageChannel(const MessageChannel&) = delete;
+  MessageChannel& operator=(const MessageChannel&) = delete;
+
+  static std::unique_ptr<MessageChannel> connect(const std::string& host,
+                                                 int port);
+
+  int fd() const
+  {
+    return fd_;
+  }
+
+  /**
+   * Stop blocking on a peer that stalls. Afterward, receive with
+   * receiveAvailable rather than receive, and a send fails if the peer leaves
+   * no room for sendTimeoutMs milliseconds.
+   */
+  void setNonBlocking(int sendTimeoutMs);
+
+  /**
+   * @return
+   * false if the connection is broken.
+   */
+  bool send(const Message& message);
+
+  /**
+   * Block until a whole message arrives.
+   *
+   * @return
+   * false if the connection is closed or broken.
+   */
+  bool receive(Message& message);
+
+  /**
+   * Read whatever has arrived without blocking, and keep a partial message
+   * for the next call. Call this until it stops completing messages.
+   *
+   * @param complete
+   * Set to true if message now holds a whole message.
+   *
+   * @return
+   * false if the connection is closed or broken.
+   */
+  bool receiveAvailable(Message& message, bool *complete);
+
+  /**
+   * @return
+   * true if data or a disconnection arrives within timeoutMs milliseconds.
+   */
+  bool waitReadable(int timeoutMs);
+
+  /**
+   * Disconnect now, before the channel is destroyed. Later sends fail.
+   */
+  void shutdown();
+
+private:
+  int fd_;
+  int sendTimeoutMs_;
+
+  // A partially received message. While hasIncomingSize_ is false, incoming_
+  // holds part of the length prefix.
+  std::vector<char> incoming_;
+  uint64_t incomingSize_;
+  bool hasIncomingSize_;
+};
+
+/**
+ * A listening TCP socket.
+ */
+class MessageListener
+{
+public:
+  /**
+   * @param port
+   * If 0, the system chooses a free port. See port().
+   */
+  MessageListener(const std::string& host, int port);
+  ~MessageListener();
+
+  MessageListener(const MessageListener&) = delete;
+  MessageListener& operator=(const MessageListener&) = delete;
+
+  int fd() const
+  {
+    return fd_;
+  }
+
+  int port() const
+  {
+    return port_;
+  }
+
+  /**
+   * Accept a pending connection without blocking. Call this when fd() is
+   * readable.
+   *
+   * @return
+   * nullptr if the connection was dropped before it was accepted.
+   */
+  std::unique_ptr<MessageChannel> accept();
+
+private:
+  int fd_;
+  int port_;
+};
+
+#endif // NTA_MESSAGE_CHANNEL_HPP
@@ -0,0 +1,289 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+#include "module_set.hpp"
+#include <nta_logging.hpp>
+
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+using gridcodingrange::MatrixList;
+
+SquareMatrix2D<double> invert2DMatrix(const SquareMatrix2D<double>& M)
+{
+  const double detInv = 1 / (M.v00*M.v11 - M.v01*M.v10);
+  return {detInv*M.v11, -detInv*M.v01,
+          -detInv*M.v10, detInv*M.v00};
+}
+
+SquareMatrix2D<double> reduce2DLatticeBasis(const SquareMatrix2D<double>& M)
+{
+  // Tolerate rounding error so that bases which are reduced on paper, like the
+  // hexagonal basis with |u.v| == |u|^2/2, aren't needlessly rewritten.
+  const double tolerance = 1e-9;
+
+  std::pair<double,double> u = {M.v00, M.v10};
+  std::pair<double,double> v = {M.v01, M.v11};
+  double uu = u.first*u.first + u.second*u.second;
+  double vv = v.first*v.first + v.second*v.second;
+  double uv = u.first*v.first + u.second*v.second;
+
+  if (fabs(uv) <= 0.5*std::min(uu, vv)*(1 + tolerance))
+  {
+    if (uv >= 0)
+    {
+      return M;
+    }
+
+    return {M.v00, -M.v01,
+            M.v10, -M.v11};
+  }
+
+  if (vv < uu)
+  {
+    std::swap(u, v);
+    std::swap(uu, vv);
+  }
+
+  while (true)
+  {
+    // Subtract the nearest integer multiple of the shorter vector.
+    const double mu = round(uv / uu);
+    v.first -= mu*u.first;
+    v.second -= mu*u.second;
+    vv = v.first*v.first + v.second*v.second;
+
+    if (vv >= uu*(1 - tolerance))
+    {
+      break;
+    }
+
+    std::swap(u, v);
+    std::swap(uu, vv);
+    uv = u.first*v.first + u.second*v.second;
+  }
+
+  if (u.first*v.first + u.second*v.second < 0)
+  {
+    v = {-v.first, -v.second};
+  }
+
+  return {u.first, v.first,
+          u.second, v.second};
+}
+
+LatticeKind classifyLatticeBasis(const SquareMatrix2D<double>& M)
+{
+  const double tolerance = 1e-9;
+
+  const double uu = M.v00*M.v00 + M.v10*M.v10;
+  const double vv = M.v01*M.v01 + M.v11*M.v11;
+  const double uv = M.v00*M.v01 + M.v10*M.v11;
+
+  if (fabs(uu - vv) > tolerance*uu)
+  {
+    return LatticeKind::General;
+  }
+
+  if (fabs(uv) <= tolerance*uu)
+  {
+    return LatticeKind::Square;
+  }
+
+  if (fabs(uv - 0.5*uu) <= tolerance*uu)
+  {
+    return LatticeKind::Hexagonal;
+  }
+
+  return LatticeKind::General;
+}
+
+TorusOccupancy::TorusOccupancy()
+  : inverseLatticeBasis_({0, 0, 0, 0}), resolution_(0)
+{
+}
+
+TorusOccupancy::TorusOccupancy(
+  const SquareMatrix2D<double>& latticeBasis,
+  const SquareMatrix2D<double>& inverseLatticeBasis,
+  double r, size_t resolution)
+  : inverseLatticeBasis_(inverseLatticeBasis), resolution_(resolution)
+{
+  NTA_ASSERT(resolution > 0);
+
+  const size_t numCells = resolution*resolution;
+
+  // Every point of a cell is within half of its longer diagonal of its center.
+  const double du0 = latticeBasis.v00 / resolution;
+  const double du1 = latticeBasis.v10 / resolution;
+  const double dv0 = latticeBasis.v01 / resolution;
+  const double dv1 = latticeBasis.v11 / resolution;
+  const double cellDiagonal = std::max(hypot(du0 + dv0, du1 + dv1),
+                                       hypot(du0 - dv0, du1 - dv1));
+
+  std::vector<double> dByCell(numCells);
+  double dMax = 0;
+  for (size_t ib = 0; ib < resolution; ib++)
+  {
+    for (size_t ia = 0; ia < resolution; ia++)
+    {
+      const double a = (ia + 0.5) / resolution;
+      const double b = (ib + 0.5) / resolution;
+      const double x = latticeBasis.v00*a + latticeBasis.v01*b;
+      const double y = latticeBasis.v10*a + latticeBasis.v11*b;
+
+      double dSquared = std::numeric_limits<double>::max();
+      for (int i = 0; i <= 1; i++)
+      {
+        for (int j = 0; j <= 1; j++)
+        {
+          const double dx = x - (latticeBasis.v00*i + latticeBasis.v01*j);
+          const double dy = y - (latticeBasis.v10*i + latticeBasis.v11*j);
+          dSquared = std::min(dSquared, dx*dx + dy*dy);
+        }
+      }
+
+      dByCell[ib*resolution + ia] = sqrt(dSquared);
+      dMax = std::max(dMax, dByCell[ib*resolution + ia]);
+    }
+  }
+
+  // Leave some slack for rounding.
+  const double slack = 1e-9*(1.0 + r);
+  for (double radius = cellDiagonal;
+       r + cellDiagonal/2 + radius + slack < dMax;
+       radius *= 2)
+  {
+    const size_t level = radiusSquared_.size();
+    radiusSquared_.push_back(radius*radius);
+    far_.resize(((level + 1)*numCells + 63) / 64, 0);
+
+    const double threshold = r + cellDiagonal/2 + radius + slack;
+    for (size_t iCell = 0; iCell < numCells; iCell++)
+    {
+      if (dByCell[iCell] > threshold)
+      {
+        const size_t iBit = level*numCells + iCell;
+        far_[iBit / 64] |= (uint64_t)1 << (iBit % 64);
+      }
+    }
+  }
+}
+
+ModuleSet::ModuleSet(
+  const MatrixList &domainToPlaneByModule,
+  const MatrixList &latticeBasisByModule)
+{
+  NTA_ASSERT(domainToPlaneByModule.size() == latticeBasisByModule.size());
+  NTA_ASSERT(latticeBasisByModule.numRows() == 2);
+  NTA_ASSERT(latticeBasisByModule.numCols() == 2);
+
+  initialize_(domainToPlaneByModule);
+
+  for (size_t iModule = 0; iModule < numModules_; iModule++)
+  {
+    this->latticeBasis(iModule) = {
+      latticeBasisByModule(iModule, 0, 0), latticeBasisByModule(iModule, 0, 1),
+      latticeBasisByModule(iModule, 1, 0), latticeBasisByModule(iModule, 1, 1)
+    };
+  }
+
+  updateInverseLatticeBases();
+}
+
+ModuleSet::ModuleSet(const MatrixList &domainToPlaneByModule)
+{
+  initialize_(domainToPlaneByModule);
+
+  for (size_t iModule = 0; iModule < numModules_; iModule++)
+  {
+    this->latticeBasis(iModule) = {1, 0,
+                                   0, 1};
+  }
+
+  updateInverseLatticeBases();
+}
+
+void ModuleSet::initialize_(const MatrixList &domainToPlaneByModule)
+{
+  NTA_ASSERT(domainToPlaneByModule.size() == 0 ||
+             domainToPlaneByModule.numRows() == 2);
+
+  numModules_ = domainToPlaneByModule.size();
+  numDims_ = domainToPlaneByModule.numCols();
+
+  // Round each record up to a whole number of cache lines.
+  recordSize_ = DomainToPlaneOffset + 2*numDims_;
+  recordSize_ = ((recordSize_ + CacheLineDoubles - 1) / CacheLineDoubles) *
+    CacheLineDoubles;
+
+  buffer_.assign(numModules_*recordSize_, 0.0);
+
+  for (size_t iModule = 0; iModule < numModules_; iModule++)
+  {
+    double *out = domainToPlane(iModule);
+    for (size_t iDim = 0; iDim < numDims_; iDim++)
+    {
+      out[iDim] = domainToPlaneByModule(iModule, 0, iDim);
+      out[numDims_ + iDim] = domainToPlaneByModule(iModule, 1, iDim);
+    }
+  }
+}
+
+void ModuleSet::updateInverseLatticeBases()
+{
+  latticeKind_ = LatticeKind::General;
+  hasTorusOccupancy_ = false;
+  torusOccupancy_.assign(numModules_, TorusOccupancy());
+
+  for (size_t iModule = 0; iModule < numModules_; iModule++)
+  {
+    *reinterpret_cast<SquareMatrix2D<double>*>(
+      record_(iModule) + InverseLatticeBasisOffset) =
+      invert2DMatrix(latticeBasis(iModule));
+
+    const LatticeKind kind = classifyLatticeBasis(latticeBasis(iModule));
+    if (iModule == 0)
+    {
+      latticeKind_ = kind;
+    }
+    else if (kind != latticeKind_)
+    {
+      latticeKind_ = LatticeKind::General;
+    }
+  }
+}
+
+void ModuleSet::buildTorusOccupancy(double r, size_t resolution)
+{
+  hasTorusOccupancy_ = (resolution > 0);
+  for (size_t iModule = 0; iModule < numModules_; iModule++)
+  {
+    torusOccupancy_[iModule] = (resolution > 0)
+      ? TorusOccupancy(latticeBasis(iModule), inverseLatticeBasis(iModule), r,
+                       resolution)
+      : TorusOccupancy();
+  }
+}
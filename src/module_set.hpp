@@ -0,0 +1,433 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef NTA_MODULE_SET_HPP
+#define NTA_MODULE_SET_HPP
+
+#include <stdlib.h>
+
+#include "matrix_list.hpp"
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template<typename T>
+struct SquareMatrix2D {
+  T v00;
+  T v01;
+  T v10;
+  T v11;
+};
+
+SquareMatrix2D<double> invert2DMatrix(const SquareMatrix2D<double>& M);
+
+/**
+ * Find a Lagrange-reduced basis for the lattice spanned by the columns of M:
+ * the same lattice, described by its two shortest independent vectors, with an
+ * acute angle between them. A basis that is already reduced and acute is
+ * returned unchanged.
+ */
+SquareMatrix2D<double> reduce2DLatticeBasis(const SquareMatrix2D<double>& M);
+
+/**
+ * The shape of a lattice, up to rotation and scale. Square and hexagonal
+ * lattices have closed-form nearest lattice points.
+ */
+enum class LatticeKind {
+  General,
+  Square,
+  // Basis vectors of equal length, 60 degrees apart.
+  Hexagonal
+};
+
+/**
+ * Recognize a reduced, acute basis of a square or hexagonal lattice.
+ */
+LatticeKind classifyLatticeBasis(const SquareMatrix2D<double>& M);
+
+/**
+ * Bitmaps over one module's fundamental cell that rule out small shapes
+ * without enumerating lattice points. Each bitmap has a shape radius R, and
+ * marks the cells whose points are all farther than r + R from every lattice
+ * point. Any shape within R of a point in a marked cell is farther than r from
+ * every lattice point, so a small shadow can be ruled out by reducing its
+ * center modulo the lattice and doing one lookup.
+ *
+ * The cells are a resolution x resolution grid in lattice coordinates. The
+ * first bitmap's R is the length of a cell's longer diagonal, and each further
+ * bitmap doubles it, until no cell is far enough to be marked.
+ */
+class TorusOccupancy
+{
+public:
+  /**
+   * An occupancy that never rules anything out.
+   */
+  TorusOccupancy();
+
+  /**
+   * @param latticeBasis
+   * A reduced basis with an acute angle between its vectors, so that the
+   * nearest lattice point to any point of the fundamental cell is one of its
+   * corners.
+   */
+  TorusOccupancy(const SquareMatrix2D<double>& latticeBasis,
+                 const SquareMatrix2D<double>& inverseLatticeBasis,
+                 double r, size_t resolution);
+
+  /**
+   * Whether every point within sqrt(radiusSquared) of this point on the plane
+   * is provably farther than r from every lattice point.
+   */
+  bool isFar(double x, double y, double radiusSquared) const
+  {
+    size_t level = 0;
+    while (level < radiusSquared_.size() &&
+           radiusSquared > radiusSquared_[level])
+    {
+      level++;
+    }
+
+    if (level == radiusSquared_.size())
+    {
+      return false;
+    }
+
+    double a = inverseLatticeBasis_.v00*x + inverseLatticeBasis_.v01*y;
+    double b = inverseLatticeBasis_.v10*x + inverseLatticeBasis_.v11*y;
+    a -= floor(a);
+    b -= floor(b);
+
+    // Rounding can put a point that's just below a lattice line at 1.0.
+    const size_t ia = std::min((size_t)(a*resolution_), resolution_ - 1);
+    const size_t ib = std::min((size_t)(b*resolution_), resolution_ - 1);
+    const size_t iCell = level*resolution_*resolution_ + ib*resolution_ + ia;
+
+    return (far_[iCell / 64] >> (iCell % 64)) & 1;
+  }
+
+private:
+  SquareMatrix2D<double> inverseLatticeBasis_;
+  size_t resolution_;
+  std::vector<double> radiusSquared_;
+  std::vector<uint64_t> far_;
+};
+
+/**
+ * A std::allocator replacement that aligns every allocation to a given
+ * boundary, e.g. a cache line.
+ */
+template<typename T, size_t Alignment>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  template<typename U>
+  struct rebind {
+    typedef AlignedAllocator<U, Alignment> other;
+  };
+
+  AlignedAllocator() {}
+
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(size_t n)
+  {
+    void *p = nullptr;
+    if (posix_memalign(&p, Alignment, n*sizeof(T)) != 0)
+    {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t)
+  {
+    free(p);
+  }
+};
+
+template<typename T, typename U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&,
+                const AlignedAllocator<U, Alignment>&)
+{
+  return true;
+}
+
+template<typename T, typename U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&,
+                const AlignedAllocator<U, Alignment>&)
+{
+  return false;
+}
+
+/**
+ * The parameters of m grid cell modules in a k-dimensional domain, stored in
+ * one contiguous, cache-line-aligned buffer.
+ *
+ * Each module occupies a fixed-size record that starts on a cache line:
+ *
+ *   [latticeBasis (4) | inverseLatticeBasis (4) | domainToPlane (2*k) | pad]
+ *
+ * The domainToPlane matrix is stored row-major, so element (row, col) is at
+ * domainToPlane(iModule)[row*k + col]. Projecting a point through every module
+ * walks the buffer linearly rather than chasing three levels of std::vector
+ * pointers per module.
+ */
+class ModuleSet
+{
+public:
+  /**
+   * @param domainToPlaneByModule
+   * A list of m 2*k matrices.
+   *
+   * @param latticeBasisByModule
+   * A list of m 2*2 matrices.
+   */
+  ModuleSet(
+    const gridcodingrange::MatrixList &domainToPlaneByModule,
+    const gridcodingrange::MatrixList &latticeBasisByModule);
+
+  /**
+   * For computations that never wrap around the lattice. Every module gets an
+   * identity lattice basis.
+   */
+  explicit ModuleSet(
+    const gridcodingrange::MatrixList &domainToPlaneByModule);
+
+  size_t numModules() const
+  {
+    return numModules_;
+  }
+
+  size_t numDims() const
+  {
+    return numDims_;
+  }
+
+  const double *domainToPlane(size_t iModule) const
+  {
+    return record_(iModule) + DomainToPlaneOffset;
+  }
+
+  double *domainToPlane(size_t iModule)
+  {
+    return record_(iModule) + DomainToPlaneOffset;
+  }
+
+  const SquareMatrix2D<double> &latticeBasis(size_t iModule) const
+  {
+    return *reinterpret_cast<const SquareMatrix2D<double>*>(
+      record_(iModule) + LatticeBasisOffset);
+  }
+
+  SquareMatrix2D<double> &latticeBasis(size_t iModule)
+  {
+    return *reinterpret_cast<SquareMatrix2D<double>*>(
+      record_(iModule) + LatticeBasisOffset);
+  }
+
+  const SquareMatrix2D<double> &inverseLatticeBasis(size_t iModule) const
+  {
+    return *reinterpret_cast<const SquareMatrix2D<double>*>(
+      record_(iModule) + InverseLatticeBasisOffset);
+  }
+
+  /**
+   * Project a point in the domain onto this module's plane.
+   *
+   * @tparam K
+   * The number of dimensions if it's known at compile time, or 0 to use
+   * numDims(). With a fixed K the compiler can fully unroll the projection.
+   */
+  template<size_t K>
+  std::pair<double,double> project(size_t iModule, const double p[]) const
+  {
+    const size_t numDims = (K > 0) ? K : numDims_;
+    const double *row0 = domainToPlane(iModule);
+    const double *row1 = row0 + numDims;
+
+    double x = 0;
+    double y = 0;
+    for (size_t col = 0; col < numDims; col++)
+    {
+      x += row0[col]*p[col];
+      y += row1[col]*p[col];
+    }
+
+    return {x, y};
+  }
+
+  std::pair<double,double> project(size_t iModule, const double p[]) const
+  {
+    return project<0>(iModule, p);
+  }
+
+  /**
+   * The kind of lattice that every module shares, or LatticeKind::General if
+   * they don't all share one. Each module's lattice may still have its own
+   * rotation and scale.
+   */
+  LatticeKind latticeKind() const
+  {
+    return latticeKind_;
+  }
+
+  /**
+   * Recompute the inverse lattice bases and the shared lattice kind, and
+   * forget any torus occupancy. Call this after modifying any latticeBasis.
+   */
+  void updateInverseLatticeBases();
+
+  const TorusOccupancy &torusOccupancy(size_t iModule) const
+  {
+    return torusOccupancy_[iModule];
+  }
+
+  /**
+   * Whether buildTorusOccupancy built any bitmaps. When it didn't, searches
+   * skip the lookups entirely.
+   */
+  bool hasTorusOccupancy() const
+  {
+    return hasTorusOccupancy_;
+  }
+
+  /**
+   * Precompute every module's TorusOccupancy for a search with readout radius
+   * r. A resolution of 0 disables it. The lattice bases must be reduced.
+   * Experimental, see setTorusOccupancyResolution.
+   */
+  void buildTorusOccupancy(double r, size_t resolution);
+
+private:
+  static const size_t CacheLineDoubles = 8;
+  static const size_t LatticeBasisOffset = 0;
+  static const size_t InverseLatticeBasisOffset = 4;
+  static const size_t DomainToPlaneOffset = 8;
+
+  void initialize_(const gridcodingrange::MatrixList &domainToPlaneByModule);
+
+  const double *record_(size_t iModule) const
+  {
+    return buffer_.data() + iModule*recordSize_;
+  }
+
+  double *record_(size_t iModule)
+  {
+    return buffer_.data() + iModule*recordSize_;
+  }
+
+  size_t numModules_;
+  size_t numDims_;
+  size_t recordSize_;
+  LatticeKind latticeKind_;
+  bool hasTorusOccupancy_;
+  std::vector<double,
+              AlignedAllocator<double, CacheLineDoubles*sizeof(double)>>
+    buffer_;
+  std::vector<TorusOccupancy> torusOccupancy_;
+};
+
+/**
+ * The number of dimensions of a search, known at compile time when K > 0.
+ */
+template<size_t K>
+inline size_t numDimsOf(const ModuleSet &modules)
+{
+  return (K > 0) ? K : modules.numDims();
+}
+
+/**
+ * Per-search state with one value per dimension. It's a fixed-size std::array
+ * when the number of dimensions is known at compile time, and a std::vector
+ * otherwise.
+ */
+template<size_t K>
+class DimsArray
+{
+public:
+  explicit DimsArray(size_t)
+  {
+    values_.fill(0.0);
+  }
+
+  double *data() { return values_.data(); }
+  const double *data() const { return values_.data(); }
+  size_t size() const { return K; }
+  double &operator[](size_t i) { return values_[i]; }
+  double operator[](size_t i) const { return values_[i]; }
+
+private:
+  std::array<double, K> values_;
+};
+
+template<>
+class DimsArray<0>
+{
+public:
+  explicit DimsArray(size_t numDims)
+    : values_(numDims, 0.0)
+  {
+  }
+
+  double *data() { return values_.data(); }
+  const double *data() const { return values_.data(); }
+  size_t size() const { return values_.size(); }
+  double &operator[](size_t i) { return values_[i]; }
+  double operator[](size_t i) const { return values_[i]; }
+
+private:
+  std::vector<double> values_;
+};
+
+/**
+ * Call f(std::integral_constant<size_t, K>()) with K == numDims for 1 to 8
+ * dimensions. Above that, call it with K == 0, the generic kernel.
+ */
+template<typename F>
+auto dispatchOnNumDims(size_t numDims, F f)
+  -> decltype(f(std::integral_constant<size_t, 0>()))
+{
+  switch (numDims)
+  {
+    case 1: return f(std::integral_constant<size_t, 1>());
+    case 2: return f(std::integral_constant<size_t, 2>());
+    case 3: return f(std::integral_constant<size_t, 3>());
+    case 4: return f(std::integral_constant<size_t, 4>());
+    case 5: return f(std::integral_constant<size_t, 5>());
+    case 6: return f(std::integral_constant<size_t, 6>());
+    case 7: return f(std::integral_constant<size_t, 7>());
+    case 8: return f(std::integral_constant<size_t, 8>());
+    default: return f(std::integral_constant<size_t, 0>());
+  }
+}
+
+#endif // NTA_MODULE_SET_HPP
@@ -24,8 +24,12 @@
 #include <pybind11/numpy.h>
 #include <pybind11/stl.h>
 
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "cancellation_token.hpp"
 #include "grid_coding_range.hpp"
 #include <nta_logging.hpp>
 
@@ -34,10 +38,13 @@ using std::vector;
 
 namespace py = pybind11;
 
+using gridcodingrange::CancellationToken;
+using gridcodingrange::MatrixList;
+using gridcodingrange::SearchStats;
+
 static vector<double>
-copyArray1D(py::buffer arr)
+copyArray1D(const py::buffer_info& info)
 {
-  py::buffer_info info = arr.request();
   NTA_CHECK(info.ndim == 1);
 
   // We generally call np.asarray in the Python wrapper, so the user can't mess
@@ -45,20 +52,21 @@ copyArray1D(py::buffer arr)
   NTA_ASSERT(info.itemsize == sizeof(double));
   NTA_ASSERT(info.format == py::format_descriptor<double>::format());
 
-  vector<double> v;
-  for (int i = 0; i < info.shape[0]; i++)
+  vector<double> v(info.shape[0]);
+  for (size_t i = 0; i < v.size(); i++)
   {
-    char *pi = (char *)info.ptr + i*info.strides[0];
-    v.push_back(*(double*)pi);
+    v[i] = *(const double*)((const char *)info.ptr + i*info.strides[0]);
   }
 
   return v;
 }
 
-static vector<vector<vector<double>>>
-copyArray3D(py::buffer arr)
+/**
+ * View a 3D array without copying it. The buffer_info must outlive the view.
+ */
+static MatrixList
+viewArray3D(const py::buffer_info& info)
 {
-  py::buffer_info info = arr.request();
   NTA_CHECK(info.ndim == 3);
 
   // We generally call np.asarray in the Python wrapper, so the user can't mess
@@ -66,26 +74,34 @@ copyArray3D(py::buffer arr)
   NTA_ASSERT(info.itemsize == sizeof(double));
   NTA_ASSERT(info.format == py::format_descriptor<double>::format());
 
-  vector<vector<vector<double>>> m;
-  for (int i = 0; i < info.shape[0]; i++)
+  return MatrixList(info.ptr, info.shape[0], info.shape[1], info.shape[2],
+                    info.strides[0], info.strides[1], info.strides[2]);
+}
+
+// Each function below requests its buffers while it holds the GIL, then
+// releases the GIL for the computation. The py::gil_scoped_release is declared
+// last, so the GIL is reacquired before the buffers are released.
+
+/**
+ * Copy SearchStats into a Python dict, if the caller passed one.
+ */
+static void
+copyStats(const SearchStats& searchStats, py::object stats)
+{
+  if (stats.is_none())
   {
-    vector<vector<double>> module;
-    char *pi = (char *)info.ptr + i*info.strides[0];
-    for (int j = 0; j < info.shape[1]; j++)
-    {
-      vector<double> row;
-      char *pj = pi + j*info.strides[1];
-      for (int k = 0; k < info.shape[2]; k++)
-      {
-        char *pk = pj + k*info.strides[2];
-        row.push_back(*(double *)pk);
-      }
-      module.push_back(row);
-    }
-    m.push_back(module);
+    return;
   }
 
-  return m;
+  py::dict statsDict = stats.cast<py::dict>();
+  statsDict["numNodes"] = searchStats.numNodes;
+  statsDict["maxDepth"] = searchStats.maxDepth;
+  statsDict["numImpossibleProofsByModule"] =
+    searchStats.numImpossibleProofsByModule;
+  statsDict["numLatticePoints"] = searchStats.numLatticePoints;
+  statsDict["numPolygonDistanceChecks"] = searchStats.numPolygonDistanceChecks;
+  statsDict["numShadowFramesBuilt"] = searchStats.numShadowFramesBuilt;
+  statsDict["numExpansionTasks"] = searchStats.numExpansionTasks;
 }
 
 static pair<double, vector<double>>
@@ -95,12 +111,162 @@ computeCodingRange(
   py::buffer scaledbox,
   py::buffer ignorebox,
   double phaseResolution,
-  double pingInterval)
+  double pingInterval,
+  size_t numThreads,
+  double timeout,
+  py::object stats,
+  double precision,
+  double maxShellFactor)
 {
-  return gridcodingrange::computeCodingRange(
-    copyArray3D(domainToPlaneByModule), copyArray3D(latticeBasisByModule),
-    copyArray1D(scaledbox), copyArray1D(ignorebox), phaseResolution,
-    pingInterval);
+  const py::buffer_info domainToPlaneInfo = domainToPlaneByModule.request();
+  const py::buffer_info latticeBasisInfo = latticeBasisByModule.request();
+  const vector<double> scaledboxCopy = copyArray1D(scaledbox.request());
+  const vector<double> ignoreboxCopy = copyArray1D(ignorebox.request());
+
+  gridcodingrange::ExpansionSchedule schedule;
+  schedule.precision = precision;
+  schedule.maxShellFactor = maxShellFactor;
+
+  SearchStats searchStats;
+  pair<double, vector<double>> result;
+  {
+    py::gil_scoped_release releaseGIL;
+    result = gridcodingrange::computeCodingRange(
+      viewArray3D(domainToPlaneInfo), viewArray3D(latticeBasisInfo),
+      scaledboxCopy, ignoreboxCopy, phaseResolution, pingInterval, numThreads,
+      timeout, nullptr, stats.is_none() ? nullptr : &searchStats, schedule);
+  }
+
+  copyStats(searchStats, stats);
+  return result;
+}
+
+static pair<double, vector<double>>
+computeCodingRangeWithCheckpoints(
+  py::buffer domainToPlaneByModule,
+  py::buffer latticeBasisByModule,
+  py::buffer scaledbox,
+  py::buffer ignorebox,
+  double phaseResolution,
+  const std::string& checkpointPath,
+  double checkpointInterval,
+  double pingInterval,
+  size_t numThreads,
+  double timeout)
+{
+  const py::buffer_info domainToPlaneInfo = domainToPlaneByModule.request();
+  const py::buffer_info latticeBasisInfo = latticeBasisByModule.request();
+  const vector<double> scaledboxCopy = copyArray1D(scaledbox.request());
+  const vector<double> ignoreboxCopy = copyArray1D(ignorebox.request());
+
+  py::gil_scoped_release releaseGIL;
+  return gridcodingrange::computeCodingRangeWithCheckpoints(
+    viewArray3D(domainToPlaneInfo), viewArray3D(latticeBasisInfo),
+    scaledboxCopy, ignoreboxCopy, phaseResolution, checkpointPath,
+    checkpointInterval, pingInterval, numThreads, timeout);
+}
+
+static pair<double, vector<double>>
+resumeCodingRange(
+  const std::string& checkpointPath,
+  double checkpointInterval,
+  double pingInterval,
+  size_t numThreads,
+  double timeout)
+{
+  py::gil_scoped_release releaseGIL;
+  return gridcodingrange::resumeCodingRange(
+    checkpointPath, checkpointInterval, pingInterval, numThreads, timeout);
+}
+
+/**
+ * Owns copies of the query's matrices, which the coordinator only views.
+ */
+class PyCodingRangeCoordinator
+{
+public:
+  PyCodingRangeCoordinator(
+    py::buffer domainToPlaneByModule,
+    py::buffer latticeBasisByModule,
+    py::buffer scaledbox,
+    py::buffer ignorebox,
+    double phaseResolution,
+    const std::string& host,
+    int port)
+    : domainToPlaneInfo_(domainToPlaneByModule.request()),
+      latticeBasisInfo_(latticeBasisByModule.request()),
+      coordinator_(viewArray3D(domainToPlaneInfo_),
+                   viewArray3D(latticeBasisInfo_),
+                   copyArray1D(scaledbox.request()),
+                   copyArray1D(ignorebox.request()),
+                   phaseResolution, host, port)
+  {
+  }
+
+  int port() const
+  {
+    return coordinator_.port();
+  }
+
+  pair<double, vector<double>> run(double pingInterval, double timeout)
+  {
+    py::gil_scoped_release releaseGIL;
+    return coordinator_.run(pingInterval, timeout);
+  }
+
+private:
+  const py::buffer_info domainToPlaneInfo_;
+  const py::buffer_info latticeBasisInfo_;
+  gridcodingrange::CodingRangeCoordinator coordinator_;
+};
+
+static void
+runCodingRangeWorker(
+  const std::string& host,
+  int port,
+  size_t numThreads,
+  double timeout)
+{
+  py::gil_scoped_release releaseGIL;
+  gridcodingrange::runCodingRangeWorker(host, port, numThreads, timeout);
+}
+
+/**
+ * @param queries
+ * A list of (domainToPlaneByModule, latticeBasisByModule, scaledbox, ignorebox,
+ * phaseResolution) tuples.
+ */
+static vector<pair<double, vector<double>>>
+computeCodingRangeBatch(
+  py::list queries,
+  double pingInterval,
+  size_t numThreadsPerQuery,
+  double timeout)
+{
+  vector<py::buffer_info> bufferInfos;
+  vector<gridcodingrange::CodingRangeQuery> queryStructs;
+  for (py::handle queryHandle : queries)
+  {
+    py::tuple query = py::reinterpret_borrow<py::tuple>(queryHandle);
+    NTA_CHECK(query.size() == 5)
+      << "Each query should have 5 elements. Actual: " << query.size();
+
+    bufferInfos.push_back(query[0].cast<py::buffer>().request());
+    const MatrixList domainToPlaneByModule = viewArray3D(bufferInfos.back());
+    bufferInfos.push_back(query[1].cast<py::buffer>().request());
+    const MatrixList latticeBasisByModule = viewArray3D(bufferInfos.back());
+
+    queryStructs.push_back({
+        domainToPlaneByModule,
+        latticeBasisByModule,
+        copyArray1D(query[2].cast<py::buffer>().request()),
+        copyArray1D(query[3].cast<py::buffer>().request()),
+        query[4].cast<double>()});
+  }
+
+  py::gil_scoped_release releaseGIL;
+  return gridcodingrange::computeCodingRangeBatch(queryStructs, pingInterval,
+                                                  numThreadsPerQuery, timeout);
 }
 
 static pair<double, vector<double>>
@@ -109,11 +275,16 @@ computeGridUniquenessHypercube(
   py::buffer latticeBasisByModule,
   double phaseResolution,
   double ignoredCenterDiameter,
-  double pingInterval)
+  double pingInterval,
+  double timeout)
 {
+  const py::buffer_info domainToPlaneInfo = domainToPlaneByModule.request();
+  const py::buffer_info latticeBasisInfo = latticeBasisByModule.request();
+
+  py::gil_scoped_release releaseGIL;
   return gridcodingrange::computeGridUniquenessHypercube(
-    copyArray3D(domainToPlaneByModule), copyArray3D(latticeBasisByModule),
-    phaseResolution, ignoredCenterDiameter, pingInterval);
+    viewArray3D(domainToPlaneInfo), viewArray3D(latticeBasisInfo),
+    phaseResolution, ignoredCenterDiameter, pingInterval, timeout);
 }
 
 static double
@@ -122,11 +293,22 @@ computeBinSidelength(
   double readoutResolution,
   double resultPrecision,
   double upperBound,
-  double timeout)
+  double timeout,
+  py::object stats)
 {
-  return gridcodingrange::computeBinSidelength(
-    copyArray3D(domainToPlaneByModule), readoutResolution, resultPrecision,
-    upperBound, timeout);
+  const py::buffer_info domainToPlaneInfo = domainToPlaneByModule.request();
+
+  SearchStats searchStats;
+  double result;
+  {
+    py::gil_scoped_release releaseGIL;
+    result = gridcodingrange::computeBinSidelength(
+      viewArray3D(domainToPlaneInfo), readoutResolution, resultPrecision,
+      upperBound, timeout, nullptr, stats.is_none() ? nullptr : &searchStats);
+  }
+
+  copyStats(searchStats, stats);
+  return result;
 }
 
 static vector<double>
@@ -135,19 +317,338 @@ computeBinRectangle(
   double readoutResolution,
   double resultPrecision,
   double upperBound,
-  double timeout)
+  double timeout,
+  py::object stats)
+{
+  const py::buffer_info domainToPlaneInfo = domainToPlaneByModule.request();
+
+  SearchStats searchStats;
+  vector<double> result;
+  {
+    py::gil_scoped_release releaseGIL;
+    result = gridcodingrange::computeBinRectangle(
+      viewArray3D(domainToPlaneInfo), readoutResolution, resultPrecision,
+      upperBound, timeout, nullptr, stats.is_none() ? nullptr : &searchStats);
+  }
+
+  copyStats(searchStats, stats);
+  return result;
+}
+
+// The async functions below start the computation on a thread of its own and
+// return immediately. That thread calls onStart() first, and skips the
+// computation if it returns false. When the computation finishes, it takes the
+// GIL and calls onDone(result) or onError(message). The Python wrapper turns
+// these into a concurrent.futures.Future.
+//
+// Async calls don't capture SIGINT, so that it still reaches the program as a
+// KeyboardInterrupt. They're cancelled through their futures instead.
+//
+// The computation's searches run on the process-wide thread pool. The call
+// itself isn't a pool task, so it can't be picked up by a thread that's
+// waiting on some other computation, and it never occupies a pool worker
+// while it waits.
+
+/**
+ * Everything that an async call needs to keep alive until it finishes. It's
+ * created and destroyed while holding the GIL.
+ */
+struct AsyncCall
 {
-  return gridcodingrange::computeBinRectangle(
-    copyArray3D(domainToPlaneByModule), readoutResolution, resultPrecision,
-    upperBound, timeout);
+  vector<py::buffer_info> bufferInfos;
+  py::object token;
+  py::object onStart;
+  py::object onDone;
+  py::object onError;
+
+  CancellationToken *cancellationToken()
+  {
+    return token.cast<CancellationToken*>();
+  }
+};
+
+template<typename F>
+static void
+runAsync(std::unique_ptr<AsyncCall> call, F computation)
+{
+  AsyncCall *c = call.get();
+
+  std::thread thread([c, computation]() {
+      {
+        py::gil_scoped_acquire acquireGIL;
+        bool started = true;
+        try
+        {
+          started = c->onStart().cast<bool>();
+        }
+        catch (py::error_already_set& e)
+        {
+          // Run the computation anyway, so that the future still finishes.
+          e.restore();
+          PyErr_WriteUnraisable(c->onStart.ptr());
+        }
+
+        if (!started)
+        {
+          // Cancelled before it started.
+          delete c;
+          return;
+        }
+      }
+
+      decltype(computation()) result;
+      bool failed = false;
+      std::string message;
+      try
+      {
+        result = computation();
+      }
+      catch (const std::exception& e)
+      {
+        failed = true;
+        message = e.what();
+      }
+
+      py::gil_scoped_acquire acquireGIL;
+      try
+      {
+        if (failed)
+        {
+          c->onError(message);
+        }
+        else
+        {
+          c->onDone(result);
+        }
+      }
+      catch (py::error_already_set& e)
+      {
+        // Nobody can catch this, so print it.
+        e.restore();
+        PyErr_WriteUnraisable(c->onDone.ptr());
+      }
+
+      delete c;
+    });
+
+  // The thread owns the call now.
+  call.release();
+  thread.detach();
+}
+
+static void
+computeCodingRangeAsync(
+  py::buffer domainToPlaneByModule,
+  py::buffer latticeBasisByModule,
+  py::buffer scaledbox,
+  py::buffer ignorebox,
+  double phaseResolution,
+  size_t numThreads,
+  double timeout,
+  py::object token,
+  py::object onStart,
+  py::object onDone,
+  py::object onError)
+{
+  std::unique_ptr<AsyncCall> call(
+    new AsyncCall{{}, token, onStart, onDone, onError});
+  call->bufferInfos.push_back(domainToPlaneByModule.request());
+  call->bufferInfos.push_back(latticeBasisByModule.request());
+
+  const MatrixList domainToPlane = viewArray3D(call->bufferInfos[0]);
+  const MatrixList latticeBasis = viewArray3D(call->bufferInfos[1]);
+  const vector<double> scaledboxCopy = copyArray1D(scaledbox.request());
+  const vector<double> ignoreboxCopy = copyArray1D(ignorebox.request());
+  CancellationToken *cancellationToken = call->cancellationToken();
+
+  runAsync(std::move(call), [=]() {
+      return gridcodingrange::computeCodingRange(
+        domainToPlane, latticeBasis, scaledboxCopy, ignoreboxCopy,
+        phaseResolution, 0.0, numThreads, timeout, cancellationToken, nullptr,
+        gridcodingrange::ExpansionSchedule(), false);
+    });
+}
+
+static void
+computeCodingRangeBatchAsync(
+  py::list queries,
+  size_t numThreadsPerQuery,
+  double timeout,
+  py::object token,
+  py::object onStart,
+  py::object onDone,
+  py::object onError)
+{
+  std::unique_ptr<AsyncCall> call(
+    new AsyncCall{{}, token, onStart, onDone, onError});
+
+  vector<gridcodingrange::CodingRangeQuery> queryStructs;
+  for (py::handle queryHandle : queries)
+  {
+    py::tuple query = py::reinterpret_borrow<py::tuple>(queryHandle);
+    NTA_CHECK(query.size() == 5)
+      << "Each query should have 5 elements. Actual: " << query.size();
+
+    call->bufferInfos.push_back(query[0].cast<py::buffer>().request());
+    const MatrixList domainToPlaneByModule =
+      viewArray3D(call->bufferInfos.back());
+    call->bufferInfos.push_back(query[1].cast<py::buffer>().request());
+    const MatrixList latticeBasisByModule =
+      viewArray3D(call->bufferInfos.back());
+
+    queryStructs.push_back({
+        domainToPlaneByModule,
+        latticeBasisByModule,
+        copyArray1D(query[2].cast<py::buffer>().request()),
+        copyArray1D(query[3].cast<py::buffer>().request()),
+        query[4].cast<double>()});
+  }
+  CancellationToken *cancellationToken = call->cancellationToken();
+
+  runAsync(std::move(call), [=]() {
+      return gridcodingrange::computeCodingRangeBatch(
+        queryStructs, 0.0, numThreadsPerQuery, timeout, cancellationToken,
+        false);
+    });
+}
+
+static void
+computeGridUniquenessHypercubeAsync(
+  py::buffer domainToPlaneByModule,
+  py::buffer latticeBasisByModule,
+  double phaseResolution,
+  double ignoredCenterDiameter,
+  double timeout,
+  py::object token,
+  py::object onStart,
+  py::object onDone,
+  py::object onError)
+{
+  std::unique_ptr<AsyncCall> call(
+    new AsyncCall{{}, token, onStart, onDone, onError});
+  call->bufferInfos.push_back(domainToPlaneByModule.request());
+  call->bufferInfos.push_back(latticeBasisByModule.request());
+
+  const MatrixList domainToPlane = viewArray3D(call->bufferInfos[0]);
+  const MatrixList latticeBasis = viewArray3D(call->bufferInfos[1]);
+  CancellationToken *cancellationToken = call->cancellationToken();
+
+  runAsync(std::move(call), [=]() {
+      return gridcodingrange::computeGridUniquenessHypercube(
+        domainToPlane, latticeBasis, phaseResolution, ignoredCenterDiameter,
+        0.0, timeout, cancellationToken, false);
+    });
+}
+
+static void
+computeBinSidelengthAsync(
+  py::buffer domainToPlaneByModule,
+  double readoutResolution,
+  double resultPrecision,
+  double upperBound,
+  double timeout,
+  py::object token,
+  py::object onStart,
+  py::object onDone,
+  py::object onError)
+{
+  std::unique_ptr<AsyncCall> call(
+    new AsyncCall{{}, token, onStart, onDone, onError});
+  call->bufferInfos.push_back(domainToPlaneByModule.request());
+
+  const MatrixList domainToPlane = viewArray3D(call->bufferInfos[0]);
+  CancellationToken *cancellationToken = call->cancellationToken();
+
+  runAsync(std::move(call), [=]() {
+      return gridcodingrange::computeBinSidelength(
+        domainToPlane, readoutResolution, resultPrecision, upperBound, timeout,
+        cancellationToken, nullptr, false);
+    });
+}
+
+static void
+computeBinRectangleAsync(
+  py::buffer domainToPlaneByModule,
+  double readoutResolution,
+  double resultPrecision,
+  double upperBound,
+  double timeout,
+  py::object token,
+  py::object onStart,
+  py::object onDone,
+  py::object onError)
+{
+  std::unique_ptr<AsyncCall> call(
+    new AsyncCall{{}, token, onStart, onDone, onError});
+  call->bufferInfos.push_back(domainToPlaneByModule.request());
+
+  const MatrixList domainToPlane = viewArray3D(call->bufferInfos[0]);
+  CancellationToken *cancellationToken = call->cancellationToken();
+
+  runAsync(std::move(call), [=]() {
+      return gridcodingrange::computeBinRectangle(
+        domainToPlane, readoutResolution, resultPrecision, upperBound, timeout,
+        cancellationToken, nullptr, false);
+    });
+}
+
+static void
+setNumThreads(size_t numThreads)
+{
+  // Replacing the pool may wait for its workers to finish their current
+  // tasks.
+  py::gil_scoped_release releaseGIL;
+  gridcodingrange::setNumThreads(numThreads);
 }
 
 PYBIND11_MODULE(_gridcodingrange, m)
 {
+  py::class_<CancellationToken>(m, "CancellationToken")
+    .def(py::init<>())
+    .def("cancel", &CancellationToken::cancel)
+    .def("isCancelled", &CancellationToken::isCancelled)
+    .def("setTimeout", &CancellationToken::setTimeout)
+    .def("hasDeadline", &CancellationToken::hasDeadline);
+
   m.def("computeCodingRange", &computeCodingRange);
+  m.def("computeCodingRangeWithCheckpoints",
+        &computeCodingRangeWithCheckpoints);
+  m.def("resumeCodingRange", &resumeCodingRange);
+  m.def("computeCodingRangeBatch", &computeCodingRangeBatch);
+
+  py::class_<PyCodingRangeCoordinator>(m, "CodingRangeCoordinator")
+    .def(py::init<py::buffer, py::buffer, py::buffer, py::buffer, double,
+                  const std::string&, int>())
+    .def("port", &PyCodingRangeCoordinator::port)
+    .def("run", &PyCodingRangeCoordinator::run);
+  m.def("runCodingRangeWorker", &runCodingRangeWorker);
+
   m.def("computeGridUniquenessHypercube", &computeGridUniquenessHypercube);
   m.def("computeBinSidelength", &computeBinSidelength);
   m.def("computeBinRectangle", &computeBinRectangle);
+  m.def("computeCodingRangeAsync", &computeCodingRangeAsync);
+  m.def("computeCodingRangeBatchAsync", &computeCodingRangeBatchAsync);
+  m.def("computeGridUniquenessHypercubeAsync",
+        &computeGridUniquenessHypercubeAsync);
+  m.def("computeBinSidelengthAsync", &computeBinSidelengthAsync);
+  m.def("computeBinRectangleAsync", &computeBinRectangleAsync);
+  m.def("setNumThreads", &setNumThreads);
+  m.def("getNumThreads", &gridcodingrange::getNumThreads);
+  m.def("setCaptureInterrupts", &gridcodingrange::setCaptureInterrupts);
+  m.def("getCaptureInterrupts", &gridcodingrange::getCaptureInterrupts);
+  py::enum_<gridcodingrange::SearchOrder>(m, "SearchOrder")
+    .value("DepthFirst", gridcodingrange::SearchOrder::DepthFirst)
+    .value("BestFirst", gridcodingrange::SearchOrder::BestFirst)
+    .value("BranchAndBound", gridcodingrange::SearchOrder::BranchAndBound);
+  m.def("setSearchOrder", &gridcodingrange::setSearchOrder);
+  m.def("getSearchOrder", &gridcodingrange::getSearchOrder);
+  m.def("setTorusOccupancyResolution",
+        &gridcodingrange::setTorusOccupancyResolution);
+  m.def("getTorusOccupancyResolution",
+        &gridcodingrange::getTorusOccupancyResolution);
+  m.def("resetTorusOccupancyResolution",
+        &gridcodingrange::resetTorusOccupancyResolution);
+  m.def("searchStatsEnabled", &SearchStats::enabled);
   m.def("resetCheckPolygonThreshold", &gridcodingrange::resetCheckPolygonThreshold);
   m.def("setCheckPolygonThreshold", &gridcodingrange::setCheckPolygonThreshold);
 
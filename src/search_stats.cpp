@@ -0,0 +1,105 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#include "search_stats.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+namespace {
+  thread_local gridcodingrange::SearchStats *t_currentStats = nullptr;
+
+  // Tasks merge their stats once, when they end, so one lock is plenty.
+  std::mutex g_mergeMutex;
+}
+
+namespace gridcodingrange
+{
+  SearchStats::SearchStats()
+    : numNodes(0), maxDepth(0), numLatticePoints(0),
+      numPolygonDistanceChecks(0), numShadowFramesBuilt(0),
+      numExpansionTasks(0)
+  {
+  }
+
+  bool SearchStats::enabled()
+  {
+#ifdef GRIDCODINGRANGE_SEARCH_STATS
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  SearchStats *SearchStats::current()
+  {
+    return t_currentStats;
+  }
+
+  void SearchStats::add(const SearchStats& other)
+  {
+    numNodes += other.numNodes;
+    maxDepth = std::max(maxDepth, other.maxDepth);
+
+    if (other.numImpossibleProofsByModule.size() >
+        numImpossibleProofsByModule.size())
+    {
+      numImpossibleProofsByModule.resize(
+        other.numImpossibleProofsByModule.size(), 0);
+    }
+    for (size_t i = 0; i < other.numImpossibleProofsByModule.size(); i++)
+    {
+      numImpossibleProofsByModule[i] += other.numImpossibleProofsByModule[i];
+    }
+
+    numLatticePoints += other.numLatticePoints;
+    numPolygonDistanceChecks += other.numPolygonDistanceChecks;
+    numShadowFramesBuilt += other.numShadowFramesBuilt;
+    numExpansionTasks += other.numExpansionTasks;
+  }
+
+  SearchStatsScope::SearchStatsScope(SearchStats *stats)
+    : previous_(t_currentStats)
+  {
+    t_currentStats = stats;
+  }
+
+  SearchStatsScope::~SearchStatsScope()
+  {
+    t_currentStats = previous_;
+  }
+
+  SearchStatsTaskScope::SearchStatsTaskScope(SearchStats *parent)
+    : parent_(parent), scope_(parent != nullptr ? &stats_ : nullptr)
+  {
+  }
+
+  SearchStatsTaskScope::~SearchStatsTaskScope()
+  {
+    if (parent_ != nullptr)
+    {
+      std::lock_guard<std::mutex> lock(g_mergeMutex);
+      parent_->add(stats_);
+    }
+  }
+}
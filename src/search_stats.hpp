@@ -0,0 +1,152 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef NTA_SEARCH_STATS_HPP
+#define NTA_SEARCH_STATS_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace gridcodingrange
+{
+  /**
+   * Counters that explain where a search spent its time, e.g. for tuning
+   * checkPolygonThreshold or the module order.
+   *
+   * They're only collected when the library is built with
+   * GRIDCODINGRANGE_SEARCH_STATS defined. Otherwise the counting compiles to
+   * nothing and every counter stays 0.
+   */
+  struct SearchStats
+  {
+    SearchStats();
+
+    /**
+     * Whether this build collects statistics.
+     */
+    static bool enabled();
+
+    /**
+     * The stats that the calling thread is counting into, or nullptr.
+     */
+    static SearchStats *current();
+
+    void add(const SearchStats& other);
+
+    void recordNode(size_t depth)
+    {
+      numNodes++;
+      if (depth > maxDepth)
+      {
+        maxDepth = depth;
+      }
+    }
+
+    void recordImpossibleProof(size_t iModule)
+    {
+      if (iModule >= numImpossibleProofsByModule.size())
+      {
+        numImpossibleProofsByModule.resize(iModule + 1, 0);
+      }
+      numImpossibleProofsByModule[iModule]++;
+    }
+
+    // Boxes visited by the divide-and-conquer recursion, and the frame number
+    // of the deepest one.
+    unsigned long long numNodes;
+    size_t maxDepth;
+
+    // How many boxes each module proved can't contain grid code zero.
+    std::vector<unsigned long long> numImpossibleProofsByModule;
+
+    // Lattice points that LatticePointEnumerators considered.
+    unsigned long long numLatticePoints;
+
+    // distToConvexPolygonSquared calls.
+    unsigned long long numPolygonDistanceChecks;
+
+    // Frames of cached shadows, i.e. one zonogon per module per frame.
+    unsigned long long numShadowFramesBuilt;
+
+    // Boxes that computeCodingRange's expanding search handed out.
+    unsigned long long numExpansionTasks;
+  };
+
+  /**
+   * Count into a SearchStats on the calling thread while this object exists.
+   * If stats is nullptr, don't count.
+   */
+  class SearchStatsScope
+  {
+  public:
+    explicit SearchStatsScope(SearchStats *stats);
+    ~SearchStatsScope();
+
+    SearchStatsScope(const SearchStatsScope&) = delete;
+    SearchStatsScope& operator=(const SearchStatsScope&) = delete;
+
+  private:
+    SearchStats *previous_;
+  };
+
+  /**
+   * Like SearchStatsScope, for a task that may run concurrently with other
+   * tasks of the same search. It counts into its own SearchStats, then adds
+   * them to the parent when it ends. The parent is typically the
+   * SearchStats::current() of the thread that queued the task.
+   */
+  class SearchStatsTaskScope
+  {
+  public:
+    explicit SearchStatsTaskScope(SearchStats *parent);
+    ~SearchStatsTaskScope();
+
+    SearchStatsTaskScope(const SearchStatsTaskScope&) = delete;
+    SearchStatsTaskScope& operator=(const SearchStatsTaskScope&) = delete;
+
+  private:
+    SearchStats *parent_;
+    SearchStats stats_;
+    SearchStatsScope scope_;
+  };
+} // end namespace gridcodingrange
+
+/**
+ * Apply a statement to the current thread's SearchStats, e.g.
+ * SEARCH_STATS(numLatticePoints++). Compiled out unless
+ * GRIDCODINGRANGE_SEARCH_STATS is defined.
+ */
+#ifdef GRIDCODINGRANGE_SEARCH_STATS
+#define SEARCH_STATS(statement)                                         \
+  do {                                                                  \
+    gridcodingrange::SearchStats *searchStats_ =                        \
+      gridcodingrange::SearchStats::current();                          \
+    if (searchStats_ != nullptr)                                        \
+    {                                                                   \
+      searchStats_->statement;                                          \
+    }                                                                   \
+  } while (false)
+#else
+#define SEARCH_STATS(statement) do {} while (false)
+#endif
+
+#endif // NTA_SEARCH_STATS_HPP
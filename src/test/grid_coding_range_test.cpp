@@ -26,10 +26,28 @@
 #include <nta_logging.hpp>
 
 #include "grid_coding_range.hpp"
+#include "lattice_point_enumerator.hpp"
+#include "message_channel.hpp"
+#include "module_set.hpp"
+#include "thread_pool.hpp"
 #include <gtest/gtest.h>
 
-#include <vector>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
 
 using namespace gridcodingrange;
 using std::vector;
@@ -124,6 +142,54 @@ namespace {
    * Specifically focus on the area that would be covered by a square around
    * zero but not by a circle.
    */
+  /**
+   * The parallel search should agree with the serial search, and any point it
+   * reports should be inside the box.
+   */
+  TEST(GridUniquenessTest, ParallelSearchMatchesSerial)
+  {
+    const vector<double> scales = {2, 3, 6, 7, 21}; // Factors of 42
+    vector<vector<vector<double>>> domainToPlaneByModule;
+    vector<vector<vector<double>>> latticeBasisByModule;
+    for (double scale : scales)
+    {
+      domainToPlaneByModule.push_back({
+          {1/scale, 0, 0.5/scale},
+          {0, 1/scale, 0.5/scale},
+        });
+      latticeBasisByModule.push_back({
+          {1, 0},
+          {0, 1},
+        });
+    }
+
+    const vector<vector<double>> x0s = {
+      {41.0, 41.0, -1.0},
+      {41.0, 41.0, 0.5},
+      {40.0, 30.0, -5.0},
+    };
+    const vector<double> dims = {2.0, 2.0, 2.0};
+
+    for (const vector<double>& x0 : x0s)
+    {
+      vector<double> point(3);
+      const bool expected = findGridCodeZero(
+        domainToPlaneByModule, latticeBasisByModule, x0, dims, 0.01);
+      ASSERT_EQ(expected,
+                findGridCodeZero(domainToPlaneByModule, latticeBasisByModule,
+                                 x0, dims, 0.01, &point, 4));
+
+      if (expected)
+      {
+        for (size_t iDim = 0; iDim < 3; iDim++)
+        {
+          ASSERT_GE(point[iDim], x0[iDim]);
+          ASSERT_LE(point[iDim], x0[iDim] + dims[iDim]);
+        }
+      }
+    }
+  }
+
   TEST(GridUniquenessTest, ZeroHasACircularRadius)
   {
     const vector<vector<vector<double>>> domainToPlaneByModule = {
@@ -426,6 +492,63 @@ namespace {
                     0.2);
   };
 
+  TEST(GridUniquenessTest, LatticePointEnumeratorFindsEveryNearbyPoint)
+  {
+    const vector<SquareMatrix2D<double>> latticeBases = {
+      {1.0, 0.0, 0.0, 1.0},
+      {1.0, cos(M_PI/3), 0.0, sin(M_PI/3)},
+      {0.646673658192444, -0.337238590405595,
+       0.762766792538848, 0.9414192122222954},
+      {0.0, -1.3, 0.7, 0.0},
+    };
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> position(-20.0, 20.0);
+    std::uniform_real_distribution<double> size(0.0, 3.0);
+    std::uniform_real_distribution<double> radius(0.01, 0.5);
+
+    for (const SquareMatrix2D<double>& latticeBasis : latticeBases)
+    {
+      const SquareMatrix2D<double> inverseLatticeBasis =
+        ::invert2DMatrix(latticeBasis);
+
+      for (int iRect = 0; iRect < 200; iRect++)
+      {
+        const double left = position(rng);
+        const double right = left + size(rng);
+        const double bottom = position(rng);
+        const double top = bottom + size(rng);
+        const double r = radius(rng);
+
+        std::set<pair<double,double>> expected;
+        for (int i = -60; i <= 60; i++)
+        {
+          for (int j = -60; j <= 60; j++)
+          {
+            const pair<double,double> p = transform2D(latticeBasis, {i, j});
+            const double dx = p.first - std::max(left, std::min(p.first, right));
+            const double dy = p.second - std::max(bottom, std::min(p.second, top));
+            if (dx*dx + dy*dy <= r*r)
+            {
+              expected.insert(p);
+            }
+          }
+        }
+
+        LatticePointEnumerator latticePoints(latticeBasis, inverseLatticeBasis,
+                                             left, right, bottom, top, r, r*r);
+        std::set<pair<double,double>> actual;
+        pair<double,double> latticePoint;
+        while (latticePoints.getNext(&latticePoint))
+        {
+          EXPECT_TRUE(actual.insert(latticePoint).second);
+        }
+
+        EXPECT_EQ(expected, actual);
+      }
+    }
+  }
+
   vector<vector<double>> invert2DMatrix(const vector<vector<double>>& M)
   {
     const double detInv = 1 / (M[0][0]*M[1][1] - M[0][1]*M[1][0]);
@@ -545,6 +668,530 @@ namespace {
                       0.01).first));
   }
 
+  TEST(GridUniquenessTest, SkewedLatticeBasis)
+  {
+    // A reduced basis is left alone.
+    const SquareMatrix2D<double> hexagonal = {1.0, cos(M_PI/3),
+                                              0.0, sin(M_PI/3)};
+    const SquareMatrix2D<double> reduced = reduce2DLatticeBasis(hexagonal);
+    EXPECT_EQ(hexagonal.v00, reduced.v00);
+    EXPECT_EQ(hexagonal.v01, reduced.v01);
+    EXPECT_EQ(hexagonal.v10, reduced.v10);
+    EXPECT_EQ(hexagonal.v11, reduced.v11);
+
+    // A skewed basis for the same lattice is reduced to unit vectors.
+    const SquareMatrix2D<double> skewed = {
+      2*hexagonal.v00 + 5*hexagonal.v01, 3*hexagonal.v00 + 8*hexagonal.v01,
+      2*hexagonal.v10 + 5*hexagonal.v11, 3*hexagonal.v10 + 8*hexagonal.v11};
+    const SquareMatrix2D<double> unskewed = reduce2DLatticeBasis(skewed);
+    EXPECT_NEAR(1.0, hypot(unskewed.v00, unskewed.v10), 1e-9);
+    EXPECT_NEAR(1.0, hypot(unskewed.v01, unskewed.v11), 1e-9);
+
+    // The coding range depends only on the lattice, not on its basis.
+    vector<vector<vector<double>>> latticeBasisByModule =
+      getLatticeBasisWithNearestZeroAt(12.5, 0.25);
+    for (vector<vector<double>>& basis : latticeBasisByModule)
+    {
+      basis = {{2*basis[0][0] + 5*basis[0][1], 3*basis[0][0] + 8*basis[0][1]},
+               {2*basis[1][0] + 5*basis[1][1], 3*basis[1][0] + 8*basis[1][1]}};
+    }
+
+    EXPECT_EQ(12,
+              floor(computeCodingRange(
+                      getPlaneMatrixWithNearestZeroAt(12.5, 0.25),
+                      latticeBasisByModule,
+                      {1.0, 1.0},
+                      {0.5, 0.5},
+                      0.01).first));
+  }
+
+  TEST(GridUniquenessTest, SharedLatticeKind)
+  {
+    const double c = cos(M_PI/3);
+    const double s = sin(M_PI/3);
+    const vector<vector<vector<double>>> domainToPlaneByModule = {
+      {{1.0, 0.0}, {0.0, 1.0}},
+      {{0.5, 0.2}, {-0.3, 0.7}},
+    };
+
+    // Hexagonal lattices with different scales and rotations.
+    EXPECT_EQ(LatticeKind::Hexagonal,
+              ModuleSet(domainToPlaneByModule,
+                        vector<vector<vector<double>>>({
+                            {{1.0, c}, {0.0, s}},
+                            {{2*c, -2*c}, {2*s, 2*s}}})).latticeKind());
+
+    // The 120 degree basis is made acute when it's reduced.
+    EXPECT_EQ(LatticeKind::Hexagonal,
+              classifyLatticeBasis(reduce2DLatticeBasis({1.0, -c, 0.0, s})));
+
+    EXPECT_EQ(LatticeKind::Square,
+              ModuleSet(domainToPlaneByModule,
+                        vector<vector<vector<double>>>({
+                            {{1.0, 0.0}, {0.0, 1.0}},
+                            {{0.0, -3.0}, {3.0, 0.0}}})).latticeKind());
+
+    // Modules with different kinds of lattices share no kind.
+    EXPECT_EQ(LatticeKind::General,
+              ModuleSet(domainToPlaneByModule,
+                        vector<vector<vector<double>>>({
+                            {{1.0, c}, {0.0, s}},
+                            {{1.0, 0.0}, {0.0, 1.0}}})).latticeKind());
+  }
+
+  TEST(GridUniquenessTest, TorusOccupancyOnlyRulesOutFarShapes)
+  {
+    const double r = 0.1;
+    const vector<SquareMatrix2D<double>> latticeBases = {
+      {1.0, cos(M_PI/3), 0.0, sin(M_PI/3)},
+      reduce2DLatticeBasis({0.646673658192444, -0.337238590405595,
+                            0.762766792538848, 0.9414192122222954}),
+    };
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> position(-20.0, 20.0);
+    std::uniform_real_distribution<double> radius(0.0, 0.5);
+
+    for (const SquareMatrix2D<double>& latticeBasis : latticeBases)
+    {
+      const SquareMatrix2D<double> inverseLatticeBasis =
+        ::invert2DMatrix(latticeBasis);
+      const TorusOccupancy occupancy(latticeBasis, inverseLatticeBasis, r, 32);
+
+      size_t numRuledOut = 0;
+      for (int iPoint = 0; iPoint < 10000; iPoint++)
+      {
+        const double x = position(rng);
+        const double y = position(rng);
+        const double shapeRadius = radius(rng);
+        if (!occupancy.isFar(x, y, shapeRadius*shapeRadius))
+        {
+          continue;
+        }
+
+        numRuledOut++;
+
+        // Find the nearest lattice point by brute force.
+        const pair<double,double> ij = transform2D(inverseLatticeBasis, {x, y});
+        double d = std::numeric_limits<double>::max();
+        for (int i = floor(ij.first) - 2; i <= floor(ij.first) + 3; i++)
+        {
+          for (int j = floor(ij.second) - 2; j <= floor(ij.second) + 3; j++)
+          {
+            const pair<double,double> p = transform2D(latticeBasis, {i, j});
+            d = std::min(d, hypot(p.first - x, p.second - y));
+          }
+        }
+
+        EXPECT_GT(d, r + shapeRadius);
+      }
+
+      EXPECT_GT(numRuledOut, 0);
+    }
+
+    // Searches with and without the bitmaps agree.
+    const vector<double> ignorebox = {0.5, 0.5};
+    const double expected = computeCodingRange(
+      getPlaneMatrixWithNearestZeroAt(-6.5, 6.5),
+      getLatticeBasisWithNearestZeroAt(-6.5, 6.5),
+      {1.0, 1.0}, ignorebox, 0.2).first;
+
+    setTorusOccupancyResolution(64);
+    const double actual = computeCodingRange(
+      getPlaneMatrixWithNearestZeroAt(-6.5, 6.5),
+      getLatticeBasisWithNearestZeroAt(-6.5, 6.5),
+      {1.0, 1.0}, ignorebox, 0.2).first;
+    resetTorusOccupancyResolution();
+
+    EXPECT_EQ(expected, actual);
+  }
+
+  TEST(GridUniquenessTest, BestFirstSearchOrder)
+  {
+    const vector<double> ignorebox = {0.5, 0.5};
+
+    setSearchOrder(SearchOrder::BestFirst);
+
+    const double result1 = computeCodingRange(
+      getPlaneMatrixWithNearestZeroAt(12.5, 0.25),
+      getLatticeBasisWithNearestZeroAt(12.5, 0.25),
+      {0.5, 1.0}, ignorebox, 0.01).first;
+    const double result2 = computeCodingRange(
+      getPlaneMatrixWithNearestZeroAt(-6.5, 6.5),
+      getLatticeBasisWithNearestZeroAt(-6.5, 6.5),
+      {1.0, 1.0}, ignorebox, 0.01).first;
+
+    setSearchOrder(SearchOrder::DepthFirst);
+
+    EXPECT_EQ(24, floor(result1));
+    EXPECT_EQ(6, floor(result2));
+  }
+
+  TEST(GridUniquenessTest, BranchAndBoundSearchOrder)
+  {
+    const vector<vector<vector<double>>> domainToPlane =
+      getPlaneMatrixWithNearestZeroAt(12.5, 0.25);
+    const vector<vector<vector<double>>> latticeBasis =
+      getLatticeBasisWithNearestZeroAt(12.5, 0.25);
+    const vector<double> scaledbox = {1.0, 1.0};
+    const vector<double> ignorebox = {0.5, 0.5};
+
+    ExpansionSchedule fine;
+    fine.precision = 0.0001;
+    fine.maxShellFactor = 100.0;
+
+    const double baseline = computeCodingRange(
+      domainToPlane, latticeBasis, scaledbox, ignorebox, 0.01).first;
+    const double fineBaseline = computeCodingRange(
+      domainToPlane, latticeBasis, scaledbox, ignorebox, 0.01,
+      10.0, 0, -1.0, nullptr, nullptr, fine).first;
+
+    setSearchOrder(SearchOrder::BranchAndBound);
+
+    const double result = computeCodingRange(
+      domainToPlane, latticeBasis, scaledbox, ignorebox, 0.01).first;
+    const double fineResult = computeCodingRange(
+      domainToPlane, latticeBasis, scaledbox, ignorebox, 0.01,
+      10.0, 0, -1.0, nullptr, nullptr, fine).first;
+    const double result2 = computeCodingRange(
+      getPlaneMatrixWithNearestZeroAt(-6.5, 6.5),
+      getLatticeBasisWithNearestZeroAt(-6.5, 6.5),
+      scaledbox, ignorebox, 0.01).first;
+
+    setSearchOrder(SearchOrder::DepthFirst);
+
+    EXPECT_EQ(baseline, result);
+    EXPECT_EQ(fineBaseline, fineResult);
+    EXPECT_EQ(6, floor(result2));
+  }
+
+  TEST(GridUniquenessTest, AdaptiveExpansionSchedule)
+  {
+    const vector<vector<vector<double>>> domainToPlane =
+      getPlaneMatrixWithNearestZeroAt(12.5, 0.25);
+    const vector<vector<vector<double>>> latticeBasis =
+      getLatticeBasisWithNearestZeroAt(12.5, 0.25);
+    const vector<double> scaledbox = {1.0, 1.0};
+    const vector<double> ignorebox = {0.5, 0.5};
+
+    const double baseline = computeCodingRange(
+      domainToPlane, latticeBasis, scaledbox, ignorebox, 0.01).first;
+
+    // Wide shells with the default precision test the same scale factors.
+    ExpansionSchedule wide;
+    wide.maxShellFactor = 100.0;
+    EXPECT_EQ(baseline, computeCodingRange(
+                domainToPlane, latticeBasis, scaledbox, ignorebox, 0.01,
+                10.0, 0, -1.0, nullptr, nullptr, wide).first);
+
+    // A finer precision lands closer to the collision.
+    ExpansionSchedule fine;
+    fine.precision = 0.0001;
+    fine.maxShellFactor = 100.0;
+    const double result = computeCodingRange(
+      domainToPlane, latticeBasis, scaledbox, ignorebox, 0.01,
+      10.0, 0, -1.0, nullptr, nullptr, fine).first;
+    EXPECT_LE(baseline, result);
+    EXPECT_GT(baseline*1.01, result);
+    EXPECT_EQ(12, floor(result));
+  }
+
+  TEST(GridUniquenessTest, ComputeCodingRangeBatch)
+  {
+    const vector<double> ignorebox = {0.5, 0.5};
+
+    const vector<vector<vector<double>>> domainToPlaneA =
+      getPlaneMatrixWithNearestZeroAt(12.5, 0.25);
+    const vector<vector<vector<double>>> latticeBasisA =
+      getLatticeBasisWithNearestZeroAt(12.5, 0.25);
+    const vector<vector<vector<double>>> domainToPlaneB =
+      getPlaneMatrixWithNearestZeroAt(-6.5, 6.5);
+    const vector<vector<vector<double>>> latticeBasisB =
+      getLatticeBasisWithNearestZeroAt(-6.5, 6.5);
+
+    const vector<CodingRangeQuery> queries = {
+      {domainToPlaneA, latticeBasisA, {1.0, 1.0}, ignorebox, 0.01},
+      {domainToPlaneB, latticeBasisB, {1.0, 1.0}, ignorebox, 0.01},
+      {domainToPlaneA, latticeBasisA, {0.5, 1.0}, ignorebox, 0.01},
+    };
+
+    const vector<pair<double, vector<double>>> results =
+      computeCodingRangeBatch(queries);
+
+    ASSERT_EQ(3, results.size());
+    EXPECT_EQ(12, floor(results[0].first));
+    EXPECT_EQ(6, floor(results[1].first));
+    EXPECT_EQ(24, floor(results[2].first));
+  }
+
+  TEST(GridUniquenessTest, CancelledComputeCodingRangeThrows)
+  {
+    CancellationToken token;
+    token.cancel();
+
+    try
+    {
+      computeCodingRange(getPlaneMatrixWithNearestZeroAt(12.5, 0.25),
+                         getLatticeBasisWithNearestZeroAt(12.5, 0.25),
+                         {1.0, 1.0}, {0.5, 0.5}, 0.01, 10.0, 0, -1.0,
+                         &token);
+      FAIL() << "Expected an exception";
+    }
+    catch (const std::exception& e)
+    {
+      EXPECT_STREQ("cancelled", e.what());
+    }
+  }
+
+  TEST(GridUniquenessTest, ExpiredDeadlineThrowsTimeout)
+  {
+    const vector<vector<vector<double>>> domainToPlaneByModule = {
+      {{1, 0},
+       {0, 1}}
+    };
+
+    CancellationToken token;
+    token.setDeadline(CancellationToken::Clock::now() -
+                      std::chrono::seconds(1));
+
+    try
+    {
+      computeBinSidelength(domainToPlaneByModule, 0.2, 0.001, 2048.0, -1.0,
+                           &token);
+      FAIL() << "Expected an exception";
+    }
+    catch (const std::exception& e)
+    {
+      EXPECT_STREQ("timeout", e.what());
+    }
+  }
+
+  std::atomic<int> g_numTestInterrupts(0);
+
+  TEST(GridUniquenessTest, BackgroundCallLeavesSigintAlone)
+  {
+    // The nearest collision is very far away, so this runs until it's
+    // cancelled.
+    const vector<vector<vector<double>>> domainToPlaneByModule = {
+      {{1},
+       {sqrt(2.0)}}
+    };
+    const vector<vector<vector<double>>> latticeBasisByModule = {
+      {{1, 0},
+       {0, 1}}
+    };
+
+    void (*prevHandler)(int) = signal(SIGINT, [](int) {
+        g_numTestInterrupts++;
+      });
+
+    CancellationToken token;
+    std::string message;
+    std::thread call([&] {
+        try
+        {
+          computeCodingRange(domainToPlaneByModule, latticeBasisByModule,
+                             {1.0}, {0.5}, 1e-12, 0.0, 0, -1.0, &token,
+                             nullptr, ExpansionSchedule(), false);
+        }
+        catch (const std::exception& e)
+        {
+          message = e.what();
+        }
+      });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    raise(SIGINT);
+    EXPECT_EQ(1, g_numTestInterrupts.load());
+
+    token.cancel();
+    call.join();
+    signal(SIGINT, prevHandler);
+
+    EXPECT_EQ("cancelled", message);
+  }
+
+  TEST(GridUniquenessTest, SearchStats)
+  {
+    const vector<vector<vector<double>>> domainToPlaneByModule = {
+      {{1, 0},
+       {0, 1}}
+    };
+
+    SearchStats stats;
+    stats.numNodes = 42;
+    computeBinSidelength(domainToPlaneByModule, 0.2, 0.01, 2048.0, -1.0,
+                         nullptr, &stats);
+
+    if (SearchStats::enabled())
+    {
+      EXPECT_GT(stats.numNodes, 0u);
+      EXPECT_GT(stats.numShadowFramesBuilt, 0u);
+    }
+    else
+    {
+      EXPECT_EQ(0u, stats.numNodes);
+    }
+  }
+
+  TEST(GridUniquenessTest, ResumeFromCheckpoint)
+  {
+    const vector<vector<vector<double>>> domainToPlaneByModule =
+      getPlaneMatrixWithNearestZeroAt(12.5, 0.25);
+    const vector<vector<vector<double>>> latticeBasisByModule =
+      getLatticeBasisWithNearestZeroAt(12.5, 0.25);
+    const std::string path =
+      ::testing::TempDir() + "gridcodingrange_resume_test.checkpoint";
+
+    const pair<double, vector<double>> expected = computeCodingRange(
+      domainToPlaneByModule, latticeBasisByModule, {1.0, 1.0}, {0.5, 0.5},
+      0.01);
+
+    // A run that's stopped before it starts leaves a checkpoint at the
+    // beginning of the expansion.
+    CancellationToken token;
+    token.cancel();
+    EXPECT_THROW(computeCodingRangeWithCheckpoints(
+                   domainToPlaneByModule, latticeBasisByModule, {1.0, 1.0},
+                   {0.5, 0.5}, 0.01, path, 600.0, 10.0, 0, -1.0, &token),
+                 std::exception);
+    EXPECT_EQ(expected, resumeCodingRange(path));
+
+    // Resuming a finished run returns its result.
+    EXPECT_EQ(expected, resumeCodingRange(path));
+
+    // Rewind the finished checkpoint to halfway through the expansion, with no
+    // result yet.
+    std::ostringstream rewound;
+    rewound.precision(std::numeric_limits<double>::max_digits10);
+    {
+      std::ifstream in(path);
+      std::string line;
+      while (std::getline(in, line))
+      {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "numTasksFinished")
+        {
+          unsigned long long numTasksFinished;
+          fields >> numTasksFinished;
+          ASSERT_GT(numTasksFinished, 1u);
+          rewound << key << " " << numTasksFinished / 2 << "\n";
+        }
+        else if (key == "foundPointBaselineRadius")
+        {
+          rewound << key << " " << std::numeric_limits<double>::max() << "\n";
+        }
+        else
+        {
+          rewound << line << "\n";
+        }
+      }
+    }
+    {
+      std::ofstream out(path);
+      out << rewound.str();
+    }
+    EXPECT_EQ(expected, resumeCodingRange(path));
+
+    std::remove(path.c_str());
+  }
+
+  TEST(GridUniquenessTest, ShardedComputeCodingRange)
+  {
+    const vector<vector<vector<double>>> domainToPlaneByModule =
+      getPlaneMatrixWithNearestZeroAt(12.5, 0.25);
+    const vector<vector<vector<double>>> latticeBasisByModule =
+      getLatticeBasisWithNearestZeroAt(12.5, 0.25);
+
+    const pair<double, vector<double>> expected = computeCodingRange(
+      domainToPlaneByModule, latticeBasisByModule, {1.0, 1.0}, {0.5, 0.5},
+      0.01);
+
+    CodingRangeCoordinator coordinator(domainToPlaneByModule,
+                                       latticeBasisByModule, {1.0, 1.0},
+                                       {0.5, 0.5}, 0.01);
+
+    // Threads stand in for worker processes. They use the same sockets.
+    vector<std::thread> workers;
+    for (int i = 0; i < 2; i++)
+    {
+      workers.emplace_back([&coordinator] {
+          runCodingRangeWorker("127.0.0.1", coordinator.port(), 1);
+        });
+    }
+
+    const pair<double, vector<double>> result = coordinator.run(0.0, 60.0);
+
+    for (std::thread& worker : workers)
+    {
+      worker.join();
+    }
+
+    EXPECT_EQ(expected, result);
+  }
+
+  TEST(GridUniquenessTest, StalledWorkerDoesNotBlockCoordinatorTimeout)
+  {
+    CodingRangeCoordinator coordinator(
+      getPlaneMatrixWithNearestZeroAt(12.5, 0.25),
+      getLatticeBasisWithNearestZeroAt(12.5, 0.25), {1.0, 1.0}, {0.5, 0.5},
+      0.01);
+
+    // A peer that sends half of a length prefix and then stalls.
+    std::unique_ptr<MessageChannel> peer =
+      MessageChannel::connect("127.0.0.1", coordinator.port());
+    ASSERT_EQ(4, ::send(peer->fd(), "\x01\x00\x00\x00", 4, 0));
+
+    try
+    {
+      coordinator.run(0.0, 0.5);
+      FAIL() << "Expected an exception";
+    }
+    catch (const std::exception& e)
+    {
+      EXPECT_STREQ("timeout", e.what());
+    }
+  }
+
+  TEST(GridUniquenessTest, MessagesAreLittleEndian)
+  {
+    Message message;
+    message.writeU64(0x0102030405060708);
+    message.writeF64(1.0);
+
+    const vector<char> expected = {
+      8, 7, 6, 5, 4, 3, 2, 1,
+      0, 0, 0, 0, 0, 0, (char)0xf0, 0x3f};
+    EXPECT_EQ(expected, message.bytes());
+    EXPECT_EQ(0x0102030405060708u, message.readU64());
+    EXPECT_EQ(1.0, message.readF64());
+    EXPECT_EQ(0u, message.bytesLeft());
+  }
+
+  TEST(GridUniquenessTest, ShardWorkerRejectsOversizedQuery)
+  {
+    MessageListener listener("127.0.0.1", 0);
+
+    // Stand in for a coordinator that claims a huge query but doesn't send it.
+    std::thread coordinator([&listener] {
+        std::unique_ptr<MessageChannel> channel = listener.accept();
+        Message message;
+        message.writeU64(1); // Query
+        message.writeU64(1); // Protocol version
+        message.writeU64(1ull << 40); // Modules
+        message.writeU64(3); // Dimensions
+        channel->send(message);
+        channel->waitReadable(10000);
+      });
+
+    EXPECT_THROW(runCodingRangeWorker("127.0.0.1", listener.port(), 1, 10.0),
+                 std::exception);
+
+    coordinator.join();
+  }
+
   TEST(GridUniquenessTest, ScaledboxWithZeroWidth)
   {
     const vector<double> ignorebox = {0.5, 0.5};
@@ -760,6 +1407,36 @@ namespace {
     }
   }
 
+  TEST(GridUniquenessTest, TaskGroupOnlyHelpsWithItsOwnTasks)
+  {
+    ThreadPool pool(1);
+
+    // Keep the only worker busy, so that every other task stays queued until
+    // somebody helps.
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    pool.submit([released] { released.wait(); });
+
+    std::promise<std::thread::id> unrelatedThread;
+    pool.submit([&unrelatedThread] {
+        unrelatedThread.set_value(std::this_thread::get_id());
+      });
+
+    std::thread::id groupThread;
+    {
+      TaskGroup tasks(pool);
+      tasks.run([&groupThread] {
+          groupThread = std::this_thread::get_id();
+        });
+      tasks.wait();
+    }
+
+    release.set_value();
+    ASSERT_EQ(std::this_thread::get_id(), groupThread);
+    ASSERT_NE(std::this_thread::get_id(),
+              unrelatedThread.get_future().get());
+  }
+
   TEST(GridUniquenessTest, binSidelengthBasicTest)
   {
     const vector<double> scales = {1, 2};
@@ -0,0 +1,363 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#include "thread_pool.hpp"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
+namespace {
+  // Which pool and worker the current thread belongs to, if any.
+  thread_local ThreadPool *t_currentPool = nullptr;
+  thread_local size_t t_currentWorker = 0;
+
+  std::mutex g_sharedPoolMutex;
+  std::shared_ptr<ThreadPool> g_sharedPool;
+  size_t g_sharedNumThreads = 0;
+
+  size_t defaultNumThreads()
+  {
+    const char *envNumThreads = getenv("GRIDCODINGRANGE_NUM_THREADS");
+    if (envNumThreads != nullptr)
+    {
+      const long numThreads = strtol(envNumThreads, nullptr, 10);
+      if (numThreads > 0)
+      {
+        return numThreads;
+      }
+    }
+
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+}
+
+ThreadPool::ThreadPool(size_t numThreads)
+  : numQueued_(0), nextQueue_(0), quitting_(false)
+{
+  numThreads = std::max<size_t>(numThreads, 1);
+
+  for (size_t i = 0; i < numThreads; i++)
+  {
+    queues_.emplace_back(new WorkerQueue);
+  }
+
+  for (size_t i = 0; i < numThreads; i++)
+  {
+    threads_.emplace_back(&ThreadPool::workerLoop_, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(idleMutex_);
+    quitting_ = true;
+  }
+  idleCondition_.notify_all();
+
+  for (std::thread& thread : threads_)
+  {
+    thread.join();
+  }
+}
+
+void ThreadPool::submit(std::function<void()> task, const TaskGroup *group)
+{
+  const size_t iQueue = (t_currentPool == this)
+    ? t_currentWorker
+    : nextQueue_++ % queues_.size();
+
+  {
+    // Count the task before it becomes visible, so that numQueued_ never
+    // underflows. Take the lock so that a worker can't miss this between
+    // checking numQueued_ and going to sleep.
+    std::lock_guard<std::mutex> lock(idleMutex_);
+    numQueued_++;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queues_[iQueue]->mutex);
+    queues_[iQueue]->tasks.push_back({std::move(task), group});
+  }
+  idleCondition_.notify_one();
+}
+
+bool ThreadPool::tryPop_(size_t iQueue, std::function<void()> *task)
+{
+  WorkerQueue& queue = *queues_[iQueue];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty())
+  {
+    return false;
+  }
+
+  *task = std::move(queue.tasks.back().function);
+  queue.tasks.pop_back();
+  numQueued_--;
+  return true;
+}
+
+bool ThreadPool::trySteal_(size_t iThief, std::function<void()> *task)
+{
+  for (size_t offset = 1; offset <= queues_.size(); offset++)
+  {
+    WorkerQueue& queue = *queues_[(iThief + offset) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty())
+    {
+      *task = std::move(queue.tasks.front().function);
+      queue.tasks.pop_front();
+      numQueued_--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool ThreadPool::tryTakeFromGroup_(size_t iQueue, const TaskGroup *group,
+                                   bool newest, std::function<void()> *task)
+{
+  WorkerQueue& queue = *queues_[iQueue];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+
+  auto take = [&](std::deque<Task>::iterator it) {
+    *task = std::move(it->function);
+    queue.tasks.erase(it);
+    numQueued_--;
+  };
+
+  if (newest)
+  {
+    for (auto it = queue.tasks.rbegin(); it != queue.tasks.rend(); ++it)
+    {
+      if (it->group == group)
+      {
+        take(std::next(it).base());
+        return true;
+      }
+    }
+  }
+  else
+  {
+    for (auto it = queue.tasks.begin(); it != queue.tasks.end(); ++it)
+    {
+      if (it->group == group)
+      {
+        take(it);
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+bool ThreadPool::runPendingTask(const TaskGroup& group)
+{
+  // Like a worker, take the newest task from the calling worker's own deque,
+  // then the oldest task from the others.
+  const bool isWorker = (t_currentPool == this);
+  const size_t iFirst = isWorker ? t_currentWorker : 0;
+
+  std::function<void()> task;
+  bool found = false;
+  for (size_t offset = 0; offset < queues_.size() && !found; offset++)
+  {
+    found = tryTakeFromGroup_((iFirst + offset) % queues_.size(), &group,
+                              isWorker && offset == 0, &task);
+  }
+
+  if (found)
+  {
+    task();
+  }
+
+  return found;
+}
+
+void ThreadPool::workerLoop_(size_t iWorker)
+{
+  t_currentPool = this;
+  t_currentWorker = iWorker;
+
+  while (true)
+  {
+    std::function<void()> task;
+    if (tryPop_(iWorker, &task) || trySteal_(iWorker, &task))
+    {
+      task();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(idleMutex_);
+    idleCondition_.wait(lock, [this] {
+        return quitting_ || numQueued_ > 0;
+      });
+
+    // Finish the queued tasks before quitting. Detached tasks, like async
+    // calls, may have nobody waiting on them.
+    if (quitting_ && numQueued_ == 0)
+    {
+      break;
+    }
+  }
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::shared()
+{
+  std::lock_guard<std::mutex> lock(g_sharedPoolMutex);
+  if (!g_sharedPool)
+  {
+    if (g_sharedNumThreads == 0)
+    {
+      g_sharedNumThreads = defaultNumThreads();
+    }
+
+    g_sharedPool = std::make_shared<ThreadPool>(g_sharedNumThreads);
+  }
+
+  return g_sharedPool;
+}
+
+void ThreadPool::setSharedNumThreads(size_t numThreads)
+{
+  if (numThreads == 0)
+  {
+    numThreads = defaultNumThreads();
+  }
+
+  std::shared_ptr<ThreadPool> oldPool;
+  {
+    std::lock_guard<std::mutex> lock(g_sharedPoolMutex);
+    g_sharedNumThreads = numThreads;
+    if (g_sharedPool && g_sharedPool->numThreads() != numThreads)
+    {
+      // Create the new pool lazily. Destroy the old one outside of the lock,
+      // after any running computations release it.
+      oldPool.swap(g_sharedPool);
+    }
+  }
+}
+
+size_t ThreadPool::sharedNumThreads()
+{
+  std::lock_guard<std::mutex> lock(g_sharedPoolMutex);
+  if (g_sharedNumThreads == 0)
+  {
+    g_sharedNumThreads = defaultNumThreads();
+  }
+
+  return g_sharedNumThreads;
+}
+
+ThreadPool *ThreadPool::current()
+{
+  return t_currentPool;
+}
+
+ThreadPoolLease::ThreadPoolLease()
+  : pool_(ThreadPool::current())
+{
+  if (pool_ == nullptr)
+  {
+    shared_ = ThreadPool::shared();
+    pool_ = shared_.get();
+  }
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool)
+  : pool_(pool), numPending_(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+  waitNoThrow_();
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+  numPending_++;
+
+  pool_.submit([this, task] {
+      try
+      {
+        task();
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!exception_)
+        {
+          exception_ = std::current_exception();
+        }
+      }
+
+      // Notify while holding the lock, so that the group can't be destroyed
+      // between the decrement and the notify.
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--numPending_ == 0)
+      {
+        finishedCondition_.notify_all();
+      }
+    }, this);
+}
+
+void TaskGroup::waitNoThrow_()
+{
+  while (numPending_ > 0)
+  {
+    if (!pool_.runPendingTask(*this))
+    {
+      // Nothing to help with. The remaining tasks are running on other
+      // threads, but they may queue more work, so check back periodically.
+      std::unique_lock<std::mutex> lock(mutex_);
+      finishedCondition_.wait_for(lock, std::chrono::milliseconds(1), [this] {
+          return numPending_ == 0;
+        });
+    }
+  }
+
+  // Wait for the last task to release the lock.
+  std::lock_guard<std::mutex> lock(mutex_);
+}
+
+void TaskGroup::wait()
+{
+  waitNoThrow_();
+
+  std::exception_ptr exception;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::swap(exception, exception_);
+  }
+
+  if (exception)
+  {
+    std::rethrow_exception(exception);
+  }
+}
@@ -0,0 +1,195 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+
+#ifndef NTA_THREAD_POOL_HPP
+#define NTA_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads, each with its own deque of tasks.
+ *
+ * A worker pushes and pops tasks at the back of its own deque, so a recursive
+ * search stays depth-first and cache-friendly. An idle worker steals from the
+ * front of another worker's deque, which is where the oldest and typically
+ * largest tasks are.
+ */
+class TaskGroup;
+
+class ThreadPool
+{
+public:
+  explicit ThreadPool(size_t numThreads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t numThreads() const
+  {
+    return threads_.size();
+  }
+
+  /**
+   * Queue a task. When called from one of this pool's workers, the task goes
+   * onto that worker's own deque. The task must not throw. Use a TaskGroup to
+   * propagate exceptions.
+   *
+   * @param group
+   * The TaskGroup that the task belongs to, if any, so that runPendingTask can
+   * find it.
+   */
+  void submit(std::function<void()> task, const TaskGroup *group = nullptr);
+
+  /**
+   * Run one of the group's queued tasks on the calling thread, if there is
+   * one. Threads that are waiting on a group use this to help rather than
+   * block. They never pick up unrelated tasks, which could keep them busy long
+   * after their own group has finished.
+   *
+   * @return
+   * true if a task was run.
+   */
+  bool runPendingTask(const TaskGroup& group);
+
+  /**
+   * The process-wide pool, created on first use. Hold on to the returned
+   * pointer for the duration of a computation. If the shared pool is resized
+   * meanwhile, the computation finishes on the old pool.
+   */
+  static std::shared_ptr<ThreadPool> shared();
+
+  /**
+   * Replace the process-wide pool with one of this size. If 0, use the
+   * GRIDCODINGRANGE_NUM_THREADS environment variable, or one worker per
+   * hardware thread if it isn't set.
+   */
+  static void setSharedNumThreads(size_t numThreads);
+
+  /**
+   * The size that the process-wide pool has or will have when it's created.
+   */
+  static size_t sharedNumThreads();
+
+  /**
+   * The pool that the calling thread is a worker of, or nullptr.
+   */
+  static ThreadPool *current();
+
+private:
+  struct Task
+  {
+    std::function<void()> function;
+    const TaskGroup *group;
+  };
+
+  struct WorkerQueue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void workerLoop_(size_t iWorker);
+  bool tryPop_(size_t iQueue, std::function<void()> *task);
+  bool trySteal_(size_t iThief, std::function<void()> *task);
+  bool tryTakeFromGroup_(size_t iQueue, const TaskGroup *group, bool newest,
+                         std::function<void()> *task);
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
+  std::vector<std::thread> threads_;
+
+  std::atomic<size_t> numQueued_;
+  std::atomic<size_t> nextQueue_;
+  std::mutex idleMutex_;
+  std::condition_variable idleCondition_;
+  bool quitting_;
+};
+
+/**
+ * The pool that a computation should use, kept alive for as long as this
+ * object is. Computations that are already running on a pool's worker stay on
+ * that pool. It outlives them, and it may no longer be the shared pool.
+ * Everything else uses the shared pool.
+ */
+class ThreadPoolLease
+{
+public:
+  ThreadPoolLease();
+
+  ThreadPool& operator*() const
+  {
+    return *pool_;
+  }
+
+  ThreadPool* operator->() const
+  {
+    return pool_;
+  }
+
+private:
+  std::shared_ptr<ThreadPool> shared_;
+  ThreadPool *pool_;
+};
+
+/**
+ * A set of tasks on a ThreadPool that can be waited on together. Tasks may add
+ * more tasks to their own group.
+ *
+ * While waiting, the calling thread runs the group's queued tasks itself, so
+ * nested waits never starve the pool. It doesn't run other groups' tasks, so a
+ * wait ends soon after the group's last task does. If any task throws, wait()
+ * rethrows the first exception after every task has finished.
+ */
+class TaskGroup
+{
+public:
+  explicit TaskGroup(ThreadPool& pool);
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void run(std::function<void()> task);
+
+  void wait();
+
+private:
+  void waitNoThrow_();
+
+  ThreadPool& pool_;
+  std::atomic<size_t> numPending_;
+  std::mutex mutex_;
+  std::condition_variable finishedCondition_;
+  std::exception_ptr exception_;
+};
+
+#endif // NTA_THREAD_POOL_HPP
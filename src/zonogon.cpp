@@ -0,0 +1,122 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+#include "zonogon.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using std::pair;
+using std::vector;
+
+/**
+ * A number that increases monotonically with the angle of a vector in the
+ * upper half-plane. Unlike a cross product, it gives a consistent ordering
+ * even for nearly parallel vectors.
+ */
+static double getPseudoAngle(const pair<double,double> &v)
+{
+  return 1 - v.first / (std::abs(v.first) + v.second);
+}
+
+void Zonogon::build(const double domainToPlane[], size_t numDims,
+                    const double dims[])
+{
+  const double *row0 = domainToPlane;
+  const double *row1 = domainToPlane + numDims;
+
+  generators_.clear();
+  vertices_.clear();
+  boundingBox_ = {0, 0, 0, 0};
+
+  // The lowest vertex is the sum of every edge that points downward.
+  pair<double,double> start = {0, 0};
+
+  for (size_t iDim = 0; iDim < numDims; iDim++)
+  {
+    double x = row0[iDim]*dims[iDim];
+    double y = row1[iDim]*dims[iDim];
+
+    boundingBox_.xmin += std::min(x, 0.0);
+    boundingBox_.xmax += std::max(x, 0.0);
+    boundingBox_.ymin += std::min(y, 0.0);
+    boundingBox_.ymax += std::max(y, 0.0);
+
+    if (x == 0 && y == 0)
+    {
+      continue;
+    }
+
+    // Point every edge into the half-open upper half-plane, angle [0, pi).
+    if (y < 0 || (y == 0 && x < 0))
+    {
+      start.first += x;
+      start.second += y;
+      x = -x;
+      y = -y;
+    }
+
+    generators_.push_back({x, y});
+  }
+
+  std::sort(generators_.begin(), generators_.end(),
+            [](const pair<double,double> &a, const pair<double,double> &b)
+            {
+              return getPseudoAngle(a) < getPseudoAngle(b);
+            });
+
+  // Merge parallel edges.
+  size_t numGenerators = 0;
+  for (size_t i = 0; i < generators_.size(); i++)
+  {
+    if (numGenerators > 0 &&
+        getPseudoAngle(generators_[numGenerators - 1]) ==
+        getPseudoAngle(generators_[i]))
+    {
+      generators_[numGenerators - 1].first += generators_[i].first;
+      generators_[numGenerators - 1].second += generators_[i].second;
+    }
+    else
+    {
+      generators_[numGenerators++] = generators_[i];
+    }
+  }
+  generators_.resize(numGenerators);
+
+  // Walk up the right side, then back down the left side. With fewer than two
+  // edges this degenerates into a point or a segment.
+  vertices_.push_back(start);
+
+  pair<double,double> p = start;
+  for (size_t i = 0; i < numGenerators; i++)
+  {
+    p.first += generators_[i].first;
+    p.second += generators_[i].second;
+    vertices_.push_back(p);
+  }
+  for (size_t i = 0; i + 1 < numGenerators; i++)
+  {
+    p.first -= generators_[i].first;
+    p.second -= generators_[i].second;
+    vertices_.push_back(p);
+  }
+}
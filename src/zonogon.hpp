@@ -0,0 +1,80 @@
+/* ---------------------------------------------------------------------
+ * Numenta Platform for Intelligent Computing (NuPIC)
+ * Copyright (C) 2019, Numenta, Inc.  Unless you have an agreement
+ * with Numenta, Inc., for a separate license for this software code, the
+ * following terms and conditions apply:
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses.
+ *
+ * http://numenta.org/licenses/
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef NTA_ZONOGON_HPP
+#define NTA_ZONOGON_HPP
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+struct BoundingBox2D {
+  double xmin;
+  double xmax;
+  double ymin;
+  double ymax;
+};
+
+/**
+ * The 2D shadow of a k-dimensional box.
+ *
+ * Projecting the box [0, dims[0]] x ... x [0, dims[k-1]] onto a plane gives a
+ * zonogon: the Minkowski sum of the k projected edges of the box. Its convex
+ * hull can be built directly from those k edge vectors. Point every edge into
+ * the upper half-plane, sort the edges by angle, and walk them once forward
+ * and once backward from the lowest vertex. This takes O(k log k) rather than
+ * pushing all 2^k vertices of the box through a general convex hull.
+ */
+class Zonogon
+{
+public:
+  /**
+   * Build the shadow of the box [0, dims] under a 2*k row-major matrix.
+   *
+   * Storage is reused across calls, so a Zonogon that's built repeatedly
+   * stops allocating once it has seen its largest shadow.
+   */
+  void build(const double domainToPlane[], size_t numDims,
+             const double dims[]);
+
+  /**
+   * The vertices of the shadow in counterclockwise order, starting from the
+   * lowest vertex. A shadow with no area is returned as the two endpoints of a
+   * segment, or as a single point.
+   */
+  const std::vector<std::pair<double,double>> &vertices() const
+  {
+    return vertices_;
+  }
+
+  const BoundingBox2D &boundingBox() const
+  {
+    return boundingBox_;
+  }
+
+private:
+  std::vector<std::pair<double,double>> generators_;
+  std::vector<std::pair<double,double>> vertices_;
+  BoundingBox2D boundingBox_;
+};
+
+#endif // NTA_ZONOGON_HPP
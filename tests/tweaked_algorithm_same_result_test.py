@@ -22,15 +22,22 @@
 import unittest
 
 import math
+import os
 import pickle
+import signal
+import time
 
 import numpy as np
 from scipy.stats import ortho_group
 
 from gridcodingrange import (computeCodingRange,
+                             computeCodingRangeAsync,
                              computeBinSidelength,
                              resetCheckPolygonThreshold,
-                             setCheckPolygonThreshold)
+                             resetTorusOccupancyResolution,
+                             setCheckPolygonThreshold,
+                             setSearchOrder,
+                             setTorusOccupancyResolution)
 
 def create_bases(k, s):
     assert(k>1)
@@ -95,6 +102,8 @@ class AlgorithmTweaksTest(unittest.TestCase):
 
     def tearDown(self):
         resetCheckPolygonThreshold()
+        resetTorusOccupancyResolution()
+        setSearchOrder("depthFirst")
 
     def testExpandBoxAsSubspace1D3D(self):
         for _ in range(100):
@@ -210,5 +219,159 @@ class AlgorithmTweaksTest(unittest.TestCase):
                     baseline))
 
 
+    def testBestFirstSearchOrder(self):
+        m = 4
+        k = 3
+
+        for _ in range(100):
+            A = create_params(m, k, True)['A']
+            phr = 0.2
+            L = create_L(m)
+            scaledbox = np.ones(k, dtype='float')
+            ignorebox_width = 0.51*computeBinSidelength(A, 0.2, 0.01, 1000)
+            ignorebox = ignorebox_width*np.ones(k, dtype='float')
+
+            setSearchOrder("depthFirst")
+            baseline = computeCodingRange(A, L, scaledbox, ignorebox, phr)
+
+            setSearchOrder("bestFirst")
+            result = computeCodingRange(A, L, scaledbox, ignorebox, phr)
+
+            self.assertEqual(
+                result[0],
+                baseline[0],
+                "Different results for best-first search A: {} L: {}, results {} != {}".format(
+                    A.tolist(),
+                    L.tolist(),
+                    result,
+                    baseline))
+
+
+    def testBranchAndBoundSearchOrder(self):
+        m = 4
+        k = 3
+
+        for _ in range(100):
+            A = create_params(m, k, True)['A']
+            phr = 0.2
+            L = create_L(m)
+            scaledbox = np.ones(k, dtype='float')
+            ignorebox_width = 0.51*computeBinSidelength(A, 0.2, 0.01, 1000)
+            ignorebox = ignorebox_width*np.ones(k, dtype='float')
+
+            setSearchOrder("depthFirst")
+            baseline = computeCodingRange(A, L, scaledbox, ignorebox, phr)
+
+            setSearchOrder("branchAndBound")
+            result = computeCodingRange(A, L, scaledbox, ignorebox, phr)
+
+            self.assertEqual(
+                result[0],
+                baseline[0],
+                "Different results for branch-and-bound search A: {} L: {}, results {} != {}".format(
+                    A.tolist(),
+                    L.tolist(),
+                    result,
+                    baseline))
+
+
+    def testTorusOccupancy(self):
+        m = 4
+        k = 3
+
+        for _ in range(100):
+            A = create_params(m, k, True)['A']
+            phr = 0.2
+            L = create_L(m)
+            scaledbox = np.ones(k, dtype='float')
+            ignorebox_width = 0.51*computeBinSidelength(A, 0.2, 0.01, 1000)
+            ignorebox = ignorebox_width*np.ones(k, dtype='float')
+
+            setTorusOccupancyResolution(0)
+            baseline = computeCodingRange(A, L, scaledbox, ignorebox, phr)
+
+            setTorusOccupancyResolution(64)
+            result = computeCodingRange(A, L, scaledbox, ignorebox, phr)
+
+            self.assertEqual(
+                result[0],
+                baseline[0],
+                "Different results with torus occupancy A: {} L: {}, results {} != {}".format(
+                    A.tolist(),
+                    L.tolist(),
+                    result,
+                    baseline))
+
+
+    def testWideExpansionShells(self):
+        m = 4
+        k = 3
+
+        for _ in range(100):
+            A = create_params(m, k, True)['A']
+            phr = 0.2
+            L = create_L(m)
+            scaledbox = np.ones(k, dtype='float')
+            ignorebox_width = 0.51*computeBinSidelength(A, 0.2, 0.01, 1000)
+            ignorebox = ignorebox_width*np.ones(k, dtype='float')
+
+            baseline = computeCodingRange(A, L, scaledbox, ignorebox, phr)
+            result = computeCodingRange(A, L, scaledbox, ignorebox, phr,
+                                        maxShellFactor=100.0)
+
+            self.assertEqual(
+                result[0],
+                baseline[0],
+                "Different results for wide expansion shells A: {} L: {}, results {} != {}".format(
+                    A.tolist(),
+                    L.tolist(),
+                    result,
+                    baseline))
+
+
+    def testAsync(self):
+        m = 4
+        k = 3
+
+        for _ in range(20):
+            A = create_params(m, k, True)['A']
+            phr = 0.2
+            L = create_L(m)
+            scaledbox = np.ones(k, dtype='float')
+            ignorebox_width = 0.51*computeBinSidelength(A, 0.2, 0.01, 1000)
+            ignorebox = ignorebox_width*np.ones(k, dtype='float')
+
+            baseline = computeCodingRange(A, L, scaledbox, ignorebox, phr)
+            future = computeCodingRangeAsync(A, L, scaledbox, ignorebox, phr)
+            result = future.result()
+
+            self.assertFalse(future.cancelled())
+            self.assertEqual(
+                result[0],
+                baseline[0],
+                "Different results for async computation A: {} L: {}, results {} != {}".format(
+                    A.tolist(),
+                    L.tolist(),
+                    result,
+                    baseline))
+
+
+    def testAsyncLeavesSigintAlone(self):
+        # The nearest collision is very far away, so this runs until it's
+        # cancelled.
+        A = np.array([[[1.0], [math.sqrt(2)]]])
+        L = np.array([[[1.0, 0.0], [0.0, 1.0]]])
+        future = computeCodingRangeAsync(A, L, np.ones(1), 0.5*np.ones(1),
+                                         1e-12)
+        try:
+            time.sleep(0.1)
+            with self.assertRaises(KeyboardInterrupt):
+                os.kill(os.getpid(), signal.SIGINT)
+                time.sleep(1.0)
+            self.assertTrue(future.running())
+        finally:
+            future.cancel()
+
+
 if __name__ == "__main__":
   unittest.main()